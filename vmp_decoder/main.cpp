@@ -9,6 +9,13 @@ extern "C" {
 #include <string.h>
 #include "pe_loader.h"
 #include "vmp_decoder.h"
+#include "vmp_trace.h"
+#include "vmp_trace_index.h"
+#include "vmp_trace_align.h"
+#include "vmp_cfg_event.h"
+#include "vmp_scan.h"
+#include "vmp_explore.h"
+#include "vmp_batch.h"
 
     struct vmp_cmd_params
     {
@@ -16,12 +23,164 @@ extern "C" {
         char filename[128];
         char log_filename[128];
         uint32_t vmp_start_addr;
+
+        int trace;
+        char trace_filename[128];
+        struct vmp_trace_param trace_param;
+
+        char *cfg_csr_filename;
+        // 0表示不渲染dot文件
+        int dot_render;
+        struct vmp_cfg_event_param cfg_events;
+        // 分析缓存的目录，为空的话不用缓存
+        char *cache_dir;
+        // handler库的目录，要和 -trace_mode vm 一起用
+        char *hlib_dir;
+        // 分发到校验过的handler时只模拟去掉花指令以后的指令，要和 -trace_mode vm 一起用
+        int vm_summary;
+        // 能翻译的handler直接在VM指令级解释执行
+        int vm_interp;
+        // 前几次分发以后找handler表，把所有handler预解码，threads<=0时用CPU核数
+        int handler_table;
+        int handler_table_threads;
+        // 只扫描所有的VM入口，输出以后退出
+        int scan_entries;
+        // 同时分析多个VM入口，"all"是扫出来的全部入口，否则是逗号分开的IDA地址
+        char *run_entries;
+        int entry_threads;
+        // 条件跳转的标志位带污点时两边都走，inputs是一开始就带污点的寄存器
+        int explore;
+        struct vmp_explore_param explore_param;
+        uint32_t explore_inputs;
+        // 批量分析一个目录或者列表文件里的所有文件，这时不需要filename
+        struct vmp_batch_param batch;
+
+        // 这两个命令的filename是trace文件，不需要运行decoder
+        int trace_index_build;
+        char *trace_query[2];
+        // filename是模拟器的trace，和调试器导出的trace对比
+        struct vmp_trace_align_param align_param;
     };
 
+    static int vmp_scan_dump(struct vmp_decoder *decoder)
+    {
+        struct vmp_scan_entry *entries;
+        int i, counts;
+
+        if (vmp_decoder_scan_entries(decoder, &entries, &counts))
+        {
+            printf("vmp_scan_dump() failed with vmp_decoder_scan_entries(). %s:%d\n", __FILE__, __LINE__);
+            vmp_decoder_destroy(decoder);
+            return -1;
+        }
+
+        for (i = 0; i < counts; i++)
+        {
+            printf("vm entry[%d] %08x %-9s target[%08x] imm[%08x]\n", i, entries[i].addr,
+                vmp_scan_kind_name(entries[i].kind), entries[i].target, entries[i].imm);
+        }
+        vmp_decoder_destroy(decoder);
+
+        return 0;
+    }
+
+    // "all"的时候entries返回NULL，由decoder自己扫
+    static int vmp_entries_parse(char *str, uint32_t **entries, int *counts)
+    {
+        char *p;
+        int n = 1;
+
+        *entries = NULL;
+        *counts = 0;
+        if (!strcmp(str, "all"))
+            return 0;
+
+        for (p = str; *p; p++)
+        {
+            n += (*p == ',');
+        }
+
+        *entries = (uint32_t *)calloc(n, sizeof (entries[0][0]));
+        if (!*entries)
+        {
+            printf("vmp_entries_parse() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        for (p = str; *p; p++)
+        {
+            (*entries)[(*counts)++] = strtoul(p, &p, 16);
+            if (*p != ',')
+                break;
+        }
+
+        return 0;
+    }
+
+    // eax,ecx,...按OPERAND_TYPE_REG_xx的顺序转成位图
+    static uint32_t vmp_regs_parse(char *str)
+    {
+        static const char *names[] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" };
+        uint32_t regs = 0;
+        int i;
+
+        for (i = 0; i < 8; i++)
+        {
+            if (strstr(str, names[i]))
+                regs |= 1 << i;
+        }
+
+        return regs;
+    }
+
     int vmp_help(void)
     {
-        printf("Usage: vmp_decoder [-dump_pe] [-vmp_start_addr] [-help] filename\n"
-                "\t\t-vmp_start_addr    IDA address  \n");
+        printf("Usage: vmp_decoder [-dump_pe] [-vmp_start_addr] [-trace_mode] [-trace_fmt] [-trace_keyframe] [-trace_block_regs] [-trace_file] [-trace_index] [-cfg_csr] [-dot_render] [-cfg_events] [-cfg_events_fmt] [-cache] [-hlib] [-vm_summary] [-vm_interp] [-handler_table] [-scan_entries] [-run_entries] [-entry_threads] [-explore] [-explore_depth] [-explore_insts] [-explore_stale] [-explore_inputs] [-help] filename\n"
+                "       vmp_decoder -batch dir|list [-batch_out] [-batch_threads] [-batch_insts] [-batch_ms] [-cache]\n"
+                "       vmp_decoder -trace_index_build trace_filename\n"
+                "       vmp_decoder -trace_query inst|addr|access|block value trace_filename\n"
+                "       vmp_decoder -trace_align dbg_trace [-align_base] [-align_dbg_before] [-align_max_skip] [-align_threads] trace_filename\n"
+                "\t\t-vmp_start_addr    IDA address  \n"
+                "\t\t-trace_mode        full|delta|block|vm, delta only dump changed registers,  \n"
+                "\t\t                   block dump every basic block once and then only block id,  \n"
+                "\t\t                   vm dump one event per vm handler instead of x86 instructions  \n"
+                "\t\t-trace_fmt         text|bin, bin trace default write to vmp.trace  \n"
+                "\t\t-trace_keyframe    dump a full keyframe every N instructions in delta mode  \n"
+                "\t\t-trace_block_regs  dump changed registers at every block exit in block mode  \n"
+                "\t\t-trace_file        trace filename  \n"
+                "\t\t-trace_index       write trace_filename.idx together with a bin trace  \n"
+                "\t\t-cfg_csr           write the cfg as mmap-able CSR arrays to this file  \n"
+                "\t\t-dot_render        render 1.dot and 1.dot.d\\*.dot to png with N background dot.exe processes  \n"
+                "\t\t-cfg_events        stream cfg node/edge/extend/split events to a file or \\\\.\\pipe\\name while running  \n"
+                "\t\t-cfg_events_fmt    jsonl|bin, default jsonl  \n"
+                "\t\t-cache             cache dir for vm entry, decoded instructions, handler table and handler analysis, keyed by file hash  \n"
+                "\t\t-hlib              handler library dir shared between samples, needs -trace_mode vm  \n"
+                "\t\t-vm_summary        run only the non-junk instructions of verified handlers, needs -trace_mode vm  \n"
+                "\t\t-vm_interp         interpret verified handlers at the virtual instruction level, implies -vm_summary  \n"
+                "\t\t-handler_table     find the handler table after the first dispatches and pre-decode every handler  \n"
+                "\t\t                   with N threads (0: cpu counts), needs -trace_mode vm  \n"
+                "\t\t-scan_entries      list every vm entry stub (push imm32; call / jmp into .vmp0/.vmp1) in the code sections  \n"
+                "\t\t-run_entries       all|addr,addr,... analyse these vm entries in parallel and merge the cfgs, can't use with -trace_mode  \n"
+                "\t\t-entry_threads     threads for -run_entries, default cpu counts  \n"
+                "\t\t-explore           follow both sides of conditional jumps on tainted flags with N work-stealing threads  \n"
+                "\t\t                   (0: cpu counts), can't use with -trace_mode and -run_entries  \n"
+                "\t\t-explore_depth     max forks along one path, default 64  \n"
+                "\t\t-explore_insts     max instructions per path, default 1000000  \n"
+                "\t\t-explore_stale     stop a path, or the whole exploration, after this many instructions without new blocks or edges, default 200000  \n"
+                "\t\t-explore_inputs    eax,ecx,... registers tainted at the vm entry, return values of IAT calls are always tainted  \n"
+                "\t\t-batch            analyse every file in a dir, or listed one per line in a file, on a thread pool  \n"
+                "\t\t-batch_out        output dir, one sub dir per file and summary.csv, default batch_out  \n"
+                "\t\t-batch_threads    threads for -batch, default cpu counts  \n"
+                "\t\t-batch_insts      max instructions per file, default no limit  \n"
+                "\t\t-batch_ms         max milliseconds per file, default no limit  \n"
+                "\t\t-trace_index_build build trace_filename.idx from an existing bin trace  \n"
+                "\t\t-trace_query       inst N: registers at instruction N, addr X: first/last execution of X,  \n"
+                "\t\t                   access esi: instructions accessing [esi], block X: executions of block/handler X  \n"
+                "\t\t-trace_align       compare a bin (x86 mode) or text trace with a debugger run trace, report the first divergence  \n"
+                "\t\t-align_base        image base in the debugger (hex), default find it from the first instruction  \n"
+                "\t\t-align_dbg_before  registers in the debugger trace are the values before the instruction  \n"
+                "\t\t-align_max_skip    max debugger lines skipped to resync (IAT calls), default 1000000  \n"
+                "\t\t-align_threads     parser threads, default cpu counts  \n");
         return 0;
     }
 
@@ -47,13 +206,168 @@ extern "C" {
                 cmd_mod->vmp_start_addr = strtol(argv[i+1], NULL, ((str[0] == '0') && (str[0] == 'x')) ? 16:10);
                 i++;
             }
+            else if (!strcmp(argv[i], "-trace_mode") && (i + 1 < argc))
+            {
+                cmd_mod->trace = 1;
+                i++;
+                cmd_mod->trace_param.mode = !strcmp(argv[i], "delta") ? VMP_TRACE_MODE_DELTA
+                    : (!strcmp(argv[i], "block") ? VMP_TRACE_MODE_BLOCK
+                    : (!strcmp(argv[i], "vm") ? VMP_TRACE_MODE_VM : VMP_TRACE_MODE_FULL));
+            }
+            else if (!strcmp(argv[i], "-trace_fmt") && (i + 1 < argc))
+            {
+                cmd_mod->trace = 1;
+                cmd_mod->trace_param.fmt = !strcmp(argv[++i], "bin") ? VMP_TRACE_FMT_BIN : VMP_TRACE_FMT_TEXT;
+            }
+            else if (!strcmp(argv[i], "-trace_keyframe") && (i + 1 < argc))
+            {
+                cmd_mod->trace = 1;
+                cmd_mod->trace_param.keyframe = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-trace_block_regs"))
+            {
+                cmd_mod->trace = 1;
+                cmd_mod->trace_param.block_regs = 1;
+            }
+            else if (!strcmp(argv[i], "-trace_file") && (i + 1 < argc))
+            {
+                cmd_mod->trace = 1;
+                strcpy(cmd_mod->trace_filename, argv[++i]);
+                cmd_mod->trace_param.filename = cmd_mod->trace_filename;
+            }
+            else if (!strcmp(argv[i], "-trace_index"))
+            {
+                cmd_mod->trace = 1;
+                cmd_mod->trace_param.index = 1;
+            }
+            else if (!strcmp(argv[i], "-cfg_csr") && (i + 1 < argc))
+            {
+                cmd_mod->cfg_csr_filename = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-dot_render") && (i + 1 < argc))
+            {
+                cmd_mod->dot_render = atoi(argv[++i]);
+                if (cmd_mod->dot_render <= 0)
+                    cmd_mod->dot_render = 1;
+            }
+            else if (!strcmp(argv[i], "-cfg_events") && (i + 1 < argc))
+            {
+                cmd_mod->cfg_events.filename = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-cache") && (i + 1 < argc))
+            {
+                cmd_mod->cache_dir = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-hlib") && (i + 1 < argc))
+            {
+                cmd_mod->hlib_dir = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-vm_summary"))
+            {
+                cmd_mod->vm_summary = 1;
+            }
+            else if (!strcmp(argv[i], "-vm_interp"))
+            {
+                cmd_mod->vm_interp = 1;
+            }
+            else if (!strcmp(argv[i], "-scan_entries"))
+            {
+                cmd_mod->scan_entries = 1;
+            }
+            else if (!strcmp(argv[i], "-run_entries") && (i + 1 < argc))
+            {
+                cmd_mod->run_entries = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-entry_threads") && (i + 1 < argc))
+            {
+                cmd_mod->entry_threads = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-explore") && (i + 1 < argc))
+            {
+                cmd_mod->explore = 1;
+                cmd_mod->explore_param.threads = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-explore_depth") && (i + 1 < argc))
+            {
+                cmd_mod->explore_param.max_depth = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-explore_insts") && (i + 1 < argc))
+            {
+                cmd_mod->explore_param.max_insts = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-batch") && (i + 1 < argc))
+            {
+                cmd_mod->batch.input = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-batch_out") && (i + 1 < argc))
+            {
+                cmd_mod->batch.out_dir = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-batch_threads") && (i + 1 < argc))
+            {
+                cmd_mod->batch.threads = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-batch_insts") && (i + 1 < argc))
+            {
+                cmd_mod->batch.max_insts = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-batch_ms") && (i + 1 < argc))
+            {
+                cmd_mod->batch.max_ms = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-explore_stale") && (i + 1 < argc))
+            {
+                cmd_mod->explore_param.stale_insts = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-explore_inputs") && (i + 1 < argc))
+            {
+                cmd_mod->explore_inputs = vmp_regs_parse(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-handler_table") && (i + 1 < argc))
+            {
+                cmd_mod->handler_table = 1;
+                cmd_mod->handler_table_threads = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-cfg_events_fmt") && (i + 1 < argc))
+            {
+                cmd_mod->cfg_events.fmt = !strcmp(argv[++i], "bin") ? VMP_CFG_EVENT_FMT_BIN : VMP_CFG_EVENT_FMT_JSONL;
+            }
+            else if (!strcmp(argv[i], "-trace_index_build"))
+            {
+                cmd_mod->trace_index_build = 1;
+            }
+            else if (!strcmp(argv[i], "-trace_query") && (i + 2 < argc))
+            {
+                cmd_mod->trace_query[0] = argv[++i];
+                cmd_mod->trace_query[1] = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-trace_align") && (i + 1 < argc))
+            {
+                cmd_mod->align_param.dbg_filename = argv[++i];
+            }
+            else if (!strcmp(argv[i], "-align_base") && (i + 1 < argc))
+            {
+                cmd_mod->align_param.dbg_base = strtoul(argv[++i], NULL, 16);
+            }
+            else if (!strcmp(argv[i], "-align_dbg_before"))
+            {
+                cmd_mod->align_param.dbg_before = 1;
+            }
+            else if (!strcmp(argv[i], "-align_max_skip") && (i + 1 < argc))
+            {
+                cmd_mod->align_param.max_skip = atoi(argv[++i]);
+            }
+            else if (!strcmp(argv[i], "-align_threads") && (i + 1 < argc))
+            {
+                cmd_mod->align_param.threads = atoi(argv[++i]);
+            }
             else
             {
                 strcpy(cmd_mod->filename, argv[i]);
             }
         }
 
-        if (!cmd_mod->filename[0])
+        if (!cmd_mod->filename[0] && !cmd_mod->batch.input)
         {
             vmp_help();
             return 1;
@@ -66,11 +380,58 @@ extern "C" {
     {
         struct vmp_decoder *vmp_decoder1 = NULL;
         struct vmp_cmd_params cmd_mod = { 0 };
+        uint32_t *entries = NULL;
+        int entry_counts = 0;
         if (vmp_cmd_parse (&cmd_mod, argc, argv))
         {
             return 0;
         }
 
+        if (cmd_mod.trace_index_build)
+        {
+            return vmp_trace_index_build(cmd_mod.filename);
+        }
+
+        if (cmd_mod.trace_query[0])
+        {
+            return vmp_trace_index_query(cmd_mod.filename, cmd_mod.trace_query[0], cmd_mod.trace_query[1]);
+        }
+
+        if (cmd_mod.align_param.dbg_filename)
+        {
+            cmd_mod.align_param.emu_filename = cmd_mod.filename;
+            return vmp_trace_align(&cmd_mod.align_param);
+        }
+
+        if (cmd_mod.trace_param.index && (cmd_mod.trace_param.fmt != VMP_TRACE_FMT_BIN))
+        {
+            printf("-trace_index only works with -trace_fmt bin\n");
+            return -1;
+        }
+
+        if (cmd_mod.run_entries && cmd_mod.trace)
+        {
+            printf("-run_entries can't use with -trace_mode\n");
+            return -1;
+        }
+
+        if (cmd_mod.explore && (cmd_mod.trace || cmd_mod.run_entries))
+        {
+            printf("-explore can't use with -trace_mode and -run_entries\n");
+            return -1;
+        }
+
+        if (cmd_mod.batch.input && (cmd_mod.trace || cmd_mod.run_entries || cmd_mod.explore))
+        {
+            printf("-batch can't use with -trace_mode, -run_entries and -explore\n");
+            return -1;
+        }
+
+        if (cmd_mod.run_entries && vmp_entries_parse(cmd_mod.run_entries, &entries, &entry_counts))
+        {
+            return -1;
+        }
+
         // 我在调试的时候碰到一个问题，就是假如在cmd里直接运行把调试信息直接输出到屏幕上
         // 虽然可以运行完，然后因为错误信息太多需要很长时间才能结束，但是假如重定向到
         // 文件里，可以很快运行完，不过因为printf是有缓冲区的，即使追加了\n，但是在重定
@@ -85,16 +446,90 @@ extern "C" {
         // 我们采用第2种
         freopen("vmp.log", "w", stdout);
 
-        vmp_decoder1 = vmp_decoder_create(cmd_mod.filename, cmd_mod.vmp_start_addr, cmd_mod.dump_pe);
+        if (cmd_mod.batch.input)
+        {
+            if (!cmd_mod.batch.out_dir)
+                cmd_mod.batch.out_dir = "batch_out";
+            cmd_mod.batch.cache_dir = cmd_mod.cache_dir;
+            return vmp_batch_run(&cmd_mod.batch);
+        }
+
+        vmp_decoder1 = vmp_decoder_create(cmd_mod.filename, cmd_mod.vmp_start_addr, cmd_mod.dump_pe, cmd_mod.cache_dir);
         if (NULL == vmp_decoder1)
         {
             printf("main() failed with vmp_decoder_create(). %s:%d\n", __FILE__, __LINE__);
             return -1;
         }
 
+        if (cmd_mod.scan_entries)
+        {
+            return vmp_scan_dump(vmp_decoder1);
+        }
+
+        if (cmd_mod.trace && vmp_decoder_set_trace(vmp_decoder1, &cmd_mod.trace_param))
+        {
+            printf("main() failed with vmp_decoder_set_trace(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (cmd_mod.cfg_csr_filename)
+        {
+            vmp_decoder_set_cfg_csr(vmp_decoder1, cmd_mod.cfg_csr_filename);
+        }
+
+        if (cmd_mod.dot_render && vmp_decoder_set_dot_render(vmp_decoder1, cmd_mod.dot_render))
+        {
+            printf("main() failed with vmp_decoder_set_dot_render(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (cmd_mod.hlib_dir && vmp_decoder_set_hlib(vmp_decoder1, cmd_mod.hlib_dir))
+        {
+            printf("main() failed with vmp_decoder_set_hlib(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (cmd_mod.vm_summary && vmp_decoder_set_vm_summary(vmp_decoder1, 1))
+        {
+            printf("main() failed with vmp_decoder_set_vm_summary(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (cmd_mod.vm_interp && vmp_decoder_set_vm_interp(vmp_decoder1, 1))
+        {
+            printf("main() failed with vmp_decoder_set_vm_interp(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (cmd_mod.handler_table && vmp_decoder_set_handler_table(vmp_decoder1, cmd_mod.handler_table_threads))
+        {
+            printf("main() failed with vmp_decoder_set_handler_table(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (cmd_mod.cfg_events.filename && vmp_decoder_set_cfg_events(vmp_decoder1, &cmd_mod.cfg_events))
+        {
+            printf("main() failed with vmp_decoder_set_cfg_events(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
         __try
         { 
-            if (vmp_decoder_run(vmp_decoder1))
+            if (cmd_mod.run_entries)
+            {
+                if (vmp_decoder_run_entries(vmp_decoder1, entries, entry_counts, cmd_mod.entry_threads))
+                {
+                    printf("main() failed with vmp_decoder_run_entries(). %s:%d\n", __FILE__, __LINE__);
+                }
+            }
+            else if (cmd_mod.explore)
+            {
+                if (vmp_decoder_explore(vmp_decoder1, &cmd_mod.explore_param, cmd_mod.explore_inputs))
+                {
+                    printf("main() failed with vmp_decoder_explore(). %s:%d\n", __FILE__, __LINE__);
+                }
+            }
+            else if (vmp_decoder_run(vmp_decoder1))
             {
                 printf("main() failed with vmp_decoder_run(). %s:%d\n", __FILE__, __LINE__);
             }
@@ -106,6 +541,7 @@ extern "C" {
 
 
         vmp_decoder_destroy(vmp_decoder1);
+        free(entries);
 
         return 0;
     }
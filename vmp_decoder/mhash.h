@@ -0,0 +1,196 @@
+﻿/*
+\file       mhash.h
+\brief      open addressing hash map, 64bit key to 64bit value
+ ----history----
+\version    0.01
+\desc       create
+
+*/
+#if !defined(__mhash_h__)
+#define __mhash_h__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* key为全1的时候表示这个槽是空的，地址不可能是这个值 */
+#define MHASH64_EMPTY               (~(uint64_t)0)
+#define MHASH64_MIN_SIZE            64
+
+typedef struct mhash64
+{
+    uint64_t    *keys;
+    uint64_t    *vals;
+    uint32_t    size;       /* 总是2的幂 */
+    uint32_t    counts;
+} mhash64_t;
+
+static inline uint64_t mhash64_mix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline int mhash64_init(struct mhash64 *h, uint32_t size)
+{
+    uint32_t n = MHASH64_MIN_SIZE;
+
+    while (n < size)
+        n <<= 1;
+
+    h->keys = (uint64_t *)malloc(n * sizeof (h->keys[0]));
+    h->vals = (uint64_t *)calloc(n, sizeof (h->vals[0]));
+    if (!h->keys || !h->vals)
+    {
+        free(h->keys);
+        free(h->vals);
+        memset(h, 0, sizeof (h[0]));
+        return -1;
+    }
+    memset(h->keys, 0xff, n * sizeof (h->keys[0]));
+    h->size = n;
+    h->counts = 0;
+
+    return 0;
+}
+
+static inline void mhash64_uninit(struct mhash64 *h)
+{
+    free(h->keys);
+    free(h->vals);
+    memset(h, 0, sizeof (h[0]));
+}
+
+static inline void mhash64_clear(struct mhash64 *h)
+{
+    if (h->keys)
+    {
+        memset(h->keys, 0xff, h->size * sizeof (h->keys[0]));
+        memset(h->vals, 0, h->size * sizeof (h->vals[0]));
+    }
+    h->counts = 0;
+}
+
+/* @return     指向value的指针，没找到返回NULL */
+static inline uint64_t *mhash64_find(struct mhash64 *h, uint64_t key)
+{
+    uint32_t i, mask = h->size - 1;
+
+    if (!h->size)
+        return NULL;
+
+    for (i = (uint32_t)mhash64_mix(key) & mask; h->keys[i] != MHASH64_EMPTY; i = (i + 1) & mask)
+    {
+        if (h->keys[i] == key)
+            return h->vals + i;
+    }
+
+    return NULL;
+}
+
+static inline int mhash64_grow(struct mhash64 *h)
+{
+    struct mhash64 n;
+    uint32_t i, j, mask;
+
+    if (mhash64_init(&n, h->size ? h->size * 2 : MHASH64_MIN_SIZE))
+        return -1;
+
+    mask = n.size - 1;
+    for (i = 0; i < h->size; i++)
+    {
+        if (h->keys[i] == MHASH64_EMPTY)
+            continue;
+
+        for (j = (uint32_t)mhash64_mix(h->keys[i]) & mask; n.keys[j] != MHASH64_EMPTY; j = (j + 1) & mask);
+        n.keys[j] = h->keys[i];
+        n.vals[j] = h->vals[i];
+        n.counts++;
+    }
+
+    mhash64_uninit(h);
+    *h = n;
+
+    return 0;
+}
+
+/* 找到key对应的value，没有的话插入一个值为0的新项
+@is_new     可以为NULL，新插入时置1
+@return     指向value的指针，内存不足时返回NULL */
+static inline uint64_t *mhash64_insert(struct mhash64 *h, uint64_t key, int *is_new)
+{
+    uint32_t i, mask;
+
+    if (is_new)
+        *is_new = 0;
+
+    /* 装载因子控制在 1/2 以下 */
+    if (((h->counts + 1) * 2 > h->size) && mhash64_grow(h))
+        return NULL;
+
+    mask = h->size - 1;
+    for (i = (uint32_t)mhash64_mix(key) & mask; h->keys[i] != MHASH64_EMPTY; i = (i + 1) & mask)
+    {
+        if (h->keys[i] == key)
+            return h->vals + i;
+    }
+
+    h->keys[i] = key;
+    h->vals[i] = 0;
+    h->counts++;
+    if (is_new)
+        *is_new = 1;
+
+    return h->vals + i;
+}
+
+/* 删除key，后面同一条探测链上的项往前挪，不留墓碑
+@return     0           success
+            -1          not found */
+static inline int mhash64_remove(struct mhash64 *h, uint64_t key)
+{
+    uint32_t i, j, k, mask = h->size - 1;
+
+    if (!h->size)
+        return -1;
+
+    for (i = (uint32_t)mhash64_mix(key) & mask; h->keys[i] != key; i = (i + 1) & mask)
+    {
+        if (h->keys[i] == MHASH64_EMPTY)
+            return -1;
+    }
+
+    for (j = (i + 1) & mask; h->keys[j] != MHASH64_EMPTY; j = (j + 1) & mask)
+    {
+        k = (uint32_t)mhash64_mix(h->keys[j]) & mask;
+        /* k在(i, j]之间的话，j这一项不能挪到i */
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            continue;
+
+        h->keys[i] = h->keys[j];
+        h->vals[i] = h->vals[j];
+        i = j;
+    }
+
+    h->keys[i] = MHASH64_EMPTY;
+    h->vals[i] = 0;
+    h->counts--;
+
+    return 0;
+}
+
+#define mhash64_foreach(_h, _i)     for ((_i) = 0; (_i) < (_h)->size; (_i)++) if ((_h)->keys[_i] != MHASH64_EMPTY)
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* !defined(__mhash_h__) */
@@ -65,14 +65,18 @@ extern "C" {
     }
 
 
-    char* last_error()
+#if 0
+    // 只有pe_loader_create里关掉的文件映射用到，和它一起关掉
+    // buf由调用者给，几个线程同时出错也不会互相覆盖
+    static char* last_error(char *buf, int size)
     {
-        static char buf[256];
+        buf[0] = 0;
         FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
                NULL, GetLastError(), MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), 
-               buf, (sizeof(buf) / sizeof(char)), NULL);
+               buf, size, NULL);
         return buf;
     }
+#endif
 
     struct pe_loader *pe_loader_create(LPCTSTR filename)
     {
@@ -110,6 +114,7 @@ extern "C" {
         printf("AllocationGraularity = %d\n", sys_info.dwAllocationGranularity);
 
 #if 0
+        char err[256];
 
         mod->file_handl = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
             NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
@@ -146,7 +151,7 @@ extern "C" {
                 psec_header[i].Misc.VirtualSize / sys_info.dwAllocationGranularity + sys_info.dwAllocationGranularity);
             if (!mod->sec_handl[i])
             {
-                printf("pe_loader_create() failed with (%s)MapViewOfFile()\n", last_error());
+                printf("pe_loader_create() failed with (%s)MapViewOfFile()\n", last_error(err, sizeof (err)));
                 goto fail_label;
             }
         }
@@ -160,7 +165,8 @@ extern "C" {
             goto fail_label;
         }
 
-        mod->buf_base = (uint8_t *)calloc(1, (mod->size_of_image/ (64 * 1024) + 2) * 64 * 1024);
+        mod->buf_size = (mod->size_of_image/ (64 * 1024) + 2) * 64 * 1024;
+        mod->buf_base = (uint8_t *)calloc(1, mod->buf_size);
         if (NULL == mod->buf_base)
         {
             printf("pe_loader() failed when calloc()\n");
@@ -195,7 +201,7 @@ extern "C" {
         if (mod->is_x64)
         {
             printf("pe_loader() failed with un-support X64 arch. %s:%d\r\n", __FILE__, __LINE__);
-            return NULL;
+            goto fail_label;
         }
 
         mod->fake_image_base = popt_header->ImageBase;
@@ -212,18 +218,149 @@ extern "C" {
         return NULL;
     }
 
+    // 和pe_loader_create一样展开，只是文件已经整个读到内存里了，不用再读两遍头。
+    // mod->buf_base够大的话直接重用，只清掉镜像用到的部分
+    static int pe_loader_load_mem(struct pe_loader *mod, uint8_t *data, int size)
+    {
+        PIMAGE_DOS_HEADER pdos_header = (PIMAGE_DOS_HEADER)data;
+        PIMAGE_NT_HEADERS32 pnt_headder;
+        PIMAGE_OPTIONAL_HEADER32 popt_header;
+        PIMAGE_SECTION_HEADER psec_header;
+        uint32_t len;
+        int i, buf_size;
+
+        if (!data || (size < (int)sizeof (pdos_header[0])) || (pdos_header->e_magic != IMAGE_DOS_SIGNATURE)
+            || (pdos_header->e_lfanew < 0) || ((uint32_t)pdos_header->e_lfanew + sizeof (IMAGE_NT_HEADERS32) > (uint32_t)size))
+        {
+            printf("pe_loader_create_mem() failed with invalid pe header. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        pnt_headder = (PIMAGE_NT_HEADERS32)(data + pdos_header->e_lfanew);
+        popt_header = &pnt_headder->OptionalHeader;
+        psec_header = (PIMAGE_SECTION_HEADER)((char *)popt_header + sizeof(popt_header[0]));
+        if (pnt_headder->FileHeader.Machine != 0x14c)
+        {
+            printf("pe_loader_create_mem() failed with un-support arch[%x]. %s:%d\n", pnt_headder->FileHeader.Machine, __FILE__, __LINE__);
+            return -1;
+        }
+
+        mod->size_of_image = popt_header->SizeOfImage;
+        mod->pe_header_size = (int)((char *)popt_header - (char *)data) + pnt_headder->FileHeader.SizeOfOptionalHeader + (int)(pnt_headder->FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER));
+        if ((mod->pe_header_size > size) || (mod->pe_header_size > mod->size_of_image))
+        {
+            printf("pe_loader_create_mem() failed with invalid header size. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        buf_size = (mod->size_of_image/ (64 * 1024) + 2) * 64 * 1024;
+        if (mod->buf_size < buf_size)
+        {
+            free(mod->buf_base);
+            mod->buf_size = 0;
+            mod->buf_base = (uint8_t *)calloc(1, buf_size);
+            if (NULL == mod->buf_base)
+            {
+                printf("pe_loader_create_mem() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            mod->buf_size = buf_size;
+        }
+        // 64k对齐
+        mod->image_base = (uint8_t *)((uint64_t)(mod->buf_base + 64 * 1024) & ~0xffff);
+        memset(mod->image_base, 0, mod->size_of_image);
+        memcpy(mod->image_base, data, mod->pe_header_size);
+
+        pnt_headder = (PIMAGE_NT_HEADERS32)(mod->image_base + pdos_header->e_lfanew);
+        popt_header = &pnt_headder->OptionalHeader;
+        psec_header = (PIMAGE_SECTION_HEADER)((char *)popt_header + sizeof(popt_header[0]));
+
+        for (i = 0; i < pnt_headder->FileHeader.NumberOfSections; i++)
+        {
+            if (!psec_header[i].PointerToRawData || !psec_header[i].SizeOfRawData
+                || (psec_header[i].PointerToRawData >= (uint32_t)size) || (psec_header[i].VirtualAddress >= (uint32_t)mod->size_of_image))
+            {
+                continue;
+            }
+
+            // pe_loader_create是按VirtualSize读的，读到文件末尾为止
+            len = psec_header[i].Misc.VirtualSize;
+            if (len > size - psec_header[i].PointerToRawData)
+                len = size - psec_header[i].PointerToRawData;
+            if (len > mod->size_of_image - psec_header[i].VirtualAddress)
+                len = mod->size_of_image - psec_header[i].VirtualAddress;
+
+            memcpy(mod->image_base + psec_header[i].VirtualAddress, data + psec_header[i].PointerToRawData, len);
+        }
+
+        mod->fake_image_base = popt_header->ImageBase;
+        pe_loader_fix_reloc(mod, 1);
+        pe_loader_fix_iat(mod);
+
+        return 0;
+    }
+
+    struct pe_loader *pe_loader_create_mem(uint8_t *data, int size)
+    {
+        struct pe_loader *mod;
+
+        if (!(mod = (struct pe_loader *)calloc(1, sizeof(mod[0]))))
+        {
+            printf("pe_loader_create_mem() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (pe_loader_load_mem(mod, data, size))
+        {
+            pe_loader_destroy(mod);
+            return NULL;
+        }
+
+        return mod;
+    }
+
+    int pe_loader_reset(struct pe_loader *mod, uint8_t *data, int size)
+    {
+        uint8_t *buf_base = mod->buf_base;
+        int buf_size = mod->buf_size;
+
+        // pe_loader_create打开的文件和映射不再需要了，只留下镜像的缓冲
+        if (mod->fp)
+            fclose(mod->fp);
+        if (mod->map_handl)
+            CloseHandle(mod->map_handl);
+        if (mod->file_handl)
+            CloseHandle(mod->file_handl);
+
+        memset(mod, 0, sizeof (mod[0]));
+        mod->buf_base = buf_base;
+        mod->buf_size = buf_size;
+
+        if (pe_loader_load_mem(mod, data, size))
+        {
+            printf("pe_loader_reset() failed with pe_loader_load_mem(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        return 0;
+    }
+
     void             pe_loader_destroy(struct pe_loader *mod)
     {
         if (mod)
         {
-            if (mod->image_base)
-                UnmapViewOfFile(mod->map_handl);
-
             if (mod->map_handl)
+            {
+                UnmapViewOfFile(mod->image_base);
                 CloseHandle(mod->map_handl);
+            }
 
             if (mod->file_handl)
                 CloseHandle(mod->file_handl);
+
+            if (mod->fp)
+                fclose(mod->fp);
+            free(mod->buf_base);
             free(mod);
         }
     }
@@ -304,6 +441,48 @@ extern "C" {
         return 0;
     }
 
+    long pe_loader_section_get(struct pe_loader *mod, int i, unsigned char **section_start, int *section_size, DWORD *characteristics)
+    {
+        PIMAGE_DOS_HEADER pdos_header;
+        PIMAGE_NT_HEADERS32 pnt_headder;
+        PIMAGE_FILE_HEADER pfile_header;
+        PIMAGE_OPTIONAL_HEADER32 popt_header;
+        PIMAGE_SECTION_HEADER psec_header;
+
+        if (mod->is_x64)
+        {
+            printf("pe_loader_section_get() not support x64 arch. %s:%d\r\n", __FILE__, __LINE__);
+            return 0;
+        }
+
+        pdos_header = (PIMAGE_DOS_HEADER)mod->image_base;
+        pnt_headder = (PIMAGE_NT_HEADERS32)(((char *)pdos_header + pdos_header->e_lfanew));
+        popt_header = &pnt_headder->OptionalHeader;
+        pfile_header = &pnt_headder->FileHeader;
+        psec_header = (PIMAGE_SECTION_HEADER)((char *)popt_header + sizeof(popt_header[0]));
+
+        if ((i < 0) || (i >= pfile_header->NumberOfSections))
+            return 0;
+
+        if (section_start)
+        {
+            *section_start = (unsigned char *)mod->image_base + psec_header[i].VirtualAddress;
+        }
+
+        if (section_size)
+        {
+            *section_size = psec_header[i].Misc.VirtualSize ?
+                 psec_header[i].Misc.VirtualSize:psec_header[i].SizeOfRawData;
+        }
+
+        if (characteristics)
+        {
+            *characteristics = psec_header[i].Characteristics;
+        }
+
+        return 1;
+    }
+
     int pe_loader_addr_in_iat(struct pe_loader *mod, unsigned char *iat)
     {
 #undef func_format
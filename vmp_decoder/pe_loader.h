@@ -14,6 +14,8 @@ struct pe_loader
     HANDLE  file_handl;
     HANDLE  map_handl;
     uint8_t* buf_base;
+    // buf_base的大小，pe_loader_reset时够大就不重新分配
+    int     buf_size;
     uint8_t* image_base;
     uint8_t* sec_handl[16];
     FILE *fp;
@@ -33,9 +35,15 @@ struct pe_loader
 };
 
 struct pe_loader *pe_loader_create(LPCTSTR path);
+/* 从已经读到内存里的PE文件展开，data用完以后可以释放 */
+struct pe_loader *pe_loader_create_mem(uint8_t *data, int size);
+/* 换成另一个已经读到内存里的PE文件，镜像的缓冲够大的话重用 */
+int pe_loader_reset(struct pe_loader *mod, uint8_t *data, int size);
 void pe_loader_destroy(struct pe_loader *mod);
 void pe_loader_dump(struct pe_loader *mod);
 long pe_loader_section_find(struct pe_loader *mod, const char *sec_name, unsigned char **section_start, int *section_size);
+/* 按下标取section，下标越界返回0 */
+long pe_loader_section_get(struct pe_loader *mod, int i, unsigned char **section_start, int *section_size, DWORD *characteristics);
 int pe_loader_sym_find(struct pe_loader *mod, DWORD rva, char *sym_name, int sym_buf_siz);
 
 int pe_loader_fix_reloc(struct pe_loader *mod, int just_vmp);
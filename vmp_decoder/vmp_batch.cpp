@@ -0,0 +1,396 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_batch.h"
+#include "vmp_tpool.h"
+
+    static int vmp_batch_add(struct vmp_batch *batch, const char *path)
+    {
+        struct vmp_batch_item *items;
+        int size;
+
+        if (batch->counts >= batch->size)
+        {
+            size = batch->size ? batch->size * 2 : 64;
+            items = (struct vmp_batch_item *)realloc(batch->items, size * sizeof (items[0]));
+            if (!items)
+            {
+                printf("vmp_batch_add() failed with realloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            memset(items + batch->size, 0, (size - batch->size) * sizeof (items[0]));
+            batch->items = items;
+            batch->size = size;
+        }
+
+        strncpy(batch->items[batch->counts].path, path, sizeof (batch->items[0].path) - 1);
+        batch->counts++;
+
+        return 0;
+    }
+
+    static int vmp_batch_scan_dir(struct vmp_batch *batch, const char *dir)
+    {
+        WIN32_FIND_DATA find_data;
+        HANDLE find;
+        char pattern[MAX_PATH] = {0}, path[MAX_PATH];
+
+        _snprintf(pattern, sizeof (pattern) - 1, "%s\\*", dir);
+        find = FindFirstFile(pattern, &find_data);
+        if (find == INVALID_HANDLE_VALUE)
+        {
+            printf("vmp_batch_scan_dir(%s) failed with FindFirstFile(). %s:%d\n", dir, __FILE__, __LINE__);
+            return -1;
+        }
+
+        do
+        {
+            if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                continue;
+
+            memset(path, 0, sizeof (path));
+            _snprintf(path, sizeof (path) - 1, "%s\\%s", dir, find_data.cFileName);
+            if (vmp_batch_add(batch, path))
+            {
+                FindClose(find);
+                return -1;
+            }
+        } while (FindNextFile(find, &find_data));
+        FindClose(find);
+
+        return 0;
+    }
+
+    // 列表文件一行一个路径，空行和#开头的行跳过
+    static int vmp_batch_scan_list(struct vmp_batch *batch, const char *list)
+    {
+        FILE *fp;
+        char line[MAX_PATH + 16], *s, *e;
+        int ret = -1;
+
+        if (!(fp = fopen(list, "r")))
+        {
+            printf("vmp_batch_scan_list(%s) failed with fopen(). %s:%d\n", list, __FILE__, __LINE__);
+            return -1;
+        }
+
+        while (fgets(line, sizeof (line), fp))
+        {
+            for (s = line; (*s == ' ') || (*s == '\t'); s++);
+            for (e = s + strlen(s); (e > s) && ((e[-1] == '\r') || (e[-1] == '\n') || (e[-1] == ' ') || (e[-1] == '\t')); e--);
+            *e = 0;
+
+            if (!s[0] || (s[0] == '#'))
+                continue;
+
+            if (vmp_batch_add(batch, s))
+                goto exit_label;
+        }
+        ret = 0;
+
+    exit_label:
+        fclose(fp);
+        return ret;
+    }
+
+    static uint8_t *vmp_batch_read_file(const char *path, int *size)
+    {
+        FILE *fp;
+        uint8_t *data = NULL;
+        long len;
+
+        if (!(fp = fopen(path, "rb")))
+        {
+            printf("vmp_batch_read_file(%s) failed with fopen(). %s:%d\n", path, __FILE__, __LINE__);
+            return NULL;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if (len <= 0)
+        {
+            printf("vmp_batch_read_file(%s) failed with empty file. %s:%d\n", path, __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (!(data = (uint8_t *)malloc(len)))
+        {
+            printf("vmp_batch_read_file(%s) failed with malloc(%ld). %s:%d\n", path, len, __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (fread(data, 1, len, fp) != (size_t)len)
+        {
+            printf("vmp_batch_read_file(%s) failed with fread(). %s:%d\n", path, __FILE__, __LINE__);
+            free(data);
+            data = NULL;
+            goto exit_label;
+        }
+        *size = (int)len;
+
+    exit_label:
+        fclose(fp);
+        return data;
+    }
+
+    // 按顺序预读，worker在分析当前文件的时候下一个文件已经读好了
+    static unsigned __stdcall vmp_batch_reader(void *arg)
+    {
+        struct vmp_batch *batch = (struct vmp_batch *)arg;
+        struct vmp_batch_item *item;
+        int i;
+
+        for (i = 0; i < batch->counts; i++)
+        {
+            item = batch->items + i;
+
+            AcquireSRWLockExclusive(&batch->lock);
+            while (i >= batch->taken + batch->window)
+            {
+                SleepConditionVariableSRW(&batch->taken_cond, &batch->lock, INFINITE, 0);
+            }
+            ReleaseSRWLockExclusive(&batch->lock);
+
+            item->data = vmp_batch_read_file(item->path, &item->size);
+
+            AcquireSRWLockExclusive(&batch->lock);
+            item->loaded = 1;
+            WakeAllConditionVariable(&batch->loaded);
+            ReleaseSRWLockExclusive(&batch->lock);
+        }
+
+        return 0;
+    }
+
+    static const char *vmp_batch_analyse(struct vmp_batch *batch, struct vmp_batch_item *item)
+    {
+        struct vmp_decoder_create_param param = {0};
+        struct vmp_decoder *decoder;
+        const char *status;
+
+        param.filename = item->path;
+        param.data = item->data;
+        param.size = item->size;
+        param.cache_dir = batch->param.cache_dir;
+        param.out_dir = item->out_dir;
+        param.quiet = 1;
+
+        if (!(decoder = vmp_decoder_pool_get(batch->pool, &param)))
+        {
+            return "create_failed";
+        }
+
+        vmp_decoder_set_budget(decoder, batch->param.max_insts, batch->param.max_ms);
+        vmp_decoder_set_cfg_csr(decoder, item->csr_filename);
+
+        status = vmp_decoder_run(decoder) ? "run_failed" : "ok";
+        vmp_decoder_result(decoder, &item->result);
+        if (item->result.budget_hit)
+        {
+            status = "budget";
+        }
+
+        vmp_decoder_pool_put(batch->pool, decoder);
+
+        return status;
+    }
+
+    static void vmp_batch_job(void *arg)
+    {
+        struct vmp_batch_item *item = (struct vmp_batch_item *)arg;
+        struct vmp_batch *batch = item->batch;
+        DWORD start;
+        LONG done;
+
+        AcquireSRWLockExclusive(&batch->lock);
+        while (!item->loaded)
+        {
+            SleepConditionVariableSRW(&batch->loaded, &batch->lock, INFINITE, 0);
+        }
+        batch->taken++;
+        WakeConditionVariable(&batch->taken_cond);
+        ReleaseSRWLockExclusive(&batch->lock);
+
+        start = GetTickCount();
+        if (!item->data)
+        {
+            item->status = "read_failed";
+        }
+        else
+        {
+            // 目录已经存在的话CreateDirectory会失败，不用管
+            CreateDirectory(item->out_dir, NULL);
+
+            // 一个文件崩了不影响别的文件，崩了的decoder不再放回池里，也不释放
+            __try
+            {
+                item->status = vmp_batch_analyse(batch, item);
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER)
+            {
+                item->status = "crash";
+            }
+
+            free(item->data);
+            item->data = NULL;
+        }
+        item->ms = GetTickCount() - start;
+
+        done = InterlockedIncrement(&batch->done);
+        printf("batch [%d/%d] %s: %s insts[%llu] blocks[%d] %ums\n", (int)done, batch->counts, item->path, item->status,
+            (unsigned long long)item->result.insts, item->result.blocks, item->ms);
+    }
+
+    static int vmp_batch_summary(struct vmp_batch *batch)
+    {
+        struct vmp_batch_item *item;
+        char filename[MAX_PATH] = {0};
+        FILE *fp;
+        int i;
+
+        _snprintf(filename, sizeof (filename) - 1, "%s\\summary.csv", batch->param.out_dir);
+        if (!(fp = fopen(filename, "w")))
+        {
+            printf("vmp_batch_summary(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        fprintf(fp, "index,file,status,entry,insts,blocks,edges,size,ms\n");
+        for (i = 0; i < batch->counts; i++)
+        {
+            item = batch->items + i;
+            fprintf(fp, "%d,\"%s\",%s,%08x,%llu,%d,%d,%d,%u\n", i, item->path, item->status, item->result.entry,
+                (unsigned long long)item->result.insts, item->result.blocks, item->result.edges, item->size, item->ms);
+        }
+        fclose(fp);
+
+        return 0;
+    }
+
+    int vmp_batch_run(struct vmp_batch_param *param)
+    {
+        struct vmp_batch batch = {0};
+        struct vmp_batch_item *item;
+        struct vmp_tpool *pool = NULL;
+        HANDLE reader = NULL;
+        DWORD attr, start = GetTickCount();
+        const char *name, *s;
+        int i, ret = -1, threads;
+
+        batch.param = *param;
+        InitializeSRWLock(&batch.lock);
+        InitializeConditionVariable(&batch.loaded);
+        InitializeConditionVariable(&batch.taken_cond);
+
+        attr = GetFileAttributes(param->input);
+        if (attr == INVALID_FILE_ATTRIBUTES)
+        {
+            printf("vmp_batch_run(%s) failed with GetFileAttributes(). %s:%d\n", param->input, __FILE__, __LINE__);
+            return -1;
+        }
+
+        if ((attr & FILE_ATTRIBUTE_DIRECTORY) ? vmp_batch_scan_dir(&batch, param->input) : vmp_batch_scan_list(&batch, param->input))
+        {
+            goto exit_label;
+        }
+
+        if (!batch.counts)
+        {
+            printf("vmp_batch_run(%s) failed with no file. %s:%d\n", param->input, __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        CreateDirectory(param->out_dir, NULL);
+        for (i = 0; i < batch.counts; i++)
+        {
+            item = batch.items + i;
+            item->batch = &batch;
+            item->index = i;
+            item->status = "skipped";
+
+            for (name = s = item->path; *s; s++)
+            {
+                if ((*s == '\\') || (*s == '/'))
+                    name = s + 1;
+            }
+
+            // 不同目录下可能有同名的文件，前面加上序号
+            _snprintf(item->out_dir, sizeof (item->out_dir) - 1, "%s\\%05d_%s", param->out_dir, i, name);
+            _snprintf(item->csr_filename, sizeof (item->csr_filename) - 1, "%s\\cfg.csr", item->out_dir);
+        }
+
+        threads = (param->threads > 0) ? param->threads : vmp_tpool_cpu_counts();
+        batch.window = threads * VMP_BATCH_WINDOW;
+
+        // 每个线程留一个空闲的decoder，下一个文件直接reset
+        if (!(batch.pool = vmp_decoder_pool_create(threads)))
+        {
+            printf("vmp_batch_run() failed with vmp_decoder_pool_create(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (!(pool = vmp_tpool_create(threads)))
+        {
+            printf("vmp_batch_run() failed with vmp_tpool_create(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        reader = (HANDLE)_beginthreadex(NULL, 0, vmp_batch_reader, &batch, 0, NULL);
+        if (!reader)
+        {
+            printf("vmp_batch_run() failed with _beginthreadex(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        // 任务按提交顺序开始，和预读的顺序一样
+        for (i = 0; i < batch.counts; i++)
+        {
+            if (vmp_tpool_submit(pool, vmp_batch_job, batch.items + i))
+            {
+                printf("vmp_batch_run() failed with vmp_tpool_submit(). %s:%d\n", __FILE__, __LINE__);
+                break;
+            }
+        }
+
+        // 没提交上的文件也要让预读线程走完
+        AcquireSRWLockExclusive(&batch.lock);
+        batch.taken += batch.counts - i;
+        WakeAllConditionVariable(&batch.taken_cond);
+        ReleaseSRWLockExclusive(&batch.lock);
+
+        vmp_tpool_wait(pool);
+        WaitForSingleObject(reader, INFINITE);
+
+        for (; i < batch.counts; i++)
+        {
+            free(batch.items[i].data);
+            batch.items[i].data = NULL;
+        }
+
+        ret = vmp_batch_summary(&batch);
+
+        printf("batch %d files with %d threads: %ums, summary in %s\\summary.csv\n", batch.counts, threads,
+            GetTickCount() - start, param->out_dir);
+
+    exit_label:
+        if (reader)
+            CloseHandle(reader);
+        if (pool)
+            vmp_tpool_destroy(pool);
+        vmp_decoder_pool_destroy(batch.pool);
+        free(batch.items);
+
+        return ret;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,80 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_batch_h__
+#define __vmp_batch_h__
+
+#include <windows.h>
+#include <stdint.h>
+#include "vmp_decoder.h"
+
+// 批量分析: 一个目录下的所有文件，或者列表文件里一行一个的路径，在一个进程里用线程池跑。
+// 读文件的线程按顺序往前预读，最多比已经拿走的多读window个，worker拿到的时候文件已经在内存里了。
+// 每个文件一个输出目录out_dir\<序号>_<文件名>，放dot和cfg.csr，全部跑完以后写out_dir\summary.csv
+#define VMP_BATCH_WINDOW            2
+
+typedef struct vmp_batch_param
+{
+    // 目录或者列表文件
+    const char              *input;
+    const char              *out_dir;
+    // <=0时用CPU核数
+    int                     threads;
+    // 每个文件的预算，<=0时不限制
+    int                     max_insts;
+    int                     max_ms;
+    const char              *cache_dir;
+} vmp_batch_param_t;
+
+typedef struct vmp_batch_item
+{
+    char                    path[MAX_PATH];
+    char                    out_dir[MAX_PATH];
+    char                    csr_filename[MAX_PATH + 16];
+
+    // 预读线程读好以后loaded置1，读失败的话data为空
+    uint8_t                 *data;
+    int                     size;
+    int                     loaded;
+
+    const char              *status;
+    struct vmp_decoder_result result;
+    DWORD                   ms;
+
+    struct vmp_batch        *batch;
+    int                     index;
+} vmp_batch_item_t;
+
+typedef struct vmp_batch
+{
+    struct vmp_batch_param  param;
+
+    struct vmp_batch_item   *items;
+    int                     counts;
+    int                     size;
+
+    SRWLOCK                 lock;
+    CONDITION_VARIABLE      loaded;
+    CONDITION_VARIABLE      taken_cond;
+    // 已经被worker拿走的文件数，预读的不超过taken + window
+    int                     taken;
+    int                     window;
+    volatile LONG           done;
+
+    // 空闲的decoder，换文件时reset，不用重新分配镜像、堆栈和cfg
+    struct vmp_decoder_pool *pool;
+} vmp_batch_t;
+
+/* 跑完input里所有的文件才返回
+@return     0           success
+            -1          failed */
+int vmp_batch_run(struct vmp_batch_param *param);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
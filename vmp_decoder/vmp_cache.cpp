@@ -0,0 +1,636 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_cache.h"
+#include "vmp_decoder.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define VMP_CACHE_ALIGN(_n)         (((_n) + 7) & ~(uint64_t)7)
+
+    static int vmp_cache_u64_cmp(const void *a, const void *b)
+    {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return (x < y) ? -1 : (x > y);
+    }
+
+    // 整个文件按8字节一组混进去，尾巴补0
+    static uint64_t vmp_cache_hash(const uint8_t *buf, uint64_t size)
+    {
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ size, w, i;
+
+        for (i = 0; i + 8 <= size; i += 8)
+        {
+            memcpy(&w, buf + i, 8);
+            h = (h ^ mhash64_mix(w)) * 0x100000001b3ULL;
+        }
+        if (i < size)
+        {
+            w = 0;
+            memcpy(&w, buf + i, (size_t)(size - i));
+            h = (h ^ mhash64_mix(w)) * 0x100000001b3ULL;
+        }
+
+        return mhash64_mix(h);
+    }
+
+    static int vmp_cache_file_hash(const char *filename, uint64_t *hash)
+    {
+        HANDLE file_handl, map_handl;
+        LARGE_INTEGER size;
+        uint8_t *base;
+        int ret = -1;
+
+        file_handl = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_handl == INVALID_HANDLE_VALUE)
+        {
+            printf("vmp_cache_file_hash(%s) failed with CreateFile(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (GetFileSizeEx(file_handl, &size) && size.QuadPart
+            && (map_handl = CreateFileMapping(file_handl, NULL, PAGE_READONLY, 0, 0, NULL)))
+        {
+            if ((base = (uint8_t *)MapViewOfFile(map_handl, FILE_MAP_READ, 0, 0, 0)))
+            {
+                *hash = vmp_cache_hash(base, (uint64_t)size.QuadPart);
+                UnmapViewOfFile(base);
+                ret = 0;
+            }
+            CloseHandle(map_handl);
+        }
+        CloseHandle(file_handl);
+
+        if (ret)
+        {
+            printf("vmp_cache_file_hash(%s) failed with MapViewOfFile(). %s:%d\n", filename, __FILE__, __LINE__);
+        }
+
+        return ret;
+    }
+
+    static int vmp_cache_check(struct vmp_cache *cache, struct vmp_cache_head *head, uint64_t size)
+    {
+        struct vmp_cache_info *infos;
+        uint32_t i;
+
+        if ((size < sizeof (head[0])) || memcmp(head->magic, VMP_CACHE_MAGIC, 4))
+            return -1;
+
+        if ((head->version != VMP_CACHE_VERSION) || (head->head_size != sizeof (head[0])) || (head->file_size > size)
+            || (head->decoder_version != VMP_DECODER_VERSION) || (head->file_hash != cache->file_hash))
+            return -1;
+
+        if ((head->entry_offset + (uint64_t)head->entry_counts * sizeof (uint32_t) > head->inst_offset)
+            || (head->inst_offset + (uint64_t)head->inst_counts * sizeof (uint32_t) > head->len_offset)
+            || (head->len_offset + head->inst_counts > head->handler_offset)
+            || (head->handler_offset + (uint64_t)head->handler_counts * sizeof (struct vmp_cache_handler) > head->hinst_offset)
+            || (head->hinst_offset + (uint64_t)head->hinst_counts * sizeof (uint32_t) > head->hlen_offset)
+            || (head->hlen_offset + head->hinst_counts > head->info_offset)
+            || (head->info_offset + (uint64_t)head->info_counts * sizeof (struct vmp_cache_info) > head->kinst_offset)
+            || (head->kinst_offset + (uint64_t)head->kinst_counts * sizeof (uint32_t) > head->klen_offset)
+            || (head->klen_offset + head->kinst_counts > head->file_size))
+            return -1;
+
+        infos = (struct vmp_cache_info *)((uint8_t *)head + head->info_offset);
+        for (i = 0; i < head->info_counts; i++)
+        {
+            if ((uint64_t)infos[i].kinst_start + infos[i].kinst_counts > head->kinst_counts)
+                return -1;
+        }
+
+        return 0;
+    }
+
+    static void vmp_cache_unmap(struct vmp_cache *cache)
+    {
+        if (cache->head)
+            UnmapViewOfFile(cache->head);
+        if (cache->map_handl)
+            CloseHandle(cache->map_handl);
+        if (cache->file_handl)
+            CloseHandle(cache->file_handl);
+
+        cache->head = NULL;
+        cache->entries = cache->insts = cache->hinsts = cache->kinsts = NULL;
+        cache->lens = cache->hlens = cache->klens = NULL;
+        cache->handlers = NULL;
+        cache->infos = NULL;
+        cache->map_handl = cache->file_handl = NULL;
+    }
+
+    // 映射analysis.bin，文件不存在或者不对的话当成没有缓存
+    static int vmp_cache_map(struct vmp_cache *cache)
+    {
+        char filename[VMP_CACHE_PATH_SIZE + 16];
+        LARGE_INTEGER size;
+        uint8_t *base;
+
+        sprintf(filename, "%s\\analysis.bin", cache->path);
+        if (GetFileAttributes(filename) == INVALID_FILE_ATTRIBUTES)
+            return 0;
+
+        cache->file_handl = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (cache->file_handl == INVALID_HANDLE_VALUE)
+        {
+            cache->file_handl = NULL;
+            goto fail_label;
+        }
+
+        if (!GetFileSizeEx(cache->file_handl, &size) || !size.QuadPart
+            || !(cache->map_handl = CreateFileMapping(cache->file_handl, NULL, PAGE_READONLY, 0, 0, NULL))
+            || !(base = (uint8_t *)MapViewOfFile(cache->map_handl, FILE_MAP_READ, 0, 0, 0)))
+            goto fail_label;
+        cache->head = (struct vmp_cache_head *)base;
+
+        if (vmp_cache_check(cache, cache->head, (uint64_t)size.QuadPart))
+            goto fail_label;
+
+        cache->entries = (uint32_t *)(base + cache->head->entry_offset);
+        cache->insts = (uint32_t *)(base + cache->head->inst_offset);
+        cache->lens = base + cache->head->len_offset;
+        cache->handlers = (struct vmp_cache_handler *)(base + cache->head->handler_offset);
+        cache->hinsts = (uint32_t *)(base + cache->head->hinst_offset);
+        cache->hlens = base + cache->head->hlen_offset;
+        cache->infos = (struct vmp_cache_info *)(base + cache->head->info_offset);
+        cache->kinsts = (uint32_t *)(base + cache->head->kinst_offset);
+        cache->klens = base + cache->head->klen_offset;
+
+        return 0;
+
+    fail_label:
+        printf("vmp_cache_map(%s) failed with invalid file, ignore it. %s:%d\n", filename, __FILE__, __LINE__);
+        vmp_cache_unmap(cache);
+        return -1;
+    }
+
+    struct vmp_cache *vmp_cache_open(const char *cache_dir, const char *filename)
+    {
+        struct vmp_cache *cache;
+
+        cache = (struct vmp_cache *)calloc(1, sizeof (cache[0]));
+        if (!cache)
+        {
+            printf("vmp_cache_open() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (mhash64_init(&cache->new_insts, 0))
+        {
+            printf("vmp_cache_open() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        if (vmp_cache_file_hash(filename, &cache->file_hash))
+        {
+            printf("vmp_cache_open() failed with vmp_cache_file_hash(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        if (!cache_dir)
+            cache_dir = VMP_CACHE_DIR;
+        _snprintf(cache->path, sizeof (cache->path) - 1, "%s\\%016llx_v%d",
+            cache_dir, (unsigned long long)cache->file_hash, VMP_DECODER_VERSION);
+
+        // 已经存在的话会失败，不用管
+        CreateDirectory(cache_dir, NULL);
+        CreateDirectory(cache->path, NULL);
+        if (GetFileAttributes(cache->path) == INVALID_FILE_ATTRIBUTES)
+        {
+            printf("vmp_cache_open(%s) failed with CreateDirectory(). %s:%d\n", cache->path, __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        vmp_cache_map(cache);
+
+        return cache;
+
+    fail_label:
+        vmp_cache_close(cache);
+        return NULL;
+    }
+
+    void vmp_cache_close(struct vmp_cache *cache)
+    {
+        if (!cache)
+            return;
+
+        vmp_cache_unmap(cache);
+        mhash64_uninit(&cache->new_insts);
+        free(cache->new_handlers);
+        free(cache->new_hinsts);
+        free(cache->new_infos);
+        free(cache->new_kinsts);
+        free(cache);
+    }
+
+    uint32_t vmp_cache_entry(struct vmp_cache *cache)
+    {
+        if (cache->new_entry)
+            return cache->new_entry;
+
+        return (cache->head && cache->head->entry_counts) ? cache->entries[0] : 0;
+    }
+
+    int vmp_cache_add_entry(struct vmp_cache *cache, uint32_t addr)
+    {
+        cache->new_entry = addr;
+        return 0;
+    }
+
+    // @hits       不为空的话，在上次的缓存里找到时加1
+    static int vmp_cache_lookup(struct vmp_cache *cache, uint32_t addr, uint64_t *hits)
+    {
+        uint32_t lo = 0, hi, mid;
+        uint64_t *val;
+
+        if (cache->head)
+        {
+            hi = cache->head->inst_counts;
+            while (lo < hi)
+            {
+                mid = lo + (hi - lo) / 2;
+                if (cache->insts[mid] < addr)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            if ((lo < cache->head->inst_counts) && (cache->insts[lo] == addr))
+            {
+                if (hits)
+                    (*hits)++;
+                return cache->lens[lo];
+            }
+        }
+
+        return (val = mhash64_find(&cache->new_insts, addr)) ? (int)*val : 0;
+    }
+
+    int vmp_cache_inst_len(struct vmp_cache *cache, uint32_t addr)
+    {
+        return vmp_cache_lookup(cache, addr, &cache->hits);
+    }
+
+    int vmp_cache_find_inst(struct vmp_cache *cache, uint32_t addr)
+    {
+        return vmp_cache_lookup(cache, addr, NULL);
+    }
+
+    int vmp_cache_add_inst(struct vmp_cache *cache, uint32_t addr, int len)
+    {
+        uint64_t *val;
+
+        // 不在镜像里的地址(比如IAT调用时模拟的ret)不缓存
+        if (!addr || (len <= 0) || (len > 15))
+            return 0;
+
+        if (!(val = mhash64_insert(&cache->new_insts, addr, NULL)))
+        {
+            printf("vmp_cache_add_inst() failed with mhash64_insert(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        *val = len;
+
+        return 0;
+    }
+
+    int vmp_cache_set_htab(struct vmp_cache *cache, uint32_t table, int entries, struct vmp_cache_handler *handlers, int counts,
+        struct mhash64 *insts)
+    {
+        struct vmp_cache_handler *h;
+        uint64_t *hinsts;
+        uint32_t i, n = 0;
+
+        h = (struct vmp_cache_handler *)malloc((counts + 1) * sizeof (h[0]));
+        hinsts = (uint64_t *)malloc(((uint64_t)insts->counts + 1) * sizeof (hinsts[0]));
+        if (!h || !hinsts)
+        {
+            printf("vmp_cache_set_htab() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            free(h);
+            free(hinsts);
+            return -1;
+        }
+
+        memcpy(h, handlers, counts * sizeof (h[0]));
+        mhash64_foreach(insts, i)
+        {
+            hinsts[n++] = (insts->keys[i] << 8) | insts->vals[i];
+        }
+        qsort(hinsts, n, sizeof (hinsts[0]), vmp_cache_u64_cmp);
+
+        free(cache->new_handlers);
+        free(cache->new_hinsts);
+        cache->new_htab = 1;
+        cache->new_table = table;
+        cache->new_table_entries = entries;
+        cache->new_handlers = h;
+        cache->new_handler_counts = counts;
+        cache->new_hinsts = hinsts;
+        cache->new_hinst_counts = n;
+
+        return 0;
+    }
+
+    int vmp_cache_get_htab(struct vmp_cache *cache, uint32_t *table, int *entries, struct vmp_cache_handler **handlers, int *counts,
+        uint32_t **insts, uint8_t **lens, int *inst_counts)
+    {
+        if (!cache->head || !cache->head->table)
+            return -1;
+
+        *table = cache->head->table;
+        *entries = cache->head->table_entries;
+        *handlers = cache->handlers;
+        *counts = cache->head->handler_counts;
+        *insts = cache->hinsts;
+        *lens = cache->hlens;
+        *inst_counts = cache->head->hinst_counts;
+
+        return 0;
+    }
+
+    int vmp_cache_add_info(struct vmp_cache *cache, uint32_t handler, struct vmp_hlib_entry *entry, uint32_t *insts, uint8_t *lens, int counts)
+    {
+        struct vmp_cache_info *infos, *info;
+        uint64_t *kinsts;
+        uint32_t size;
+        int i;
+
+        if (cache->new_info_counts == cache->new_info_size)
+        {
+            size = cache->new_info_size * 2 + 64;
+            if (!(infos = (struct vmp_cache_info *)realloc(cache->new_infos, size * sizeof (infos[0]))))
+            {
+                printf("vmp_cache_add_info() failed with realloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            cache->new_infos = infos;
+            cache->new_info_size = size;
+        }
+
+        if (cache->new_kinst_counts + counts > cache->new_kinst_size)
+        {
+            size = (cache->new_kinst_counts + counts) * 2 + 256;
+            if (!(kinsts = (uint64_t *)realloc(cache->new_kinsts, size * sizeof (kinsts[0]))))
+            {
+                printf("vmp_cache_add_info() failed with realloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            cache->new_kinsts = kinsts;
+            cache->new_kinst_size = size;
+        }
+
+        info = cache->new_infos + cache->new_info_counts++;
+        memset(info, 0, sizeof (info[0]));
+        info->handler = handler;
+        info->entry = *entry;
+        info->kinst_start = cache->new_kinst_counts;
+        info->kinst_counts = counts;
+
+        for (i = 0; i < counts; i++)
+        {
+            cache->new_kinsts[cache->new_kinst_counts++] = ((uint64_t)insts[i] << 8) | lens[i];
+        }
+
+        return 0;
+    }
+
+    int vmp_cache_get_infos(struct vmp_cache *cache, struct vmp_cache_info **infos, int *counts, uint32_t **kinsts, uint8_t **klens)
+    {
+        if (!cache->head || !cache->head->info_counts)
+            return -1;
+
+        *infos = cache->infos;
+        *counts = cache->head->info_counts;
+        *kinsts = cache->kinsts;
+        *klens = cache->klens;
+
+        return 0;
+    }
+
+    // 保存成功以后，这次的结果已经在映射的文件里了
+    static void vmp_cache_clear_new(struct vmp_cache *cache)
+    {
+        mhash64_clear(&cache->new_insts);
+        cache->new_entry = 0;
+
+        free(cache->new_handlers);
+        free(cache->new_hinsts);
+        free(cache->new_infos);
+        free(cache->new_kinsts);
+        cache->new_htab = 0;
+        cache->new_handlers = NULL;
+        cache->new_hinsts = NULL;
+        cache->new_infos = NULL;
+        cache->new_kinsts = NULL;
+        cache->new_handler_counts = cache->new_hinst_counts = 0;
+        cache->new_info_counts = cache->new_info_size = 0;
+        cache->new_kinst_counts = cache->new_kinst_size = 0;
+    }
+
+    // 这次新加的指令排好序，和上次的合并到一起
+    static uint64_t *vmp_cache_merge_insts(struct vmp_cache *cache, uint32_t *counts)
+    {
+        uint32_t i, j, k, old_counts = cache->head ? cache->head->inst_counts : 0;
+        uint64_t *add, *out;
+
+        add = (uint64_t *)malloc(((uint64_t)cache->new_insts.counts + 1) * sizeof (uint64_t));
+        out = (uint64_t *)malloc(((uint64_t)cache->new_insts.counts + old_counts + 1) * sizeof (uint64_t));
+        if (!add || !out)
+        {
+            free(add);
+            free(out);
+            return NULL;
+        }
+
+        k = 0;
+        mhash64_foreach(&cache->new_insts, i)
+        {
+            add[k++] = (cache->new_insts.keys[i] << 8) | cache->new_insts.vals[i];
+        }
+        qsort(add, k, sizeof (add[0]), vmp_cache_u64_cmp);
+
+        for (i = j = *counts = 0; (i < old_counts) || (j < k); )
+        {
+            if ((j >= k) || ((i < old_counts) && (cache->insts[i] <= (add[j] >> 8))))
+            {
+                if ((j < k) && (cache->insts[i] == (add[j] >> 8)))
+                    j++;
+                out[(*counts)++] = ((uint64_t)cache->insts[i] << 8) | cache->lens[i];
+                i++;
+            }
+            else
+            {
+                out[(*counts)++] = add[j++];
+            }
+        }
+        free(add);
+
+        return out;
+    }
+
+    int vmp_cache_save(struct vmp_cache *cache)
+    {
+        char filename[VMP_CACHE_PATH_SIZE + 16], tmp_filename[VMP_CACHE_PATH_SIZE + 16];
+        struct vmp_cache_head head = { 0 }, *h, *old = cache->head;
+        uint64_t *insts = NULL;
+        uint32_t i, inst_counts = 0, *entries, *out_insts;
+        uint8_t *buf = NULL, *lens;
+        // 这次没有设置过的话沿用上次的
+        int new_htab = cache->new_htab, new_infos = (cache->new_info_counts != 0);
+        FILE *fp;
+        int ret = -1;
+
+        sprintf(filename, "%s\\analysis.bin", cache->path);
+        sprintf(tmp_filename, "%s\\analysis.bin.tmp", cache->path);
+
+        insts = vmp_cache_merge_insts(cache, &inst_counts);
+        if (!insts)
+        {
+            printf("vmp_cache_save() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        memcpy(head.magic, VMP_CACHE_MAGIC, 4);
+        head.version = VMP_CACHE_VERSION;
+        head.head_size = sizeof (head);
+        head.decoder_version = VMP_DECODER_VERSION;
+        head.file_hash = cache->file_hash;
+        head.entry_counts = vmp_cache_entry(cache) ? 1 : 0;
+        head.inst_counts = inst_counts;
+        head.entry_offset = VMP_CACHE_ALIGN(sizeof (head));
+        head.inst_offset = VMP_CACHE_ALIGN(head.entry_offset + head.entry_counts * sizeof (uint32_t));
+        head.len_offset = VMP_CACHE_ALIGN(head.inst_offset + (uint64_t)inst_counts * sizeof (uint32_t));
+
+        if (new_htab)
+        {
+            head.table = cache->new_table;
+            head.table_entries = cache->new_table_entries;
+            head.handler_counts = cache->new_handler_counts;
+            head.hinst_counts = cache->new_hinst_counts;
+        }
+        else if (old)
+        {
+            head.table = old->table;
+            head.table_entries = old->table_entries;
+            head.handler_counts = old->handler_counts;
+            head.hinst_counts = old->hinst_counts;
+        }
+        if (new_infos)
+        {
+            head.info_counts = cache->new_info_counts;
+            head.kinst_counts = cache->new_kinst_counts;
+        }
+        else if (old)
+        {
+            head.info_counts = old->info_counts;
+            head.kinst_counts = old->kinst_counts;
+        }
+        head.handler_offset = VMP_CACHE_ALIGN(head.len_offset + inst_counts);
+        head.hinst_offset = VMP_CACHE_ALIGN(head.handler_offset + (uint64_t)head.handler_counts * sizeof (struct vmp_cache_handler));
+        head.hlen_offset = VMP_CACHE_ALIGN(head.hinst_offset + (uint64_t)head.hinst_counts * sizeof (uint32_t));
+        head.info_offset = VMP_CACHE_ALIGN(head.hlen_offset + head.hinst_counts);
+        head.kinst_offset = VMP_CACHE_ALIGN(head.info_offset + (uint64_t)head.info_counts * sizeof (struct vmp_cache_info));
+        head.klen_offset = VMP_CACHE_ALIGN(head.kinst_offset + (uint64_t)head.kinst_counts * sizeof (uint32_t));
+        head.file_size = head.klen_offset + head.kinst_counts;
+
+        buf = (uint8_t *)calloc(1, (size_t)head.file_size);
+        if (!buf)
+        {
+            printf("vmp_cache_save() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+        h = (struct vmp_cache_head *)buf;
+        *h = head;
+        entries = (uint32_t *)(buf + head.entry_offset);
+        lens = buf + head.len_offset;
+
+        if (head.entry_counts)
+            entries[0] = vmp_cache_entry(cache);
+        for (i = 0; i < inst_counts; i++)
+        {
+            ((uint32_t *)(buf + head.inst_offset))[i] = (uint32_t)(insts[i] >> 8);
+            lens[i] = (uint8_t)insts[i];
+        }
+
+        out_insts = (uint32_t *)(buf + head.hinst_offset);
+        lens = buf + head.hlen_offset;
+        if (new_htab)
+        {
+            memcpy(buf + head.handler_offset, cache->new_handlers, head.handler_counts * sizeof (struct vmp_cache_handler));
+            for (i = 0; i < head.hinst_counts; i++)
+            {
+                out_insts[i] = (uint32_t)(cache->new_hinsts[i] >> 8);
+                lens[i] = (uint8_t)cache->new_hinsts[i];
+            }
+        }
+        else if (old)
+        {
+            memcpy(buf + head.handler_offset, cache->handlers, head.handler_counts * sizeof (struct vmp_cache_handler));
+            memcpy(out_insts, cache->hinsts, head.hinst_counts * sizeof (uint32_t));
+            memcpy(lens, cache->hlens, head.hinst_counts);
+        }
+
+        out_insts = (uint32_t *)(buf + head.kinst_offset);
+        lens = buf + head.klen_offset;
+        if (new_infos)
+        {
+            memcpy(buf + head.info_offset, cache->new_infos, head.info_counts * sizeof (struct vmp_cache_info));
+            for (i = 0; i < head.kinst_counts; i++)
+            {
+                out_insts[i] = (uint32_t)(cache->new_kinsts[i] >> 8);
+                lens[i] = (uint8_t)cache->new_kinsts[i];
+            }
+        }
+        else if (old)
+        {
+            memcpy(buf + head.info_offset, cache->infos, head.info_counts * sizeof (struct vmp_cache_info));
+            memcpy(out_insts, cache->kinsts, head.kinst_counts * sizeof (uint32_t));
+            memcpy(lens, cache->klens, head.kinst_counts);
+        }
+
+        // 先写临时文件再替换，写到一半崩溃的话上次的缓存还在
+        fp = fopen(tmp_filename, "wb");
+        if (!fp)
+        {
+            printf("vmp_cache_save(%s) failed with fopen(). %s:%d\n", tmp_filename, __FILE__, __LINE__);
+            goto exit_label;
+        }
+        if (fwrite(buf, 1, (size_t)head.file_size, fp) != (size_t)head.file_size)
+        {
+            printf("vmp_cache_save(%s) failed with fwrite(). %s:%d\n", tmp_filename, __FILE__, __LINE__);
+            fclose(fp);
+            goto exit_label;
+        }
+        fclose(fp);
+
+        // 映射着的文件不能被替换，先解除映射，替换完再映射新的
+        vmp_cache_unmap(cache);
+        if (!MoveFileEx(tmp_filename, filename, MOVEFILE_REPLACE_EXISTING))
+        {
+            printf("vmp_cache_save(%s) failed with MoveFileEx(). %s:%d\n", filename, __FILE__, __LINE__);
+            vmp_cache_map(cache);
+            goto exit_label;
+        }
+        vmp_cache_clear_new(cache);
+        vmp_cache_map(cache);
+        ret = 0;
+
+    exit_label:
+        free(insts);
+        free(buf);
+
+        return ret;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,167 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_cache_h__
+#define __vmp_cache_h__
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "mhash.h"
+#include "vmp_hlib.h"
+
+// 同一个加壳文件反复跑时的分析缓存，目录是 cache_dir\<文件内容hash>_v<VMP_DECODER_VERSION>\，里面有:
+//      analysis.bin:   struct vmp_cache_head + 下面这些数组，8字节对齐，mmap以后直接用
+//          entries:    entry_counts * u32，vmp_decoder_find_vmp_start_addr找到的VM入口
+//          insts:      inst_counts * u32，解码过的指令地址，从小到大排好序
+//          lens:       inst_counts * u8，对应的指令长度
+//          handlers:   handler_counts * struct vmp_cache_handler，找到的handler表里的handler
+//          hinsts:     hinst_counts * u32，handler表的handler静态解码出来的指令，从小到大排好序
+//          hlens:      hinst_counts * u8
+//          infos:      info_counts * struct vmp_cache_info，模拟时分析过的handler: 分析结果和摘要的范围
+//          kinsts:     kinst_counts * u32，各个handler的摘要指令，按infos的顺序一段段放
+//          klens:      kinst_counts * u8
+// 再次运行时handler表直接从缓存恢复，不用再找表和解码；分析过的handler直接填进vmp_vm，不再记录和分析，
+// 摘要还是先和完整模拟对一遍再用。block边界和cfg和起始地址、模拟器的状态有关，每次重新跑。
+// 地址全部是IDA地址。文件内容或者VMP_DECODER_VERSION变了，目录名就变了，旧的缓存自然不再使用
+#define VMP_CACHE_MAGIC             "VMPA"
+// 3: 加了handler表和handler的分析结果
+#define VMP_CACHE_VERSION           3
+#define VMP_CACHE_DIR               "vmp.cache"
+#define VMP_CACHE_PATH_SIZE         260
+
+typedef struct vmp_cache_head
+{
+    char        magic[4];
+    uint16_t    version;
+    uint16_t    head_size;
+    uint32_t    decoder_version;
+    uint32_t    entry_counts;
+    uint64_t    file_hash;
+    uint64_t    file_size;
+
+    uint32_t    inst_counts;
+    uint32_t    reserved;
+    uint64_t    entry_offset;
+    uint64_t    inst_offset;
+    uint64_t    len_offset;
+
+    // handler表的IDA地址，0是没有
+    uint32_t    table;
+    uint32_t    table_entries;
+    uint32_t    handler_counts;
+    uint32_t    hinst_counts;
+    uint32_t    info_counts;
+    uint32_t    kinst_counts;
+    uint64_t    handler_offset;
+    uint64_t    hinst_offset;
+    uint64_t    hlen_offset;
+    uint64_t    info_offset;
+    uint64_t    kinst_offset;
+    uint64_t    klen_offset;
+} vmp_cache_head_t;
+
+// 和struct vmp_htab_handler里的统计一样，指令都在hinsts里
+typedef struct vmp_cache_handler
+{
+    uint32_t    addr;
+    int32_t     index;
+    int32_t     insts;
+    int32_t     branches;
+    int32_t     kept;
+    uint8_t     liftable;
+    uint8_t     partial;
+    uint16_t    reserved;
+} vmp_cache_handler_t;
+
+typedef struct vmp_cache_info
+{
+    uint32_t    handler;
+    // 摘要的指令是kinsts里的[kinst_start, kinst_start + kinst_counts)，没有摘要的话是0
+    uint32_t    kinst_start;
+    uint32_t    kinst_counts;
+    uint32_t    reserved;
+    struct vmp_hlib_entry entry;
+} vmp_cache_info_t;
+
+typedef struct vmp_cache
+{
+    char        path[VMP_CACHE_PATH_SIZE];
+    uint64_t    file_hash;
+
+    // 上次保存的内容，没有的话head为空
+    struct vmp_cache_head *head;
+    uint32_t    *entries;
+    uint32_t    *insts;
+    uint8_t     *lens;
+    struct vmp_cache_handler *handlers;
+    uint32_t    *hinsts;
+    uint8_t     *hlens;
+    struct vmp_cache_info *infos;
+    uint32_t    *kinsts;
+    uint8_t     *klens;
+    HANDLE      file_handl;
+    HANDLE      map_handl;
+
+    // 这次运行新加的，key是地址，val是长度
+    struct mhash64 new_insts;
+    uint32_t    new_entry;
+    // 这次运行的handler表和handler分析结果，设置过的话保存时整个替换上次的，没设置的话沿用上次的
+    int         new_htab;
+    uint32_t    new_table;
+    uint32_t    new_table_entries;
+    struct vmp_cache_handler *new_handlers;
+    uint32_t    new_handler_counts;
+    // (地址 << 8) | 长度
+    uint64_t    *new_hinsts;
+    uint32_t    new_hinst_counts;
+    struct vmp_cache_info *new_infos;
+    uint32_t    new_info_counts;
+    uint32_t    new_info_size;
+    uint64_t    *new_kinsts;
+    uint32_t    new_kinst_counts;
+    uint32_t    new_kinst_size;
+    // 上次的缓存可以直接用的次数，运行结束时打印
+    uint64_t    hits;
+} vmp_cache_t;
+
+/* 算filename内容的hash，打开(没有就创建)对应的缓存目录，有analysis.bin的话映射进来 */
+struct vmp_cache *vmp_cache_open(const char *cache_dir, const char *filename);
+void vmp_cache_close(struct vmp_cache *cache);
+
+/* @return  0   没有缓存的VM入口 */
+uint32_t vmp_cache_entry(struct vmp_cache *cache);
+int vmp_cache_add_entry(struct vmp_cache *cache, uint32_t addr);
+/* @return  0   这条指令没有解码过 */
+int vmp_cache_inst_len(struct vmp_cache *cache, uint32_t addr);
+/* 和vmp_cache_inst_len一样，但不改hits，没有线程在add的时候可以在多个线程里同时查 */
+int vmp_cache_find_inst(struct vmp_cache *cache, uint32_t addr);
+int vmp_cache_add_inst(struct vmp_cache *cache, uint32_t addr, int len);
+
+/* 这次找到的handler表，保存时写进缓存
+@handlers   addr/index和统计
+@insts      key是静态解码过的指令地址，val是长度 */
+int vmp_cache_set_htab(struct vmp_cache *cache, uint32_t table, int entries, struct vmp_cache_handler *handlers, int counts,
+    struct mhash64 *insts);
+/* 上次缓存的handler表，返回的指针指向映射的文件，下次vmp_cache_save以前有效
+@return     0           有
+            -1          没有 */
+int vmp_cache_get_htab(struct vmp_cache *cache, uint32_t *table, int *entries, struct vmp_cache_handler **handlers, int *counts,
+    uint32_t **insts, uint8_t **lens, int *inst_counts);
+/* 加一个分析过的handler，insts/lens是摘要的指令，没有摘要的话counts为0 */
+int vmp_cache_add_info(struct vmp_cache *cache, uint32_t handler, struct vmp_hlib_entry *entry, uint32_t *insts, uint8_t *lens, int counts);
+/* 上次缓存的handler分析结果，摘要的指令是kinsts/klens里的一段
+@return     0           有
+            -1          没有 */
+int vmp_cache_get_infos(struct vmp_cache *cache, struct vmp_cache_info **infos, int *counts, uint32_t **kinsts, uint8_t **klens);
+/* 把上次的和这次新加的合并以后写回analysis.bin */
+int vmp_cache_save(struct vmp_cache *cache);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
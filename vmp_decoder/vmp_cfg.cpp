@@ -0,0 +1,651 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_cfg.h"
+#include "x86_emu.h"
+#include "macro_list.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+    // 从arena里分配，返回的内存是清零的，只能随cfg一起释放
+    static void *vmp_cfg_alloc(struct vmp_cfg *cfg, size_t size)
+    {
+        struct vmp_cfg_arena_block *block = cfg->arena;
+        size_t block_size;
+        uint8_t *p;
+
+        size = (size + 7) & ~(size_t)7;
+        if (!block || (block->used + size > block->size))
+        {
+            // vmp_cfg_reset留下来的块已经清过零了
+            if (cfg->spare && (size <= VMP_CFG_ARENA_BLOCK_SIZE))
+            {
+                block = cfg->spare;
+                cfg->spare = block->next;
+            }
+            else
+            {
+                block_size = (size > VMP_CFG_ARENA_BLOCK_SIZE) ? size : VMP_CFG_ARENA_BLOCK_SIZE;
+                block = (struct vmp_cfg_arena_block *)calloc(1, sizeof (block[0]) + block_size);
+                if (!block)
+                {
+                    print_err("[%s] err: vmp_cfg_alloc() failed with calloc(). %s:%d\r\n", time2s(0), __FILE__, __LINE__);
+                    return NULL;
+                }
+                block->size = block_size;
+            }
+            block->next = cfg->arena;
+            cfg->arena = block;
+        }
+
+        p = (uint8_t *)(block + 1) + block->used;
+        block->used += size;
+
+        return p;
+    }
+
+    struct vmp_cfg *vmp_cfg_create(void)
+    {
+        struct vmp_cfg *cfg = (struct vmp_cfg *)calloc(1, sizeof (cfg[0]));
+
+        if (!cfg)
+        {
+            printf("vmp_cfg_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (mhash64_init(&cfg->map, 1024) || mhash64_init(&cfg->edges, 1024))
+        {
+            printf("vmp_cfg_create() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            vmp_cfg_destroy(cfg);
+            return NULL;
+        }
+
+        return cfg;
+    }
+
+    void vmp_cfg_destroy(struct vmp_cfg *cfg)
+    {
+        struct vmp_cfg_arena_block *block, *next;
+
+        if (!cfg)
+            return;
+
+        for (block = cfg->arena; block; block = next)
+        {
+            next = block->next;
+            free(block);
+        }
+        for (block = cfg->spare; block; block = next)
+        {
+            next = block->next;
+            free(block);
+        }
+        mhash64_uninit(&cfg->map);
+        mhash64_uninit(&cfg->edges);
+        free(cfg->index.sorted);
+        free(cfg->index.pending);
+        free(cfg);
+    }
+
+    void vmp_cfg_reset(struct vmp_cfg *cfg)
+    {
+        struct vmp_cfg_arena_block *block, *next;
+
+        // 一般大小的块清零以后留着下次分配，单独分配的大块直接释放
+        for (block = cfg->arena; block; block = next)
+        {
+            next = block->next;
+            if (block->size != VMP_CFG_ARENA_BLOCK_SIZE)
+            {
+                free(block);
+                continue;
+            }
+            memset(block + 1, 0, block->used);
+            block->used = 0;
+            block->next = cfg->spare;
+            cfg->spare = block;
+        }
+        cfg->arena = NULL;
+
+        mhash64_clear(&cfg->map);
+        mhash64_clear(&cfg->edges);
+        cfg->edge_counts = 0;
+        cfg->index.sorted_counts = 0;
+        cfg->index.pending_counts = 0;
+        cfg->list = NULL;
+        cfg->counts = 0;
+        cfg->label_counts = 0;
+        cfg->notify = NULL;
+        cfg->notify_arg = NULL;
+    }
+
+    // 最后一个 id <= addr 的下标，没有的话返回-1
+    static int vmp_cfg_index_search(struct vmp_cfg_index_entry *arr, int counts, uint8_t *addr)
+    {
+        int lo = 0, hi = counts - 1, mid;
+
+        while (lo <= hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (arr[mid].id <= addr)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
+        }
+
+        return hi;
+    }
+
+    static int vmp_cfg_index_merge(struct vmp_cfg_index *index)
+    {
+        struct vmp_cfg_index_entry *arr;
+        int i, j, k, size = index->sorted_counts + index->pending_counts;
+
+        if (size > index->sorted_size)
+        {
+            size = size * 2;
+            arr = (struct vmp_cfg_index_entry *)realloc(index->sorted, size * sizeof (arr[0]));
+            if (!arr)
+            {
+                print_err("[%s] err: vmp_cfg_index_merge() failed with realloc(). %s:%d\r\n", time2s(0), __FILE__, __LINE__);
+                return -1;
+            }
+            index->sorted = arr;
+            index->sorted_size = size;
+        }
+
+        // 从后往前归并，不需要额外的空间
+        i = index->sorted_counts - 1;
+        j = index->pending_counts - 1;
+        for (k = i + j + 1; j >= 0; k--)
+        {
+            if ((i >= 0) && (index->sorted[i].id > index->pending[j].id))
+                index->sorted[k] = index->sorted[i--];
+            else
+                index->sorted[k] = index->pending[j--];
+        }
+
+        index->sorted_counts += index->pending_counts;
+        index->pending_counts = 0;
+
+        return 0;
+    }
+
+    static int vmp_cfg_index_add(struct vmp_cfg_index *index, struct vmp_cfg_node *node)
+    {
+        struct vmp_cfg_index_entry *arr;
+        int i, limit, size;
+
+        // 小数组的上限取大数组大小的平方根，插入和合并的均摊开销都是O(sqrt(n))
+        limit = VMP_CFG_INDEX_PENDING_MIN;
+        while ((limit * limit) < index->sorted_counts)
+            limit *= 2;
+
+        if (index->pending_counts >= limit)
+        {
+            if (vmp_cfg_index_merge(index))
+                return -1;
+        }
+
+        if (index->pending_counts == index->pending_size)
+        {
+            size = index->pending_size ? index->pending_size * 2 : VMP_CFG_INDEX_PENDING_MIN;
+            arr = (struct vmp_cfg_index_entry *)realloc(index->pending, size * sizeof (arr[0]));
+            if (!arr)
+            {
+                print_err("[%s] err: vmp_cfg_index_add() failed with realloc(). %s:%d\r\n", time2s(0), __FILE__, __LINE__);
+                return -1;
+            }
+            index->pending = arr;
+            index->pending_size = size;
+        }
+
+        i = vmp_cfg_index_search(index->pending, index->pending_counts, node->id) + 1;
+        memmove(index->pending + i + 1, index->pending + i, (index->pending_counts - i) * sizeof (index->pending[0]));
+        index->pending[i].id = node->id;
+        index->pending[i].node = node;
+        index->pending_counts++;
+
+        return 0;
+    }
+
+    struct vmp_cfg_node *vmp_cfg_find_contain(struct vmp_cfg *cfg, uint8_t *addr)
+    {
+        struct vmp_cfg_index *index = &cfg->index;
+        struct vmp_cfg_index_entry *entry = NULL;
+        int i;
+
+        // block之间不重叠，起始地址不大于addr的最后一个block是唯一可能包含它的
+        if ((i = vmp_cfg_index_search(index->sorted, index->sorted_counts, addr)) >= 0)
+            entry = index->sorted + i;
+        if (((i = vmp_cfg_index_search(index->pending, index->pending_counts, addr)) >= 0)
+            && (!entry || (index->pending[i].id > entry->id)))
+            entry = index->pending + i;
+
+        if (entry && (addr < entry->id + entry->node->len))
+            return entry->node;
+
+        return NULL;
+    }
+
+    struct vmp_cfg_node *vmp_cfg_node_create(struct vmp_cfg *cfg, uint8_t *addr, int iat_call)
+    {
+        struct vmp_cfg_node *node;
+        uint64_t *val;
+
+        node = (struct vmp_cfg_node *)vmp_cfg_alloc(cfg, sizeof (node[0]));
+        if (!node)
+        {
+            printf("vmp_cfg_node_create() failed with vmp_cfg_alloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        val = mhash64_insert(&cfg->map, (uint64_t)addr, NULL);
+        if (!val)
+        {
+            printf("vmp_cfg_node_create() failed with mhash64_insert(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+        *val = (uint64_t)node;
+
+        // 名字到输出的时候再格式化，IAT节点的名字在IAT项指向的字符串里
+        if (iat_call)
+        {
+            node->debug.external_call = 1;
+        }
+        else
+        {
+            node->label = ++cfg->label_counts;
+        }
+
+        node->id = addr;
+        node->index = cfg->counts;
+
+        // IAT节点的id是IAT里的一项，不是代码，不放进地址索引
+        if (!iat_call && vmp_cfg_index_add(&cfg->index, node))
+        {
+            printf("vmp_cfg_node_create() failed with vmp_cfg_index_add(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        mlist_add((*cfg), node, in_list);
+        vmp_cfg_notify(cfg, VMP_CFG_NOTIFY_NODE, node, NULL, 0);
+
+        return node;
+    }
+
+    struct vmp_cfg_node *vmp_cfg_find(struct vmp_cfg *cfg, uint8_t *id)
+    {
+        uint64_t *val = mhash64_find(&cfg->map, (uint64_t)id);
+
+        return val ? (struct vmp_cfg_node *)*val : NULL;
+    }
+
+    int vmp_cfg_node_update_vmp(struct vmp_cfg_node *node, int vmp)
+    {
+        if (!node->debug.vmp)
+        {
+            node->debug.vmp = vmp;
+        }
+        return 0;
+    }
+
+    const char *vmp_cfg_node_name(struct vmp_cfg_node *node, char *buf)
+    {
+        if (node->debug.external_call)
+        {
+            _snprintf(buf, VMP_CFG_NAME_SIZE - 1, "%s", ((char **)node->id)[0]);
+            buf[VMP_CFG_NAME_SIZE - 1] = 0;
+        }
+        else if (node->debug.vmp)
+        {
+            sprintf(buf, "vmp%d", node->debug.vmp);
+        }
+        else
+        {
+            sprintf(buf, "label%d", node->label);
+        }
+
+        return buf;
+    }
+
+    int vmp_cfg_add_inst(struct vmp_cfg *cfg, struct vmp_cfg_node *node, uint8_t *addr, int len)
+    {
+        if ((node->id + node->len) == addr)
+        {
+            node->len += len;
+            vmp_cfg_notify(cfg, VMP_CFG_NOTIFY_EXTEND, node, NULL, 0);
+            return 0;
+        }
+
+        return -1;
+    }
+
+    static struct vmp_cfg_node_link *vmp_cfg_add_edge(struct vmp_cfg *cfg, struct vmp_cfg_node *from, struct vmp_cfg_node *to, int kind)
+    {
+        struct vmp_cfg_node_link *link;
+        uint64_t *val;
+
+        val = mhash64_insert(&cfg->edges, vmp_cfg_edge_key(from, to, kind), NULL);
+        if (!val)
+        {
+            printf("vmp_cfg_add_edge() failed with mhash64_insert(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (*val)
+        {
+            link = (struct vmp_cfg_node_link *)*val;
+            link->counts++;
+            return link;
+        }
+
+        link = (struct vmp_cfg_node_link *)vmp_cfg_alloc(cfg, sizeof (link[0]));
+        if (!link)
+        {
+            printf("vmp_cfg_add_edge() failed with vmp_cfg_alloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+        *val = (uint64_t)link;
+        cfg->edge_counts++;
+
+        link->node = to;
+        link->counts = 1;
+        if (kind == VMP_CFG_EDGE_JMP)
+        {
+            link->next = from->jmps.list;
+            from->jmps.list = link;
+            from->jmps.count++;
+        }
+        else if (kind == VMP_CFG_EDGE_FALL)
+        {
+            link->next = from->falls.list;
+            from->falls.list = link;
+            from->falls.count++;
+        }
+        else
+        {
+            link->next = from->trues.list;
+            from->trues.list = link;
+            from->trues.count++;
+        }
+        vmp_cfg_notify(cfg, VMP_CFG_NOTIFY_EDGE, from, to, kind);
+        return link;
+    }
+
+    int vmp_cfg_add_edges(struct vmp_cfg *cfg, struct vmp_cfg_node *from, struct vmp_cfg_node *to, int jmp_type)
+    {
+        return vmp_cfg_add_edge(cfg, from, to, (jmp_type == X86_JMP) ? VMP_CFG_EDGE_JMP : VMP_CFG_EDGE_TRUE) ? 0 : -1;
+    }
+
+    int vmp_cfg_add_fall_edge(struct vmp_cfg *cfg, struct vmp_cfg_node *from, struct vmp_cfg_node *to)
+    {
+        return vmp_cfg_add_edge(cfg, from, to, VMP_CFG_EDGE_FALL) ? 0 : -1;
+    }
+
+    // 把from的一个出边链表挪给to，hash里的key跟着改
+    static uint64_t vmp_cfg_move_links(struct vmp_cfg *cfg, struct vmp_cfg_node *from, struct vmp_cfg_node *to,
+        struct vmp_cfg_node_link *list, int count, int kind)
+    {
+        struct vmp_cfg_node_link *link;
+        uint64_t *val, sum = 0;
+        int i;
+
+        for (i = 0, link = list; i < count; i++, link = link->next)
+        {
+            mhash64_remove(&cfg->edges, vmp_cfg_edge_key(from, link->node, kind));
+        }
+
+        for (i = 0, link = list; i < count; i++, link = link->next)
+        {
+            val = mhash64_insert(&cfg->edges, vmp_cfg_edge_key(to, link->node, kind), NULL);
+            if (!val)
+            {
+                printf("vmp_cfg_move_links() failed with mhash64_insert(). %s:%d\n", __FILE__, __LINE__);
+                return sum;
+            }
+            *val = (uint64_t)link;
+            sum += link->counts;
+        }
+
+        return sum;
+    }
+
+    int vmp_cfg_seperate(struct vmp_cfg *cfg, struct vmp_cfg_node *cur_node,
+        uint8_t *addr, struct vmp_cfg_node **head, struct vmp_cfg_node **tail)
+    {
+        struct vmp_cfg_node *node;
+        struct vmp_cfg_node_link *fall;
+        uint64_t sum;
+
+        if ((addr <= cur_node->id) || (addr >= cur_node->id + cur_node->len))
+        {
+            printf("vmp_cfg_seperate() failed with invalid addr. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        node = vmp_cfg_node_create(cfg, addr, 0);
+        if (!node)
+        {
+            printf("vmp_cfg_seperate() failed with vmp_cfg_node_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        node->len = (int)(cur_node->id + cur_node->len - addr);
+        cur_node->len = (int)(addr - cur_node->id);
+
+        sum = vmp_cfg_move_links(cfg, cur_node, node, cur_node->jmps.list, cur_node->jmps.count, VMP_CFG_EDGE_JMP);
+        sum += vmp_cfg_move_links(cfg, cur_node, node, cur_node->trues.list, cur_node->trues.count, VMP_CFG_EDGE_TRUE);
+        sum += vmp_cfg_move_links(cfg, cur_node, node, cur_node->falls.list, cur_node->falls.count, VMP_CFG_EDGE_FALL);
+        node->jmps = cur_node->jmps;
+        node->trues = cur_node->trues;
+        node->falls = cur_node->falls;
+        memset(&cur_node->jmps, 0, sizeof (cur_node->jmps));
+        memset(&cur_node->trues, 0, sizeof (cur_node->trues));
+        memset(&cur_node->falls, 0, sizeof (cur_node->falls));
+        vmp_cfg_notify(cfg, VMP_CFG_NOTIFY_SPLIT, cur_node, node, 0);
+
+        // 以前从cur_node出去的每一次，都是顺序执行经过了addr
+        fall = vmp_cfg_add_edge(cfg, cur_node, node, VMP_CFG_EDGE_FALL);
+        if (!fall)
+        {
+            printf("vmp_cfg_seperate() failed with vmp_cfg_add_edge(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        fall->counts = sum;
+
+        if (head)
+            *head = cur_node;
+        if (tail)
+            *tail = node;
+
+        return 0;
+    }
+
+    static int vmp_cfg_addr_cmp(const void *a, const void *b)
+    {
+        uint8_t *x = *(uint8_t **)a, *y = *(uint8_t **)b;
+
+        return (x < y) ? -1 : (x > y);
+    }
+
+    // 第一个大于addr的下标
+    static int vmp_cfg_addr_upper(uint8_t **arr, int counts, uint8_t *addr)
+    {
+        int lo = 0, hi = counts, mid;
+
+        while (lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (arr[mid] <= addr)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        return lo;
+    }
+
+    // IAT节点不在地址索引里，按id找，没有的话新建
+    static struct vmp_cfg_node *vmp_cfg_merge_node(struct vmp_cfg *dst, struct vmp_cfg_node *src)
+    {
+        struct vmp_cfg_node *node = vmp_cfg_find(dst, src->id);
+
+        return node ? node : vmp_cfg_node_create(dst, src->id, src->debug.external_call);
+    }
+
+    static int vmp_cfg_merge_edge(struct vmp_cfg *dst, struct vmp_cfg_node *from, struct vmp_cfg_node *to, int kind, uint64_t counts)
+    {
+        struct vmp_cfg_node_link *link;
+
+        if (!to || !(link = vmp_cfg_add_edge(dst, from, to, kind)))
+            return -1;
+        link->counts += counts - 1;
+
+        return 0;
+    }
+
+    static int vmp_cfg_merge_links(struct vmp_cfg *dst, struct vmp_cfg_node *from,
+        struct vmp_cfg_node_link *list, int count, int kind)
+    {
+        struct vmp_cfg_node_link *link;
+        int i;
+
+        for (i = 0, link = list; i < count; i++, link = link->next)
+        {
+            if (vmp_cfg_merge_edge(dst, from, vmp_cfg_merge_node(dst, link->node), kind, link->counts))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    static int vmp_cfg_merge_one(struct vmp_cfg *dst, struct vmp_cfg *src, uint8_t **starts, int start_counts)
+    {
+        struct vmp_cfg_node *node, *cur, *next;
+        struct vmp_cfg_node_link *link;
+        uint8_t *addr, *end;
+        uint64_t execs;
+        int i, j;
+
+        for (i = 0, node = src->list; i < src->counts; i++, node = node->in_list.next)
+        {
+            if (!(cur = vmp_cfg_merge_node(dst, node)))
+                return -1;
+            vmp_cfg_node_update_vmp(cur, node->debug.vmp);
+
+            // 经过这个block的次数，切开的地方顺序执行边的次数都是这个
+            for (execs = 0, link = node->jmps.list, j = 0; j < node->jmps.count; j++, link = link->next)
+                execs += link->counts;
+            for (link = node->trues.list, j = 0; j < node->trues.count; j++, link = link->next)
+                execs += link->counts;
+            for (link = node->falls.list, j = 0; j < node->falls.count; j++, link = link->next)
+                execs += link->counts;
+            if (!execs)
+                execs = 1;
+
+            addr = node->id;
+            end = node->id + node->len;
+            for (j = node->debug.external_call ? start_counts : vmp_cfg_addr_upper(starts, start_counts, addr);
+                (j < start_counts) && (starts[j] < end); j++)
+            {
+                if ((int)(starts[j] - addr) > cur->len)
+                {
+                    cur->len = (int)(starts[j] - addr);
+                    vmp_cfg_notify(dst, VMP_CFG_NOTIFY_EXTEND, cur, NULL, 0);
+                }
+
+                if (!(next = vmp_cfg_find(dst, starts[j])) || vmp_cfg_merge_edge(dst, cur, next, VMP_CFG_EDGE_FALL, execs))
+                    return -1;
+                cur = next;
+                addr = starts[j];
+            }
+
+            if ((int)(end - addr) > cur->len)
+            {
+                cur->len = (int)(end - addr);
+                vmp_cfg_notify(dst, VMP_CFG_NOTIFY_EXTEND, cur, NULL, 0);
+            }
+
+            // 出边都挂在最后一段上
+            if (vmp_cfg_merge_links(dst, cur, node->jmps.list, node->jmps.count, VMP_CFG_EDGE_JMP)
+                || vmp_cfg_merge_links(dst, cur, node->trues.list, node->trues.count, VMP_CFG_EDGE_TRUE)
+                || vmp_cfg_merge_links(dst, cur, node->falls.list, node->falls.count, VMP_CFG_EDGE_FALL))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    int vmp_cfg_merge(struct vmp_cfg *dst, struct vmp_cfg **srcs, int counts)
+    {
+        struct vmp_cfg_node *node;
+        uint8_t **starts;
+        int i, j, k, total = dst->counts, ret = 0;
+
+        for (i = 0; i < counts; i++)
+        {
+            total += srcs[i]->counts;
+        }
+
+        starts = (uint8_t **)malloc((total + 1) * sizeof (starts[0]));
+        if (!starts)
+        {
+            printf("vmp_cfg_merge() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        // 所有cfg里的block起始地址，排序去重
+        for (k = 0, i = -1; i < counts; i++)
+        {
+            struct vmp_cfg *cfg = (i < 0) ? dst : srcs[i];
+
+            for (j = 0, node = cfg->list; j < cfg->counts; j++, node = node->in_list.next)
+            {
+                if (!node->debug.external_call)
+                    starts[k++] = node->id;
+            }
+        }
+        qsort(starts, k, sizeof (starts[0]), vmp_cfg_addr_cmp);
+        for (i = 0, j = 0; i < k; i++)
+        {
+            if (!j || (starts[j - 1] != starts[i]))
+                starts[j++] = starts[i];
+        }
+        k = j;
+
+        for (i = 0; i < k; i++)
+        {
+            if (!vmp_cfg_find(dst, starts[i]) && !vmp_cfg_node_create(dst, starts[i], 0))
+            {
+                printf("vmp_cfg_merge() failed with vmp_cfg_node_create(). %s:%d\n", __FILE__, __LINE__);
+                ret = -1;
+                goto exit_label;
+            }
+        }
+
+        for (i = 0; i < counts; i++)
+        {
+            if (vmp_cfg_merge_one(dst, srcs[i], starts, k))
+            {
+                printf("vmp_cfg_merge() failed with vmp_cfg_merge_one(). %s:%d\n", __FILE__, __LINE__);
+                ret = -1;
+                goto exit_label;
+            }
+        }
+
+    exit_label:
+        free(starts);
+        return ret;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,191 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_cfg_h__
+#define __vmp_cfg_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mhash.h"
+
+// 节点和边都从arena里分配，cfg销毁时一起释放，每次向系统要这么大的一块
+#define VMP_CFG_ARENA_BLOCK_SIZE    (256 * 1024)
+// 节点名字只在输出时才格式化，用这么大的buf
+#define VMP_CFG_NAME_SIZE           64
+
+typedef struct vmp_cfg_arena_block
+{
+    struct vmp_cfg_arena_block *next;
+    size_t      used;
+    size_t      size;
+} vmp_cfg_arena_block_t;
+
+// 同一个(from, to, 跳转类型)只有一条边，counts是这条边被执行的次数
+struct vmp_cfg_node_link
+{
+    struct vmp_cfg_node_link *next;
+    struct vmp_cfg_node *node;
+    uint64_t counts;
+};
+
+// 边的类型
+#define VMP_CFG_EDGE_TRUE           0   // 条件跳转，放在trues里
+#define VMP_CFG_EDGE_JMP            1   // X86_JMP，放在jmps里
+#define VMP_CFG_EDGE_FALL           2   // block被切开以后，顺序执行进入下一个block，放在falls里
+
+// 边的key: from和to的index，加上边的类型
+#define vmp_cfg_edge_key(_from, _to, _kind)  \
+    ((((uint64_t)(_from)->index) << 34) | (((uint64_t)(_to)->index) << 2) | (uint64_t)(_kind))
+
+// 按地址排序的block索引分成两级: 大的有序数组，加上一个小的有序数组接收新插入的节点，
+// 小数组超过这个大小(或者大数组大小的平方根)时合并进大数组
+#define VMP_CFG_INDEX_PENDING_MIN   256
+
+// cfg发生变化时的通知，见vmp_cfg_event.h
+#define VMP_CFG_NOTIFY_NODE         1   // 新建节点
+#define VMP_CFG_NOTIFY_EDGE         2   // 新加一条边，other是目标，kind是边的类型
+#define VMP_CFG_NOTIFY_EXTEND       3   // block变长了
+#define VMP_CFG_NOTIFY_SPLIT        4   // node被切开，other是后半部分，node所有的出边都挪到了other上
+
+struct vmp_cfg_node;
+typedef void (*vmp_cfg_notify_func)(void *arg, int type, struct vmp_cfg_node *node, struct vmp_cfg_node *other, int kind);
+
+typedef struct vmp_cfg_node
+{
+    uint8_t *id;
+    // 创建顺序，从0开始
+    int index;
+    // 创建时分配的编号，名字是 label%d
+    int label;
+    // block的字节数，包括结尾的跳转指令
+    int len;
+    // block模式trace里的block id，0表示这个block还没有执行过
+    int trace_id;
+
+    struct {
+        unsigned vmp                : 16;
+        unsigned external_call      : 1;
+    } debug;
+
+    struct {
+        struct vmp_cfg_node *next;
+        struct vmp_cfg_node *prev;
+    } in_list;
+
+    struct
+    {
+        struct vmp_cfg_node_link *list;
+        int count;
+    } trues;
+
+    struct
+    {
+    } falses;
+
+    struct
+    {
+        struct vmp_cfg_node_link *list;
+        int count;
+    } jmps;
+
+    struct
+    {
+        struct vmp_cfg_node_link *list;
+        int count;
+    } falls;
+} vmp_cfg_node_t;
+
+// 地址和节点放在一起，查找时不用访问节点
+struct vmp_cfg_index_entry
+{
+    uint8_t     *id;
+    struct vmp_cfg_node *node;
+};
+
+typedef struct vmp_cfg_index
+{
+    struct vmp_cfg_index_entry *sorted;
+    int         sorted_counts;
+    int         sorted_size;
+
+    struct vmp_cfg_index_entry *pending;
+    int         pending_counts;
+    int         pending_size;
+} vmp_cfg_index_t;
+
+typedef struct vmp_cfg
+{
+    struct vmp_cfg_arena_block *arena;
+    // vmp_cfg_reset以后留下来重用的块
+    struct vmp_cfg_arena_block *spare;
+
+    // key: 节点的id(block起始地址)，value: 节点指针
+    struct mhash64 map;
+    // key: vmp_cfg_edge_key，value: 边的指针
+    struct mhash64 edges;
+    int edge_counts;
+
+    // 按block起始地址排序，用来找包含某个地址的block
+    struct vmp_cfg_index index;
+
+    struct vmp_cfg_node *list;
+    int counts;
+
+    int label_counts;
+
+    // 不为空的话，节点和边有变化时调用
+    vmp_cfg_notify_func notify;
+    void *notify_arg;
+} vmp_cfg_t;
+
+#define vmp_cfg_notify(_cfg, _type, _node, _other, _kind) \
+    do { if ((_cfg)->notify) (_cfg)->notify((_cfg)->notify_arg, _type, _node, _other, _kind); } while (0)
+
+struct vmp_cfg *vmp_cfg_create(void);
+void vmp_cfg_destroy(struct vmp_cfg *cfg);
+/* 清空所有的节点和边，arena的块和hash表留着给下一次用 */
+void vmp_cfg_reset(struct vmp_cfg *cfg);
+
+/*
+@iat_call   addr是IAT里的一项，节点名字用导入函数的名字 */
+struct vmp_cfg_node *vmp_cfg_node_create(struct vmp_cfg *cfg, uint8_t *addr, int iat_call);
+struct vmp_cfg_node *vmp_cfg_find(struct vmp_cfg *cfg, uint8_t *id);
+/* 找包含addr的block，也就是 id <= addr < id + len 的节点，O(log n) */
+struct vmp_cfg_node *vmp_cfg_find_contain(struct vmp_cfg *cfg, uint8_t *addr);
+int vmp_cfg_node_update_vmp(struct vmp_cfg_node *node, int vmp);
+/* 格式化节点的名字，buf至少VMP_CFG_NAME_SIZE */
+const char *vmp_cfg_node_name(struct vmp_cfg_node *node, char *buf);
+
+/* 把addr处的指令加到block里，只有addr正好是block结尾时block才会变长
+@return     0           block变长了
+            -1          指令不在block的结尾 */
+int vmp_cfg_add_inst(struct vmp_cfg *cfg, struct vmp_cfg_node *node, uint8_t *addr, int len);
+/* 边已经存在的话只增加它的执行次数 */
+int vmp_cfg_add_edges(struct vmp_cfg *cfg, struct vmp_cfg_node *from, struct vmp_cfg_node *to, int jmp_type);
+int vmp_cfg_add_fall_edge(struct vmp_cfg *cfg, struct vmp_cfg_node *from, struct vmp_cfg_node *to);
+
+/* 在addr处把cur_node切成两个block，addr必须是一条指令的开头(调用者保证)
+cur_node保留前半部分，后半部分是一个新节点，cur_node所有的出边都挪到新节点上，
+再加一条 cur_node -> 新节点 的顺序执行边，它的执行次数是挪过去的出边次数之和
+@head       前半部分，也就是cur_node
+@tail       后半部分
+@return     0           success
+            -1          failure */
+int vmp_cfg_seperate(struct vmp_cfg *cfg, struct vmp_cfg_node *cur_node,
+    uint8_t *addr, struct vmp_cfg_node **head, struct vmp_cfg_node **tail);
+
+/* 把几个分开跑出来的cfg合并到dst里。所有cfg的block起始地址合在一起，每个block在别的cfg的
+起始地址处切开，切开的地方加顺序执行边；相同的边执行次数相加。dst的节点按地址顺序创建，
+合并的结果和srcs里各个cfg是怎么跑出来的无关
+@return     0           success
+            -1          failure */
+int vmp_cfg_merge(struct vmp_cfg *dst, struct vmp_cfg **srcs, int counts);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
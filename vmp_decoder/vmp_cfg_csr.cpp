@@ -0,0 +1,399 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_cfg_csr.h"
+#include "vmp_cfg_dom.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define vmp_cfg_csr_align(_a)       (((_a) + 7) & ~(uint64_t)7)
+
+    // DFS时每个节点的出边迭代器，依次走trues、jmps、falls三个链表
+    struct vmp_cfg_csr_iter
+    {
+        struct vmp_cfg_node *node;
+        struct vmp_cfg_node_link *link;
+        int         kind;
+        int         left;
+    };
+
+    static struct vmp_cfg_node_link *vmp_cfg_csr_links(struct vmp_cfg_node *node, int kind, int *counts)
+    {
+        switch (kind)
+        {
+        case VMP_CFG_EDGE_TRUE:
+            *counts = node->trues.count;
+            return node->trues.list;
+
+        case VMP_CFG_EDGE_JMP:
+            *counts = node->jmps.count;
+            return node->jmps.list;
+
+        default:
+            *counts = node->falls.count;
+            return node->falls.list;
+        }
+    }
+
+    static struct vmp_cfg_node_link *vmp_cfg_csr_iter_next(struct vmp_cfg_csr_iter *iter)
+    {
+        struct vmp_cfg_node_link *link;
+
+        while (!iter->left)
+        {
+            if (++iter->kind > VMP_CFG_EDGE_FALL)
+                return NULL;
+            iter->link = vmp_cfg_csr_links(iter->node, iter->kind, &iter->left);
+        }
+
+        link = iter->link;
+        iter->link = link->next;
+        iter->left--;
+
+        return link;
+    }
+
+    static void vmp_cfg_csr_iter_init(struct vmp_cfg_csr_iter *iter, struct vmp_cfg_node *node)
+    {
+        iter->node = node;
+        iter->kind = VMP_CFG_EDGE_TRUE;
+        iter->link = vmp_cfg_csr_links(node, iter->kind, &iter->left);
+    }
+
+    static int vmp_cfg_csr_setup(struct vmp_cfg_csr *csr, uint8_t *base)
+    {
+        struct vmp_cfg_csr_head *head = (struct vmp_cfg_csr_head *)base;
+
+        csr->base = base;
+        csr->head = head;
+        csr->nodes = (struct vmp_cfg_csr_node *)(base + head->node_offset);
+        csr->rows = (uint32_t *)(base + head->row_offset);
+        csr->edges = (struct vmp_cfg_csr_edge *)(base + head->edge_offset);
+        csr->weights = (uint64_t *)(base + head->weight_offset);
+        csr->strs = (const char *)(base + head->str_offset);
+        csr->idom = (uint32_t *)(base + head->idom_offset);
+        csr->loop = (uint32_t *)(base + head->loop_offset);
+
+        return 0;
+    }
+
+    // 算出DFS逆后序，root走不到的节点按创建顺序排在后面
+    static int vmp_cfg_csr_order(struct vmp_cfg *cfg, struct vmp_cfg_node *root,
+        struct vmp_cfg_node **order, uint32_t *pos, uint32_t *reach_counts)
+    {
+        struct vmp_cfg_csr_iter *stack;
+        struct vmp_cfg_node_link *link;
+        struct vmp_cfg_node *node;
+        int i, sp = -1, post = cfg->counts, counts = 0;
+
+        stack = (struct vmp_cfg_csr_iter *)malloc((cfg->counts + 1) * sizeof (stack[0]));
+        if (!stack)
+        {
+            printf("vmp_cfg_csr_order() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        // 后序从数组末尾往前放，放完以后[post, counts)就是逆后序
+        if (root)
+        {
+            pos[root->index] = 0;
+            vmp_cfg_csr_iter_init(&stack[++sp], root);
+        }
+        while (sp >= 0)
+        {
+            if ((link = vmp_cfg_csr_iter_next(&stack[sp])))
+            {
+                if (pos[link->node->index] == (uint32_t)-1)
+                {
+                    pos[link->node->index] = 0;
+                    vmp_cfg_csr_iter_init(&stack[++sp], link->node);
+                }
+                continue;
+            }
+
+            order[--post] = stack[sp--].node;
+        }
+        free(stack);
+
+        memmove(order, order + post, (cfg->counts - post) * sizeof (order[0]));
+        counts = cfg->counts - post;
+        *reach_counts = counts;
+
+        for (i = 0, node = cfg->list; i < cfg->counts; i++, node = node->in_list.next)
+        {
+            if (pos[node->index] == (uint32_t)-1)
+                order[counts++] = node;
+        }
+
+        for (i = 0; i < counts; i++)
+        {
+            pos[order[i]->index] = i;
+        }
+
+        return 0;
+    }
+
+    // 支配树和循环的结果也写到文件里
+    static int vmp_cfg_csr_analyze(struct vmp_cfg_csr *csr)
+    {
+        struct vmp_cfg_dom *dom;
+        uint32_t i;
+
+        dom = vmp_cfg_dom_create(csr);
+        if (!dom)
+        {
+            printf("vmp_cfg_csr_analyze() failed with vmp_cfg_dom_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        memcpy(csr->idom, dom->idom, csr->head->node_counts * sizeof (uint32_t));
+        memcpy(csr->loop, dom->loop, csr->head->node_counts * sizeof (uint32_t));
+        for (i = 0; i < dom->reach_counts; i++)
+        {
+            if (vmp_cfg_dom_is_header(dom, i))
+                csr->nodes[i].flags |= VMP_CFG_CSR_NODE_HEADER;
+        }
+        if (dom->dispatcher != VMP_CFG_DOM_NONE)
+            csr->nodes[dom->dispatcher].flags |= VMP_CFG_CSR_NODE_DISPATCHER;
+        csr->head->dispatcher = dom->dispatcher;
+        csr->head->header_counts = dom->header_counts;
+
+        vmp_cfg_dom_destroy(dom);
+
+        return 0;
+    }
+
+    struct vmp_cfg_csr *vmp_cfg_csr_build(struct vmp_cfg *cfg, struct vmp_cfg_node *root,
+        vmp_cfg_csr_addr_func addr_func, void *arg)
+    {
+        struct vmp_cfg_csr *csr = NULL;
+        struct vmp_cfg_node **order = NULL;
+        struct vmp_cfg_node *node;
+        struct vmp_cfg_node_link *link;
+        struct vmp_cfg_csr_head head = { 0 };
+        struct vmp_cfg_csr_iter iter;
+        uint32_t *pos = NULL, edge_counts = 0, str_size = 0, i, j;
+        char name[VMP_CFG_NAME_SIZE];
+        uint8_t *base;
+
+        csr = (struct vmp_cfg_csr *)calloc(1, sizeof (csr[0]));
+        order = (struct vmp_cfg_node **)malloc((cfg->counts + 1) * sizeof (order[0]));
+        pos = (uint32_t *)malloc((cfg->counts + 1) * sizeof (pos[0]));
+        if (!csr || !order || !pos)
+        {
+            printf("vmp_cfg_csr_build() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+        memset(pos, 0xff, (cfg->counts + 1) * sizeof (pos[0]));
+
+        if (vmp_cfg_csr_order(cfg, root, order, pos, &head.reach_counts))
+        {
+            printf("vmp_cfg_csr_build() failed with vmp_cfg_csr_order(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        for (i = 0; i < (uint32_t)cfg->counts; i++)
+        {
+            node = order[i];
+            edge_counts += node->trues.count + node->jmps.count + node->falls.count;
+            str_size += (uint32_t)strlen(vmp_cfg_node_name(node, name)) + 1;
+        }
+
+        memcpy(head.magic, VMP_CFG_CSR_MAGIC, 4);
+        head.version = VMP_CFG_CSR_VERSION;
+        head.head_size = sizeof (head);
+        head.node_counts = cfg->counts;
+        head.edge_counts = edge_counts;
+        head.str_size = str_size;
+        head.node_offset = vmp_cfg_csr_align(sizeof (head));
+        head.row_offset = vmp_cfg_csr_align(head.node_offset + (uint64_t)head.node_counts * sizeof (struct vmp_cfg_csr_node));
+        head.edge_offset = vmp_cfg_csr_align(head.row_offset + ((uint64_t)head.node_counts + 1) * sizeof (uint32_t));
+        head.weight_offset = vmp_cfg_csr_align(head.edge_offset + (uint64_t)edge_counts * sizeof (struct vmp_cfg_csr_edge));
+        head.str_offset = vmp_cfg_csr_align(head.weight_offset + (uint64_t)edge_counts * sizeof (uint64_t));
+        head.idom_offset = vmp_cfg_csr_align(head.str_offset + str_size);
+        head.loop_offset = vmp_cfg_csr_align(head.idom_offset + (uint64_t)head.node_counts * sizeof (uint32_t));
+        head.file_size = vmp_cfg_csr_align(head.loop_offset + (uint64_t)head.node_counts * sizeof (uint32_t));
+
+        base = (uint8_t *)calloc(1, (size_t)head.file_size);
+        if (!base)
+        {
+            printf("vmp_cfg_csr_build() failed with calloc(%llu). %s:%d\n", (unsigned long long)head.file_size, __FILE__, __LINE__);
+            goto fail_label;
+        }
+        memcpy(base, &head, sizeof (head));
+        vmp_cfg_csr_setup(csr, base);
+
+        for (i = 0, edge_counts = 0, str_size = 0; i < head.node_counts; i++)
+        {
+            node = order[i];
+
+            csr->nodes[i].addr = addr_func ? addr_func(arg, node->id) : (uint32_t)(uintptr_t)node->id;
+            csr->nodes[i].len = node->len;
+            csr->nodes[i].flags = (node->debug.external_call ? VMP_CFG_CSR_NODE_IAT : 0)
+                | ((i >= head.reach_counts) ? VMP_CFG_CSR_NODE_UNREACH : 0)
+                | ((uint32_t)node->debug.vmp << 16);
+            csr->nodes[i].name = str_size;
+            vmp_cfg_node_name(node, name);
+            j = (uint32_t)strlen(name) + 1;
+            memcpy((char *)csr->strs + str_size, name, j);
+            str_size += j;
+
+            csr->rows[i] = edge_counts;
+            vmp_cfg_csr_iter_init(&iter, node);
+            while ((link = vmp_cfg_csr_iter_next(&iter)))
+            {
+                csr->edges[edge_counts].to = pos[link->node->index];
+                csr->edges[edge_counts].kind = iter.kind;
+                csr->weights[edge_counts] = link->counts;
+                edge_counts++;
+            }
+        }
+        csr->rows[i] = edge_counts;
+
+        if (vmp_cfg_csr_analyze(csr))
+        {
+            printf("vmp_cfg_csr_build() failed with vmp_cfg_csr_analyze(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        free(order);
+        free(pos);
+
+        return csr;
+
+    fail_label:
+        free(order);
+        free(pos);
+        vmp_cfg_csr_close(csr);
+        return NULL;
+    }
+
+    int vmp_cfg_csr_save(struct vmp_cfg_csr *csr, const char *filename)
+    {
+        FILE *fp = fopen(filename, "wb");
+
+        if (!fp)
+        {
+            printf("vmp_cfg_csr_save(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (fwrite(csr->base, 1, (size_t)csr->head->file_size, fp) != (size_t)csr->head->file_size)
+        {
+            printf("vmp_cfg_csr_save(%s) failed with fwrite(). %s:%d\n", filename, __FILE__, __LINE__);
+            fclose(fp);
+            return -1;
+        }
+        fclose(fp);
+
+        return 0;
+    }
+
+    static int vmp_cfg_csr_check(struct vmp_cfg_csr_head *head, uint64_t size)
+    {
+        if ((size < sizeof (head[0])) || memcmp(head->magic, VMP_CFG_CSR_MAGIC, 4))
+            return -1;
+
+        if ((head->version != VMP_CFG_CSR_VERSION) || (head->head_size != sizeof (head[0])) || (head->file_size > size))
+            return -1;
+
+        if ((head->node_offset + (uint64_t)head->node_counts * sizeof (struct vmp_cfg_csr_node) > head->row_offset)
+            || (head->row_offset + ((uint64_t)head->node_counts + 1) * sizeof (uint32_t) > head->edge_offset)
+            || (head->edge_offset + (uint64_t)head->edge_counts * sizeof (struct vmp_cfg_csr_edge) > head->weight_offset)
+            || (head->weight_offset + (uint64_t)head->edge_counts * sizeof (uint64_t) > head->str_offset)
+            || (head->str_offset + head->str_size > head->idom_offset)
+            || (head->idom_offset + (uint64_t)head->node_counts * sizeof (uint32_t) > head->loop_offset)
+            || (head->loop_offset + (uint64_t)head->node_counts * sizeof (uint32_t) > head->file_size))
+            return -1;
+
+        return 0;
+    }
+
+    struct vmp_cfg_csr *vmp_cfg_csr_open(const char *filename)
+    {
+        struct vmp_cfg_csr *csr;
+        LARGE_INTEGER size;
+        uint8_t *base;
+
+        csr = (struct vmp_cfg_csr *)calloc(1, sizeof (csr[0]));
+        if (!csr)
+        {
+            printf("vmp_cfg_csr_open() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        csr->file_handl = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (csr->file_handl == INVALID_HANDLE_VALUE)
+        {
+            printf("vmp_cfg_csr_open(%s) failed with CreateFile(). %s:%d\n", filename, __FILE__, __LINE__);
+            csr->file_handl = NULL;
+            goto fail_label;
+        }
+
+        if (!GetFileSizeEx(csr->file_handl, &size) || !size.QuadPart)
+        {
+            printf("vmp_cfg_csr_open(%s) failed with GetFileSizeEx(). %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        csr->map_handl = CreateFileMapping(csr->file_handl, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!csr->map_handl)
+        {
+            printf("vmp_cfg_csr_open(%s) failed with CreateFileMapping(). %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        base = (uint8_t *)MapViewOfFile(csr->map_handl, FILE_MAP_READ, 0, 0, 0);
+        if (!base)
+        {
+            printf("vmp_cfg_csr_open(%s) failed with MapViewOfFile(). %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+        csr->base = base;
+
+        if (vmp_cfg_csr_check((struct vmp_cfg_csr_head *)base, (uint64_t)size.QuadPart))
+        {
+            printf("vmp_cfg_csr_open(%s) failed with invalid file. %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+        vmp_cfg_csr_setup(csr, base);
+
+        return csr;
+
+    fail_label:
+        vmp_cfg_csr_close(csr);
+        return NULL;
+    }
+
+    void vmp_cfg_csr_close(struct vmp_cfg_csr *csr)
+    {
+        if (!csr)
+            return;
+
+        if (csr->map_handl)
+        {
+            if (csr->base)
+                UnmapViewOfFile(csr->base);
+            CloseHandle(csr->map_handl);
+        }
+        else
+        {
+            free(csr->base);
+        }
+
+        if (csr->file_handl)
+            CloseHandle(csr->file_handl);
+
+        free(csr);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,115 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_cfg_csr_h__
+#define __vmp_cfg_csr_h__
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "vmp_cfg.h"
+
+// 分析结束后把cfg压成CSR(compressed sparse row)数组，写成可以直接mmap使用的二进制文件
+// 文件和内存里的布局完全一样，所有段都8字节对齐，小端:
+//      head:       struct vmp_cfg_csr_head
+//      nodes:      node_counts * struct vmp_cfg_csr_node
+//      rows:       (node_counts + 1) * u32，节点i的出边是 edges[rows[i], rows[i + 1])
+//      edges:      edge_counts * struct vmp_cfg_csr_edge
+//      weights:    edge_counts * u64，边的执行次数
+//      strs:       str_size字节，节点名字，以0结尾
+//      idom:       node_counts * u32，直接支配节点，root是0，走不到的节点是0xffffffff
+//      loop:       node_counts * u32，包含这个节点的最内层循环的头，循环头自己是外面一层循环的头，
+//                  不在循环里是0xffffffff，见vmp_cfg_dom.h
+// 节点按从root开始的DFS逆后序排列，root是0，root走不到的节点按创建顺序排在后面，
+// 这样遍历时基本上是顺序访问内存
+#define VMP_CFG_CSR_MAGIC           "VMPG"
+#define VMP_CFG_CSR_VERSION         2
+
+// 节点标志
+#define VMP_CFG_CSR_NODE_IAT        0x01    // 导入函数
+#define VMP_CFG_CSR_NODE_UNREACH    0x02    // 从root走不到
+#define VMP_CFG_CSR_NODE_HEADER     0x04    // 循环头
+#define VMP_CFG_CSR_NODE_DISPATCHER 0x08    // 识别出来的VM dispatcher
+
+typedef struct vmp_cfg_csr_head
+{
+    char        magic[4];
+    uint16_t    version;
+    uint16_t    head_size;
+    uint32_t    node_counts;
+    uint32_t    edge_counts;
+    // 和DFS的顺序一致的节点个数，[0, reach_counts)是逆后序，root走不到的节点在后面
+    uint32_t    reach_counts;
+    uint32_t    str_size;
+    uint64_t    file_size;
+
+    uint64_t    node_offset;
+    uint64_t    row_offset;
+    uint64_t    edge_offset;
+    uint64_t    weight_offset;
+    uint64_t    str_offset;
+    uint64_t    idom_offset;
+    uint64_t    loop_offset;
+
+    // 没有识别出来的话是0xffffffff
+    uint32_t    dispatcher;
+    uint32_t    header_counts;
+} vmp_cfg_csr_head_t;
+
+typedef struct vmp_cfg_csr_node
+{
+    // IDA地址
+    uint32_t    addr;
+    uint32_t    len;
+    // 低16位是VMP_CFG_CSR_NODE_xxx，高16位是vmp编号
+    uint32_t    flags;
+    // 名字在strs里的偏移
+    uint32_t    name;
+} vmp_cfg_csr_node_t;
+
+typedef struct vmp_cfg_csr_edge
+{
+    // 目标节点的下标
+    uint32_t    to;
+    // VMP_CFG_EDGE_xxx
+    uint32_t    kind;
+} vmp_cfg_csr_edge_t;
+
+typedef struct vmp_cfg_csr
+{
+    struct vmp_cfg_csr_head *head;
+    struct vmp_cfg_csr_node *nodes;
+    uint32_t    *rows;
+    struct vmp_cfg_csr_edge *edges;
+    uint64_t    *weights;
+    const char  *strs;
+    uint32_t    *idom;
+    uint32_t    *loop;
+
+    // vmp_cfg_csr_build出来的是一整块malloc的内存，vmp_cfg_csr_open出来的是文件映射
+    uint8_t     *base;
+    HANDLE      file_handl;
+    HANDLE      map_handl;
+} vmp_cfg_csr_t;
+
+// 把节点地址转成写到文件里的地址，NULL的话直接取低32位
+typedef uint32_t (*vmp_cfg_csr_addr_func)(void *arg, uint8_t *addr);
+
+struct vmp_cfg_csr *vmp_cfg_csr_build(struct vmp_cfg *cfg, struct vmp_cfg_node *root,
+    vmp_cfg_csr_addr_func addr_func, void *arg);
+int vmp_cfg_csr_save(struct vmp_cfg_csr *csr, const char *filename);
+/* 只读映射文件，检查头以后直接使用，不做任何解析 */
+struct vmp_cfg_csr *vmp_cfg_csr_open(const char *filename);
+void vmp_cfg_csr_close(struct vmp_cfg_csr *csr);
+
+#define vmp_cfg_csr_name(_csr, _i)          ((_csr)->strs + (_csr)->nodes[_i].name)
+#define vmp_cfg_csr_out_counts(_csr, _i)    ((_csr)->rows[(_i) + 1] - (_csr)->rows[_i])
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,312 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_cfg_dom.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+    // 计算过程中用到的临时数组
+    typedef struct vmp_cfg_dom_tmp
+    {
+        uint32_t    *pred_rows;     // 节点i的前驱是 preds[pred_rows[i], pred_rows[i + 1])
+        uint32_t    *preds;
+        uint32_t    *child_rows;    // 支配树上的孩子，布局和preds一样
+        uint32_t    *children;
+        uint32_t    *stack;
+        uint32_t    *iter;
+        uint32_t    *uf;            // 并查集，已经处理完的内层循环合并到循环头
+        uint32_t    *mark;
+    } vmp_cfg_dom_tmp_t;
+
+    static void vmp_cfg_dom_tmp_free(struct vmp_cfg_dom_tmp *tmp)
+    {
+        free(tmp->pred_rows);
+        free(tmp->preds);
+        free(tmp->child_rows);
+        free(tmp->children);
+        free(tmp->stack);
+        free(tmp->iter);
+        free(tmp->uf);
+        free(tmp->mark);
+    }
+
+    static inline uint32_t vmp_cfg_dom_intersect(uint32_t *idom, uint32_t a, uint32_t b)
+    {
+        while (a != b)
+        {
+            while (a > b)
+                a = idom[a];
+            while (b > a)
+                b = idom[b];
+        }
+
+        return a;
+    }
+
+    static inline uint32_t vmp_cfg_dom_find(uint32_t *uf, uint32_t x)
+    {
+        while (uf[x] != x)
+        {
+            uf[x] = uf[uf[x]];
+            x = uf[x];
+        }
+
+        return x;
+    }
+
+    static void vmp_cfg_dom_preds(struct vmp_cfg_csr *csr, struct vmp_cfg_dom_tmp *tmp, uint32_t r)
+    {
+        uint32_t i, e, to;
+
+        for (i = 0; i < r; i++)
+        {
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                if (to < r)
+                    tmp->pred_rows[to + 1]++;
+            }
+        }
+        for (i = 0; i < r; i++)
+        {
+            tmp->pred_rows[i + 1] += tmp->pred_rows[i];
+        }
+
+        // iter当写入位置用
+        memcpy(tmp->iter, tmp->pred_rows, r * sizeof (uint32_t));
+        for (i = 0; i < r; i++)
+        {
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                if (to < r)
+                    tmp->preds[tmp->iter[to]++] = i;
+            }
+        }
+    }
+
+    static void vmp_cfg_dom_idom(struct vmp_cfg_dom *dom, struct vmp_cfg_dom_tmp *tmp)
+    {
+        uint32_t i, k, p, new_idom, r = dom->reach_counts;
+        int changed = 1;
+
+        dom->idom[0] = 0;
+        while (changed)
+        {
+            changed = 0;
+            for (i = 1; i < r; i++)
+            {
+                new_idom = VMP_CFG_DOM_NONE;
+                for (k = tmp->pred_rows[i]; k < tmp->pred_rows[i + 1]; k++)
+                {
+                    p = tmp->preds[k];
+                    if (dom->idom[p] == VMP_CFG_DOM_NONE)
+                        continue;
+                    new_idom = (new_idom == VMP_CFG_DOM_NONE) ? p : vmp_cfg_dom_intersect(dom->idom, p, new_idom);
+                }
+
+                if (dom->idom[i] != new_idom)
+                {
+                    dom->idom[i] = new_idom;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    // 支配树的先序和后序编号
+    static void vmp_cfg_dom_number(struct vmp_cfg_dom *dom, struct vmp_cfg_dom_tmp *tmp)
+    {
+        uint32_t i, c, r = dom->reach_counts, pre = 0, post = 0;
+        int sp = -1;
+
+        for (i = 1; i < r; i++)
+        {
+            tmp->child_rows[dom->idom[i] + 1]++;
+        }
+        for (i = 0; i < r; i++)
+        {
+            tmp->child_rows[i + 1] += tmp->child_rows[i];
+        }
+        memcpy(tmp->iter, tmp->child_rows, r * sizeof (uint32_t));
+        for (i = 1; i < r; i++)
+        {
+            tmp->children[tmp->iter[dom->idom[i]]++] = i;
+        }
+
+        memcpy(tmp->iter, tmp->child_rows, r * sizeof (uint32_t));
+        tmp->stack[++sp] = 0;
+        dom->pre[0] = pre++;
+        while (sp >= 0)
+        {
+            i = tmp->stack[sp];
+            if (tmp->iter[i] < tmp->child_rows[i + 1])
+            {
+                c = tmp->children[tmp->iter[i]++];
+                dom->pre[c] = pre++;
+                tmp->stack[++sp] = c;
+                continue;
+            }
+
+            dom->post[i] = post++;
+            sp--;
+        }
+    }
+
+    // 从内层到外层处理循环头，逆后序编号大的循环头不可能包含编号小的
+    static void vmp_cfg_dom_loops(struct vmp_cfg_dom *dom, struct vmp_cfg_dom_tmp *tmp)
+    {
+        uint32_t h, i, k, p, y, z, r = dom->reach_counts;
+        int sp;
+
+        for (i = 0; i < r; i++)
+        {
+            tmp->uf[i] = i;
+        }
+
+        for (h = r; h-- > 0; )
+        {
+            sp = -1;
+            for (k = tmp->pred_rows[h]; k < tmp->pred_rows[h + 1]; k++)
+            {
+                p = tmp->preds[k];
+                if (!vmp_cfg_dom_dominates(dom, h, p))
+                    continue;
+
+                dom->latches[h]++;
+                y = vmp_cfg_dom_find(tmp->uf, p);
+                if ((y != h) && (tmp->mark[y] != h + 1))
+                {
+                    tmp->mark[y] = h + 1;
+                    tmp->stack[++sp] = y;
+                }
+            }
+            if (!dom->latches[h])
+                continue;
+
+            dom->header_counts++;
+            while (sp >= 0)
+            {
+                y = tmp->stack[sp--];
+                dom->loop[y] = h;
+                tmp->uf[y] = h;
+
+                for (k = tmp->pred_rows[y]; k < tmp->pred_rows[y + 1]; k++)
+                {
+                    z = vmp_cfg_dom_find(tmp->uf, tmp->preds[k]);
+                    if ((z == h) || (tmp->mark[z] == h + 1) || !vmp_cfg_dom_dominates(dom, h, z))
+                        continue;
+
+                    tmp->mark[z] = h + 1;
+                    tmp->stack[++sp] = z;
+                }
+            }
+        }
+
+        // 循环头的逆后序编号比循环里的节点小，顺着算深度就行
+        for (i = 0; i < r; i++)
+        {
+            h = dom->loop[i];
+            dom->loop_depth[i] = ((h == VMP_CFG_DOM_NONE) ? 0 : dom->loop_depth[h]) + (dom->latches[i] ? 1 : 0);
+        }
+    }
+
+    static void vmp_cfg_dom_dispatcher(struct vmp_cfg_dom *dom, struct vmp_cfg_dom_tmp *tmp)
+    {
+        uint32_t i, best = VMP_CFG_DOM_NONE;
+
+        for (i = 0; i < dom->reach_counts; i++)
+        {
+            if (dom->latches[i] < VMP_CFG_DOM_DISPATCHER_MIN)
+                continue;
+
+            if ((best == VMP_CFG_DOM_NONE) || (dom->latches[i] > dom->latches[best])
+                || ((dom->latches[i] == dom->latches[best])
+                    && (tmp->pred_rows[i + 1] - tmp->pred_rows[i] > tmp->pred_rows[best + 1] - tmp->pred_rows[best])))
+            {
+                best = i;
+            }
+        }
+
+        dom->dispatcher = best;
+    }
+
+    struct vmp_cfg_dom *vmp_cfg_dom_create(struct vmp_cfg_csr *csr)
+    {
+        struct vmp_cfg_dom *dom;
+        struct vmp_cfg_dom_tmp tmp = { 0 };
+        uint32_t n = csr->head->node_counts, r = csr->head->reach_counts;
+
+        dom = (struct vmp_cfg_dom *)calloc(1, sizeof (dom[0]));
+        if (!dom)
+        {
+            printf("vmp_cfg_dom_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+        dom->counts = n;
+        dom->reach_counts = r;
+        dom->dispatcher = VMP_CFG_DOM_NONE;
+
+        dom->idom = (uint32_t *)malloc((n + 1) * sizeof (uint32_t));
+        dom->loop = (uint32_t *)malloc((n + 1) * sizeof (uint32_t));
+        dom->loop_depth = (uint32_t *)calloc(n + 1, sizeof (uint32_t));
+        dom->latches = (uint32_t *)calloc(n + 1, sizeof (uint32_t));
+        dom->pre = (uint32_t *)calloc(n + 1, sizeof (uint32_t));
+        dom->post = (uint32_t *)calloc(n + 1, sizeof (uint32_t));
+
+        tmp.pred_rows = (uint32_t *)calloc(r + 2, sizeof (uint32_t));
+        tmp.preds = (uint32_t *)malloc((csr->head->edge_counts + 1) * sizeof (uint32_t));
+        tmp.child_rows = (uint32_t *)calloc(r + 2, sizeof (uint32_t));
+        tmp.children = (uint32_t *)malloc((r + 1) * sizeof (uint32_t));
+        tmp.stack = (uint32_t *)malloc((r + 1) * sizeof (uint32_t));
+        tmp.iter = (uint32_t *)malloc((r + 1) * sizeof (uint32_t));
+        tmp.uf = (uint32_t *)malloc((r + 1) * sizeof (uint32_t));
+        tmp.mark = (uint32_t *)calloc(r + 1, sizeof (uint32_t));
+
+        if (!dom->idom || !dom->loop || !dom->loop_depth || !dom->latches || !dom->pre || !dom->post
+            || !tmp.pred_rows || !tmp.preds || !tmp.child_rows || !tmp.children || !tmp.stack || !tmp.iter || !tmp.uf || !tmp.mark)
+        {
+            printf("vmp_cfg_dom_create() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            vmp_cfg_dom_tmp_free(&tmp);
+            vmp_cfg_dom_destroy(dom);
+            return NULL;
+        }
+        memset(dom->idom, 0xff, (n + 1) * sizeof (uint32_t));
+        memset(dom->loop, 0xff, (n + 1) * sizeof (uint32_t));
+
+        if (r)
+        {
+            vmp_cfg_dom_preds(csr, &tmp, r);
+            vmp_cfg_dom_idom(dom, &tmp);
+            vmp_cfg_dom_number(dom, &tmp);
+            vmp_cfg_dom_loops(dom, &tmp);
+            vmp_cfg_dom_dispatcher(dom, &tmp);
+        }
+        vmp_cfg_dom_tmp_free(&tmp);
+
+        return dom;
+    }
+
+    void vmp_cfg_dom_destroy(struct vmp_cfg_dom *dom)
+    {
+        if (!dom)
+            return;
+
+        free(dom->idom);
+        free(dom->loop);
+        free(dom->loop_depth);
+        free(dom->latches);
+        free(dom->pre);
+        free(dom->post);
+        free(dom);
+    }
+
+#ifdef __cplusplus
+}
+#endif
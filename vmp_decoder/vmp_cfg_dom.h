@@ -0,0 +1,55 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_cfg_dom_h__
+#define __vmp_cfg_dom_h__
+
+#include <stdint.h>
+#include "vmp_cfg_csr.h"
+
+// 在CSR上算支配树(Cooper-Harvey-Kennedy)和循环嵌套森林，全部是按节点下标的平铺数组
+// CSR的节点已经是逆后序，root是0，所以下标直接当逆后序编号用，root走不到的节点不参与计算
+//  循环:   h支配p并且有边p->h时，p->h是回边，h是循环头；循环体是不经过h能反向走到p的节点，
+//          不被h支配的入口(不可归约的部分)忽略
+//  dispatcher: 回边最多的循环头，VM的每个handler执行完都会跳回dispatcher
+#define VMP_CFG_DOM_NONE            ((uint32_t)-1)
+// 回边少于这个数的循环头不当成dispatcher
+#define VMP_CFG_DOM_DISPATCHER_MIN  4
+
+typedef struct vmp_cfg_dom
+{
+    uint32_t    counts;
+    uint32_t    reach_counts;
+
+    // 直接支配节点，root是它自己，走不到的节点是VMP_CFG_DOM_NONE
+    uint32_t    *idom;
+    // 普通节点: 包含它的最内层循环的头；循环头: 外面一层循环的头；不在循环里是VMP_CFG_DOM_NONE
+    uint32_t    *loop;
+    // 循环嵌套深度，循环头算在自己的循环里
+    uint32_t    *loop_depth;
+    // 进入这个节点的回边数，大于0就是循环头
+    uint32_t    *latches;
+    // 支配树上的先序和后序编号，a支配b <=> pre[a] <= pre[b] && post[b] <= post[a]
+    uint32_t    *pre;
+    uint32_t    *post;
+
+    uint32_t    header_counts;
+    uint32_t    dispatcher;
+} vmp_cfg_dom_t;
+
+struct vmp_cfg_dom *vmp_cfg_dom_create(struct vmp_cfg_csr *csr);
+void vmp_cfg_dom_destroy(struct vmp_cfg_dom *dom);
+
+#define vmp_cfg_dom_reach(_dom, _i)         ((_i) < (_dom)->reach_counts)
+#define vmp_cfg_dom_dominates(_dom, _a, _b) (vmp_cfg_dom_reach(_dom, _a) && vmp_cfg_dom_reach(_dom, _b) \
+    && ((_dom)->pre[_a] <= (_dom)->pre[_b]) && ((_dom)->post[_b] <= (_dom)->post[_a]))
+#define vmp_cfg_dom_is_header(_dom, _i)     ((_dom)->latches[_i] > 0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
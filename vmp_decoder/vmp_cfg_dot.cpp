@@ -0,0 +1,574 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_cfg_dot.h"
+#include "mhash.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+// 一行dot最长多少，节点名字不超过VMP_CFG_NAME_SIZE
+#define VMP_CFG_DOT_LINE            512
+#define VMP_CFG_DOT_NONE            ((uint32_t)-1)
+
+    typedef struct vmp_cfg_dot_buf
+    {
+        FILE        *fp;
+        char        *data;
+        char        *p;
+    } vmp_cfg_dot_buf_t;
+
+    // 所有cluster的划分结果，都是平铺的数组
+    typedef struct vmp_cfg_dot_part
+    {
+        uint32_t    node_counts;
+        uint32_t    *cluster;       // 节点 -> cluster
+        uint32_t    *indeg;
+
+        uint32_t    counts;
+        uint32_t    *entry;         // cluster的入口节点(hub就是它自己)
+        uint8_t     *hub;
+        uint32_t    *start;         // cluster的节点是 members[start[c], start[c + 1])
+        uint32_t    *members;
+        uint32_t    *in_start;      // 从别的cluster进来的边是 in_edges[in_start[c], in_start[c + 1])
+        uint32_t    *in_edges;      // 边的下标
+        uint32_t    *in_from;       // 边的起点，和in_edges一一对应
+        uint32_t    *mark;
+    } vmp_cfg_dot_part_t;
+
+    static void vmp_cfg_dot_buf_flush(struct vmp_cfg_dot_buf *buf)
+    {
+        if (buf->p > buf->data)
+            fwrite(buf->data, buf->p - buf->data, 1, buf->fp);
+        buf->p = buf->data;
+    }
+
+    static inline char *vmp_cfg_dot_buf_reserve(struct vmp_cfg_dot_buf *buf)
+    {
+        if (buf->p + VMP_CFG_DOT_LINE > buf->data + VMP_CFG_DOT_BUF_SIZE)
+            vmp_cfg_dot_buf_flush(buf);
+        return buf->p;
+    }
+
+    static int vmp_cfg_dot_buf_open(struct vmp_cfg_dot_buf *buf, const char *filename)
+    {
+        buf->fp = fopen(filename, "w");
+        if (!buf->fp)
+        {
+            printf("vmp_cfg_dot_buf_open(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+        buf->p = buf->data;
+
+        return 0;
+    }
+
+    static void vmp_cfg_dot_buf_close(struct vmp_cfg_dot_buf *buf)
+    {
+        vmp_cfg_dot_buf_flush(buf);
+        fclose(buf->fp);
+        buf->fp = NULL;
+    }
+
+    static void vmp_cfg_dot_part_free(struct vmp_cfg_dot_part *part)
+    {
+        free(part->cluster);
+        free(part->indeg);
+        free(part->entry);
+        free(part->hub);
+        free(part->start);
+        free(part->members);
+        free(part->in_start);
+        free(part->in_edges);
+        free(part->in_from);
+        free(part->mark);
+    }
+
+    // 从seed开始不经过hub和已经分好的节点做BFS，走到的节点都归到cluster c
+    static uint32_t vmp_cfg_dot_part_bfs(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_part *part,
+        uint32_t *queue, uint32_t seed, uint32_t c)
+    {
+        uint32_t head = 0, tail = 0, i, e, to;
+
+        part->cluster[seed] = c;
+        queue[tail++] = seed;
+        while (head < tail)
+        {
+            i = queue[head++];
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                if (part->cluster[to] == VMP_CFG_DOT_NONE)
+                {
+                    part->cluster[to] = c;
+                    queue[tail++] = to;
+                }
+            }
+        }
+
+        return tail;
+    }
+
+    static int vmp_cfg_dot_partition(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_part *part, int hub_min)
+    {
+        uint32_t n = csr->head->node_counts, edge_counts = csr->head->edge_counts;
+        uint32_t i, e, c, k, to, hub_counts, *queue;
+
+        part->node_counts = n;
+        part->cluster = (uint32_t *)malloc((n + 1) * sizeof (uint32_t));
+        part->indeg = (uint32_t *)calloc(n + 1, sizeof (uint32_t));
+        part->entry = (uint32_t *)malloc((n + 1) * sizeof (uint32_t));
+        part->hub = (uint8_t *)calloc(n + 1, sizeof (uint8_t));
+        part->start = (uint32_t *)calloc(n + 2, sizeof (uint32_t));
+        part->members = (uint32_t *)malloc((n + 1) * sizeof (uint32_t));
+        part->in_start = (uint32_t *)calloc(n + 2, sizeof (uint32_t));
+        part->in_edges = (uint32_t *)malloc((edge_counts + 1) * sizeof (uint32_t));
+        part->in_from = (uint32_t *)malloc((edge_counts + 1) * sizeof (uint32_t));
+        part->mark = (uint32_t *)calloc(n + 1, sizeof (uint32_t));
+        if (!part->cluster || !part->indeg || !part->entry || !part->hub || !part->start || !part->members
+            || !part->in_start || !part->in_edges || !part->in_from || !part->mark)
+        {
+            printf("vmp_cfg_dot_partition() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        memset(part->cluster, 0xff, (n + 1) * sizeof (uint32_t));
+
+        for (e = 0; e < edge_counts; e++)
+        {
+            part->indeg[csr->edges[e].to]++;
+        }
+
+        // hub单独成一个cluster
+        for (i = 0, c = 0; i < n; i++)
+        {
+            if ((part->indeg[i] >= (uint32_t)hub_min) || (vmp_cfg_csr_out_counts(csr, i) >= (uint32_t)hub_min)
+                || (csr->nodes[i].flags & VMP_CFG_CSR_NODE_DISPATCHER))
+            {
+                part->cluster[i] = c;
+                part->entry[c] = i;
+                part->hub[c] = 1;
+                c++;
+            }
+        }
+        hub_counts = c;
+
+        // BFS的队列借用members
+        queue = part->members;
+        if (n && (part->cluster[0] == VMP_CFG_DOT_NONE))
+        {
+            part->entry[c] = 0;
+            vmp_cfg_dot_part_bfs(csr, part, queue, 0, c++);
+        }
+        for (k = 0; k < hub_counts; k++)
+        {
+            i = part->entry[k];
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                if (part->cluster[to] == VMP_CFG_DOT_NONE)
+                {
+                    part->entry[c] = to;
+                    vmp_cfg_dot_part_bfs(csr, part, queue, to, c++);
+                }
+            }
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (part->cluster[i] == VMP_CFG_DOT_NONE)
+            {
+                part->entry[c] = i;
+                vmp_cfg_dot_part_bfs(csr, part, queue, i, c++);
+            }
+        }
+        part->counts = c;
+
+        // 计数排序，把每个cluster的节点和从外面进来的边放到一起
+        for (i = 0; i < n; i++)
+        {
+            part->start[part->cluster[i] + 1]++;
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                if (part->cluster[to] != part->cluster[i])
+                    part->in_start[part->cluster[to] + 1]++;
+            }
+        }
+        for (c = 0; c < part->counts; c++)
+        {
+            part->start[c + 1] += part->start[c];
+            part->in_start[c + 1] += part->in_start[c];
+        }
+        for (i = 0; i < n; i++)
+        {
+            part->members[part->start[part->cluster[i]]++] = i;
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                if (part->cluster[to] != part->cluster[i])
+                {
+                    part->in_from[part->in_start[part->cluster[to]]] = i;
+                    part->in_edges[part->in_start[part->cluster[to]]++] = e;
+                }
+            }
+        }
+        // 上面放的时候把start往后推了一格，推回来
+        for (c = part->counts; c > 0; c--)
+        {
+            part->start[c] = part->start[c - 1];
+            part->in_start[c] = part->in_start[c - 1];
+        }
+        part->start[0] = 0;
+        part->in_start[0] = 0;
+
+        return 0;
+    }
+
+    static const char *vmp_cfg_dot_style(struct vmp_cfg_csr *csr, uint32_t i)
+    {
+        if (csr->nodes[i].flags & VMP_CFG_CSR_NODE_IAT)
+            return "style=filled, color=red, ";
+        // 循环头画双边框
+        if (csr->nodes[i].flags & VMP_CFG_CSR_NODE_HEADER)
+            return "peripheries=2, ";
+        return "";
+    }
+
+    static char *vmp_cfg_dot_hub(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_part *part, char *p, uint32_t c)
+    {
+        uint32_t i = part->entry[c];
+
+        p += sprintf(p, " c%u [shape=doubleoctagon, style=filled, color=orange, label=\"%s%s\\nin %u out %u\"];\n",
+            c, (csr->nodes[i].flags & VMP_CFG_CSR_NODE_DISPATCHER) ? "dispatcher " : "",
+            vmp_cfg_csr_name(csr, i), part->indeg[i], vmp_cfg_csr_out_counts(csr, i));
+
+        return p;
+    }
+
+    static int vmp_cfg_dot_write_overview(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_part *part,
+        struct vmp_cfg_dot_buf *buf, const char *filename)
+    {
+        struct mhash64 merged;
+        uint64_t *val;
+        uint32_t c, i, e, to;
+        char *p;
+
+        if (mhash64_init(&merged, 1024))
+        {
+            printf("vmp_cfg_dot_write_overview() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (vmp_cfg_dot_buf_open(buf, filename))
+        {
+            mhash64_uninit(&merged);
+            return -1;
+        }
+
+        p = vmp_cfg_dot_buf_reserve(buf);
+        p += sprintf(p, "digraph {\n node [shape=box];\n");
+        buf->p = p;
+
+        for (c = 0; c < part->counts; c++)
+        {
+            i = part->entry[c];
+            p = vmp_cfg_dot_buf_reserve(buf);
+            if (part->hub[c])
+            {
+                p = vmp_cfg_dot_hub(csr, part, p, c);
+            }
+            else
+            {
+                p += sprintf(p, " c%u [%slabel=\"%s\\n%u blocks\"];\n",
+                    c, vmp_cfg_dot_style(csr, i), vmp_cfg_csr_name(csr, i), part->start[c + 1] - part->start[c]);
+            }
+            buf->p = p;
+        }
+
+        // cluster之间的边合并，key是两个cluster的编号
+        for (c = 0; c < part->counts; c++)
+        {
+            for (i = part->in_start[c]; i < part->in_start[c + 1]; i++)
+            {
+                e = part->in_edges[i];
+                val = mhash64_insert(&merged, ((uint64_t)part->cluster[part->in_from[i]] << 32) | c, NULL);
+                if (!val)
+                {
+                    printf("vmp_cfg_dot_write_overview() failed with mhash64_insert(). %s:%d\n", __FILE__, __LINE__);
+                    break;
+                }
+                *val += csr->weights[e];
+            }
+        }
+
+        mhash64_foreach(&merged, i)
+        {
+            to = (uint32_t)merged.keys[i];
+            p = vmp_cfg_dot_buf_reserve(buf);
+            p += sprintf(p, "c%u -> c%u [label=\"%llu\"];\n",
+                (uint32_t)(merged.keys[i] >> 32), to, (unsigned long long)merged.vals[i]);
+            buf->p = p;
+        }
+
+        p = vmp_cfg_dot_buf_reserve(buf);
+        p += sprintf(p, "}\n");
+        buf->p = p;
+        vmp_cfg_dot_buf_close(buf);
+        mhash64_uninit(&merged);
+
+        return 0;
+    }
+
+    // cluster外面的节点在这张图里只画一个汇总节点，每个文件只声明一次
+    static char *vmp_cfg_dot_outside(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_part *part,
+        char *p, uint32_t c, uint32_t other)
+    {
+        uint32_t i = part->entry[other];
+
+        if (part->mark[other] == c + 1)
+            return p;
+        part->mark[other] = c + 1;
+
+        if (part->hub[other])
+        {
+            p = vmp_cfg_dot_hub(csr, part, p, other);
+        }
+        else
+        {
+            p += sprintf(p, " c%u [style=dashed, label=\"%s\\n%u blocks\"];\n",
+                other, vmp_cfg_csr_name(csr, i), part->start[other + 1] - part->start[other]);
+        }
+
+        return p;
+    }
+
+    static int vmp_cfg_dot_write_cluster(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_part *part,
+        struct vmp_cfg_dot_buf *buf, const char *filename, uint32_t c)
+    {
+        uint32_t k, i, e, to, from;
+        char *p;
+
+        if (vmp_cfg_dot_buf_open(buf, filename))
+            return -1;
+
+        p = vmp_cfg_dot_buf_reserve(buf);
+        p += sprintf(p, "digraph {\n node [shape=box];\n");
+        buf->p = p;
+
+        for (k = part->start[c]; k < part->start[c + 1]; k++)
+        {
+            i = part->members[k];
+            p = vmp_cfg_dot_buf_reserve(buf);
+            p += sprintf(p, " n%u [%slabel=\"%s\\n%08x\"];\n", i, vmp_cfg_dot_style(csr, i),
+                vmp_cfg_csr_name(csr, i), csr->nodes[i].addr);
+            buf->p = p;
+        }
+
+        for (k = part->in_start[c]; k < part->in_start[c + 1]; k++)
+        {
+            e = part->in_edges[k];
+            from = part->in_from[k];
+            p = vmp_cfg_dot_buf_reserve(buf);
+            p = vmp_cfg_dot_outside(csr, part, p, c, part->cluster[from]);
+            p += sprintf(p, "c%u -> n%u [label=\"%llu\"];\n",
+                part->cluster[from], csr->edges[e].to, (unsigned long long)csr->weights[e]);
+            buf->p = p;
+        }
+
+        for (k = part->start[c]; k < part->start[c + 1]; k++)
+        {
+            i = part->members[k];
+            for (e = csr->rows[i]; e < csr->rows[i + 1]; e++)
+            {
+                to = csr->edges[e].to;
+                p = vmp_cfg_dot_buf_reserve(buf);
+                if (part->cluster[to] == c)
+                {
+                    p += sprintf(p, "n%u -> n%u [%slabel=\"%llu\"];\n", i, to,
+                        (csr->edges[e].kind == VMP_CFG_EDGE_FALL) ? "style=dashed, " : "", (unsigned long long)csr->weights[e]);
+                }
+                else
+                {
+                    p = vmp_cfg_dot_outside(csr, part, p, c, part->cluster[to]);
+                    p += sprintf(p, "n%u -> c%u [label=\"%llu\"];\n", i, part->cluster[to], (unsigned long long)csr->weights[e]);
+                }
+                buf->p = p;
+            }
+        }
+
+        p = vmp_cfg_dot_buf_reserve(buf);
+        p += sprintf(p, "}\n");
+        buf->p = p;
+        vmp_cfg_dot_buf_close(buf);
+
+        return 0;
+    }
+
+    int vmp_cfg_dot_write(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_param *param)
+    {
+        struct vmp_cfg_dot_part part = { 0 };
+        struct vmp_cfg_dot_buf buf = { 0 };
+        char filename[MAX_PATH], *s;
+        uint32_t c;
+        int counts = 0;
+
+        buf.data = (char *)malloc(VMP_CFG_DOT_BUF_SIZE);
+        if (!buf.data)
+        {
+            printf("vmp_cfg_dot_write() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (vmp_cfg_dot_partition(csr, &part, (param->hub_min > 0) ? param->hub_min : VMP_CFG_DOT_HUB_MIN))
+        {
+            printf("vmp_cfg_dot_write() failed with vmp_cfg_dot_partition(). %s:%d\n", __FILE__, __LINE__);
+            counts = -1;
+            goto exit_label;
+        }
+
+        if (vmp_cfg_dot_write_overview(csr, &part, &buf, param->filename))
+        {
+            printf("vmp_cfg_dot_write() failed with vmp_cfg_dot_write_overview(). %s:%d\n", __FILE__, __LINE__);
+            counts = -1;
+            goto exit_label;
+        }
+        if (param->render)
+            vmp_cfg_dot_render_submit(param->render, param->filename);
+
+        // 目录已经存在的话CreateDirectory会失败，不用管
+        CreateDirectory(param->dir, NULL);
+        for (c = 0; c < part.counts; c++)
+        {
+            if (part.hub[c])
+                continue;
+
+            _snprintf(filename, sizeof (filename) - 1, "%s\\%04u_%s.dot", param->dir, c, vmp_cfg_csr_name(csr, part.entry[c]));
+            filename[sizeof (filename) - 1] = 0;
+            // 导入函数的名字里可能有文件名不能用的字符
+            for (s = filename + strlen(param->dir) + 1; *s; s++)
+            {
+                if (strchr("<>:\"/\\|?*@", *s))
+                    *s = '_';
+            }
+
+            if (vmp_cfg_dot_write_cluster(csr, &part, &buf, filename, c))
+            {
+                printf("vmp_cfg_dot_write() failed with vmp_cfg_dot_write_cluster(). %s:%d\n", __FILE__, __LINE__);
+                counts = -1;
+                goto exit_label;
+            }
+            counts++;
+
+            if (param->render && (part.start[c + 1] - part.start[c] <= VMP_CFG_DOT_RENDER_MAX))
+                vmp_cfg_dot_render_submit(param->render, filename);
+        }
+
+    exit_label:
+        vmp_cfg_dot_part_free(&part);
+        free(buf.data);
+
+        return counts;
+    }
+
+    struct vmp_cfg_dot_render_task
+    {
+        struct vmp_cfg_dot_render *render;
+        char        cmd[MAX_PATH * 2 + 64];
+    };
+
+    static void vmp_cfg_dot_render_proc(void *arg)
+    {
+        struct vmp_cfg_dot_render_task *task = (struct vmp_cfg_dot_render_task *)arg;
+        STARTUPINFO si = { 0 };
+        PROCESS_INFORMATION pi = { 0 };
+
+        si.cb = sizeof (si);
+        if (!CreateProcess(NULL, task->cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi))
+        {
+            printf("vmp_cfg_dot_render_proc(%s) failed with CreateProcess(). %s:%d\n", task->cmd, __FILE__, __LINE__);
+            InterlockedIncrement(&task->render->fail_counts);
+            free(task);
+            return;
+        }
+
+        WaitForSingleObject(pi.hProcess, INFINITE);
+        CloseHandle(pi.hThread);
+        CloseHandle(pi.hProcess);
+        InterlockedIncrement(&task->render->done_counts);
+        free(task);
+    }
+
+    struct vmp_cfg_dot_render *vmp_cfg_dot_render_create(int procs)
+    {
+        struct vmp_cfg_dot_render *render = (struct vmp_cfg_dot_render *)calloc(1, sizeof (render[0]));
+
+        if (!render)
+        {
+            printf("vmp_cfg_dot_render_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        render->pool = vmp_tpool_create(procs);
+        if (!render->pool)
+        {
+            printf("vmp_cfg_dot_render_create() failed with vmp_tpool_create(). %s:%d\n", __FILE__, __LINE__);
+            free(render);
+            return NULL;
+        }
+
+        return render;
+    }
+
+    int vmp_cfg_dot_render_submit(struct vmp_cfg_dot_render *render, const char *dot_filename)
+    {
+        struct vmp_cfg_dot_render_task *task;
+        char png[MAX_PATH], *s;
+
+        task = (struct vmp_cfg_dot_render_task *)malloc(sizeof (task[0]));
+        if (!task)
+        {
+            printf("vmp_cfg_dot_render_submit() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        task->render = render;
+
+        strncpy(png, dot_filename, sizeof (png) - 5);
+        png[sizeof (png) - 5] = 0;
+        s = strrchr(png, '.');
+        strcpy((s && !strchr(s, '\\')) ? s : png + strlen(png), ".png");
+        _snprintf(task->cmd, sizeof (task->cmd) - 1, "dot.exe -Tpng -o \"%s\" \"%s\"", png, dot_filename);
+        task->cmd[sizeof (task->cmd) - 1] = 0;
+
+        if (vmp_tpool_submit(render->pool, vmp_cfg_dot_render_proc, task))
+        {
+            printf("vmp_cfg_dot_render_submit() failed with vmp_tpool_submit(). %s:%d\n", __FILE__, __LINE__);
+            free(task);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int vmp_cfg_dot_render_destroy(struct vmp_cfg_dot_render *render)
+    {
+        if (!render)
+            return 0;
+
+        vmp_tpool_destroy(render->pool);
+        if (render->fail_counts)
+        {
+            printf("vmp_cfg_dot_render: %ld png rendered, %ld failed\n", (long)render->done_counts, (long)render->fail_counts);
+        }
+        free(render);
+
+        return 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
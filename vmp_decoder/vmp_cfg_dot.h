@@ -0,0 +1,63 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_cfg_dot_h__
+#define __vmp_cfg_dot_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vmp_cfg_csr.h"
+#include "vmp_tpool.h"
+
+// 整个cfg写成一个dot文件的话，graphviz在大图上基本跑不出来，所以按cluster分开输出:
+//  hub:        vmp_cfg_dom识别出来的dispatcher，还有入度或者出度不小于hub_min的节点(比如被到处调用的导入函数)，
+//              单独成一个cluster，在图里只画成一个汇总节点
+//  cluster:    从root和每个hub的后继(handler入口)开始，不经过hub能走到的节点，先到先得
+//  总览图:     每个cluster一个节点，cluster之间的边合并，权重是执行次数之和
+//  cluster图:  cluster内部的block，循环头是双边框，指向hub和其他cluster的边只画到一个汇总节点
+#define VMP_CFG_DOT_HUB_MIN         16
+// 超过这么多节点的cluster只写dot，不渲染
+#define VMP_CFG_DOT_RENDER_MAX      3000
+// 写文件的缓冲区大小
+#define VMP_CFG_DOT_BUF_SIZE        (256 * 1024)
+
+struct vmp_cfg_dot_param
+{
+    // 总览图的文件名
+    const char  *filename;
+    // cluster图放在这个目录下，文件名是 cluster编号_入口名字.dot
+    const char  *dir;
+    // 0表示用VMP_CFG_DOT_HUB_MIN
+    int         hub_min;
+    // 不为空的话，写完以后把每个dot文件交给它渲染成png
+    struct vmp_cfg_dot_render *render;
+};
+
+/*
+@return     写出来的cluster个数(不含hub)
+            -1          failure */
+int vmp_cfg_dot_write(struct vmp_cfg_csr *csr, struct vmp_cfg_dot_param *param);
+
+// 后台渲染: 线程池里的每个线程同时最多跑一个dot.exe进程，提交以后马上返回
+typedef struct vmp_cfg_dot_render
+{
+    struct vmp_tpool *pool;
+    volatile LONG   done_counts;
+    volatile LONG   fail_counts;
+} vmp_cfg_dot_render_t;
+
+/* @procs   同时运行的dot.exe个数，<=0表示用CPU核数 */
+struct vmp_cfg_dot_render *vmp_cfg_dot_render_create(int procs);
+/* 提交一个dot文件，输出是同名的.png */
+int vmp_cfg_dot_render_submit(struct vmp_cfg_dot_render *render, const char *dot_filename);
+/* 等已经提交的渲染都结束 */
+int vmp_cfg_dot_render_destroy(struct vmp_cfg_dot_render *render);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,160 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_cfg_event.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+    static const char *vmp_cfg_event_type_name[] = { "", "node", "edge", "extend", "split" };
+    static const char *vmp_cfg_event_kind_name[] = { "true", "jmp", "fall" };
+
+    static inline uint32_t vmp_cfg_event_addr(struct vmp_cfg_event_sink *sink, struct vmp_cfg_node *node)
+    {
+        return sink->param.addr_func ? sink->param.addr_func(sink->param.addr_arg, node->id) : (uint32_t)(uintptr_t)node->id;
+    }
+
+    static void vmp_cfg_event_write_jsonl(struct vmp_cfg_event_sink *sink, struct vmp_cfg_event *ev)
+    {
+        char line[256], *p = line;
+
+        p += sprintf(p, "{\"seq\":%llu,\"ev\":\"%s\",\"node\":%u,\"addr\":\"0x%08x\",\"len\":%u",
+            (unsigned long long)ev->seq, vmp_cfg_event_type_name[ev->type], ev->node, ev->addr, ev->len);
+
+        switch (ev->type)
+        {
+        case VMP_CFG_EVENT_NODE:
+            p += sprintf(p, ",\"iat\":%d", (ev->flags & VMP_CFG_EVENT_IAT) ? 1 : 0);
+            break;
+
+        case VMP_CFG_EVENT_EDGE:
+            p += sprintf(p, ",\"to\":%u,\"to_addr\":\"0x%08x\",\"kind\":\"%s\"",
+                ev->other, ev->other_addr, vmp_cfg_event_kind_name[ev->kind]);
+            break;
+
+        case VMP_CFG_EVENT_SPLIT:
+            p += sprintf(p, ",\"tail\":%u,\"tail_addr\":\"0x%08x\",\"tail_len\":%u", ev->other, ev->other_addr, ev->other_len);
+            break;
+        }
+
+        *p++ = '}';
+        *p++ = '\n';
+        fwrite(line, p - line, 1, sink->fp);
+    }
+
+    // 挂在vmp_cfg->notify上
+    static void vmp_cfg_event_notify(void *arg, int type, struct vmp_cfg_node *node, struct vmp_cfg_node *other, int kind)
+    {
+        struct vmp_cfg_event_sink *sink = (struct vmp_cfg_event_sink *)arg;
+        struct vmp_cfg_event ev = { 0 };
+
+        ev.type = (uint8_t)type;
+        ev.kind = (uint8_t)kind;
+        ev.flags = node->debug.external_call ? VMP_CFG_EVENT_IAT : 0;
+        ev.node = node->index;
+        ev.addr = vmp_cfg_event_addr(sink, node);
+        ev.len = node->len;
+        ev.other = (uint32_t)-1;
+        if (other)
+        {
+            ev.other = other->index;
+            ev.other_addr = vmp_cfg_event_addr(sink, other);
+            ev.other_len = other->len;
+        }
+        ev.seq = sink->seq++;
+
+        if (sink->fp)
+        {
+            if (sink->param.fmt == VMP_CFG_EVENT_FMT_BIN)
+                fwrite(&ev, sizeof (ev), 1, sink->fp);
+            else
+                vmp_cfg_event_write_jsonl(sink, &ev);
+        }
+
+        if (sink->param.func)
+            sink->param.func(sink->param.arg, &ev);
+    }
+
+    struct vmp_cfg_event_sink *vmp_cfg_event_create(struct vmp_cfg_event_param *param)
+    {
+        struct vmp_cfg_event_sink *sink;
+        char head[16] = VMP_CFG_EVENT_MAGIC;
+
+        sink = (struct vmp_cfg_event_sink *)calloc(1, sizeof (sink[0]));
+        if (!sink)
+        {
+            printf("vmp_cfg_event_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+        sink->param = *param;
+        sink->flush_tick = GetTickCount();
+
+        if (!param->filename)
+            return sink;
+
+        sink->fp = fopen(param->filename, (param->fmt == VMP_CFG_EVENT_FMT_BIN) ? "wb" : "w");
+        sink->buf = (char *)malloc(VMP_CFG_EVENT_BUF_SIZE);
+        if (!sink->fp || !sink->buf)
+        {
+            printf("vmp_cfg_event_create(%s) failed with fopen(). %s:%d\n", param->filename, __FILE__, __LINE__);
+            vmp_cfg_event_destroy(sink);
+            return NULL;
+        }
+        setvbuf(sink->fp, sink->buf, _IOFBF, VMP_CFG_EVENT_BUF_SIZE);
+
+        if (param->fmt == VMP_CFG_EVENT_FMT_BIN)
+        {
+            *(uint16_t *)(head + 4) = VMP_CFG_EVENT_VERSION;
+            *(uint16_t *)(head + 6) = sizeof (struct vmp_cfg_event);
+            fwrite(head, sizeof (head), 1, sink->fp);
+        }
+
+        return sink;
+    }
+
+    int vmp_cfg_event_destroy(struct vmp_cfg_event_sink *sink)
+    {
+        if (!sink)
+            return 0;
+
+        if (sink->fp)
+            fclose(sink->fp);
+        free(sink->buf);
+        free(sink);
+
+        return 0;
+    }
+
+    int vmp_cfg_event_attach(struct vmp_cfg_event_sink *sink, struct vmp_cfg *cfg)
+    {
+        cfg->notify = vmp_cfg_event_notify;
+        cfg->notify_arg = sink;
+
+        return 0;
+    }
+
+    int vmp_cfg_event_flush(struct vmp_cfg_event_sink *sink)
+    {
+        sink->flush_seq = sink->seq;
+        sink->flush_tick = GetTickCount();
+
+        return sink->fp ? fflush(sink->fp) : 0;
+    }
+
+    int vmp_cfg_event_tick(struct vmp_cfg_event_sink *sink)
+    {
+        if ((sink->seq == sink->flush_seq) || (GetTickCount() - sink->flush_tick < VMP_CFG_EVENT_FLUSH_MS))
+            return 0;
+
+        return vmp_cfg_event_flush(sink);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,94 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_cfg_event_h__
+#define __vmp_cfg_event_h__
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "vmp_cfg.h"
+#include "vmp_cfg_csr.h"
+
+// 运行过程中把cfg的变化实时输出出去，下游(IDA导入脚本之类的)不用等vmp_decoder_run结束
+// 每个事件是一条定长的记录，可以写到文件、管道(\\.\pipe\xxx，需要对方先创建好)，或者交给回调
+//  node:   新建节点，flags里有VMP_CFG_EVENT_IAT
+//  edge:   新加一条边，other是目标，kind是VMP_CFG_EDGE_xxx；已有的边再执行不再输出
+//  extend: block变长，len是新的长度
+//  split:  node在other_addr处被切开，len是前半部分的长度，other是后半部分(它的node事件已经先输出了)，
+//          other_len是后半部分的长度，node所有的出边都挪到了other上，node -> other的fall边随后输出
+// 节点用创建顺序的编号(从0开始)表示，地址是IDA地址
+#define VMP_CFG_EVENT_NODE          VMP_CFG_NOTIFY_NODE
+#define VMP_CFG_EVENT_EDGE          VMP_CFG_NOTIFY_EDGE
+#define VMP_CFG_EVENT_EXTEND        VMP_CFG_NOTIFY_EXTEND
+#define VMP_CFG_EVENT_SPLIT         VMP_CFG_NOTIFY_SPLIT
+
+#define VMP_CFG_EVENT_IAT           0x01
+
+#define VMP_CFG_EVENT_FMT_JSONL     0
+#define VMP_CFG_EVENT_FMT_BIN       1
+
+// 二进制格式: 16字节的头 "VMPE" + u16 version + u16 record_size + 8字节保留，后面全是struct vmp_cfg_event
+#define VMP_CFG_EVENT_MAGIC         "VMPE"
+#define VMP_CFG_EVENT_VERSION       1
+// 有没写出去的事件时，最多隔这么久刷一次
+#define VMP_CFG_EVENT_FLUSH_MS      200
+#define VMP_CFG_EVENT_BUF_SIZE      (64 * 1024)
+
+typedef struct vmp_cfg_event
+{
+    uint8_t     type;
+    uint8_t     kind;
+    uint16_t    flags;
+    uint32_t    node;
+    uint32_t    addr;
+    uint32_t    len;
+    uint32_t    other;      // 没有的话是0xffffffff
+    uint32_t    other_addr;
+    uint32_t    other_len;
+    uint32_t    reserved;
+    uint64_t    seq;        // 事件序号，从0开始
+} vmp_cfg_event_t;
+
+typedef void (*vmp_cfg_event_func)(void *arg, const struct vmp_cfg_event *ev);
+
+struct vmp_cfg_event_param
+{
+    // 为空的话不写文件
+    const char  *filename;
+    int         fmt;
+    // 不为空的话每个事件都调用一次，和文件可以同时用
+    vmp_cfg_event_func func;
+    void        *arg;
+    // 地址转换，NULL的话直接取低32位
+    vmp_cfg_csr_addr_func addr_func;
+    void        *addr_arg;
+};
+
+typedef struct vmp_cfg_event_sink
+{
+    struct vmp_cfg_event_param param;
+    FILE        *fp;
+    char        *buf;
+    uint64_t    seq;
+    // 上次刷新时的序号和时间
+    uint64_t    flush_seq;
+    DWORD       flush_tick;
+} vmp_cfg_event_sink_t;
+
+struct vmp_cfg_event_sink *vmp_cfg_event_create(struct vmp_cfg_event_param *param);
+int vmp_cfg_event_destroy(struct vmp_cfg_event_sink *sink);
+/* 挂到cfg上，以后cfg的变化都会输出 */
+int vmp_cfg_event_attach(struct vmp_cfg_event_sink *sink, struct vmp_cfg *cfg);
+/* 在主循环里调用，离上次刷新超过VMP_CFG_EVENT_FLUSH_MS就把缓冲的事件写出去 */
+int vmp_cfg_event_tick(struct vmp_cfg_event_sink *sink);
+int vmp_cfg_event_flush(struct vmp_cfg_event_sink *sink);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -16,11 +16,28 @@ extern "C" {
 #include "macro_list.h"
 #include "vmp_hlp.h"
 #include "x86_emu.h"
+#include "vmp_trace.h"
+#include "vmp_vm.h"
+#include "vmp_cfg.h"
+#include "vmp_cfg_csr.h"
+#include "vmp_cfg_dot.h"
+#include "vmp_cfg_dom.h"
+#include "vmp_cfg_event.h"
+#include "vmp_cache.h"
+#include "vmp_hlib.h"
+#include "vmp_htab.h"
+#include "vmp_scan.h"
+#include "vmp_tpool.h"
+#include "vmp_explore.h"
 #include <time.h>
 
 #define print_err   printf
 #define time2s(_a)   ""
 
+// 总览图，每个cluster的图放在VMP_DECODER_DOT_DIR下面
+#define VMP_DECODER_DOT_FILENAME    "1.dot"
+#define VMP_DECODER_DOT_DIR         "1.dot.d"
+
 
     typedef struct vmp_decoder
     {
@@ -31,7 +48,6 @@ extern "C" {
         xed_int64_t fake_base;
         xed_bool_t resync;  /* turn on/off symbol-based resynchronization */
         xed_bool_t line_numbers;    /* control for printing file/line info */
-        FILE *dot_graph_output;
 
         xed_format_options_t format_options;
         xed_operand_enum_t operand;
@@ -58,13 +74,14 @@ extern "C" {
         xed_machine_mode_enum_t mmode;
         xed_address_width_enum_t stack_addr_width;
 
-        int label_counts;
-
         struct {
             int     dump_inst;
             int     dump_dot_graph;
 
             struct vmp_hlp *hlp;
+            struct vmp_trace *trace;
+            // trace是VM模式时，用来识别dispatcher和handler
+            struct vmp_vm *vm;
         } debug;
 
         struct {
@@ -82,109 +99,159 @@ extern "C" {
 
         struct x86_emu_mod *emu;
 
+        struct vmp_cfg *cfg;
+        // 不为空的话，运行结束时把cfg按CSR格式写到这个文件
+        const char *cfg_csr_filename;
+        // 不为空的话，dot文件写完以后在后台渲染成png
+        struct vmp_cfg_dot_render *dot_render;
+        // 不为空的话，cfg的每次变化都实时输出
+        struct vmp_cfg_event_sink *cfg_events;
+        // 不为空的话，VM入口和指令长度先从缓存里找，运行结束时写回去
+        struct vmp_cache *cache;
+        // handler库，要在VM模式下用
+        struct vmp_hlib *hlib;
+        // 不为空的话，前几次分发以后找handler表，把所有handler预解码
+        struct vmp_htab *htab;
+        // vmp_decoder_scan_entries扫出来的所有VM入口，scanned为0的时候还没扫过
+        int scanned;
+        struct vmp_scan_entry *entries;
+        int entry_counts;
+
+        // vmp_decoder_run_entries给每个VM入口建的worker才不为空，worker和parent共用PE镜像、
+        // vmp段和分析缓存(只读)，自己有模拟器(写镜像时写时复制)和cfg
+        struct vmp_decoder *parent;
+        // worker新解码的指令，key: IDA地址，value: 长度，跑完以后写回parent的缓存
+        struct mhash64 decoded;
+
+        // vmp_decoder_explore的worker才不为空，explore_worker是线程号
+        struct vmp_explore *explore;
+        int explore_worker;
+        // 当前任务分叉过几次，已经跑了多少条指令，最后一次走到新的block/边时跑到了第几条
+        int explore_depth;
+        int explore_insts;
+        int explore_fresh;
+        // 这个worker所有任务加起来跑的指令数，每VMP_EXPLORE_TICK条报一次
+        uint32_t explore_total;
+
+        // 不为空的话，dot文件写到这个目录下
+        char out_dir[MAX_PATH];
+        // vmp_decoder_run最多跑多少条指令、多少毫秒，<=0时不限制，hit是不是因为超了预算停下来的
         struct {
-            struct vmp_cfg_node *start;
-
-            struct vmp_cfg_node *list;
-            int counts;
-        } cfg;
+            int max_insts;
+            int max_ms;
+            int hit;
+        } budget;
+        // vmp_decoder_run跑了多少条指令
+        uint64_t insts;
     } vmp_decoder_t;
 
-    struct vmp_cfg_node_link
-    {
-        struct vmp_cfg_node_link *next;
-        struct vmp_cfg_node *node;
-    };
-
-    typedef struct vmp_cfg_node
-    {
-        uint8_t *id;
-        char name[32];
-        int len;
-
-        struct {
-            unsigned already_dot_dump   : 1;
-            unsigned vmp                : 16;
-            unsigned external_call      : 1;
-        } debug;
-
-        struct {
-            struct vmp_cfg_node *next;
-            struct vmp_cfg_node *prev;
-        } in_list;
-
-        struct 
-        {
-            struct vmp_cfg_node_link *list;
-            int count;
-        } trues;
-
-        struct
-        {
-        } falses;
-
-        struct
-        {
-            struct vmp_cfg_node_link *list;
-            int count;
-        } jmps;
-    } vmp_cfg_node_t;
-
 #define vmp_stack_push(_st, _val)       (_st[++_st##_i] = _val)
 #define vmp_stack_is_empty(_st)         (_st##_i == -1)
 #define vmp_stack_pop(_st)               (vmp_stack_is_empty(_st) ? NULL:_st[_st##_i--])
 #define vmp_stack_top(_st)              (vmp_stack_is_empty(_st) ?  NULL:_st[_st##_i])
 
     static int vmp_addr_in_vmp_section(struct vmp_decoder *decoder, unsigned char *addr);
-    static struct vmp_cfg_node *vmp_cfg_find(struct vmp_decoder *decoder, uint8_t *id);
-    static int vmp_cfg_add_inst(struct vmp_cfg_node *cfg, uint8_t *addr, int len);
+    static int vmp_decoder_inst_boundary(struct vmp_decoder *decoder, uint8_t *from, uint8_t *to);
+    static int vmp_decoder_cached_len(struct vmp_decoder *decoder, uint8_t *addr);
+    static int vmp_decoder_explore_fork(struct vmp_decoder *decoder, struct vmp_cfg_node *from, x86_emu_flow_analysis_t *flow);
     unsigned char *vmp_decoder_find_vmp_start_addr(struct vmp_decoder *decoder);
-    static int vmp_cfg_add_edges(struct vmp_decoder *decoder,
-        struct vmp_cfg_node *from, struct vmp_cfg_node *to, int jmp_type);
 #define vmp_sym_addr(_decoder, _address)  (UINT64)(pe_loader_fa2rva(_decoder->pe_mod, (DWORD64)_address))
 
-    struct vmp_decoder *vmp_decoder_create(char *filename, DWORD vmp_start_va, int dump_pe)
+    // xed的表是整个进程共用的，只初始化一次
+    static INIT_ONCE vmp_decoder_xed_once = INIT_ONCE_STATIC_INIT;
+    // 同一个进程里创建过几个decoder，用来给备份文件起名
+    static volatile LONG vmp_decoder_seq;
+
+    static BOOL CALLBACK vmp_decoder_xed_init(PINIT_ONCE once, PVOID param, PVOID *ctx)
     {
-        struct vmp_decoder *mod = (struct vmp_decoder *)calloc(1, sizeof(mod[0]));
-        char bak_filename[128];
+        xed_tables_init();
+        return TRUE;
+    }
+
+    struct vmp_decoder *vmp_decoder_create(char *filename, DWORD vmp_start_va, int dump_pe, const char *cache_dir)
+    {
+        struct vmp_decoder_create_param param = { 0 };
+
+        param.filename = filename;
+        param.vmp_start_va = vmp_start_va;
+        param.dump_pe = dump_pe;
+        param.cache_dir = cache_dir;
+
+        return vmp_decoder_create2(&param);
+    }
+
+    // pe_mod、emu、cfg不为空的话是vmp_decoder_reset留下来的，重用它们的缓冲
+    static int vmp_decoder_init(struct vmp_decoder *mod, struct vmp_decoder_create_param *param)
+    {
+        const char *filename = param->filename, *cache_dir = param->cache_dir;
+        DWORD vmp_start_va = param->vmp_start_va;
+        char bak_filename[MAX_PATH + 16] = { 0 };
+        uint32_t cache_va;
+        LONG seq;
+        struct vmp_scan_entry *entries;
+        int entry_counts;
 
         if (!filename)
         {
             printf("vmp_decoder_create() failed with invalid param. %s:%d\n", __FILE__, __LINE__);
-            return NULL;
-        }
-
-        if (!mod)
-        {
-            printf("vmp_decoder_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
-            return NULL;
+            return -1;
         }
 
         // 因为我们需要对去壳的vmp做地址的重映射工作，所以我们把文件从硬盘映射到内存不能是
         // 只读的，但是假如改成读写方式来映射，那么我在修改了重定位表后，也会同时修改文件
         // 所以我这里对命令输入的文件做了一个备份，然后修改这个备份的文件即可。
-        sprintf(bak_filename, "%s.bak", filename);
-        CopyFile(filename, bak_filename, FALSE);
+        // 同一个进程里几个decoder同时分析同一个文件时，备份文件要分开，不然后面的CopyFile会
+        // 覆盖前面已经映射了的文件。文件已经读到内存里的话直接在内存里展开，不用备份
+        if (param->data && mod->pe_mod)
+        {
+            if (pe_loader_reset(mod->pe_mod, param->data, param->size))
+            {
+                printf("vmp_decoder_create() failed with pe_loader_reset(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+        }
+        else if (param->data)
+        {
+            mod->pe_mod = pe_loader_create_mem(param->data, param->size);
+        }
+        else
+        {
+            if (mod->pe_mod)
+            {
+                pe_loader_destroy(mod->pe_mod);
+                mod->pe_mod = NULL;
+            }
+
+            if ((seq = InterlockedIncrement(&vmp_decoder_seq)) == 1)
+                _snprintf(bak_filename, sizeof (bak_filename) - 1, "%s.bak", filename);
+            else
+                _snprintf(bak_filename, sizeof (bak_filename) - 1, "%s.%ld.bak", filename, seq);
+            CopyFile(filename, bak_filename, FALSE);
 
-        mod->pe_mod = pe_loader_create(bak_filename);
+            mod->pe_mod = pe_loader_create(bak_filename);
+        }
         if (NULL == mod->pe_mod)
         {
             printf("vmp_decoder_create() failed with pe_loader_create(). %s:%d\n", __FILE__, __LINE__);
-            goto fail_label;
+            return -1;
         }
 
-        if (dump_pe)
+        if (param->dump_pe)
         {
             pe_loader_dump(mod->pe_mod);
-            return 0;
+            return -1;
         }
 
 
         mod->image_base = (unsigned char *)mod->pe_mod->image_base;
 
         strcpy_s(mod->filename, filename);
+        if (param->out_dir)
+        {
+            strcpy_s(mod->out_dir, param->out_dir);
+        }
 
-        xed_tables_init();
+        InitOnceExecuteOnce(&vmp_decoder_xed_once, vmp_decoder_xed_init, NULL, NULL);
         mod->mmode = XED_MACHINE_MODE_LEGACY_32;
         mod->stack_addr_width = XED_ADDRESS_WIDTH_32b;
 
@@ -192,9 +259,9 @@ extern "C" {
         mod->format_options.write_mask_curly_k0 = 1;
         mod->format_options.lowercase_hex = 1;
 
-        mod->debug.dump_inst = 1;
-        mod->debug.hlp = vmp_hlp_create(filename);
-        if (!mod->debug.hlp)
+        // 符号只在输出反汇编的时候用
+        mod->debug.dump_inst = !param->quiet;
+        if (mod->debug.dump_inst && !(mod->debug.hlp = vmp_hlp_create((char *)filename)))
         {
             printf("vmp_decoder_create() failed when vmp_hlp_create(). %s:%d\r\n", __FILE__, __LINE__);
         }
@@ -212,23 +279,60 @@ extern "C" {
         if (!mod->vmp_sections.counts)
         {
             printf("vmp_decoder_create() failed with not found vmp section. %s:%d\r\n", __FILE__, __LINE__);
-            goto fail_label;
+            return -1;
         }
 
-        struct x86_emu_create_param param;
+        struct x86_emu_create_param emu_param;
 
 #define FAKE_IMAGE_BASE                 0x400000
 
-        param.pe_mod = mod->pe_mod;
-        param.hlp = mod->debug.hlp;
+        memset(&emu_param, 0, sizeof (emu_param));
+        emu_param.pe_mod = mod->pe_mod;
+        emu_param.hlp = mod->debug.hlp;
+        emu_param.quiet = param->quiet;
 
-        mod->emu = x86_emu_create(&param);
+        if (mod->emu ? x86_emu_reset(mod->emu, &emu_param) : !(mod->emu = x86_emu_create(&emu_param)))
+        {
+            printf("vmp_decoder_create() failed with x86_emu_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (mod->cfg)
+        {
+            vmp_cfg_reset(mod->cfg);
+        }
+        else if (!(mod->cfg = vmp_cfg_create()))
+        {
+            printf("vmp_decoder_create() failed with vmp_cfg_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
 
         mod->entry_of_point = ((unsigned char *)mod->image_base + pe_loader_entry_point(mod->pe_mod));
 
-        if (!vmp_start_va)
+        // 缓存打不开的话不影响分析，只是这次没有缓存
+        if (cache_dir && !(mod->cache = vmp_cache_open(cache_dir, filename)))
+        {
+            printf("vmp_decoder_create() failed with vmp_cache_open(), run without cache. %s:%d\n", __FILE__, __LINE__);
+        }
+
+        if (!vmp_start_va && mod->cache && (cache_va = vmp_cache_entry(mod->cache)))
+        {
+            mod->vmp_act_start_vaddr = ((unsigned char *)mod->image_base + (cache_va - FAKE_IMAGE_BASE));
+            printf("vmp start address %08x from cache. %s:%d\n", cache_va, __FILE__, __LINE__);
+        }
+        else if (!vmp_start_va)
         {
             mod->vmp_act_start_vaddr  = vmp_decoder_find_vmp_start_addr (mod);
+            // 从PE入口走不到vmp段的话，用扫出来的第一个入口
+            if (!mod->vmp_act_start_vaddr && !vmp_decoder_scan_entries(mod, &entries, &entry_counts) && entry_counts)
+            {
+                mod->vmp_act_start_vaddr = ((unsigned char *)mod->image_base + (entries[0].addr - FAKE_IMAGE_BASE));
+                printf("vmp start address %08x from entry scan. %s:%d\n", entries[0].addr, __FILE__, __LINE__);
+            }
+            if (mod->vmp_act_start_vaddr && mod->cache)
+            {
+                vmp_cache_add_entry(mod->cache, x86_emu_ida_addr(mod->emu, mod->vmp_act_start_vaddr));
+            }
         }
         else
         {
@@ -238,208 +342,791 @@ extern "C" {
         if (!mod->vmp_act_start_vaddr)
         {
             printf("vmp_decoder_create() failed with find vmp start address(). %s:%d\n", __FILE__, __LINE__);
-            goto fail_label;
+            return -1;
         }
 
         mod->vmp_start_va = vmp_start_va;
 
-        return mod;
+        return 0;
+    }
 
-    fail_label:
-        if (mod)
+    struct vmp_decoder *vmp_decoder_create2(struct vmp_decoder_create_param *param)
+    {
+        struct vmp_decoder *mod = (struct vmp_decoder *)calloc(1, sizeof(mod[0]));
+
+        if (!mod)
+        {
+            printf("vmp_decoder_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (vmp_decoder_init(mod, param))
         {
             vmp_decoder_destroy(mod);
+            return NULL;
         }
-        return NULL;
+
+        return mod;
+    }
+
+    // 释放跟着样本走的东西，PE镜像、模拟器和cfg留给destroy或者reset处理
+    static void vmp_decoder_release(struct vmp_decoder *decoder)
+    {
+        // vm销毁时还要读模拟器的寄存器，要在emu前面
+        if (decoder->debug.vm)
+        {
+            vmp_vm_destroy(decoder->debug.vm);
+            decoder->debug.vm = NULL;
+        }
+
+        if (decoder->debug.trace)
+        {
+            vmp_trace_destroy(decoder->debug.trace);
+            decoder->debug.trace = NULL;
+        }
+
+        // 等后台的dot.exe都跑完
+        if (decoder->dot_render)
+        {
+            vmp_cfg_dot_render_destroy(decoder->dot_render);
+            decoder->dot_render = NULL;
+        }
+
+        if (decoder->cfg_events)
+        {
+            vmp_cfg_event_destroy(decoder->cfg_events);
+            decoder->cfg_events = NULL;
+        }
+
+        if (decoder->cache)
+        {
+            vmp_cache_close(decoder->cache);
+            decoder->cache = NULL;
+        }
+
+        if (decoder->hlib)
+        {
+            vmp_hlib_close(decoder->hlib);
+            decoder->hlib = NULL;
+        }
+
+        if (decoder->htab)
+        {
+            vmp_htab_destroy(decoder->htab);
+            decoder->htab = NULL;
+        }
+
+        if (decoder->debug.hlp)
+        {
+            vmp_hlp_destroy(decoder->debug.hlp);
+            decoder->debug.hlp = NULL;
+        }
+
+        free(decoder->entries);
+        decoder->entries = NULL;
     }
 
     void vmp_decoder_destroy(struct vmp_decoder *decoder)
     {
         if (decoder)
         {
+            vmp_decoder_release(decoder);
+
             if (decoder->emu)
             {
                 x86_emu_destroy(decoder->emu);
                 decoder->emu = NULL;
             }
+
+            if (decoder->cfg)
+            {
+                vmp_cfg_destroy(decoder->cfg);
+                decoder->cfg = NULL;
+            }
+
+            if (decoder->pe_mod)
+            {
+                pe_loader_destroy(decoder->pe_mod);
+                decoder->pe_mod = NULL;
+            }
             free(decoder);
         }
     }
 
-#define xed_success(ret)                (ret == XED_ERROR_NONE)
-
-    int vmp_xed_disassembly_callback_function(xed_uint64_t address,
-        char *sym_buf, xed_uint32_t buf_size, xed_uint64_t *offset, void *ctx)
+    int vmp_decoder_reset(struct vmp_decoder *decoder, struct vmp_decoder_create_param *param)
     {
-        struct vmp_decoder *decoder = (struct vmp_decoder *)ctx;
-        int ret;
+        struct pe_loader *pe_mod = decoder->pe_mod;
+        struct x86_emu_mod *emu = decoder->emu;
+        struct vmp_cfg *cfg = decoder->cfg;
 
-        sym_buf[0] = 0;
-        ret = vmp_hlp_get_symbol(decoder->debug.hlp, (uint64_t)address - (uint64_t)decoder->image_base, sym_buf, buf_size, offset);
-        if (ret)
+        vmp_decoder_release(decoder);
+
+        // 上一个样本设置过的trace、预算、输出文件都不留
+        memset(decoder, 0, sizeof (decoder[0]));
+        decoder->pe_mod = pe_mod;
+        decoder->emu = emu;
+        decoder->cfg = cfg;
+
+        if (vmp_decoder_init(decoder, param))
         {
-            //printf("sym[%s]\n", sym_buf);
+            printf("vmp_decoder_reset() failed with vmp_decoder_init(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
         }
 
-        return ret;
+        return 0;
     }
 
-    int vmp_decoder_format_inst(struct vmp_decoder *decoder,
-        xed_decoded_inst_t *xedd, xed_uint64_t runtime_instruction_address, char *buf, int buf_size)
+    typedef struct vmp_decoder_pool
     {
-        int ret;
+        SRWLOCK             lock;
+        struct vmp_decoder  *idle[VMP_DECODER_POOL_MAX];
+        int                 counts;
+        int                 max;
+    } vmp_decoder_pool_t;
 
-        xed_print_info_t pi;
-        xed_init_print_info(&pi);
+    struct vmp_decoder_pool *vmp_decoder_pool_create(int max)
+    {
+        struct vmp_decoder_pool *pool = (struct vmp_decoder_pool *)calloc(1, sizeof (pool[0]));
 
-        pi.p = xedd;
-        pi.blen = buf_size;
-        pi.buf = buf;
+        if (!pool)
+        {
+            printf("vmp_decoder_pool_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
 
-        pi.context = decoder;
+        InitializeSRWLock(&pool->lock);
+        pool->max = ((max <= 0) || (max > VMP_DECODER_POOL_MAX)) ? VMP_DECODER_POOL_MAX : max;
 
-        pi.disassembly_callback = vmp_xed_disassembly_callback_function; //xed_disassembly_callback_function;
-        pi.runtime_address = runtime_instruction_address;
-        //use default format option, INTEL, dst operand on the left
-        pi.format_options_valid = 1;
-        pi.format_options = decoder->format_options;
-        pi.buf[0] = 0;
+        return pool;
+    }
 
-        ret = xed_format_generic(&pi);
-        if (!ret)
+    void vmp_decoder_pool_destroy(struct vmp_decoder_pool *pool)
+    {
+        int i;
+
+        if (pool)
         {
-            pi.blen = xed_strncpy(pi.buf, "Error disassembing ", pi.blen);
-            pi.blen = xed_strncat(pi.buf, xed_syntax_enum_t2str(pi.syntax), pi.blen);
-            pi.blen = xed_strncat(pi.buf, " syntax.", pi.blen);
+            for (i = 0; i < pool->counts; i++)
+            {
+                vmp_decoder_destroy(pool->idle[i]);
+            }
+            free(pool);
         }
-
-        return 0;
     }
 
-    struct vmp_cfg_node *vmp_cfg_create (struct vmp_decoder *decoder, unsigned char *addr, int iat_call)
+    struct vmp_decoder *vmp_decoder_pool_get(struct vmp_decoder_pool *pool, struct vmp_decoder_create_param *param)
     {
-        struct vmp_cfg_node *node = NULL;
-        //char sym_name[128];
+        struct vmp_decoder *decoder = NULL;
 
-        node = (struct vmp_cfg_node *)calloc(1, sizeof (node[0]));
-        if (NULL == node)
+        AcquireSRWLockExclusive(&pool->lock);
+        if (pool->counts > 0)
         {
-            printf("vmp_cfg_create() failed with calloc()");
-            return NULL;
+            decoder = pool->idle[--pool->counts];
         }
+        ReleaseSRWLockExclusive(&pool->lock);
 
-        //if (vmp_hlp_get_symbol(decoder->debug.hlp, addr - decoder->image_base, sym_name, sizeof (sym_name), NULL))
-        if (iat_call)
+        if (!decoder)
         {
-            sprintf(node->name, "%s", ((unsigned char **)addr)[0]);
-            node->debug.external_call = 1;
+            return vmp_decoder_create2(param);
         }
-        else
+
+        // reset失败的实例状态不完整，不再放回池里
+        if (vmp_decoder_reset(decoder, param))
         {
-            sprintf(node->name, "label%d", ++decoder->label_counts);
+            vmp_decoder_destroy(decoder);
+            return NULL;
         }
 
-        node->id = addr;
-
-        mlist_add(decoder->cfg, node, in_list);
-
-        return node;
+        return decoder;
     }
 
-    int vmp_cfg_node_update_vmp(struct vmp_cfg_node *node, int vmp)
+    void vmp_decoder_pool_put(struct vmp_decoder_pool *pool, struct vmp_decoder *decoder)
     {
-        if (!node->debug.vmp)
+        if (!decoder)
+            return;
+
+        // 跟着样本走的东西现在就释放，池里的实例只占着镜像、堆栈和cfg的缓冲
+        vmp_decoder_release(decoder);
+
+        AcquireSRWLockExclusive(&pool->lock);
+        if (pool->counts < pool->max)
         {
-            node->debug.vmp = vmp;
-            sprintf(node->name, "vmp%d", node->debug.vmp);
+            pool->idle[pool->counts++] = decoder;
+            decoder = NULL;
         }
+        ReleaseSRWLockExclusive(&pool->lock);
+
+        vmp_decoder_destroy(decoder);
+    }
+
+    int vmp_decoder_set_cfg_csr(struct vmp_decoder *decoder, const char *filename)
+    {
+        decoder->cfg_csr_filename = filename;
         return 0;
     }
 
-    int vmp_cfg_node__dump(struct vmp_decoder *decoder, struct vmp_cfg_node *node)
+    int vmp_decoder_set_budget(struct vmp_decoder *decoder, int max_insts, int max_ms)
     {
-        struct vmp_cfg_node *list;
-        struct vmp_cfg_node_link *link;
-        int i, j;
+        decoder->budget.max_insts = max_insts;
+        decoder->budget.max_ms = max_ms;
+        return 0;
+    }
 
-        if (node->debug.already_dot_dump)
-            return 0;
+    int vmp_decoder_result(struct vmp_decoder *decoder, struct vmp_decoder_result *result)
+    {
+        memset(result, 0, sizeof (result[0]));
+        result->entry = decoder->vmp_act_start_vaddr ? x86_emu_ida_addr(decoder->emu, decoder->vmp_act_start_vaddr) : 0;
+        result->insts = decoder->insts;
+        result->blocks = decoder->cfg->counts;
+        result->edges = decoder->cfg->edge_counts;
+        result->budget_hit = decoder->budget.hit;
+        return 0;
+    }
 
-        node->debug.already_dot_dump = 1;
+    static uint32_t vmp_decoder_csr_addr(void *arg, uint8_t *addr)
+    {
+        return x86_emu_ida_addr((struct x86_emu_mod *)arg, addr);
+    }
+
+    int vmp_decoder_set_dot_render(struct vmp_decoder *decoder, int procs)
+    {
+        if (decoder->dot_render)
+            return 0;
 
-        for (i = 0, list = decoder->cfg.list; i < decoder->cfg.counts; i++, list = list->in_list.next)
+        decoder->dot_render = vmp_cfg_dot_render_create(procs);
+        if (!decoder->dot_render)
         {
-            if (list->debug.external_call)
-            { 
-                fprintf(decoder->dot_graph_output, " %s [style=\"filled\",color=red, label=%s];\n", list->name, list->name);
-            }
-            else
-            { 
-                fprintf(decoder->dot_graph_output, " %s [label=%s];\n", list->name, list->name);
-            }
+            printf("vmp_decoder_set_dot_render() failed with vmp_cfg_dot_render_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
         }
 
-        for (i = 0, list = decoder->cfg.list; i < decoder->cfg.counts; i++, list = list->in_list.next)
+        return 0;
+    }
+
+    int vmp_decoder_set_hlib(struct vmp_decoder *decoder, const char *dir)
+    {
+        if (!decoder->debug.vm)
         {
-            for (j = 0, link = list->jmps.list; j < list->jmps.count; j++, link = link->next)
-            {
-                fprintf(decoder->dot_graph_output, "%s -> %s;\n", list->name, link->node->name);
-            }
+            printf("vmp_decoder_set_hlib() failed with not in vm trace mode. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
 
-            for (j = 0, link = list->trues.list; j < list->trues.count; j++, link = link->next)
-            {
-                fprintf(decoder->dot_graph_output, "%s -> %s;\n", list->name, link->node->name);
-            }
+        if (!decoder->hlib && !(decoder->hlib = vmp_hlib_open(dir)))
+        {
+            printf("vmp_decoder_set_hlib() failed with vmp_hlib_open(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
         }
+        vmp_vm_set_hlib(decoder->debug.vm, decoder->hlib);
 
         return 0;
     }
 
-    int vmp_cfg_dump (struct vmp_decoder *decoder, struct vmp_cfg_node *start)
+    int vmp_decoder_set_vm_summary(struct vmp_decoder *decoder, int enable)
     {
-        fprintf(decoder->dot_graph_output, "digraph {\n");
-        vmp_cfg_node__dump(decoder, start);
-        fprintf(decoder->dot_graph_output, "}\n");
+        if (!decoder->debug.vm)
+        {
+            printf("vmp_decoder_set_vm_summary() failed with not in vm trace mode. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
 
-        return 0;
+        return vmp_vm_set_summary(decoder->debug.vm, enable);
     }
 
-    int vmp_decoder_dump_inst(struct vmp_decoder *decoder, 
-        xed_decoded_inst_t *xedd,
-        int indent, unsigned char *inst, int inst_len)
+    int vmp_decoder_set_vm_interp(struct vmp_decoder *decoder, int enable)
     {
-        char buf[128];
-        int i;
+        if (!decoder->debug.vm)
+        {
+            printf("vmp_decoder_set_vm_interp() failed with not in vm trace mode. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
 
-        printf("[%p]\t[%08x]", inst, FAKE_IMAGE_BASE + ((int)(inst - decoder->image_base)));
-        for (i = 0; i < indent; i++)
+        return vmp_vm_set_interp(decoder->debug.vm, enable);
+    }
+
+    /* .vmp0和.vmp1是按名字放在固定槽位里的，只有.vmp1的样本槽位0是空的，
+    这里跳过空槽位，把存在的段按顺序拷出来
+    @return     拷出来的段个数
+    */
+    static int vmp_decoder_sections(struct vmp_decoder *decoder, uint8_t **start, int *size, int max)
+    {
+        int i, n = 0;
+
+        for (i = 0; (i < 3) && (n < max); i++)
         {
-            printf("    ");
+            if (!decoder->vmp_sections.start[i] || !decoder->vmp_sections.size[i])
+                continue;
+
+            start[n] = decoder->vmp_sections.start[i];
+            size[n] = decoder->vmp_sections.size[i];
+            n++;
         }
-        for (i = 0; i < inst_len; i++)
+
+        return n;
+    }
+
+    int vmp_decoder_set_handler_table(struct vmp_decoder *decoder, int threads)
+    {
+        struct vmp_htab_param param;
+
+        if (!decoder->debug.vm)
         {
-            printf ("%02x ", inst[i]);
+            printf("vmp_decoder_set_handler_table() failed with not in vm trace mode. %s:%d\n", __FILE__, __LINE__);
+            return -1;
         }
-        for (i = inst_len; i < 14; i++)
+
+        if (decoder->htab)
+            return 0;
+
+        memset(&param, 0, sizeof (param));
+        param.image_base = decoder->image_base;
+        param.pe_image_base = decoder->pe_mod->fake_image_base;
+        param.threads = threads;
+        param.sec_counts = vmp_decoder_sections(decoder, param.sec_start, param.sec_size, VMP_HTAB_SECTIONS_MAX);
+
+        if (!(decoder->htab = vmp_htab_create(&param)))
         {
-            printf("   ");
+            printf("vmp_decoder_set_handler_table() failed with vmp_htab_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
         }
-        vmp_decoder_format_inst(decoder, xedd, (xed_uint64_t)inst, buf, sizeof (buf) -1);
-        printf("[%s]\n", buf);
 
         return 0;
     }
 
-    unsigned char *vmp_decoder_find_vmp_start_addr(struct vmp_decoder *decoder)
+    int vmp_decoder_scan_entries(struct vmp_decoder *decoder, struct vmp_scan_entry **entries, int *counts)
     {
-        xed_error_enum_t xed_error;
-        xed_decoded_inst_t xedd;
-        int decode_len;
+        struct vmp_scan_param param;
 
-        xed_decoded_inst_zero(&xedd);
-        xed_decoded_inst_set_mode(&xedd, decoder->mmode, decoder->stack_addr_width);
+        if (!decoder->scanned)
+        {
+            memset(&param, 0, sizeof (param));
+            param.pe = decoder->pe_mod;
+            param.sec_counts = vmp_decoder_sections(decoder, param.sec_start, param.sec_size, VMP_SCAN_SECTIONS_MAX);
 
-        unsigned char *start_addr = decoder->entry_of_point;
+            if (vmp_scan_entries(&param, &decoder->entries, &decoder->entry_counts))
+            {
+                printf("vmp_decoder_scan_entries() failed with vmp_scan_entries(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            decoder->scanned = 1;
+        }
+
+        *entries = decoder->entries;
+        *counts = decoder->entry_counts;
+
+        return 0;
+    }
+
+    // 用VM入口开始见过的handler找表，找不到的话就不再找了
+    static int vmp_decoder_recover_handler_table(struct vmp_decoder *decoder)
+    {
+        struct mhash64 *handlers = &decoder->debug.vm->handlers;
+        uint32_t *seeds;
+        uint32_t i;
+        int counts = 0, ret;
+
+        seeds = (uint32_t *)malloc(handlers->counts * sizeof (seeds[0]));
+        if (!seeds)
+        {
+            printf("vmp_decoder_recover_handler_table() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            decoder->htab->done = 1;
+            return -1;
+        }
+
+        mhash64_foreach(handlers, i)
+        {
+            seeds[counts++] = (uint32_t)handlers->keys[i];
+        }
+
+        ret = vmp_htab_recover(decoder->htab, seeds, counts);
+        vmp_htab_dump(decoder->htab);
+        free(seeds);
+
+        return ret;
+    }
+
+    // 上次运行缓存下来的handler表和handler分析结果，填进htab和vm
+    static int vmp_decoder_cache_load(struct vmp_decoder *decoder)
+    {
+        struct vmp_cache *cache = decoder->cache;
+        struct vmp_cache_handler *ch;
+        struct vmp_cache_info *infos;
+        struct vmp_htab_handler *handlers;
+        uint32_t table, *insts;
+        uint8_t *lens, **kinsts = NULL;
+        int i, j, entries, counts, inst_counts, loads = 0;
+
+        if (decoder->htab && !decoder->htab->done
+            && !vmp_cache_get_htab(cache, &table, &entries, &ch, &counts, &insts, &lens, &inst_counts))
+        {
+            handlers = (struct vmp_htab_handler *)calloc(counts + 1, sizeof (handlers[0]));
+            if (!handlers)
+            {
+                printf("vmp_decoder_cache_load() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            for (i = 0; i < counts; i++)
+            {
+                handlers[i].addr = ch[i].addr;
+                handlers[i].index = ch[i].index;
+                handlers[i].insts = ch[i].insts;
+                handlers[i].branches = ch[i].branches;
+                handlers[i].kept = ch[i].kept;
+                handlers[i].liftable = ch[i].liftable;
+                handlers[i].partial = ch[i].partial;
+            }
+
+            if (vmp_htab_load(decoder->htab, table, entries, handlers, counts, insts, lens, inst_counts))
+            {
+                printf("vmp_decoder_cache_load() failed with vmp_htab_load(). %s:%d\n", __FILE__, __LINE__);
+            }
+            else
+            {
+                printf("handler table[%08x] from cache, handlers[%d] insts[%d]\n", table, counts, inst_counts);
+            }
+            free(handlers);
+        }
+
+        if (!decoder->debug.vm || decoder->debug.vm->info_counts
+            || vmp_cache_get_infos(cache, &infos, &counts, &insts, &lens))
+            return 0;
+
+        for (i = 0; i < counts; i++)
+        {
+            // 摘要的指令换成这次映射的地址
+            if (infos[i].kinst_counts)
+            {
+                kinsts = (uint8_t **)malloc(infos[i].kinst_counts * sizeof (kinsts[0]));
+                if (!kinsts)
+                {
+                    printf("vmp_decoder_cache_load() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+                    return -1;
+                }
+                for (j = 0; j < (int)infos[i].kinst_counts; j++)
+                {
+                    kinsts[j] = decoder->image_base + (insts[infos[i].kinst_start + j] - FAKE_IMAGE_BASE);
+                }
+            }
+
+            if (!vmp_vm_load_handler(decoder->debug.vm, infos[i].handler, &infos[i].entry, kinsts,
+                lens + infos[i].kinst_start, infos[i].kinst_counts))
+                loads++;
+            free(kinsts);
+            kinsts = NULL;
+        }
+        printf("vm handlers[%d] from cache\n", loads);
+
+        return 0;
+    }
+
+    // 这次的handler表和handler分析结果交给缓存，和指令一起保存
+    static int vmp_decoder_cache_store(struct vmp_decoder *decoder)
+    {
+        struct vmp_cache *cache = decoder->cache;
+        struct vmp_htab *htab = decoder->htab;
+        struct vmp_vm *vm = decoder->debug.vm;
+        struct vmp_cache_handler *ch;
+        struct vmp_vm_summary *summary;
+        uint32_t i, *kinsts = NULL;
+        int j, n, counts, ret = 0;
+
+        if (htab && htab->table)
+        {
+            ch = (struct vmp_cache_handler *)calloc(htab->handler_counts + 1, sizeof (ch[0]));
+            if (!ch)
+            {
+                printf("vmp_decoder_cache_store() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            for (j = 0; j < htab->handler_counts; j++)
+            {
+                ch[j].addr = htab->handlers[j].addr;
+                ch[j].index = htab->handlers[j].index;
+                ch[j].insts = htab->handlers[j].insts;
+                ch[j].branches = htab->handlers[j].branches;
+                ch[j].kept = htab->handlers[j].kept;
+                ch[j].liftable = (uint8_t)htab->handlers[j].liftable;
+                ch[j].partial = (uint8_t)htab->handlers[j].partial;
+            }
+            ret = vmp_cache_set_htab(cache, htab->table, htab->entries, ch, htab->handler_counts, &htab->insts);
+            free(ch);
+        }
+
+        if (!vm || !vm->info_counts)
+            return ret;
+
+        mhash64_foreach(&vm->info_index, i)
+        {
+            n = (int)vm->info_index.vals[i] - 1;
+            summary = vm->summaries + n;
+            // 校验没通过的摘要不存
+            counts = (summary->state != VMP_VM_SUMMARY_NONE) ? summary->counts : 0;
+
+            if (counts)
+            {
+                kinsts = (uint32_t *)malloc(counts * sizeof (kinsts[0]));
+                if (!kinsts)
+                {
+                    printf("vmp_decoder_cache_store() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+                    return -1;
+                }
+                for (j = 0; j < counts; j++)
+                {
+                    kinsts[j] = x86_emu_ida_addr(decoder->emu, summary->insts[j]);
+                }
+            }
+
+            if (vmp_cache_add_info(cache, (uint32_t)vm->info_index.keys[i], vm->infos + n, kinsts, summary->lens, counts))
+                ret = -1;
+            free(kinsts);
+            kinsts = NULL;
+        }
+
+        return ret;
+    }
+
+    int vmp_decoder_set_cfg_events(struct vmp_decoder *decoder, struct vmp_cfg_event_param *param)
+    {
+        struct vmp_cfg_event_param p = *param;
+
+        if (decoder->cfg_events)
+            return 0;
+
+        if (!p.addr_func)
+        {
+            p.addr_func = vmp_decoder_csr_addr;
+            p.addr_arg = decoder->emu;
+        }
+
+        decoder->cfg_events = vmp_cfg_event_create(&p);
+        if (!decoder->cfg_events)
+        {
+            printf("vmp_decoder_set_cfg_events() failed with vmp_cfg_event_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        vmp_cfg_event_attach(decoder->cfg_events, decoder->cfg);
+
+        return 0;
+    }
+
+    // 运行结束以后输出cfg: 按cluster分开的dot文件，还有CSR格式的二进制文件
+    static int vmp_decoder_output_cfg(struct vmp_decoder *decoder, struct vmp_cfg_node *root)
+    {
+        struct vmp_cfg_csr *csr;
+        struct vmp_cfg_dot_param dot_param = { 0 };
+        char dot_filename[MAX_PATH + 16] = { 0 }, dot_dir[MAX_PATH + 16] = { 0 };
+        int ret = 0;
+
+        csr = vmp_cfg_csr_build(decoder->cfg, root, vmp_decoder_csr_addr, decoder->emu);
+        if (!csr)
+        {
+            printf("vmp_decoder_output_cfg() failed with vmp_cfg_csr_build(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (csr->head->dispatcher != VMP_CFG_DOM_NONE)
+        {
+            printf("dispatcher: %s(%08x), %u loops\n", vmp_cfg_csr_name(csr, csr->head->dispatcher),
+                csr->nodes[csr->head->dispatcher].addr, csr->head->header_counts);
+        }
+
+        if (decoder->out_dir[0])
+        {
+            _snprintf(dot_filename, sizeof (dot_filename) - 1, "%s\\%s", decoder->out_dir, VMP_DECODER_DOT_FILENAME);
+            _snprintf(dot_dir, sizeof (dot_dir) - 1, "%s\\%s", decoder->out_dir, VMP_DECODER_DOT_DIR);
+            dot_param.filename = dot_filename;
+            dot_param.dir = dot_dir;
+        }
+        else
+        {
+            dot_param.filename = VMP_DECODER_DOT_FILENAME;
+            dot_param.dir = VMP_DECODER_DOT_DIR;
+        }
+        dot_param.render = decoder->dot_render;
+        if (vmp_cfg_dot_write(csr, &dot_param) < 0)
+        {
+            printf("vmp_decoder_output_cfg() failed with vmp_cfg_dot_write(). %s:%d\n", __FILE__, __LINE__);
+            ret = -1;
+        }
+
+        if (decoder->cfg_csr_filename && vmp_cfg_csr_save(csr, decoder->cfg_csr_filename))
+        {
+            printf("vmp_decoder_output_cfg() failed with vmp_cfg_csr_save(). %s:%d\n", __FILE__, __LINE__);
+            ret = -1;
+        }
+
+        if (decoder->cache)
+        {
+            printf("cache: %llu instruction lengths reused\n", (unsigned long long)decoder->cache->hits);
+            if (vmp_decoder_cache_store(decoder) || vmp_cache_save(decoder->cache))
+            {
+                printf("vmp_decoder_output_cfg() failed with vmp_cache_save(). %s:%d\n", __FILE__, __LINE__);
+                ret = -1;
+            }
+        }
+        vmp_cfg_csr_close(csr);
+
+        return ret;
+    }
+
+    int vmp_decoder_set_trace(struct vmp_decoder *decoder, struct vmp_trace_param *param)
+    {
+        struct vmp_trace *trace;
+        struct vmp_vm_param vm_param;
+
+        trace = vmp_trace_create(param);
+        if (!trace)
+        {
+            printf("vmp_decoder_set_trace() failed with vmp_trace_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (decoder->debug.vm)
+        {
+            vmp_vm_destroy(decoder->debug.vm);
+            decoder->debug.vm = NULL;
+        }
+
+        if (decoder->debug.trace)
+        {
+            vmp_trace_destroy(decoder->debug.trace);
+        }
+        decoder->debug.trace = trace;
+        decoder->emu->trace = trace;
+
+        if (param->mode == VMP_TRACE_MODE_VM)
+        {
+            vm_param.emu = decoder->emu;
+            vm_param.trace = trace;
+            decoder->debug.vm = vmp_vm_create(&vm_param);
+            if (!decoder->debug.vm)
+            {
+                printf("vmp_decoder_set_trace() failed with vmp_vm_create(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            // VM模式下只输出handler事件，x86指令不再打印
+            decoder->debug.dump_inst = 0;
+        }
+
+        return 0;
+    }
+
+#define xed_success(ret)                (ret == XED_ERROR_NONE)
+
+    int vmp_xed_disassembly_callback_function(xed_uint64_t address,
+        char *sym_buf, xed_uint32_t buf_size, xed_uint64_t *offset, void *ctx)
+    {
+        struct vmp_decoder *decoder = (struct vmp_decoder *)ctx;
+        int ret;
+
+        sym_buf[0] = 0;
+        ret = vmp_hlp_get_symbol(decoder->debug.hlp, (uint64_t)address - (uint64_t)decoder->image_base, sym_buf, buf_size, offset);
+        if (ret)
+        {
+            //printf("sym[%s]\n", sym_buf);
+        }
+
+        return ret;
+    }
+
+    int vmp_decoder_format_inst(struct vmp_decoder *decoder,
+        xed_decoded_inst_t *xedd, xed_uint64_t runtime_instruction_address, char *buf, int buf_size)
+    {
+        int ret;
+
+        xed_print_info_t pi;
+        xed_init_print_info(&pi);
+
+        pi.p = xedd;
+        pi.blen = buf_size;
+        pi.buf = buf;
+
+        pi.context = decoder;
+
+        pi.disassembly_callback = vmp_xed_disassembly_callback_function; //xed_disassembly_callback_function;
+        pi.runtime_address = runtime_instruction_address;
+        //use default format option, INTEL, dst operand on the left
+        pi.format_options_valid = 1;
+        pi.format_options = decoder->format_options;
+        pi.buf[0] = 0;
+
+        ret = xed_format_generic(&pi);
+        if (!ret)
+        {
+            pi.blen = xed_strncpy(pi.buf, "Error disassembing ", pi.blen);
+            pi.blen = xed_strncat(pi.buf, xed_syntax_enum_t2str(pi.syntax), pi.blen);
+            pi.blen = xed_strncat(pi.buf, " syntax.", pi.blen);
+        }
+
+        return 0;
+    }
+
+    int vmp_decoder_dump_inst(struct vmp_decoder *decoder, 
+        xed_decoded_inst_t *xedd,
+        int indent, unsigned char *inst, int inst_len)
+    {
+        char buf[128];
+        int i;
+
+        printf("[%p]\t[%08x]", inst, FAKE_IMAGE_BASE + ((int)(inst - decoder->image_base)));
+        for (i = 0; i < indent; i++)
+        {
+            printf("    ");
+        }
+        for (i = 0; i < inst_len; i++)
+        {
+            printf ("%02x ", inst[i]);
+        }
+        for (i = inst_len; i < 14; i++)
+        {
+            printf("   ");
+        }
+        vmp_decoder_format_inst(decoder, xedd, (xed_uint64_t)inst, buf, sizeof (buf) -1);
+        printf("[%s]\n", buf);
+
+        return 0;
+    }
+
+    // block模式下，只有block第一次执行时才需要格式化反汇编，以后每次执行
+    // 只输出一个block id
+    static int vmp_decoder_trace_block_inst(struct vmp_decoder *decoder, struct vmp_cfg_node *node,
+        xed_decoded_inst_t *xedd, unsigned char *inst, int inst_len)
+    {
+        struct vmp_trace *trace = decoder->debug.trace;
+        char buf[128];
+
+        if (!trace->block.open)
+        {
+            vmp_trace_block_enter(trace, &node->trace_id, FAKE_IMAGE_BASE + ((int)(node->id - decoder->image_base)));
+        }
+
+        if (!trace->block.recording)
+            return 0;
+
+        if (xedd)
+        {
+            vmp_decoder_format_inst(decoder, xedd, (xed_uint64_t)inst, buf, sizeof (buf) - 1);
+        }
+        else
+        {
+            // IAT调用是用一条假的ret模拟的
+            strcpy(buf, "ret");
+            inst = node->id;
+        }
+
+        return vmp_trace_block_inst(trace, FAKE_IMAGE_BASE + ((int)(inst - decoder->image_base)),
+            xedd ? inst : (unsigned char *)"\xC3", inst_len, buf);
+    }
+
+    unsigned char *vmp_decoder_find_vmp_start_addr(struct vmp_decoder *decoder)
+    {
+        xed_error_enum_t xed_error;
+        xed_decoded_inst_t xedd;
+        int decode_len;
+
+        xed_decoded_inst_zero(&xedd);
+        xed_decoded_inst_set_mode(&xedd, decoder->mmode, decoder->stack_addr_width);
+
+        unsigned char *start_addr = decoder->entry_of_point;
 
         unsigned char *ret_addrs[128], *ret_addr, *jmp_addr;
         int ret_addrs_i = -1;
@@ -564,17 +1251,24 @@ default_label:
         int decode_len, ok = 0, ret;
         struct vmp_cfg_node *cfg_node_stack[128];
         int cfg_node_stack_i = -1;
-        struct vmp_cfg_node *cur_cfg_node = NULL, *t_cfg_node;
-        static int vmp_start = 0, not_empty = 0, iat_call;
+        struct vmp_cfg_node *cur_cfg_node = NULL, *t_cfg_node, *head_node, *tail_node, *jmp_from_node;
+        uint8_t *jmp_inst_addr, *summary_addr;
+        int dispatched, summary_len, cond_unknown = 0;
+        // 多个decoder会同时跑，这里不能用static
+        int vmp_start = 0, not_empty = 0, iat_call;
+        uint64_t *val;
         x86_emu_flow_analysis_t *flow_analy;
-
-        if (!decoder->dot_graph_output)
-        {
-            decoder->dot_graph_output = fopen("1.dot", "w");
-        }
+        char name[VMP_CFG_NAME_SIZE];
+        DWORD start = GetTickCount();
 
         unsigned char *vmp_run_addr = decoder->vmp_act_start_vaddr;
 
+        decoder->insts = 0;
+        decoder->budget.hit = 0;
+
+        if (decoder->cache && !decoder->parent)
+            vmp_decoder_cache_load(decoder);
+
         vmp_start = 1;
 
         while (1)
@@ -612,6 +1306,20 @@ default_label:
                 break;
             }
 
+            // 不需要输出反汇编的时候，解码过的指令直接从缓存里拿长度，探索分支时要用xed的操作数传播污点
+            if ((decoder->cache || decoder->parent) && !decoder->explore && !decoder->debug.dump_inst && !vmp_trace_is_block_mode(decoder->debug.trace)
+                && (decode_len = vmp_decoder_cached_len(decoder, vmp_run_addr)))
+            {
+                goto vmp_decoded_label;
+            }
+
+            // handler表里的handler在主循环开始前已经解码过了
+            if (decoder->htab && !decoder->debug.dump_inst && !vmp_trace_is_block_mode(decoder->debug.trace)
+                && (decode_len = vmp_htab_inst_len(decoder->htab, x86_emu_ida_addr(decoder->emu, vmp_run_addr))))
+            {
+                goto vmp_decoded_label;
+            }
+
             xed_error = xed_decode(&xedd, vmp_run_addr, 15);
             if (xed_error != XED_ERROR_NONE)
             {
@@ -624,75 +1332,629 @@ default_label:
             if (!decode_len)
                 decode_len = 1;
 
-            (decoder->debug.dump_inst && vmp_decoder_dump_inst(decoder, &xedd, cfg_node_stack_i, vmp_run_addr, decode_len));
+            // worker不能改共用的缓存，先记在自己这里
+            if (decoder->parent)
+            {
+                if (x86_emu_ida_addr(decoder->emu, vmp_run_addr)
+                    && (val = mhash64_insert(&decoder->decoded, x86_emu_ida_addr(decoder->emu, vmp_run_addr), NULL)))
+                {
+                    *val = decode_len;
+                }
+            }
+            else if (decoder->cache)
+            {
+                vmp_cache_add_inst(decoder->cache, x86_emu_ida_addr(decoder->emu, vmp_run_addr), decode_len);
+            }
+
+vmp_decoded_label:
 
-            if (!cur_cfg_node)
+            // 探索分支的worker会从fork出来的地址接着跑，那里可能已经有block了
+            if (!cur_cfg_node && !(cur_cfg_node = vmp_cfg_find(decoder->cfg, vmp_run_addr)))
             {
-                if (NULL == (cur_cfg_node = vmp_cfg_create(decoder, vmp_run_addr, 0)))
+                if (NULL == (cur_cfg_node = vmp_cfg_node_create(decoder->cfg, vmp_run_addr, 0)))
                 {
-                    printf("vmp_decoder_run() failed when vmp_cfg_create(). %s:%d\r\n", __FILE__, __LINE__);
+                    printf("vmp_decoder_run() failed when vmp_cfg_node_create(). %s:%d\r\n", __FILE__, __LINE__);
                     return NULL;
                 }
                 vmp_stack_push(cfg_node_stack, cur_cfg_node);
             }
 
-            //cur_cfg_node = vmp_stack_top(cfg_node_stack);
-            assert(cur_cfg_node);
-
-vmp_run_label:
-            ret = x86_emu_run(decoder->emu, vmp_run_addr, decode_len, &flow_analy);
+            if (vmp_trace_is_block_mode(decoder->debug.trace))
+            {
+                vmp_decoder_trace_block_inst(decoder, cur_cfg_node, &xedd, vmp_run_addr, decode_len);
+            }
+            else
+            {
+                (decoder->debug.dump_inst && vmp_decoder_dump_inst(decoder, &xedd, cfg_node_stack_i, vmp_run_addr, decode_len));
+            }
+
+            //cur_cfg_node = vmp_stack_top(cfg_node_stack);
+            assert(cur_cfg_node);
+
+            if (decoder->debug.vm && inst_in_vmp)
+            {
+                vmp_vm_inst(decoder->debug.vm, vmp_run_addr, decode_len);
+            }
+
+            // 超了预算就停下来，已经跑出来的cfg照常输出
+            decoder->insts++;
+            if (((decoder->budget.max_insts > 0) && (decoder->insts > (uint64_t)decoder->budget.max_insts))
+                || ((decoder->budget.max_ms > 0) && !(decoder->insts & 0xfff) && (GetTickCount() - start > (DWORD)decoder->budget.max_ms)))
+            {
+                decoder->budget.hit = 1;
+                break;
+            }
+
+            if (decoder->explore)
+            {
+                if (++decoder->explore_insts > decoder->explore->param.max_insts)
+                {
+                    InterlockedIncrement(&decoder->explore->stats.inst_cuts);
+                    break;
+                }
+
+                // 这条路径很久没走到新地方了
+                if (decoder->explore_insts - decoder->explore_fresh > decoder->explore->param.stale_insts)
+                {
+                    InterlockedIncrement(&decoder->explore->stats.stale_cuts);
+                    break;
+                }
+
+                if (!(++decoder->explore_total % VMP_EXPLORE_TICK) && vmp_explore_tick(decoder->explore))
+                {
+                    break;
+                }
+
+                cond_unknown = vmp_explore_cond_unknown(decoder->emu, &xedd);
+                vmp_explore_taint(decoder->emu, &xedd);
+            }
+
+vmp_run_label:
+            ret = x86_emu_run(decoder->emu, vmp_run_addr, decode_len, &flow_analy);
 
             iat_call = 0;
+            dispatched = 0;
             // 这个分析并非时纯的静态分析，实际上他一直在运算，所以我们在碰到条件跳转时，不
             // 分析那些走不到的分支，但是我们可以先把他加入进来
             if (flow_analy->jmp_type)
             {
+                if (vmp_trace_is_block_mode(decoder->debug.trace))
+                {
+                    vmp_trace_block_leave(decoder->debug.trace);
+                }
+
+                if (decoder->debug.vm && inst_in_vmp)
+                {
+                    dispatched = vmp_vm_transfer(decoder->debug.vm, vmp_run_addr, decode_len, flow_analy->true_addr);
+                }
+
+                if (dispatched && decoder->htab && !decoder->htab->done
+                    && (decoder->debug.vm->handlers.counts >= VMP_HTAB_SEEDS))
+                {
+                    vmp_decoder_recover_handler_table(decoder);
+                }
+
+                if (decoder->cfg_events)
+                {
+                    vmp_cfg_event_tick(decoder->cfg_events);
+                }
+
                 //uint8_t *addr = ((flow_analy->jmp_type == X86_COND_JMP) || flow_analy->cond) ? flow_analy->true_addr : flow_analy->false_addr;
                 uint8_t *addr = ((flow_analy->jmp_type == X86_COND_JMP) || flow_analy->cond || (flow_analy->jmp_type == X86_JMP)) ? flow_analy->true_addr : flow_analy->false_addr;
 
-                if ((t_cfg_node = vmp_cfg_find(decoder, addr)))
+                // 跳转指令也算在block里
+                jmp_inst_addr = vmp_run_addr;
+                vmp_cfg_add_inst(decoder->cfg, cur_cfg_node, vmp_run_addr, decode_len);
+
+                // 跳到了某个已有block的中间，在跳转目标处把它切开
+                if (!(t_cfg_node = vmp_cfg_find(decoder->cfg, addr))
+                    && (t_cfg_node = vmp_cfg_find_contain(decoder->cfg, addr))
+                    && vmp_decoder_inst_boundary(decoder, t_cfg_node->id, addr)
+                    && !vmp_cfg_seperate(decoder->cfg, t_cfg_node, addr, &head_node, &tail_node))
+                {
+                    if ((cur_cfg_node == head_node) && (jmp_inst_addr >= addr))
+                    {
+                        cur_cfg_node = tail_node;
+                    }
+                    t_cfg_node = tail_node;
+                }
+                else if (t_cfg_node && (t_cfg_node->id != addr))
+                {
+                    t_cfg_node = NULL;
+                }
+
+                jmp_from_node = cur_cfg_node;
+                if (t_cfg_node)
                 {
                     vmp_run_addr = flow_analy->true_addr;
-                    vmp_cfg_add_edges(decoder, cur_cfg_node, t_cfg_node, flow_analy->jmp_type);
+                    vmp_cfg_add_edges(decoder->cfg, cur_cfg_node, t_cfg_node, flow_analy->jmp_type);
+
+                    cur_cfg_node = t_cfg_node;
                 }
                 else 
                 {
                     iat_call = pe_loader_addr_in_iat(decoder->pe_mod, addr);
-                    t_cfg_node = vmp_cfg_create(decoder, flow_analy->true_addr, iat_call);
+                    t_cfg_node = vmp_cfg_node_create(decoder->cfg, flow_analy->true_addr, iat_call);
                     
-                    vmp_cfg_add_edges(decoder, cur_cfg_node, t_cfg_node, flow_analy->jmp_type);
+                    vmp_cfg_add_edges(decoder->cfg, cur_cfg_node, t_cfg_node, flow_analy->jmp_type);
 
                     cur_cfg_node = t_cfg_node;
                     vmp_run_addr = flow_analy->true_addr;
                 }
 
-                printf("jmp handler[%s]\n\n", cur_cfg_node->name);
+                if (decoder->explore && vmp_explore_cover(decoder->explore, decoder->explore_worker,
+                    x86_emu_ida_addr(decoder->emu, jmp_from_node->id), x86_emu_ida_addr(decoder->emu, cur_cfg_node->id)))
+                {
+                    decoder->explore_fresh = decoder->explore_insts;
+                }
+
+                // 两边都走得到的条件跳转，没走的一边交给别的线程，走的这一边跑过了就不再跑
+                if (cond_unknown && (flow_analy->jmp_type == X86_COND_JMP))
+                {
+                    if ((ret = vmp_decoder_explore_fork(decoder, jmp_from_node, flow_analy)) < 0)
+                    {
+                        printf("vmp_decoder_run() failed with vmp_decoder_explore_fork(). %s:%d\n", __FILE__, __LINE__);
+                        return -1;
+                    }
+                    if (ret)
+                        break;
+                }
+
+                if (vmp_trace_is_block_mode(decoder->debug.trace))
+                {
+                    if (iat_call)
+                    {
+                        vmp_decoder_trace_block_inst(decoder, cur_cfg_node, NULL, NULL, 1);
+                    }
+                }
+                else if (decoder->debug.dump_inst)
+                {
+                    printf("jmp handler[%s]\n\n", vmp_cfg_node_name(cur_cfg_node, name));
+                }
 
                 if (iat_call)
                 {
                     vmp_run_addr = (uint8_t *)"\xC3";
                     decode_len = 1;
                     x86_emu_set(decoder->emu, OPERAND_TYPE_REG_EAX, (uint32_t)time(NULL));
+                    // 外部调用的返回值是污点的来源
+                    if (decoder->explore)
+                    {
+                        decoder->emu->taint.regs |= 1 << OPERAND_TYPE_REG_EAX;
+                    }
+                    cond_unknown = 0;
                     goto vmp_run_label;
                 }
+
+                // handler有校验过的摘要，花指令不用模拟了，直接从handler结尾的分发跳转接着走，
+                // 中间这些block第一次执行时已经在cfg里了
+                if (dispatched && (summary_addr = vmp_vm_summary_run(decoder->debug.vm, &summary_len)))
+                {
+                    vmp_run_addr = summary_addr;
+                    if ((t_cfg_node = vmp_cfg_find_contain(decoder->cfg, summary_addr)))
+                    {
+                        cur_cfg_node = t_cfg_node;
+                    }
+                }
             }
             else
             {
+                vmp_cfg_add_inst(decoder->cfg, cur_cfg_node, vmp_run_addr, decode_len);
                 vmp_run_addr += decode_len;
-                vmp_cfg_add_inst(cur_cfg_node, vmp_run_addr, decode_len);
+
+                // 顺序执行到了另外一个block的开头(比如被切开的后半部分)
+                if ((vmp_run_addr == cur_cfg_node->id + cur_cfg_node->len)
+                    && (t_cfg_node = vmp_cfg_find(decoder->cfg, vmp_run_addr)))
+                {
+                    vmp_cfg_add_fall_edge(decoder->cfg, cur_cfg_node, t_cfg_node);
+                    cur_cfg_node = t_cfg_node;
+                }
             }
         }
 
-        if (decoder->dot_graph_output)
+        if (vmp_trace_is_block_mode(decoder->debug.trace))
+        {
+            vmp_trace_block_leave(decoder->debug.trace);
+        }
+
+        if (decoder->debug.vm)
+        {
+            vmp_vm_flush(decoder->debug.vm);
+        }
+
+        if (decoder->cfg_events)
+        {
+            vmp_cfg_event_flush(decoder->cfg_events);
+        }
+
+        // worker的cfg由parent合并以后一起输出
+        if ((cfg_node_stack_i >= 0) && !decoder->parent)
         {
-            vmp_cfg_dump(decoder, cfg_node_stack[0]);
-            fclose(decoder->dot_graph_output);
-            system("dot.exe -Tpng -o 1.png 1.dot");
+            vmp_decoder_output_cfg(decoder, cfg_node_stack[0]);
         }
 
         return 0;
     }
 
+    typedef struct vmp_decoder_job
+    {
+        struct vmp_decoder *worker;
+        uint32_t    entry;
+        int         ret;
+        DWORD       ms;
+    } vmp_decoder_job_t;
+
+    static void vmp_decoder_worker_destroy(struct vmp_decoder *worker)
+    {
+        if (worker)
+        {
+            if (worker->emu)
+            {
+                x86_emu_destroy(worker->emu);
+            }
+
+            if (worker->cfg)
+            {
+                vmp_cfg_destroy(worker->cfg);
+            }
+
+            mhash64_uninit(&worker->decoded);
+            free(worker);
+        }
+    }
+
+    static struct vmp_decoder *vmp_decoder_worker_create(struct vmp_decoder *parent, uint32_t entry,
+        struct vmp_explore *explore, int id)
+    {
+        struct vmp_decoder *mod;
+        struct x86_emu_create_param param;
+
+        if ((entry < FAKE_IMAGE_BASE) || (entry - FAKE_IMAGE_BASE >= (uint32_t)parent->pe_mod->size_of_image))
+        {
+            printf("vmp_decoder_worker_create() failed with invalid entry[%08x]. %s:%d\n", entry, __FILE__, __LINE__);
+            return NULL;
+        }
+
+        mod = (struct vmp_decoder *)calloc(1, sizeof (mod[0]));
+        if (!mod)
+        {
+            printf("vmp_decoder_worker_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        // 不会改的部分直接用parent的
+        strcpy_s(mod->filename, parent->filename);
+        mod->parent = parent;
+        mod->pe_mod = parent->pe_mod;
+        mod->image_base = parent->image_base;
+        mod->entry_of_point = parent->entry_of_point;
+        mod->mmode = parent->mmode;
+        mod->stack_addr_width = parent->stack_addr_width;
+        mod->format_options = parent->format_options;
+        mod->vmp_sections = parent->vmp_sections;
+        mod->cache = parent->cache;
+        mod->vmp_act_start_vaddr = parent->image_base + (entry - FAKE_IMAGE_BASE);
+        // dbghelp不能多线程调用，worker不输出反汇编
+        mod->debug.dump_inst = 0;
+        mod->explore = explore;
+        mod->explore_worker = id;
+
+        memset(&param, 0, sizeof (param));
+        param.pe_mod = parent->pe_mod;
+        param.cow = 1;
+        param.quiet = 1;
+        param.taint = !!explore;
+        if (!(mod->emu = x86_emu_create(&param)))
+        {
+            printf("vmp_decoder_worker_create() failed with x86_emu_create(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        if (!(mod->cfg = vmp_cfg_create()) || mhash64_init(&mod->decoded, 1024))
+        {
+            printf("vmp_decoder_worker_create() failed with vmp_cfg_create(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        return mod;
+
+    fail_label:
+        vmp_decoder_worker_destroy(mod);
+        return NULL;
+    }
+
+    static void vmp_decoder_job_run(void *arg)
+    {
+        struct vmp_decoder_job *job = (struct vmp_decoder_job *)arg;
+        DWORD start = GetTickCount();
+
+        job->ret = vmp_decoder_run(job->worker);
+        job->ms = GetTickCount() - start;
+    }
+
+    int vmp_decoder_run_entries(struct vmp_decoder *decoder, uint32_t *entries, int counts, int threads)
+    {
+        struct vmp_scan_entry *scanned;
+        struct vmp_decoder_job *jobs = NULL, *job;
+        struct vmp_cfg **cfgs = NULL;
+        struct vmp_cfg_node *root;
+        struct vmp_tpool *pool = NULL;
+        struct mhash64 *decoded;
+        DWORD start = GetTickCount(), sum_ms = 0;
+        uint8_t *root_addr = NULL;
+        uint32_t i;
+        int j, cfg_counts = 0, ret = -1;
+
+        // trace、vm和事件输出都是按一条执行路径设计的
+        if (decoder->debug.trace)
+        {
+            printf("vmp_decoder_run_entries() failed with trace enabled. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (!entries)
+        {
+            if (vmp_decoder_scan_entries(decoder, &scanned, &counts))
+            {
+                printf("vmp_decoder_run_entries() failed with vmp_decoder_scan_entries(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+        }
+
+        if (counts <= 0)
+        {
+            printf("vmp_decoder_run_entries() failed with no vm entry. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        jobs = (struct vmp_decoder_job *)calloc(counts, sizeof (jobs[0]));
+        cfgs = (struct vmp_cfg **)calloc(counts, sizeof (cfgs[0]));
+        if (!jobs || !cfgs)
+        {
+            printf("vmp_decoder_run_entries() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (!(pool = vmp_tpool_create(threads)))
+        {
+            printf("vmp_decoder_run_entries() failed with vmp_tpool_create(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        for (j = 0; j < counts; j++)
+        {
+            job = jobs + j;
+            job->entry = entries ? entries[j] : scanned[j].addr;
+            job->ret = -1;
+            // 建不起来的入口跳过，不影响其他的
+            if ((job->worker = vmp_decoder_worker_create(decoder, job->entry, NULL, 0)))
+            {
+                vmp_tpool_submit(pool, vmp_decoder_job_run, job);
+            }
+        }
+        vmp_tpool_wait(pool);
+
+        // 按入口的顺序合并，结果和哪个线程先跑完无关
+        for (j = 0; j < counts; j++)
+        {
+            job = jobs + j;
+            if (!job->worker)
+                continue;
+
+            printf("vm entry[%d] %08x: ret[%d] blocks[%d] edges[%d] cow pages[%d] %ums\n", j, job->entry, job->ret,
+                job->worker->cfg->counts, job->worker->cfg->edge_counts, job->worker->emu->cow.copied, job->ms);
+            sum_ms += job->ms;
+
+            if (!job->worker->cfg->counts)
+                continue;
+
+            cfgs[cfg_counts++] = job->worker->cfg;
+            if (!root_addr)
+            {
+                root_addr = job->worker->vmp_act_start_vaddr;
+            }
+
+            if (decoder->cache)
+            {
+                decoded = &job->worker->decoded;
+                mhash64_foreach(decoded, i)
+                {
+                    vmp_cache_add_inst(decoder->cache, (uint32_t)decoded->keys[i], (int)decoded->vals[i]);
+                }
+            }
+        }
+
+        if (vmp_cfg_merge(decoder->cfg, cfgs, cfg_counts))
+        {
+            printf("vmp_decoder_run_entries() failed with vmp_cfg_merge(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        printf("vm entries[%d] threads[%d]: blocks[%d] edges[%d], %ums (%ums in entries)\n", counts, pool->thread_counts,
+            decoder->cfg->counts, decoder->cfg->edge_counts, GetTickCount() - start, sum_ms);
+
+        // 第一个入口当root输出，其他入口从它走不到的部分也在cfg里
+        if (root_addr && (root = vmp_cfg_find(decoder->cfg, root_addr)))
+        {
+            vmp_decoder_output_cfg(decoder, root);
+        }
+        ret = 0;
+
+    exit_label:
+        if (pool)
+        {
+            vmp_tpool_destroy(pool);
+        }
+
+        for (j = 0; jobs && (j < counts); j++)
+        {
+            vmp_decoder_worker_destroy(jobs[j].worker);
+        }
+        free(jobs);
+        free(cfgs);
+
+        return ret;
+    }
+
+    static int vmp_decoder_explore_fork(struct vmp_decoder *decoder, struct vmp_cfg_node *from, x86_emu_flow_analysis_t *flow)
+    {
+        struct vmp_explore *ex = decoder->explore;
+        struct vmp_cfg_node *node;
+        struct x86_emu_snap *snap;
+        uint64_t state = x86_emu_state_hash(decoder->emu);
+
+        // 没走的一边先记进cfg，不管哪个线程去跑，合并以后都连得上
+        if (!(node = vmp_cfg_find(decoder->cfg, flow->false_addr))
+            && !(node = vmp_cfg_node_create(decoder->cfg, flow->false_addr, 0)))
+        {
+            printf("vmp_decoder_explore_fork() failed with vmp_cfg_node_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        vmp_cfg_add_edges(decoder->cfg, from, node, X86_COND_JMP);
+
+        if (decoder->explore_depth >= ex->param.max_depth)
+        {
+            InterlockedIncrement(&ex->stats.depth_cuts);
+        }
+        else if (!vmp_explore_seen(ex, x86_emu_ida_addr(decoder->emu, flow->false_addr), state))
+        {
+            // jcc执行完以后两边的状态只差eip，任务从false_addr开始跑
+            if (!(snap = x86_emu_snap(decoder->emu)))
+            {
+                printf("vmp_decoder_explore_fork() failed with x86_emu_snap(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+
+            if (vmp_explore_fork(ex, decoder->explore_worker, flow->false_addr, decoder->explore_depth + 1,
+                x86_emu_ida_addr(decoder->emu, from->id), x86_emu_ida_addr(decoder->emu, flow->false_addr), snap))
+            {
+                printf("vmp_decoder_explore_fork() failed with vmp_explore_fork(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+        }
+
+        return vmp_explore_seen(ex, x86_emu_ida_addr(decoder->emu, flow->true_addr), state);
+    }
+
+    static void vmp_decoder_explore_task(void *arg, int worker, struct vmp_explore_task *task)
+    {
+        struct vmp_decoder *decoder = ((struct vmp_decoder **)arg)[worker];
+
+        if (x86_emu_restore(decoder->emu, task->snap))
+        {
+            printf("vmp_decoder_explore_task() failed with x86_emu_restore(). %s:%d\n", __FILE__, __LINE__);
+            return;
+        }
+
+        decoder->vmp_act_start_vaddr = task->addr;
+        decoder->explore_depth = task->depth;
+        decoder->explore_insts = 0;
+        decoder->explore_fresh = 0;
+
+        vmp_explore_cover(decoder->explore, worker, task->from, x86_emu_ida_addr(decoder->emu, task->addr));
+
+        vmp_decoder_run(decoder);
+    }
+
+    int vmp_decoder_explore(struct vmp_decoder *decoder, struct vmp_explore_param *param, uint32_t inputs)
+    {
+        struct vmp_decoder *workers[VMP_EXPLORE_MAX_THREADS] = { 0 };
+        struct vmp_cfg *cfgs[VMP_EXPLORE_MAX_THREADS];
+        struct vmp_explore *ex;
+        struct vmp_cfg_node *root;
+        struct x86_emu_snap *snap;
+        struct mhash64 *decoded;
+        DWORD start = GetTickCount();
+        uint32_t i, entry;
+        int j, cfg_counts = 0, ret = -1;
+
+        if (decoder->debug.trace)
+        {
+            printf("vmp_decoder_explore() failed with trace enabled. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        if (!decoder->vmp_act_start_vaddr)
+        {
+            printf("vmp_decoder_explore() failed with no vm entry. %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        entry = FAKE_IMAGE_BASE + (uint32_t)(decoder->vmp_act_start_vaddr - decoder->image_base);
+
+        if (!(ex = vmp_explore_create(param, vmp_decoder_explore_task, workers)))
+        {
+            printf("vmp_decoder_explore() failed with vmp_explore_create(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        for (j = 0; j < ex->param.threads; j++)
+        {
+            if (!(workers[j] = vmp_decoder_worker_create(decoder, entry, ex, j)))
+            {
+                printf("vmp_decoder_explore() failed with vmp_decoder_worker_create(). %s:%d\n", __FILE__, __LINE__);
+                goto exit_label;
+            }
+            workers[j]->emu->taint.regs = inputs & ~(1 << OPERAND_TYPE_REG_ESP);
+        }
+
+        // 第一个任务不一定被0号线程拿到，也从快照开始
+        if (!(snap = x86_emu_snap(workers[0]->emu)))
+        {
+            printf("vmp_decoder_explore() failed with x86_emu_snap(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (vmp_explore_run(ex, workers[0]->vmp_act_start_vaddr, snap))
+        {
+            printf("vmp_decoder_explore() failed with vmp_explore_run(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        for (j = 0; j < ex->param.threads; j++)
+        {
+            if (workers[j]->cfg->counts)
+            {
+                cfgs[cfg_counts++] = workers[j]->cfg;
+            }
+
+            if (decoder->cache)
+            {
+                decoded = &workers[j]->decoded;
+                mhash64_foreach(decoded, i)
+                {
+                    vmp_cache_add_inst(decoder->cache, (uint32_t)decoded->keys[i], (int)decoded->vals[i]);
+                }
+            }
+        }
+
+        if (vmp_cfg_merge(decoder->cfg, cfgs, cfg_counts))
+        {
+            printf("vmp_decoder_explore() failed with vmp_cfg_merge(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        printf("explore %08x threads[%d]: tasks[%ld] forks[%ld] steals[%ld] dedups[%ld] rescores[%ld] depth cuts[%ld] inst cuts[%ld] stale cuts[%ld], "
+            "covered blocks[%ld] edges[%ld], %s drops[%ld], blocks[%d] edges[%d], %ums\n",
+            entry, ex->thread_counts, ex->stats.tasks, ex->stats.forks, ex->stats.steals, ex->stats.dedups, ex->stats.rescores,
+            ex->stats.depth_cuts, ex->stats.inst_cuts, ex->stats.stale_cuts, ex->stats.blocks, ex->stats.edges,
+            ex->stop ? "saturated" : "finished", ex->stats.drops, decoder->cfg->counts, decoder->cfg->edge_counts, GetTickCount() - start);
+
+        if ((root = vmp_cfg_find(decoder->cfg, decoder->vmp_act_start_vaddr)))
+        {
+            vmp_decoder_output_cfg(decoder, root);
+        }
+        ret = 0;
+
+    exit_label:
+        for (j = 0; j < VMP_EXPLORE_MAX_THREADS; j++)
+        {
+            vmp_decoder_worker_destroy(workers[j]);
+        }
+        vmp_explore_destroy(ex);
+
+        return ret;
+    }
+
     // private function
     /*
     @return     1           yes
@@ -714,60 +1976,52 @@ vmp_run_label:
         return 0;
     }
 
-    static int vmp_cfg_seperate(struct vmp_decoder *decoder,
-        struct vmp_cfg_node *cur_node,
-        uint8_t *addr, struct vmp_cfg_node **head, struct vmp_cfg_node **tail)
-    {
-        return 0;
-    }
-
-    static struct vmp_cfg_node *vmp_cfg_find(struct vmp_decoder *decoder, uint8_t *id)
+    /* 从from开始逐条解码，看to是不是一条指令的开头
+    @return     1           yes
+                0           no
+    */
+    static int vmp_decoder_inst_boundary(struct vmp_decoder *decoder, uint8_t *from, uint8_t *to)
     {
-        int i;
-        struct vmp_cfg_node *list;
+        xed_decoded_inst_t xedd;
+        int decode_len;
 
-        for (i = 0, list = decoder->cfg.list; i < decoder->cfg.counts; i++, list = list->in_list.next)
+        while (from < to)
         {
-            if (id == list->id)
-                return list;
-        }
+            if ((decode_len = vmp_decoder_cached_len(decoder, from)))
+            {
+                from += decode_len;
+                continue;
+            }
 
-        return NULL;
-    }
+            xed_decoded_inst_zero(&xedd);
+            xed_decoded_inst_set_mode(&xedd, decoder->mmode, decoder->stack_addr_width);
+            if (xed_decode(&xedd, from, 15) != XED_ERROR_NONE)
+                return 0;
 
-    static int vmp_cfg_add_inst(struct vmp_cfg_node *cfg, uint8_t *addr, int len)
-    {
-        if ((cfg->id + cfg->len) == addr)
-        {
-            cfg->len += len;
-            return 0;
+            decode_len = xed_decoded_inst_get_length(&xedd);
+            from += decode_len ? decode_len : 1;
         }
 
-        return -1;
+        return from == to;
     }
 
-    static int vmp_cfg_add_edges(struct vmp_decoder *decoder, 
-        struct vmp_cfg_node *from, struct vmp_cfg_node *to, int jmp_type)
+    // 解码过的指令长度，没有的话返回0。worker只读共用的缓存，不改里面的计数
+    static int vmp_decoder_cached_len(struct vmp_decoder *decoder, uint8_t *addr)
     {
-        struct vmp_cfg_node_link *link = (struct vmp_cfg_node_link *)calloc(1, sizeof (link[0]));
-        assert(link);
+        uint32_t ida = x86_emu_ida_addr(decoder->emu, addr);
+        uint64_t *val;
+        int len;
 
-        link->node = to;
-        if (jmp_type == X86_JMP)
-        {
-            link->next = from->jmps.list;
-            from->jmps.list = link;
-            from->jmps.count++;
-        }
-        else
+        if (decoder->parent)
         {
-            link->next = from->trues.list;
-            from->trues.list = link;
-            from->trues.count++;
+            if (decoder->cache && (len = vmp_cache_find_inst(decoder->cache, ida)))
+                return len;
+
+            return (ida && (val = mhash64_find(&decoder->decoded, ida))) ? (int)*val : 0;
         }
-        return 0;
-    }
 
+        return decoder->cache ? vmp_cache_inst_len(decoder->cache, ida) : 0;
+    }
 
 #ifdef __cplusplus
 }
@@ -3,11 +3,95 @@
 #ifndef __vmp_decoder__
 #define __vmp_decoder__
 
+// 改了会影响分析结果的代码以后加1，vmp_cache里旧版本的缓存就不会再用
+#define VMP_DECODER_VERSION         2
+
 struct vmp_decoder;
+struct vmp_trace_param;
+struct vmp_cfg_event_param;
+struct vmp_scan_entry;
+struct vmp_explore_param;
+
+typedef struct vmp_decoder_create_param
+{
+    const char      *filename;
+    // 不为空的话文件已经读到内存里了，直接从这里展开，不再读文件，也不做.bak备份
+    unsigned char   *data;
+    int             size;
+    DWORD           vmp_start_va;
+    int             dump_pe;
+    // 不为空的话使用分析缓存，见vmp_cache.h
+    const char      *cache_dir;
+    // 不为空的话dot文件写到这个目录下，否则写到当前目录
+    const char      *out_dir;
+    // 不输出反汇编和寄存器，也不加载符号
+    int             quiet;
+} vmp_decoder_create_param_t;
 
-struct vmp_decoder *vmp_decoder_create(char *filename, DWORD vmp_start_rva, int dump_pe);
+typedef struct vmp_decoder_result
+{
+    // VM入口的IDA地址
+    uint32_t        entry;
+    // vmp_decoder_run跑了多少条指令
+    uint64_t        insts;
+    int             blocks;
+    int             edges;
+    // 是不是因为超了vmp_decoder_set_budget的预算停下来的
+    int             budget_hit;
+} vmp_decoder_result_t;
+
+/* cache_dir不为空的话使用分析缓存，见vmp_cache.h */
+struct vmp_decoder *vmp_decoder_create(char *filename, DWORD vmp_start_rva, int dump_pe, const char *cache_dir);
+struct vmp_decoder *vmp_decoder_create2(struct vmp_decoder_create_param *param);
 void vmp_decoder_destroy(struct vmp_decoder *decoder);
+/* 换成param指定的样本，和新建的一样，PE镜像、模拟器堆栈和cfg的缓冲留着重用。之前的set_xxx都要重新设置
+@return     0           success
+            -1          failed，decoder只能destroy */
+int vmp_decoder_reset(struct vmp_decoder *decoder, struct vmp_decoder_create_param *param);
+
+/* 空闲的decoder留着，下一个样本直接reset，不用重新分配 */
+#define VMP_DECODER_POOL_MAX        64
+struct vmp_decoder_pool;
+/* @max     最多留几个空闲的，<=0时用VMP_DECODER_POOL_MAX */
+struct vmp_decoder_pool *vmp_decoder_pool_create(int max);
+void vmp_decoder_pool_destroy(struct vmp_decoder_pool *pool);
+/* 有空闲的就reset成param的样本，没有就新建 */
+struct vmp_decoder *vmp_decoder_pool_get(struct vmp_decoder_pool *pool, struct vmp_decoder_create_param *param);
+/* 用完放回去，池满了就destroy */
+void vmp_decoder_pool_put(struct vmp_decoder_pool *pool, struct vmp_decoder *decoder);
 int vmp_decoder_run(struct vmp_decoder *decoder);
+int vmp_decoder_set_trace(struct vmp_decoder *decoder, struct vmp_trace_param *param);
+/* 运行结束时把cfg写成CSR格式的二进制文件，见vmp_cfg_csr.h */
+int vmp_decoder_set_cfg_csr(struct vmp_decoder *decoder, const char *filename);
+/* vmp_decoder_run最多跑max_insts条指令、max_ms毫秒，超了就停下来照常输出cfg，<=0时不限制 */
+int vmp_decoder_set_budget(struct vmp_decoder *decoder, int max_insts, int max_ms);
+/* vmp_decoder_run跑完以后取统计 */
+int vmp_decoder_result(struct vmp_decoder *decoder, struct vmp_decoder_result *result);
+/* 运行结束以后在后台用procs个dot.exe进程渲染dot文件，不调用的话只写dot文件 */
+int vmp_decoder_set_dot_render(struct vmp_decoder *decoder, int procs);
+/* 运行过程中把cfg的变化实时输出到文件或回调，见vmp_cfg_event.h，addr_func为空的话输出IDA地址 */
+int vmp_decoder_set_cfg_events(struct vmp_decoder *decoder, struct vmp_cfg_event_param *param);
+/* 只能在VM模式的trace下用，新handler分析完以后到dir下的handler库里匹配，见vmp_hlib.h */
+int vmp_decoder_set_hlib(struct vmp_decoder *decoder, const char *dir);
+/* 只能在VM模式的trace下用，分发到校验过的handler时只模拟去掉花指令以后的指令，见vmp_vm.h */
+int vmp_decoder_set_vm_summary(struct vmp_decoder *decoder, int enable);
+/* 只能在VM模式的trace下用，能翻译的handler在VM指令级解释执行，见vmp_interp.h */
+int vmp_decoder_set_vm_interp(struct vmp_decoder *decoder, int enable);
+/* 只能在VM模式的trace下用，前几次分发以后找handler表，用threads个线程把所有handler预解码，见vmp_htab.h
+@threads    <=0时用CPU核数 */
+int vmp_decoder_set_handler_table(struct vmp_decoder *decoder, int threads);
+/* 扫描所有代码段里的VM入口桩，见vmp_scan.h，结果由decoder持有，不要free */
+int vmp_decoder_scan_entries(struct vmp_decoder *decoder, struct vmp_scan_entry **entries, int *counts);
+/* 每个VM入口一个worker(自己的模拟器和cfg，共用只读的PE镜像和分析缓存)，在threads个线程里同时分析，
+全部跑完以后按入口顺序把cfg合并到decoder的cfg里输出，代替vmp_decoder_run。不能和trace一起用
+@entries    IDA地址，为空的话用vmp_decoder_scan_entries扫出来的全部入口
+@threads    <=0时用CPU核数 */
+int vmp_decoder_run_entries(struct vmp_decoder *decoder, uint32_t *entries, int counts, int threads);
+/* 从VM入口开始跑，条件跳转的标志位带污点时两边都走，见vmp_explore.h。每个线程一个worker，
+任务之间用模拟器快照传递状态，全部跑完以后把cfg合并到decoder的cfg里输出，代替vmp_decoder_run。
+不能和trace一起用
+@inputs     一开始就带污点的寄存器，第OPERAND_TYPE_REG_xx位，外部调用的返回值(eax)总是带污点 */
+int vmp_decoder_explore(struct vmp_decoder *decoder, struct vmp_explore_param *param, uint32_t inputs);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,616 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_explore.h"
+#include "vmp_tpool.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+// 标志位里会被条件跳转读到的那些
+#define VMP_EXPLORE_STATUS_FLAGS    (XE_EFLAGS_CF | XE_EFLAGS_PF | XE_EFLAGS_AF | XE_EFLAGS_ZF | XE_EFLAGS_SF | XE_EFLAGS_OF)
+
+    // 任务排序: score大的先跑，score一样时后fork的先跑，快照还热
+    static int vmp_explore_before(struct vmp_explore_task *a, struct vmp_explore_task *b)
+    {
+        return (a->score != b->score) ? (a->score > b->score) : (a->seq > b->seq);
+    }
+
+    static void vmp_explore_heap_up(struct vmp_explore_deque *dq, int i)
+    {
+        struct vmp_explore_task *task = dq->tasks[i];
+
+        for (; (i > 0) && vmp_explore_before(task, dq->tasks[(i - 1) / 2]); i = (i - 1) / 2)
+        {
+            dq->tasks[i] = dq->tasks[(i - 1) / 2];
+        }
+        dq->tasks[i] = task;
+    }
+
+    static void vmp_explore_heap_down(struct vmp_explore_deque *dq, int i)
+    {
+        struct vmp_explore_task *task = dq->tasks[i];
+        int c;
+
+        for (; (c = i * 2 + 1) < dq->counts; i = c)
+        {
+            if ((c + 1 < dq->counts) && vmp_explore_before(dq->tasks[c + 1], dq->tasks[c]))
+                c++;
+            if (!vmp_explore_before(dq->tasks[c], task))
+                break;
+            dq->tasks[i] = dq->tasks[c];
+        }
+        dq->tasks[i] = task;
+    }
+
+    // 调用者持有dq->lock
+    static int vmp_explore_heap_push(struct vmp_explore_deque *dq, struct vmp_explore_task *task)
+    {
+        struct vmp_explore_task **tasks;
+
+        if (dq->counts == dq->size)
+        {
+            if (!(tasks = (struct vmp_explore_task **)realloc(dq->tasks, (dq->size * 2 + 64) * sizeof (tasks[0]))))
+            {
+                printf("vmp_explore_heap_push() failed with realloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            dq->tasks = tasks;
+            dq->size = dq->size * 2 + 64;
+        }
+
+        dq->tasks[dq->counts++] = task;
+        vmp_explore_heap_up(dq, dq->counts - 1);
+
+        return 0;
+    }
+
+    static int vmp_explore_push(struct vmp_explore_deque *dq, struct vmp_explore_task *task)
+    {
+        int ret;
+
+        AcquireSRWLockExclusive(&dq->lock);
+        ret = vmp_explore_heap_push(dq, task);
+        ReleaseSRWLockExclusive(&dq->lock);
+
+        return ret;
+    }
+
+    // 还没走过的block算2分，block走过了但边没走过算1分
+    static int vmp_explore_novelty(struct vmp_explore *ex, uint32_t from, uint32_t to)
+    {
+        int score = 0;
+
+        AcquireSRWLockShared(&ex->cover_lock);
+        if (!mhash64_find(&ex->cover, to))
+            score = 2;
+        else if (from && !mhash64_find(&ex->cover, (uint64_t)from << 32 | to))
+            score = 1;
+        ReleaseSRWLockShared(&ex->cover_lock);
+
+        return score;
+    }
+
+    /* 取出堆顶的任务。score是fork时算的，在队列里等的时候目标可能已经被别的路径走过了，
+    取出来重新算一遍，变低了又排不到最前面的话放回去再取(分数只会变低，一定会停下来) */
+    static struct vmp_explore_task *vmp_explore_take(struct vmp_explore *ex, struct vmp_explore_deque *dq)
+    {
+        struct vmp_explore_task *task = NULL;
+        int score;
+
+        AcquireSRWLockExclusive(&dq->lock);
+        while (dq->counts)
+        {
+            task = dq->tasks[0];
+            dq->tasks[0] = dq->tasks[--dq->counts];
+            if (dq->counts)
+                vmp_explore_heap_down(dq, 0);
+
+            if (!task->score || ex->stop || ((score = vmp_explore_novelty(ex, task->from, task->to)) == task->score))
+                break;
+
+            task->score = score;
+            InterlockedIncrement(&ex->stats.rescores);
+            if (!dq->counts || !vmp_explore_before(dq->tasks[0], task) || vmp_explore_heap_push(dq, task))
+                break;
+            task = NULL;
+        }
+        ReleaseSRWLockExclusive(&dq->lock);
+
+        return task;
+    }
+
+    // 去堆顶score最高的那个线程那里偷
+    static struct vmp_explore_task *vmp_explore_steal(struct vmp_explore *ex, int id)
+    {
+        struct vmp_explore_deque *dq, *best = NULL;
+        struct vmp_explore_task *task = NULL, top;
+        int i;
+
+        // 放了锁以后别的线程的任务随时会被释放，只记下score和seq
+        for (i = 1; i < ex->thread_counts; i++)
+        {
+            dq = ex->deques + (id + i) % ex->thread_counts;
+
+            AcquireSRWLockShared(&dq->lock);
+            if (dq->counts && (!best || vmp_explore_before(dq->tasks[0], &top)))
+            {
+                top.score = dq->tasks[0]->score;
+                top.seq = dq->tasks[0]->seq;
+                best = dq;
+            }
+            ReleaseSRWLockShared(&dq->lock);
+        }
+
+        if (best && (task = vmp_explore_take(ex, best)))
+        {
+            InterlockedIncrement(&ex->stats.steals);
+        }
+
+        return task;
+    }
+
+    // 入队以后调用，叫醒一个在等的线程
+    static void vmp_explore_signal(struct vmp_explore *ex)
+    {
+        AcquireSRWLockExclusive(&ex->idle_lock);
+        ex->work_seq++;
+        WakeConditionVariable(&ex->has_work);
+        ReleaseSRWLockExclusive(&ex->idle_lock);
+    }
+
+    // 记下seq以后没有新任务入队，并且还有任务在跑的话睡下去
+    static void vmp_explore_idle(struct vmp_explore *ex, LONG seq)
+    {
+        AcquireSRWLockExclusive(&ex->idle_lock);
+        while ((ex->work_seq == seq) && ex->pending)
+        {
+            SleepConditionVariableSRW(&ex->has_work, &ex->idle_lock, INFINITE, 0);
+        }
+        ReleaseSRWLockExclusive(&ex->idle_lock);
+    }
+
+    static void vmp_explore_task_free(struct vmp_explore_task *task)
+    {
+        if (task)
+        {
+            x86_emu_snap_free(task->snap);
+            free(task);
+        }
+    }
+
+    static unsigned __stdcall vmp_explore_worker(void *arg)
+    {
+        struct vmp_explore_deque *dq = (struct vmp_explore_deque *)arg;
+        struct vmp_explore *ex = dq->ex;
+        struct vmp_explore_task *task;
+        LONG seq;
+
+        while (1)
+        {
+            seq = InterlockedCompareExchange(&ex->work_seq, 0, 0);
+            if (!(task = vmp_explore_take(ex, dq)) && !(task = vmp_explore_steal(ex, dq->id)))
+            {
+                // 别的线程还在跑的任务可能还会fork，pending到0才能退出
+                if (!InterlockedCompareExchange(&ex->pending, 0, 0))
+                    break;
+
+                vmp_explore_idle(ex, seq);
+                continue;
+            }
+
+            // 覆盖率饱和以后剩下的任务不跑了，只是清掉
+            if (ex->stop)
+            {
+                InterlockedIncrement(&ex->stats.drops);
+            }
+            else
+            {
+                InterlockedIncrement(&ex->stats.tasks);
+                ex->func(ex->arg, dq->id, task);
+            }
+
+            vmp_explore_task_free(task);
+            if (!InterlockedDecrement(&ex->pending))
+            {
+                // 最后一个任务跑完了，叫醒所有在等的线程退出
+                AcquireSRWLockExclusive(&ex->idle_lock);
+                WakeAllConditionVariable(&ex->has_work);
+                ReleaseSRWLockExclusive(&ex->idle_lock);
+            }
+        }
+
+        return 0;
+    }
+
+    struct vmp_explore *vmp_explore_create(struct vmp_explore_param *param, vmp_explore_func func, void *arg)
+    {
+        struct vmp_explore *ex = (struct vmp_explore *)calloc(1, sizeof (ex[0]));
+        int i;
+
+        if (!ex)
+        {
+            printf("vmp_explore_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        ex->param = *param;
+        if (ex->param.threads <= 0)
+            ex->param.threads = vmp_tpool_cpu_counts();
+        if (ex->param.threads > VMP_EXPLORE_MAX_THREADS)
+            ex->param.threads = VMP_EXPLORE_MAX_THREADS;
+        if (ex->param.max_depth <= 0)
+            ex->param.max_depth = VMP_EXPLORE_MAX_DEPTH;
+        if (ex->param.max_insts <= 0)
+            ex->param.max_insts = VMP_EXPLORE_MAX_INSTS;
+        if (ex->param.stale_insts <= 0)
+            ex->param.stale_insts = VMP_EXPLORE_STALE_INSTS;
+        ex->func = func;
+        ex->arg = arg;
+
+        for (i = 0; i < VMP_EXPLORE_MAX_THREADS; i++)
+        {
+            InitializeSRWLock(&ex->deques[i].lock);
+            ex->deques[i].ex = ex;
+            ex->deques[i].id = i;
+        }
+
+        InitializeSRWLock(&ex->seen_lock);
+        InitializeSRWLock(&ex->cover_lock);
+        InitializeSRWLock(&ex->idle_lock);
+        InitializeConditionVariable(&ex->has_work);
+        if (mhash64_init(&ex->seen, 1024) || mhash64_init(&ex->cover, 1024))
+        {
+            printf("vmp_explore_create() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            mhash64_uninit(&ex->seen);
+            free(ex);
+            return NULL;
+        }
+
+        for (i = 0; i < ex->param.threads; i++)
+        {
+            if (mhash64_init(&ex->deques[i].covered, 1024))
+            {
+                printf("vmp_explore_create() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+                vmp_explore_destroy(ex);
+                return NULL;
+            }
+        }
+
+        return ex;
+    }
+
+    void vmp_explore_destroy(struct vmp_explore *ex)
+    {
+        int i;
+
+        if (!ex)
+            return;
+
+        for (i = 0; i < VMP_EXPLORE_MAX_THREADS; i++)
+        {
+            while (ex->deques[i].counts)
+            {
+                vmp_explore_task_free(ex->deques[i].tasks[--ex->deques[i].counts]);
+            }
+            free(ex->deques[i].tasks);
+            mhash64_uninit(&ex->deques[i].covered);
+        }
+
+        mhash64_uninit(&ex->seen);
+        mhash64_uninit(&ex->cover);
+        free(ex);
+    }
+
+    int vmp_explore_run(struct vmp_explore *ex, uint8_t *addr, struct x86_emu_snap *snap)
+    {
+        struct vmp_explore_task *task;
+        int i, ret = 0;
+
+        task = (struct vmp_explore_task *)calloc(1, sizeof (task[0]));
+        if (!task)
+        {
+            printf("vmp_explore_run() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            x86_emu_snap_free(snap);
+            return -1;
+        }
+        task->addr = addr;
+        task->snap = snap;
+
+        ex->pending = 1;
+        if (vmp_explore_push(ex->deques, task))
+        {
+            vmp_explore_task_free(task);
+            return -1;
+        }
+
+        ex->thread_counts = ex->param.threads;
+        for (i = 0; i < ex->param.threads; i++)
+        {
+            ex->threads[i] = (HANDLE)_beginthreadex(NULL, 0, vmp_explore_worker, ex->deques + i, 0, NULL);
+            if (!ex->threads[i])
+            {
+                printf("vmp_explore_run() failed with _beginthreadex(). %s:%d\n", __FILE__, __LINE__);
+                ex->thread_counts = i;
+                ret = -1;
+                break;
+            }
+        }
+
+        // 一个线程都没起来的话队列里的root没人跑，destroy时释放
+        if (!ex->thread_counts)
+            return -1;
+
+        for (i = 0; i < ex->thread_counts; i++)
+        {
+            WaitForSingleObject(ex->threads[i], INFINITE);
+            CloseHandle(ex->threads[i]);
+        }
+
+        return ret;
+    }
+
+    int vmp_explore_fork(struct vmp_explore *ex, int worker, uint8_t *addr, int depth, uint32_t from, uint32_t to,
+        struct x86_emu_snap *snap)
+    {
+        struct vmp_explore_task *task;
+
+        task = (struct vmp_explore_task *)calloc(1, sizeof (task[0]));
+        if (!task)
+        {
+            printf("vmp_explore_fork() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            x86_emu_snap_free(snap);
+            return -1;
+        }
+        task->addr = addr;
+        task->depth = depth;
+        task->from = from;
+        task->to = to;
+        task->score = vmp_explore_novelty(ex, from, to);
+        task->seq = (uint32_t)InterlockedIncrement(&ex->seq);
+        task->snap = snap;
+
+        // 先加pending再入队，不然别的线程可能看到pending为0提前退出
+        InterlockedIncrement(&ex->pending);
+        if (vmp_explore_push(ex->deques + worker, task))
+        {
+            InterlockedDecrement(&ex->pending);
+            vmp_explore_task_free(task);
+            return -1;
+        }
+        InterlockedIncrement(&ex->stats.forks);
+        vmp_explore_signal(ex);
+
+        return 0;
+    }
+
+    int vmp_explore_seen(struct vmp_explore *ex, uint32_t addr, uint64_t state)
+    {
+        uint64_t key = mhash64_mix(state ^ ((uint64_t)addr << 32 | addr));
+        int seen;
+
+        // MHASH64_EMPTY不能当key
+        if (key == MHASH64_EMPTY)
+            key--;
+
+        AcquireSRWLockExclusive(&ex->seen_lock);
+        if (!(seen = !!mhash64_find(&ex->seen, key)))
+        {
+            mhash64_insert(&ex->seen, key, NULL);
+        }
+        ReleaseSRWLockExclusive(&ex->seen_lock);
+
+        if (seen)
+        {
+            InterlockedIncrement(&ex->stats.dedups);
+        }
+
+        return seen;
+    }
+
+    // 先查自己线程的表，报过的不再去抢全局的锁
+    static int vmp_explore_cover_key(struct vmp_explore *ex, struct mhash64 *covered, uint64_t key)
+    {
+        int is_new = 0;
+
+        if (mhash64_find(covered, key))
+            return 0;
+        mhash64_insert(covered, key, NULL);
+
+        AcquireSRWLockExclusive(&ex->cover_lock);
+        mhash64_insert(&ex->cover, key, &is_new);
+        if (is_new)
+        {
+            ex->fresh_ticks = ex->ticks;
+        }
+        ReleaseSRWLockExclusive(&ex->cover_lock);
+
+        return is_new;
+    }
+
+    int vmp_explore_cover(struct vmp_explore *ex, int worker, uint32_t from, uint32_t to)
+    {
+        struct mhash64 *covered = &ex->deques[worker].covered;
+        int counts = 0;
+
+        if (vmp_explore_cover_key(ex, covered, to))
+        {
+            InterlockedIncrement(&ex->stats.blocks);
+            counts++;
+        }
+
+        if (from && vmp_explore_cover_key(ex, covered, (uint64_t)from << 32 | to))
+        {
+            InterlockedIncrement(&ex->stats.edges);
+            counts++;
+        }
+
+        return counts;
+    }
+
+    int vmp_explore_tick(struct vmp_explore *ex)
+    {
+        LONG ticks = InterlockedIncrement(&ex->ticks);
+
+        if (!ex->stop && ((int64_t)(ticks - ex->fresh_ticks) * VMP_EXPLORE_TICK > ex->param.stale_insts))
+        {
+            ex->stop = 1;
+        }
+
+        return ex->stop;
+    }
+
+    // @return  0 - 7，不是通用寄存器的话返回-1
+    static int vmp_explore_gpr(xed_reg_enum_t reg)
+    {
+        xed_reg_enum_t r32 = xed_get_largest_enclosing_register32(reg);
+
+        if ((r32 >= XED_REG_EAX) && (r32 <= XED_REG_EDI))
+            return r32 - XED_REG_EAX;
+
+        return -1;
+    }
+
+    // 堆栈上[va, va + len)的污点，不在堆栈内返回NULL
+    static uint8_t *vmp_explore_stack_taint(struct x86_emu_mod *emu, uint32_t va, int len)
+    {
+        if (!emu->taint.stack || (va < emu->stack.esp_start) || ((uint64_t)va + len > (uint64_t)emu->stack.esp_start + emu->stack.size))
+            return NULL;
+
+        return emu->taint.stack + (va - emu->stack.esp_start);
+    }
+
+    static uint32_t vmp_explore_mem_addr(struct x86_emu_mod *emu, xed_decoded_inst_t *xedd, int i)
+    {
+        struct x86_emu_reg *regs = &emu->eax;
+        uint32_t addr = (uint32_t)xed_decoded_inst_get_memory_displacement(xedd, i);
+        int r;
+
+        if ((r = vmp_explore_gpr(xed_decoded_inst_get_base_reg(xedd, i))) >= 0)
+            addr += regs[r].u.r32;
+        if ((r = vmp_explore_gpr(xed_decoded_inst_get_index_reg(xedd, i))) >= 0)
+            addr += regs[r].u.r32 * xed_decoded_inst_get_scale(xedd, i);
+
+        return addr;
+    }
+
+    static int vmp_explore_push_like(xed_iclass_enum_t iclass)
+    {
+        return (iclass == XED_ICLASS_PUSH) || (iclass == XED_ICLASS_PUSHFD) || (iclass == XED_ICLASS_PUSHAD)
+            || (iclass == XED_ICLASS_CALL_NEAR);
+    }
+
+    void vmp_explore_taint(struct x86_emu_mod *emu, xed_decoded_inst_t *xedd)
+    {
+        const xed_inst_t *xi = xed_decoded_inst_inst(xedd);
+        const xed_simple_flag_t *rfi = xed_decoded_inst_get_rflags_info(xedd);
+        const xed_operand_t *op;
+        xed_iclass_enum_t iclass = xed_decoded_inst_get_iclass(xedd);
+        xed_operand_enum_t name;
+        xed_reg_enum_t reg, first = XED_REG_INVALID;
+        uint8_t *t, *wmem[2];
+        uint32_t addr, wregs = 0, partial = 0, wflags = 0;
+        unsigned i, n = xed_inst_noperands(xi);
+        int r, j, len, wlen[2], wcounts = 0, tainted = 0, same = 0;
+
+        for (i = 0; i < n; i++)
+        {
+            op = xed_inst_operand(xi, i);
+            name = xed_operand_name(op);
+            if (!xed_operand_is_register(name))
+                continue;
+
+            reg = xed_decoded_inst_get_reg(xedd, name);
+            // esp在模拟器里一直是具体的值，不跟踪
+            if (((r = vmp_explore_gpr(reg)) < 0) || (r == OPERAND_TYPE_REG_ESP))
+                continue;
+
+            if (xed_operand_read(op))
+            {
+                tainted |= (emu->taint.regs >> r) & 1;
+                if (first == XED_REG_INVALID)
+                    first = reg;
+                else if (first == reg)
+                    same = 1;
+            }
+            if (xed_operand_written(op))
+            {
+                wregs |= 1 << r;
+                if (xed_get_register_width_bits(reg) != 32)
+                    partial |= 1 << r;
+            }
+        }
+
+        n = xed_decoded_inst_number_of_memory_operands(xedd);
+        for (i = 0; i < n; i++)
+        {
+            // 地址有污点，读出来的值也算有污点
+            if (((r = vmp_explore_gpr(xed_decoded_inst_get_base_reg(xedd, i))) >= 0) && (r != OPERAND_TYPE_REG_ESP))
+                tainted |= (emu->taint.regs >> r) & 1;
+            if ((r = vmp_explore_gpr(xed_decoded_inst_get_index_reg(xedd, i))) >= 0)
+                tainted |= (emu->taint.regs >> r) & 1;
+
+            len = xed_decoded_inst_get_memory_operand_length(xedd, i);
+            addr = vmp_explore_mem_addr(emu, xedd, i);
+            if (xed_decoded_inst_mem_written(xedd, i) && (xed_decoded_inst_get_base_reg(xedd, i) == XED_REG_ESP)
+                && vmp_explore_push_like(iclass))
+            {
+                addr = emu->esp.u.r32 - len;
+            }
+
+            if (xed_decoded_inst_mem_read(xedd, i) && (t = vmp_explore_stack_taint(emu, addr, len)))
+            {
+                for (j = 0; j < len; j++)
+                    tainted |= t[j];
+            }
+
+            if (xed_decoded_inst_mem_written(xedd, i) && (wcounts < 2))
+            {
+                wmem[wcounts] = vmp_explore_stack_taint(emu, addr, len);
+                wlen[wcounts++] = len;
+            }
+        }
+
+        if (rfi)
+        {
+            if (xed_simple_flag_reads_flags(rfi) && (emu->taint.eflags & xed_simple_flag_get_read_flag_set(rfi)->flat))
+                tainted = 1;
+            if (xed_simple_flag_writes_flags(rfi))
+                wflags = (xed_simple_flag_get_written_flag_set(rfi)->flat | xed_simple_flag_get_undefined_flag_set(rfi)->flat)
+                    & VMP_EXPLORE_STATUS_FLAGS;
+        }
+
+        // xor eax, eax这种结果和原来的值无关
+        if (same && ((iclass == XED_ICLASS_XOR) || (iclass == XED_ICLASS_SUB)))
+            tainted = 0;
+
+        // call压进去的返回地址是常量
+        for (j = 0; j < wcounts; j++)
+        {
+            if (wmem[j])
+                memset(wmem[j], (iclass == XED_ICLASS_CALL_NEAR) ? 0 : tainted, wlen[j]);
+        }
+
+        // 只写了一部分的寄存器，原来的污点还在
+        emu->taint.regs = (emu->taint.regs & ~(wregs & ~partial)) | (tainted ? wregs : 0);
+        emu->taint.eflags = (emu->taint.eflags & ~wflags) | (tainted ? wflags : 0);
+    }
+
+    int vmp_explore_cond_unknown(struct x86_emu_mod *emu, xed_decoded_inst_t *xedd)
+    {
+        const xed_simple_flag_t *rfi = xed_decoded_inst_get_rflags_info(xedd);
+
+        return (xed_decoded_inst_get_category(xedd) == XED_CATEGORY_COND_BR) && rfi && xed_simple_flag_reads_flags(rfi)
+            && (emu->taint.eflags & xed_simple_flag_get_read_flag_set(rfi)->flat);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,156 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_explore_h__
+#define __vmp_explore_h__
+
+#include <windows.h>
+#include <stdint.h>
+#include "xed/xed-interface.h"
+#include "mhash.h"
+#include "x86_emu.h"
+
+// 条件跳转分支探索: 模拟器一直是在算具体的值，条件跳转只会走一边。标志位带了污点(从外部调用
+// 的返回值、指定的输入寄存器算出来的)的条件跳转，两边其实都走得到，这时把模拟器的状态做个快照，
+// 没走的那一边当成一个任务放进当前线程的队列里。每个线程从自己的队列拿任务，自己的队列空了
+// 去别的线程队列里偷。同一个地址、状态hash一样的任务只跑一次，任务的分叉深度和每条路径的
+// 指令数都有上限
+//
+// 按覆盖率调度: 所有线程共用一张走过的block和边的表，fork时按没走的那一边能不能走到新的
+// block/边打分，分高的先跑。一条路径连续stale_insts条指令没有走到新的地方就不再往下走，
+// 所有线程加起来stale_insts条指令都没有新的覆盖时认为已经饱和，剩下的任务全部丢掉
+#define VMP_EXPLORE_MAX_THREADS     64
+#define VMP_EXPLORE_MAX_DEPTH       64
+#define VMP_EXPLORE_MAX_INSTS       1000000
+#define VMP_EXPLORE_STALE_INSTS     200000
+// 每跑这么多条指令才去加一次全局的计数
+#define VMP_EXPLORE_TICK            1024
+
+typedef struct vmp_explore_task
+{
+    // 从这里开始跑
+    uint8_t                 *addr;
+    // 分叉了几次才走到这里
+    int                     depth;
+    // 条件跳转所在的block和没走的那一边(IDA地址)，用来算score
+    uint32_t                from;
+    uint32_t                to;
+    int                     score;
+    uint32_t                seq;
+    struct x86_emu_snap     *snap;
+} vmp_explore_task_t;
+
+// 一个线程的任务队列，按score排成堆，owner和别的线程都从堆顶拿
+typedef struct vmp_explore_deque
+{
+    SRWLOCK                 lock;
+    struct vmp_explore_task **tasks;
+    int                     counts;
+    int                     size;
+
+    // 这个线程已经报过的覆盖，只有owner访问
+    struct mhash64          covered;
+
+    struct vmp_explore      *ex;
+    int                     id;
+} vmp_explore_deque_t;
+
+typedef struct vmp_explore_param
+{
+    // <=0时用CPU核数
+    int                     threads;
+    // <=0时用VMP_EXPLORE_MAX_DEPTH、VMP_EXPLORE_MAX_INSTS、VMP_EXPLORE_STALE_INSTS
+    int                     max_depth;
+    int                     max_insts;
+    int                     stale_insts;
+} vmp_explore_param_t;
+
+/* 在worker线程里跑一个任务，任务执行中可以调用vmp_explore_fork */
+typedef void (*vmp_explore_func)(void *arg, int worker, struct vmp_explore_task *task);
+
+typedef struct vmp_explore
+{
+    struct vmp_explore_param param;
+    vmp_explore_func        func;
+    void                    *arg;
+
+    struct vmp_explore_deque deques[VMP_EXPLORE_MAX_THREADS];
+    HANDLE                  threads[VMP_EXPLORE_MAX_THREADS];
+    int                     thread_counts;
+
+    // 在队列里的和正在跑的任务数，到0时所有线程退出
+    volatile LONG           pending;
+    volatile LONG           seq;
+    // 覆盖率饱和了，所有路径停下来
+    volatile LONG           stop;
+
+    // 没活干的线程睡在has_work上，fork入队或者pending到0时叫醒。
+    // work_seq每次入队加1，取任务前记下来，睡之前比一下，防止漏掉唤醒
+    SRWLOCK                 idle_lock;
+    CONDITION_VARIABLE      has_work;
+    volatile LONG           work_seq;
+
+    // 跑过或者排上队的(IDA地址, 状态hash)
+    SRWLOCK                 seen_lock;
+    struct mhash64          seen;
+
+    // 走过的block(IDA地址)和边(from << 32 | to)
+    SRWLOCK                 cover_lock;
+    struct mhash64          cover;
+    // 所有线程加起来跑了多少个VMP_EXPLORE_TICK，最后一次有新覆盖时是多少
+    volatile LONG           ticks;
+    volatile LONG           fresh_ticks;
+
+    struct {
+        volatile LONG       tasks;
+        volatile LONG       forks;
+        volatile LONG       steals;
+        volatile LONG       dedups;
+        volatile LONG       depth_cuts;
+        volatile LONG       inst_cuts;
+        volatile LONG       stale_cuts;
+        volatile LONG       drops;
+        volatile LONG       rescores;
+        volatile LONG       blocks;
+        volatile LONG       edges;
+    } stats;
+} vmp_explore_t;
+
+struct vmp_explore *vmp_explore_create(struct vmp_explore_param *param, vmp_explore_func func, void *arg);
+void vmp_explore_destroy(struct vmp_explore *ex);
+
+/* 从addr开始跑，所有任务都跑完才返回。第一个任务可能被任何一个线程拿到，也要带快照，
+snap以后归任务所有 */
+int vmp_explore_run(struct vmp_explore *ex, uint8_t *addr, struct x86_emu_snap *snap);
+
+/* 在worker线程里把一个新任务放进自己的队列，from/to是条件跳转所在的block和addr的IDA地址，
+snap以后归任务所有
+@return     0           success
+            -1          failed，snap已经释放 */
+int vmp_explore_fork(struct vmp_explore *ex, int worker, uint8_t *addr, int depth, uint32_t from, uint32_t to,
+    struct x86_emu_snap *snap);
+
+/* (addr, state)第一次出现时记下来返回0，已经有了返回1 */
+int vmp_explore_seen(struct vmp_explore *ex, uint32_t addr, uint64_t state);
+
+/* worker走了一条from->to的边(from为0时只记block to)
+@return     新覆盖到的block和边的个数 */
+int vmp_explore_cover(struct vmp_explore *ex, int worker, uint32_t from, uint32_t to);
+/* worker每跑VMP_EXPLORE_TICK条指令调用一次
+@return     1           覆盖率已经饱和，停下来 */
+int vmp_explore_tick(struct vmp_explore *ex);
+
+/* 按指令的操作数传播模拟器里的污点，要在x86_emu_run之前调用，内存操作数的地址按执行前的
+寄存器算。只跟踪通用寄存器(esp除外)、标志位和模拟的堆栈，PE镜像里的数据都当成没污点 */
+void vmp_explore_taint(struct x86_emu_mod *emu, xed_decoded_inst_t *xedd);
+/* 条件跳转读到的标志位有没有污点 */
+int vmp_explore_cond_unknown(struct x86_emu_mod *emu, xed_decoded_inst_t *xedd);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,715 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xed/xed-interface.h"
+#include "xed/xed-address-width-enum.h"
+#include "vmp_hlib.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+// 寄存器位: 0 - 7是通用寄存器，顺序和OPERAND_TYPE_REG_xxx一致，8是标志位
+#define VMP_HLIB_REG_FLAGS          8
+#define VMP_HLIB_BIT(_r)            (1 << (_r))
+#define VMP_HLIB_REG_ESP            4
+#define VMP_HLIB_REG_EBP            5
+#define VMP_HLIB_REG_ESI            6
+#define VMP_HLIB_REG_EDI            7
+
+    static const char *vmp_hlib_class_names[VMP_HLIB_CLASS_MAX] = {
+        "unknown", "push_imm", "push_ctx", "pop_ctx", "push_vsp", "alu", "read", "write", "jmp"
+    };
+
+    // 单条指令的寄存器读写情况
+    typedef struct vmp_hlib_inst
+    {
+        uint16_t    uses;
+        // 写了的寄存器，kills是整个写掉的(32位的写)，部分写的前面的值还活着
+        uint16_t    writes;
+        uint16_t    kills;
+        uint8_t     mem_write;
+        uint8_t     keep;
+    } vmp_hlib_inst_t;
+
+    static int vmp_hlib_find(struct vmp_hlib *lib, struct vmp_hlib_entry *entry, struct vmp_hlib_entry *found);
+    static void vmp_hlib_store(struct vmp_hlib *lib, struct vmp_hlib_entry *entry);
+
+    const char *vmp_hlib_class_name(int cls)
+    {
+        return ((cls >= 0) && (cls < VMP_HLIB_CLASS_MAX)) ? vmp_hlib_class_names[cls] : vmp_hlib_class_names[0];
+    }
+
+    static inline uint64_t vmp_hlib_step(uint64_t h, uint64_t v)
+    {
+        return (h ^ mhash64_mix(v)) * 0x100000001b3ULL;
+    }
+
+    static uint64_t vmp_hlib_str_hash(const char *s)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        while (*s)
+            h = (h ^ (uint8_t)*s++) * 0x100000001b3ULL;
+
+        return h;
+    }
+
+    // @return  0 - 7，不是通用寄存器的话返回-1
+    static int vmp_hlib_gpr(xed_reg_enum_t reg)
+    {
+        xed_reg_enum_t r32 = xed_get_largest_enclosing_register32(reg);
+
+        if ((r32 >= XED_REG_EAX) && (r32 <= XED_REG_EDI))
+            return r32 - XED_REG_EAX;
+
+        return -1;
+    }
+
+    // 0: 32位, 1: 16位, 2: 低8位, 3: 高8位
+    static int vmp_hlib_sub(xed_reg_enum_t reg)
+    {
+        if ((reg == XED_REG_AH) || (reg == XED_REG_CH) || (reg == XED_REG_DH) || (reg == XED_REG_BH))
+            return 3;
+
+        switch (xed_get_register_width_bits(reg))
+        {
+        case 8:     return 2;
+        case 16:    return 1;
+        }
+
+        return 0;
+    }
+
+    static void vmp_hlib_inst_regs(xed_decoded_inst_t *xedd, struct vmp_hlib_inst *inst)
+    {
+        const xed_inst_t *xi = xed_decoded_inst_inst(xedd);
+        const xed_operand_t *op;
+        const xed_simple_flag_t *rfi;
+        xed_operand_enum_t name;
+        xed_reg_enum_t reg;
+        unsigned i, n = xed_inst_noperands(xi);
+        int r, bit;
+
+        memset(inst, 0, sizeof (inst[0]));
+        for (i = 0; i < n; i++)
+        {
+            op = xed_inst_operand(xi, i);
+            name = xed_operand_name(op);
+            if (!xed_operand_is_register(name))
+                continue;
+
+            reg = xed_decoded_inst_get_reg(xedd, name);
+            if (reg == XED_REG_EFLAGS)
+                r = VMP_HLIB_REG_FLAGS;
+            else if ((r = vmp_hlib_gpr(reg)) < 0)
+                continue;
+            bit = VMP_HLIB_BIT(r);
+
+            if (xed_operand_read(op))
+                inst->uses |= bit;
+            if (xed_operand_written(op))
+            {
+                inst->writes |= bit;
+                if ((r == VMP_HLIB_REG_FLAGS) || !vmp_hlib_sub(reg))
+                    inst->kills |= bit;
+                else
+                    inst->uses |= bit;
+            }
+        }
+
+        n = xed_decoded_inst_number_of_memory_operands(xedd);
+        for (i = 0; i < n; i++)
+        {
+            if ((r = vmp_hlib_gpr(xed_decoded_inst_get_base_reg(xedd, i))) >= 0)
+                inst->uses |= VMP_HLIB_BIT(r);
+            if ((r = vmp_hlib_gpr(xed_decoded_inst_get_index_reg(xedd, i))) >= 0)
+                inst->uses |= VMP_HLIB_BIT(r);
+            if (xed_decoded_inst_mem_written(xedd, i))
+                inst->mem_write = 1;
+        }
+
+        if ((rfi = xed_decoded_inst_get_rflags_info(xedd)))
+        {
+            if (xed_simple_flag_reads_flags(rfi))
+                inst->uses |= VMP_HLIB_BIT(VMP_HLIB_REG_FLAGS);
+            if (xed_simple_flag_writes_flags(rfi))
+            {
+                inst->writes |= VMP_HLIB_BIT(VMP_HLIB_REG_FLAGS);
+                inst->kills |= VMP_HLIB_BIT(VMP_HLIB_REG_FLAGS);
+            }
+        }
+    }
+
+    // 从后往前做活跃变量分析，标出要保留的指令
+    static int vmp_hlib_dce(xed_decoded_inst_t *xedds, struct vmp_hlib_inst *insts, int counts)
+    {
+        uint32_t live = VMP_HLIB_LIVE_OUT;
+        xed_category_enum_t cat;
+        int i, kept = 0, direct;
+
+        for (i = counts - 1; i >= 0; i--)
+        {
+            vmp_hlib_inst_regs(xedds + i, insts + i);
+
+            cat = xed_decoded_inst_get_category(xedds + i);
+            direct = !xed_decoded_inst_number_of_memory_operands(xedds + i)
+                && !(insts[i].uses & ~VMP_HLIB_BIT(VMP_HLIB_REG_FLAGS));
+
+            if (xed_decoded_inst_get_iclass(xedds + i) == XED_ICLASS_NOP)
+                insts[i].keep = 0;
+            // trace已经是执行过的一条直线了，条件跳转和直接跳转只是在排布代码
+            else if ((cat == XED_CATEGORY_COND_BR) || ((cat == XED_CATEGORY_UNCOND_BR) && direct))
+                insts[i].keep = 0;
+            else if ((cat == XED_CATEGORY_UNCOND_BR) || (cat == XED_CATEGORY_RET) || insts[i].mem_write)
+                insts[i].keep = 1;
+            else
+                insts[i].keep = (insts[i].writes & live) ? 1 : 0;
+
+            if (insts[i].keep)
+            {
+                live = (live & ~insts[i].kills) | insts[i].uses;
+                kept++;
+            }
+        }
+
+        return kept;
+    }
+
+    static int vmp_hlib_rename(int *map, int *next, int r)
+    {
+        if (r == VMP_HLIB_REG_ESP)
+            return 15;
+
+        if (map[r] < 0)
+            map[r] = (*next)++;
+
+        return map[r];
+    }
+
+    static uint64_t vmp_hlib_fingerprint(xed_decoded_inst_t *xedds, struct vmp_hlib_inst *insts, int counts)
+    {
+        const xed_inst_t *xi;
+        const xed_operand_t *op;
+        xed_operand_enum_t name;
+        xed_reg_enum_t reg;
+        uint64_t h = 0x9e3779b97f4a7c15ULL, v;
+        unsigned k, n;
+        int i, r, map[8], next = 0;
+
+        memset(map, 0xff, sizeof (map));
+        for (i = 0; i < counts; i++)
+        {
+            if (!insts[i].keep)
+                continue;
+
+            h = vmp_hlib_step(h, vmp_hlib_str_hash(xed_iclass_enum_t2str(xed_decoded_inst_get_iclass(xedds + i))));
+
+            xi = xed_decoded_inst_inst(xedds + i);
+            n = xed_inst_noperands(xi);
+            for (k = 0; k < n; k++)
+            {
+                op = xed_inst_operand(xi, k);
+                name = xed_operand_name(op);
+                v = ((uint64_t)k << 32) | (xed_operand_read(op) << 12) | (xed_operand_written(op) << 13);
+
+                if (xed_operand_is_register(name))
+                {
+                    reg = xed_decoded_inst_get_reg(xedds + i, name);
+                    if ((r = vmp_hlib_gpr(reg)) >= 0)
+                        v |= (vmp_hlib_rename(map, &next, r) << 4) | vmp_hlib_sub(reg);
+                    else
+                        v |= vmp_hlib_str_hash(xed_reg_enum_t2str(reg)) << 40;
+                }
+                else if (name == XED_OPERAND_IMM0)
+                {
+                    // 立即数只保留宽度，密钥和常量每个样本都不一样
+                    v |= 0x200 | xed_decoded_inst_get_immediate_width(xedds + i);
+                }
+                else
+                {
+                    continue;
+                }
+                h = vmp_hlib_step(h, v);
+            }
+
+            n = xed_decoded_inst_number_of_memory_operands(xedds + i);
+            for (k = 0; k < n; k++)
+            {
+                v = 0x400 | ((uint64_t)xed_decoded_inst_get_memory_operand_length(xedds + i, k) << 16)
+                    | ((uint64_t)xed_decoded_inst_get_scale(xedds + i, k) << 24)
+                    | ((uint64_t)xed_decoded_inst_mem_read(xedds + i, k) << 12)
+                    | ((uint64_t)xed_decoded_inst_mem_written(xedds + i, k) << 13);
+                if ((r = vmp_hlib_gpr(xed_decoded_inst_get_base_reg(xedds + i, k))) >= 0)
+                    v |= (uint64_t)(vmp_hlib_rename(map, &next, r) + 1) << 32;
+                if ((r = vmp_hlib_gpr(xed_decoded_inst_get_index_reg(xedds + i, k))) >= 0)
+                    v |= (uint64_t)(vmp_hlib_rename(map, &next, r) + 1) << 40;
+                h = vmp_hlib_step(h, v);
+            }
+        }
+
+        return h;
+    }
+
+    static int vmp_hlib_op(xed_iclass_enum_t iclass)
+    {
+        switch (iclass)
+        {
+        case XED_ICLASS_XOR:    return VMP_HLIB_OP_XOR;
+        case XED_ICLASS_ADD:    return VMP_HLIB_OP_ADD;
+        case XED_ICLASS_SUB:    return VMP_HLIB_OP_SUB;
+        case XED_ICLASS_INC:    return VMP_HLIB_OP_INC;
+        case XED_ICLASS_DEC:    return VMP_HLIB_OP_DEC;
+        case XED_ICLASS_NOT:    return VMP_HLIB_OP_NOT;
+        case XED_ICLASS_NEG:    return VMP_HLIB_OP_NEG;
+        case XED_ICLASS_ROL:    return VMP_HLIB_OP_ROL;
+        case XED_ICLASS_ROR:    return VMP_HLIB_OP_ROR;
+        case XED_ICLASS_BSWAP:  return VMP_HLIB_OP_BSWAP;
+        }
+
+        return 0;
+    }
+
+    // 第一个寄存器操作数，写的话返回它，读的操作数放到src里
+    static int vmp_hlib_reg_operands(xed_decoded_inst_t *xedd, int *src, int *has_imm)
+    {
+        const xed_inst_t *xi = xed_decoded_inst_inst(xedd);
+        const xed_operand_t *op;
+        xed_operand_enum_t name;
+        unsigned k, n = xed_inst_noperands(xi);
+        int r, dst = -1;
+
+        *src = -1;
+        *has_imm = 0;
+        for (k = 0; k < n; k++)
+        {
+            op = xed_inst_operand(xi, k);
+            name = xed_operand_name(op);
+            if (name == XED_OPERAND_IMM0)
+            {
+                *has_imm = 1;
+                continue;
+            }
+            if ((name < XED_OPERAND_REG0) || (name > XED_OPERAND_REG1))
+                continue;
+
+            r = vmp_hlib_gpr(xed_decoded_inst_get_reg(xedd, name));
+            if ((dst < 0) && xed_operand_written(op))
+                dst = r;
+            else if (xed_operand_read(op))
+                *src = r;
+        }
+
+        return dst;
+    }
+
+    // 找出从[ESI]读操作数以后对它做的运算，还有用它更新密钥的运算
+    static void vmp_hlib_steps(struct vmp_hlib_entry *entry, xed_decoded_inst_t *xedds, struct vmp_hlib_inst *insts, int counts)
+    {
+        struct vmp_hlib_step *step;
+        xed_decoded_inst_t *xedd;
+        int i, k = -1, operand = -1, key = -1, dst, src, has_imm, op;
+
+        for (i = 0; (i < counts) && (entry->step_counts < VMP_HLIB_STEPS_MAX); i++)
+        {
+            if (!insts[i].keep)
+                continue;
+            k++;
+            xedd = xedds + i;
+            dst = vmp_hlib_reg_operands(xedd, &src, &has_imm);
+
+            if (operand < 0)
+            {
+                if ((dst >= 0) && xed_decoded_inst_number_of_memory_operands(xedd) && xed_decoded_inst_mem_read(xedd, 0)
+                    && (vmp_hlib_gpr(xed_decoded_inst_get_base_reg(xedd, 0)) == VMP_HLIB_REG_ESI))
+                {
+                    operand = dst;
+                }
+                continue;
+            }
+
+            op = vmp_hlib_op(xed_decoded_inst_get_iclass(xedd));
+            if ((dst < 0) || ((dst != operand) && (dst != key)))
+                continue;
+
+            // 操作数寄存器被别的指令覆盖，解密已经结束了
+            if (!op || (((op == VMP_HLIB_OP_ROL) || (op == VMP_HLIB_OP_ROR)) && !has_imm))
+            {
+                if (dst == operand)
+                    break;
+                continue;
+            }
+
+            step = entry->steps + entry->step_counts;
+            step->op = (uint8_t)op;
+            step->at = (uint16_t)k;
+            step->width = (uint8_t)(xed_decoded_inst_get_operand_width(xedd) / 8);
+            step->dst = (dst == operand) ? VMP_HLIB_DST_OPERAND : VMP_HLIB_DST_KEY;
+            if (has_imm)
+            {
+                step->src = VMP_HLIB_SRC_IMM;
+                step->imm = (uint32_t)xed_decoded_inst_get_unsigned_immediate(xedd);
+            }
+            else if ((src < 0) || (src == dst))
+            {
+                step->src = VMP_HLIB_SRC_NONE;
+            }
+            else if (src == operand)
+            {
+                step->src = VMP_HLIB_SRC_OPERAND;
+            }
+            else
+            {
+                // 第一次拿别的寄存器来和操作数运算，这个寄存器就是滚动密钥
+                if ((key < 0) && (dst == operand))
+                    key = src;
+                if (src != key)
+                    break;
+                step->src = VMP_HLIB_SRC_KEY;
+                entry->flags |= VMP_HLIB_F_KEY;
+            }
+            entry->step_counts++;
+        }
+    }
+
+    static void vmp_hlib_mem_flags(struct vmp_hlib_entry *entry, xed_decoded_inst_t *xedds, struct vmp_hlib_inst *insts, int counts)
+    {
+        unsigned k, n;
+        int i, base;
+
+        for (i = 0; i < counts; i++)
+        {
+            if (!insts[i].keep)
+                continue;
+
+            n = xed_decoded_inst_number_of_memory_operands(xedds + i);
+            for (k = 0; k < n; k++)
+            {
+                base = vmp_hlib_gpr(xed_decoded_inst_get_base_reg(xedds + i, k));
+                if ((base == VMP_HLIB_REG_ESP) || (base == VMP_HLIB_REG_EBP) || (base == VMP_HLIB_REG_ESI))
+                    continue;
+
+                if (base == VMP_HLIB_REG_EDI)
+                {
+                    entry->flags |= xed_decoded_inst_mem_read(xedds + i, k) ? VMP_HLIB_F_CTX_READ : 0;
+                    entry->flags |= xed_decoded_inst_mem_written(xedds + i, k) ? VMP_HLIB_F_CTX_WRITE : 0;
+                }
+                else
+                {
+                    entry->flags |= xed_decoded_inst_mem_read(xedds + i, k) ? VMP_HLIB_F_MEM_READ : 0;
+                    entry->flags |= xed_decoded_inst_mem_written(xedds + i, k) ? VMP_HLIB_F_MEM_WRITE : 0;
+                }
+            }
+        }
+    }
+
+    static int vmp_hlib_classify(struct vmp_hlib_entry *entry)
+    {
+        int vip = entry->vip_delta, vsp = entry->vsp_delta;
+
+        if ((vip > 4) || (vip < -4))
+            return VMP_HLIB_CLASS_JMP;
+        if (entry->flags & VMP_HLIB_F_MEM_WRITE)
+            return VMP_HLIB_CLASS_WRITE;
+        if (entry->operand_size && (vsp < 0))
+            return (entry->flags & VMP_HLIB_F_CTX_READ) ? VMP_HLIB_CLASS_PUSH_CTX : VMP_HLIB_CLASS_PUSH_IMM;
+        if (entry->operand_size && (vsp > 0) && (entry->flags & VMP_HLIB_F_CTX_WRITE))
+            return VMP_HLIB_CLASS_POP_CTX;
+        if (!entry->operand_size && (vsp < 0))
+            return VMP_HLIB_CLASS_PUSH_VSP;
+        if (entry->flags & VMP_HLIB_F_MEM_READ)
+            return VMP_HLIB_CLASS_READ;
+        if (!entry->operand_size && entry->kept)
+            return VMP_HLIB_CLASS_ALU;
+
+        return VMP_HLIB_CLASS_UNKNOWN;
+    }
+
+    // 去掉花指令以后的第at条指令
+    static xed_decoded_inst_t *vmp_hlib_kept_inst(xed_decoded_inst_t *xedds, struct vmp_hlib_inst *insts, int counts, int at)
+    {
+        int i;
+
+        for (i = 0; i < counts; i++)
+        {
+            if (insts[i].keep && !at--)
+                return xedds + i;
+        }
+
+        return NULL;
+    }
+
+    /* 库里命中了，分类、名字、内存读写和解密链用库里的，解密链的立即数按step->at换成当前样本的。
+    指纹一样的话保留下来的指令一一对应，对不上说明hash撞了，返回-1重新分析 */
+    static int vmp_hlib_reuse(struct vmp_hlib_entry *entry, struct vmp_hlib_entry *found,
+        xed_decoded_inst_t *xedds, struct vmp_hlib_inst *insts, int counts)
+    {
+        struct vmp_hlib_step steps[VMP_HLIB_STEPS_MAX];
+        xed_decoded_inst_t *xedd;
+        int i, src, has_imm;
+
+        if (found->step_counts > VMP_HLIB_STEPS_MAX)
+            return -1;
+
+        memcpy(steps, found->steps, sizeof (steps));
+        for (i = 0; i < found->step_counts; i++)
+        {
+            if (!(xedd = vmp_hlib_kept_inst(xedds, insts, counts, steps[i].at))
+                || (vmp_hlib_op(xed_decoded_inst_get_iclass(xedd)) != steps[i].op))
+                return -1;
+
+            if (steps[i].src == VMP_HLIB_SRC_IMM)
+            {
+                vmp_hlib_reg_operands(xedd, &src, &has_imm);
+                if (!has_imm)
+                    return -1;
+                steps[i].imm = (uint32_t)xed_decoded_inst_get_unsigned_immediate(xedd);
+            }
+        }
+
+        entry->cls = found->cls;
+        memcpy(entry->name, found->name, sizeof (entry->name));
+        // 条件跳转在算指纹时去掉了，用当前样本的
+        entry->flags = (entry->flags & VMP_HLIB_F_BRANCH) | (found->flags & ~(VMP_HLIB_F_BRANCH | VMP_HLIB_F_PARTIAL));
+        entry->step_counts = found->step_counts;
+        memcpy(entry->steps, steps, sizeof (steps));
+        entry->samples = found->samples;
+
+        return 0;
+    }
+
+    int vmp_hlib_analyze(struct vmp_hlib *lib, struct vmp_hlib_entry *entry, uint8_t **insts, uint8_t *lens, int counts,
+        int vip_delta, int vsp_delta, int operand_size, uint8_t *keep)
+    {
+        struct vmp_hlib_entry found;
+        xed_decoded_inst_t *xedds = NULL;
+        struct vmp_hlib_inst *infos = NULL;
+        uint64_t h;
+        int i, miss = 1, ret = -1;
+
+        memset(entry, 0, sizeof (entry[0]));
+        memcpy(entry->magic, VMP_HLIB_MAGIC, 4);
+        entry->version = VMP_HLIB_VERSION;
+        entry->size = sizeof (entry[0]);
+        entry->vip_delta = (int16_t)vip_delta;
+        entry->vsp_delta = (int16_t)vsp_delta;
+        entry->operand_size = (uint8_t)operand_size;
+        entry->insts = (uint16_t)((counts > 0xffff) ? 0xffff : counts);
+        entry->flags = VMP_HLIB_F_PARTIAL;
+
+        if ((counts <= 0) || (counts > VMP_HLIB_INSTS_MAX))
+            goto exit_label;
+
+        xedds = (xed_decoded_inst_t *)malloc(counts * sizeof (xedds[0]));
+        infos = (struct vmp_hlib_inst *)malloc(counts * sizeof (infos[0]));
+        if (!xedds || !infos)
+        {
+            printf("vmp_hlib_analyze() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        for (i = 0; i < counts; i++)
+        {
+            xed_decoded_inst_zero(xedds + i);
+            xed_decoded_inst_set_mode(xedds + i, XED_MACHINE_MODE_LEGACY_32, XED_ADDRESS_WIDTH_32b);
+            if (xed_decode(xedds + i, insts[i], lens[i]) != XED_ERROR_NONE)
+                goto exit_label;
+        }
+
+        entry->flags = 0;
+        entry->kept = (uint16_t)vmp_hlib_dce(xedds, infos, counts);
+
+        for (i = 0; i < counts; i++)
+        {
+            if (xed_decoded_inst_get_category(xedds + i) == XED_CATEGORY_COND_BR)
+                entry->flags |= VMP_HLIB_F_BRANCH;
+            if (keep)
+                keep[i] = infos[i].keep;
+        }
+
+        h = vmp_hlib_fingerprint(xedds, infos, counts);
+        h = vmp_hlib_step(h, ((uint64_t)(uint16_t)vsp_delta) | ((uint64_t)operand_size << 16) | ((uint64_t)(vip_delta < 0) << 24));
+        entry->fingerprint = mhash64_mix(h);
+
+        if (lib && !(miss = vmp_hlib_find(lib, entry, &found)) && !vmp_hlib_reuse(entry, &found, xedds, infos, counts))
+        {
+            ret = 1;
+            goto exit_label;
+        }
+
+        vmp_hlib_steps(entry, xedds, infos, counts);
+        vmp_hlib_mem_flags(entry, xedds, infos, counts);
+        ret = 0;
+
+    exit_label:
+        if (ret != 1)
+        {
+            entry->cls = (uint8_t)vmp_hlib_classify(entry);
+            if (entry->operand_size)
+                _snprintf(entry->name, sizeof (entry->name) - 1, "%s%d", vmp_hlib_class_name(entry->cls), entry->operand_size);
+            else
+                _snprintf(entry->name, sizeof (entry->name) - 1, "%s", vmp_hlib_class_name(entry->cls));
+        }
+
+        // 指纹撞了的时候库里原来的不覆盖
+        if (lib && miss && !ret)
+            vmp_hlib_store(lib, entry);
+
+        free(xedds);
+        free(infos);
+
+        return ret;
+    }
+
+    struct vmp_hlib *vmp_hlib_open(const char *dir)
+    {
+        struct vmp_hlib *lib;
+
+        lib = (struct vmp_hlib *)calloc(1, sizeof (lib[0]));
+        if (!lib)
+        {
+            printf("vmp_hlib_open() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (mhash64_init(&lib->seen, 256))
+        {
+            printf("vmp_hlib_open() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            free(lib);
+            return NULL;
+        }
+
+        strncpy(lib->dir, dir ? dir : VMP_HLIB_DIR, sizeof (lib->dir) - 1);
+        // 已经存在的话会失败，不用管
+        CreateDirectory(lib->dir, NULL);
+        if (GetFileAttributes(lib->dir) == INVALID_FILE_ATTRIBUTES)
+        {
+            printf("vmp_hlib_open(%s) failed with CreateDirectory(). %s:%d\n", lib->dir, __FILE__, __LINE__);
+            vmp_hlib_close(lib);
+            return NULL;
+        }
+
+        return lib;
+    }
+
+    void vmp_hlib_close(struct vmp_hlib *lib)
+    {
+        if (!lib)
+            return;
+
+        if (lib->seen.counts)
+        {
+            printf("handler library[%s]: %u handlers, %u found, %u stored\n", lib->dir, lib->seen.counts, lib->hits, lib->stores);
+        }
+
+        mhash64_uninit(&lib->seen);
+        free(lib);
+    }
+
+    static void vmp_hlib_path(struct vmp_hlib *lib, uint64_t fingerprint, char *path, int create)
+    {
+        sprintf(path, "%s\\%02x", lib->dir, (unsigned)(fingerprint & 0xff));
+        if (create)
+            CreateDirectory(path, NULL);
+        sprintf(path + strlen(path), "\\%016llx.vmh", (unsigned long long)fingerprint);
+    }
+
+    static int vmp_hlib_read(struct vmp_hlib *lib, uint64_t fingerprint, struct vmp_hlib_entry *entry)
+    {
+        char path[MAX_PATH + 32];
+        FILE *fp;
+        int ret;
+
+        vmp_hlib_path(lib, fingerprint, path, 0);
+        if (!(fp = fopen(path, "rb")))
+            return -1;
+
+        ret = (fread(entry, sizeof (entry[0]), 1, fp) == 1) ? 0 : -1;
+        fclose(fp);
+
+        if (ret || memcmp(entry->magic, VMP_HLIB_MAGIC, 4) || (entry->version != VMP_HLIB_VERSION)
+            || (entry->size != sizeof (entry[0])) || (entry->fingerprint != fingerprint))
+        {
+            printf("vmp_hlib_read(%s) failed with invalid file. %s:%d\n", path, __FILE__, __LINE__);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // 先写临时文件再改名，多个进程同时往一个库里写也不会读到写了一半的文件
+    static int vmp_hlib_write(struct vmp_hlib *lib, struct vmp_hlib_entry *entry)
+    {
+        char path[MAX_PATH + 32], tmp[MAX_PATH + 48];
+        FILE *fp;
+
+        vmp_hlib_path(lib, entry->fingerprint, path, 1);
+        sprintf(tmp, "%s.%u.tmp", path, (unsigned)GetCurrentProcessId());
+
+        if (!(fp = fopen(tmp, "wb")))
+        {
+            printf("vmp_hlib_write(%s) failed with fopen(). %s:%d\n", tmp, __FILE__, __LINE__);
+            return -1;
+        }
+        if (fwrite(entry, sizeof (entry[0]), 1, fp) != 1)
+        {
+            printf("vmp_hlib_write(%s) failed with fwrite(). %s:%d\n", tmp, __FILE__, __LINE__);
+            fclose(fp);
+            DeleteFile(tmp);
+            return -1;
+        }
+        fclose(fp);
+
+        if (!MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING))
+        {
+            printf("vmp_hlib_write(%s) failed with MoveFileEx(). %s:%d\n", path, __FILE__, __LINE__);
+            DeleteFile(tmp);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // 按entry->fingerprint到库里找，@return 0 库里有，found是库里的记录
+    static int vmp_hlib_find(struct vmp_hlib *lib, struct vmp_hlib_entry *entry, struct vmp_hlib_entry *found)
+    {
+        uint64_t *seen;
+        int is_new;
+
+        // 库里没有的时候seen留给vmp_hlib_store填
+        if (vmp_hlib_read(lib, entry->fingerprint, found))
+            return -1;
+
+        // 同一次运行里指纹一样的handler(同一个handler的多个变形副本)只算一次
+        if ((seen = mhash64_insert(&lib->seen, entry->fingerprint, &is_new)) && is_new)
+        {
+            *seen = 1;
+            lib->hits++;
+            found->samples++;
+            vmp_hlib_write(lib, found);
+        }
+
+        return 0;
+    }
+
+    static void vmp_hlib_store(struct vmp_hlib *lib, struct vmp_hlib_entry *entry)
+    {
+        uint64_t *seen;
+        int is_new;
+
+        entry->samples = 1;
+        if (!vmp_hlib_write(lib, entry) && (seen = mhash64_insert(&lib->seen, entry->fingerprint, &is_new)))
+        {
+            *seen = 2;
+            lib->stores++;
+        }
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,145 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_hlib_h__
+#define __vmp_hlib_h__
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "mhash.h"
+
+// handler库: 同一个vmp版本保护的不同文件，handler的语义基本一样，只是代码被变形过。
+// 每个handler第一次执行时记下执行过的指令，规整以后算一个语义指纹:
+//  1. 去掉花指令: 从handler结尾往前做活跃变量分析，写了以后没人用的寄存器/标志位的指令去掉，
+//     直接跳转和条件跳转(trace已经是一条直线了)也去掉，写内存和间接跳转保留
+//  2. 寄存器重命名: 除了ESP，按第一次出现的顺序编号，立即数和偏移只保留宽度
+//  3. 规整以后的指令(iclass名字 + 操作数形状)和handler的效果(VSP变化、操作数长度)一起算hash
+// 分析结果按指纹存成一个文件 dir\<指纹低8位>\<指纹>.vmh，新的样本先按指纹到库里找，找到了分类、
+// 解密链和效果直接用库里的，只有没找到的才往下分析解密链
+#define VMP_HLIB_MAGIC              "VMPH"
+// 2: vmp_hlib_step加了at
+#define VMP_HLIB_VERSION            2
+#define VMP_HLIB_DIR                "vmp.hlib"
+
+// handler结束时还活着的寄存器: ESI(VIP) EBP(VSP) EDI(context) EBX(滚动密钥) ESP，
+// EAX/ECX/EDX是handler内部的临时寄存器
+#define VMP_HLIB_LIVE_OUT           ((1 << 3) | (1 << 4) | (1 << 5) | (1 << 6) | (1 << 7))
+// 一个handler最多分析这么多条指令，超过了不算指纹
+#define VMP_HLIB_INSTS_MAX          1024
+#define VMP_HLIB_STEPS_MAX          8
+
+// handler的分类，只是按效果粗分的
+#define VMP_HLIB_CLASS_UNKNOWN      0
+#define VMP_HLIB_CLASS_PUSH_IMM     1   // 从VIP读操作数压栈
+#define VMP_HLIB_CLASS_PUSH_CTX     2   // 按VIP读出来的下标把context里的值压栈
+#define VMP_HLIB_CLASS_POP_CTX      3   // 弹栈写到context里
+#define VMP_HLIB_CLASS_PUSH_VSP     4   // 不读VIP的压栈
+#define VMP_HLIB_CLASS_ALU          5   // 栈上的运算，VSP不变或者变小
+#define VMP_HLIB_CLASS_READ         6   // 读内存
+#define VMP_HLIB_CLASS_WRITE        7   // 写内存
+#define VMP_HLIB_CLASS_JMP          8   // VIP不是顺序走的
+#define VMP_HLIB_CLASS_MAX          9
+
+#define VMP_HLIB_F_KEY              0x01    // 操作数解密用到了滚动密钥
+#define VMP_HLIB_F_CTX_READ         0x02    // 读了[EDI + x]
+#define VMP_HLIB_F_CTX_WRITE        0x04
+#define VMP_HLIB_F_MEM_READ         0x08    // 读写了VM栈、context和VIP以外的内存
+#define VMP_HLIB_F_MEM_WRITE        0x10
+#define VMP_HLIB_F_PARTIAL          0x20    // 指令太多，没有算指纹
+#define VMP_HLIB_F_BRANCH           0x40    // 执行路径上有条件跳转，下次执行不一定走同一条路
+
+// 操作数解密链上的一步
+#define VMP_HLIB_OP_XOR             1
+#define VMP_HLIB_OP_ADD             2
+#define VMP_HLIB_OP_SUB             3
+#define VMP_HLIB_OP_INC             4
+#define VMP_HLIB_OP_DEC             5
+#define VMP_HLIB_OP_NOT             6
+#define VMP_HLIB_OP_NEG             7
+#define VMP_HLIB_OP_ROL             8
+#define VMP_HLIB_OP_ROR             9
+#define VMP_HLIB_OP_BSWAP           10
+
+#define VMP_HLIB_DST_OPERAND        0   // 改的是从VIP读出来的操作数
+#define VMP_HLIB_DST_KEY            1   // 改的是滚动密钥
+
+#define VMP_HLIB_SRC_NONE           0
+#define VMP_HLIB_SRC_IMM            1
+#define VMP_HLIB_SRC_OPERAND        2
+#define VMP_HLIB_SRC_KEY            3
+
+typedef struct vmp_hlib_step
+{
+    uint8_t     op;
+    uint8_t     dst;
+    uint8_t     src;
+    // 字节数
+    uint8_t     width;
+    // 是去掉花指令以后的第几条指令，库里命中时按它到当前样本的指令里取立即数
+    uint16_t    at;
+    uint16_t    reserved;
+    // 库里存的是第一次入库的样本的值，不同样本的密钥不一样，命中时换成当前样本的
+    uint32_t    imm;
+} vmp_hlib_step_t;
+
+// 库里每个文件就是一条这样的记录
+typedef struct vmp_hlib_entry
+{
+    char        magic[4];
+    uint16_t    version;
+    uint16_t    size;
+    uint64_t    fingerprint;
+
+    uint8_t     cls;
+    // 从VIP读的字节数
+    uint8_t     operand_size;
+    uint8_t     step_counts;
+    uint8_t     flags;
+    int16_t     vip_delta;
+    int16_t     vsp_delta;
+    // 原始的指令条数和去掉花指令以后的条数
+    uint16_t    insts;
+    uint16_t    kept;
+    // 入库以后又在多少次运行里碰到过
+    uint32_t    samples;
+    // 默认是按分类生成的，可以改成更好懂的名字
+    char        name[16];
+    struct vmp_hlib_step steps[VMP_HLIB_STEPS_MAX];
+} vmp_hlib_entry_t;
+
+typedef struct vmp_hlib
+{
+    char        dir[MAX_PATH];
+    // 这次运行已经查过的，key是指纹，val是1: 库里有，2: 这次新入库的
+    struct mhash64 seen;
+    uint32_t    hits;
+    uint32_t    stores;
+} vmp_hlib_t;
+
+struct vmp_hlib *vmp_hlib_open(const char *dir);
+void vmp_hlib_close(struct vmp_hlib *lib);
+
+/* 分析一个handler第一次执行时的指令: 去掉花指令算出指纹，lib不为空的话先按指纹到库里找，
+找到了分类、名字和解密链都用库里的(立即数换成当前样本的)，不再分析；没找到的话分析出来以后存进库里
+@lib        可以为NULL，只分析不查库
+@insts      指令地址
+@lens       指令长度
+@vip_delta/vsp_delta/operand_size   handler执行完以后量出来的效果，也算进指纹里
+@keep       可以为NULL，counts个字节，返回每条指令去掉花指令以后是不是还保留
+@return     1           库里有，entry是库里的结果
+            0           分析出来的
+            -1          指令太多或者解码失败，entry->flags里有VMP_HLIB_F_PARTIAL */
+int vmp_hlib_analyze(struct vmp_hlib *lib, struct vmp_hlib_entry *entry, uint8_t **insts, uint8_t *lens, int counts,
+    int vip_delta, int vsp_delta, int operand_size, uint8_t *keep);
+
+const char *vmp_hlib_class_name(int cls);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,6 +12,21 @@ extern "C" {
 #include "vmp_hlp.h"
 #include "pe_loader.h"
 
+    // DbgHelp的函数都不是线程安全的，所有实例的调用都要拿这个锁
+    static SRWLOCK vmp_hlp_lock = SRWLOCK_INIT;
+    // SymSetOptions是整个进程的，只设一次
+    static INIT_ONCE vmp_hlp_once = INIT_ONCE_STATIC_INIT;
+
+    static BOOL CALLBACK vmp_hlp_init_once(PINIT_ONCE once, PVOID param, PVOID *ctx)
+    {
+        // SYMOPT_DEBUG option asks DbgHelp to print additional troubleshooting
+        // messages to debug output - use the debugger's Debug Output window 
+        // to view the message
+        SymSetOptions(SymGetOptions() | SYMOPT_DEBUG);
+
+        return TRUE;
+    }
+
     BOOL CALLBACK vmp_hlp_sym_enum_callback(PSYMBOL_INFO sym_info, ULONG sym_size, PVOID user_ctx)
     {
         //printf("function :%I64x : %s\r\n",  sym_info->Address, sym_info->Name);
@@ -21,8 +36,6 @@ extern "C" {
     struct vmp_hlp *vmp_hlp_create(char *filename)
     {
         struct vmp_hlp *mod = (struct vmp_hlp *)calloc(1, sizeof (mod[0]));
-        DWORD options;
-        int ret;
 
         if (!mod)
         {
@@ -30,48 +43,61 @@ extern "C" {
             return NULL;
         }
 
-        options = SymGetOptions();
-        
-        // SYMOPT_DEBUG option asks DbgHelp to print additional troubleshooting
-        // messages to debug output - use the debugger's Debug Output window 
-        // to view the message
-        options |= SYMOPT_DEBUG;
+        InitOnceExecuteOnce(&vmp_hlp_once, vmp_hlp_init_once, NULL, NULL);
 
-        SymSetOptions(options);
+        // hProcess不用是真的进程句柄，只要不重复就行。每个实例用自己的指针，符号表互不影响，
+        // 一个实例SymCleanup也不会把别的实例的清掉
+        mod->hProcess = (HANDLE)mod;
 
-        ret = SymInitialize(GetCurrentProcess(), 
-            NULL,  // No use-defined serach path -> use default
-            FALSE);
+        AcquireSRWLockExclusive(&vmp_hlp_lock);
 
-        if (!ret)
+        if (!SymInitialize(mod->hProcess, 
+            NULL,  // No use-defined serach path -> use default
+            FALSE))
         {
-            printf("vmp_hlp_create() failed when SymInitialize()");
-            return NULL;
+            printf("vmp_hlp_create() failed when SymInitialize()\n");
+            goto fail_label;
         }
+        mod->init = true;
 
-        mod->mod_base = SymLoadModuleEx(GetCurrentProcess(),
+        mod->mod_base = SymLoadModuleEx(mod->hProcess,
             NULL, filename, NULL, (DWORD64)0, 0, NULL, 0);
 
         if (0 == mod->mod_base)
         {
             printf("vmp_hlp_create() failed when SymLoadModuleEx()\n");
-            return NULL;
+            goto fail_label;
         }
         //printf("mod base = 0x%I64X\n", mod->mod_base);
 
-        if (!SymEnumSymbols(GetCurrentProcess(),
+        if (!SymEnumSymbols(mod->hProcess,
             mod->mod_base, 0, (PSYM_ENUMERATESYMBOLS_CALLBACK)vmp_hlp_sym_enum_callback, NULL))
         {
             printf("vmp_hlp_create() failed when SymEnumSymbols()\n");
-            return NULL;
+            goto fail_label;
         }
 
+        ReleaseSRWLockExclusive(&vmp_hlp_lock);
+
         return mod;
+
+    fail_label:
+        ReleaseSRWLockExclusive(&vmp_hlp_lock);
+        vmp_hlp_destroy(mod);
+        return NULL;
     }
 
     int vmp_hlp_destroy(struct vmp_hlp *mod)
     {
-        SymCleanup(GetCurrentProcess());
+        if (!mod)
+            return 0;
+
+        if (mod->init)
+        {
+            AcquireSRWLockExclusive(&vmp_hlp_lock);
+            SymCleanup(mod->hProcess);
+            ReleaseSRWLockExclusive(&vmp_hlp_lock);
+        }
 
         free(mod);
 
@@ -82,6 +108,7 @@ extern "C" {
     {
         DWORD64 displacement;
         PSYMBOL_INFO pinfo;
+        BOOL found;
         char buf[512];
         pinfo = (PSYMBOL_INFO)buf;
 
@@ -92,7 +119,11 @@ extern "C" {
         pinfo->MaxNameLen = sym_buf_siz;
 
         //printf("address = 0x%I64x. %s:%d\n", rva + mod->mod_base, __FILE__, __LINE__);
-        if (SymFromAddr(GetCurrentProcess(), rva + mod->mod_base, &displacement, pinfo))
+        AcquireSRWLockExclusive(&vmp_hlp_lock);
+        found = SymFromAddr(mod->hProcess, rva + mod->mod_base, &displacement, pinfo);
+        ReleaseSRWLockExclusive(&vmp_hlp_lock);
+
+        if (found)
         {
             if (offset)
             { 
@@ -13,9 +13,9 @@ extern "C" {
 typedef struct vmp_hlp
 {
     DWORD error;
-    HANDLE hProcess;
+    HANDLE hProcess;        // DbgHelp的会话句柄，每个实例一个
     DWORD processId;
-    bool init;
+    bool init;              // SymInitialize成功了，destroy时要SymCleanup
 
     char *base_addr;        // pe_load base addr
     DWORD64 mod_base;       // symbol load addr
@@ -0,0 +1,497 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xed/xed-interface.h"
+#include "xed/xed-address-width-enum.h"
+#include "vmp_htab.h"
+#include "vmp_hlib.h"
+#include "vmp_interp.h"
+#include "vmp_tpool.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define FAKE_IMAGE_BASE             0x400000
+
+// 一个handler解码时待走的分支
+#define VMP_HTAB_WORK_SIZE          64
+
+#define vmp_htab_ida(_htab, _p)     (FAKE_IMAGE_BASE + (uint32_t)((_p) - (_htab)->param.image_base))
+#define vmp_htab_host(_htab, _va)   ((_htab)->param.image_base + ((_va) - FAKE_IMAGE_BASE))
+
+    static int vmp_htab_in_vmp(struct vmp_htab *htab, uint8_t *p, int len)
+    {
+        int i;
+
+        for (i = 0; i < htab->param.sec_counts; i++)
+        {
+            if ((p >= htab->param.sec_start[i]) && (p + len <= htab->param.sec_start[i] + htab->param.sec_size[i]))
+                return i + 1;
+        }
+
+        return 0;
+    }
+
+    // 表项转成IDA地址，不指向vmp段的返回0
+    static uint32_t vmp_htab_entry_addr(struct vmp_htab *htab, uint32_t val)
+    {
+        uint32_t bases[2], rva;
+        int i;
+
+        bases[0] = (uint32_t)((uintptr_t)htab->param.image_base & UINT_MAX);
+        bases[1] = htab->param.pe_image_base;
+
+        for (i = 0; i < 2; i++)
+        {
+            if (val < bases[i])
+                continue;
+
+            rva = val - bases[i];
+            if (vmp_htab_in_vmp(htab, htab->param.image_base + rva, 1))
+                return FAKE_IMAGE_BASE + rva;
+        }
+
+        return 0;
+    }
+
+    struct vmp_htab *vmp_htab_create(struct vmp_htab_param *param)
+    {
+        struct vmp_htab *htab = (struct vmp_htab *)calloc(1, sizeof (htab[0]));
+
+        if (!htab)
+        {
+            printf("vmp_htab_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        htab->param = *param;
+        if (htab->param.sec_counts > VMP_HTAB_SECTIONS_MAX)
+            htab->param.sec_counts = VMP_HTAB_SECTIONS_MAX;
+
+        return htab;
+    }
+
+    void vmp_htab_destroy(struct vmp_htab *htab)
+    {
+        int i;
+
+        if (!htab)
+            return;
+
+        if (htab->table)
+        {
+            printf("handler table lookups[%llu] hits[%llu]\n",
+                (unsigned long long)htab->lookups, (unsigned long long)htab->lookup_hits);
+        }
+
+        for (i = 0; i < htab->handler_counts; i++)
+        {
+            free(htab->handlers[i].inst_addrs);
+            free(htab->handlers[i].inst_lens);
+        }
+        free(htab->handlers);
+        mhash64_uninit(&htab->insts);
+        free(htab);
+    }
+
+    // 在vmp段里找包含见过的handler最多的一串连续表项
+    static int vmp_htab_find(struct vmp_htab *htab, uint32_t *seeds, int counts, uint8_t **table, int *entries)
+    {
+        struct mhash64 seed_set;
+        uint8_t *p, *end, *run = NULL;
+        uint64_t *v, run_id = 0;
+        uint32_t addr;
+        int i, hits = 0, best_hits = 0, best_entries = 0;
+
+        if (mhash64_init(&seed_set, counts * 2))
+        {
+            printf("vmp_htab_find() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        for (i = 0; i < counts; i++)
+            mhash64_insert(&seed_set, seeds[i], NULL);
+
+        *table = NULL;
+        for (i = 0; i < htab->param.sec_counts; i++)
+        {
+            p = htab->param.sec_start[i];
+            end = p + (htab->param.sec_size[i] & ~3);
+            run = NULL;
+
+            // 多走一个位置，让最后一串也能结算
+            for (; p <= end; p += 4)
+            {
+                addr = (p < end) ? vmp_htab_entry_addr(htab, *(uint32_t *)p) : 0;
+                if (addr)
+                {
+                    if (!run)
+                    {
+                        run = p;
+                        run_id++;
+                        hits = 0;
+                    }
+                    // 表里同一个handler会出现多次，只算第一次
+                    if ((v = mhash64_find(&seed_set, addr)) && (*v != run_id))
+                    {
+                        *v = run_id;
+                        hits++;
+                    }
+                    continue;
+                }
+
+                if (run && ((p - run) / 4 >= VMP_HTAB_MIN_ENTRIES)
+                    && ((hits > best_hits) || ((hits == best_hits) && ((p - run) / 4 > best_entries))))
+                {
+                    best_hits = hits;
+                    best_entries = (int)((p - run) / 4);
+                    *table = run;
+                }
+                run = NULL;
+            }
+        }
+
+        mhash64_uninit(&seed_set);
+
+        if (!*table || (best_hits < VMP_HTAB_MIN_HITS))
+            return -1;
+
+        *entries = (best_entries > VMP_HTAB_MAX_ENTRIES) ? VMP_HTAB_MAX_ENTRIES : best_entries;
+        htab->hits = best_hits;
+
+        return 0;
+    }
+
+    static int vmp_htab_handler_add(struct vmp_htab_handler *h, uint8_t *inst, int len)
+    {
+        if (!h->inst_addrs)
+        {
+            h->inst_addrs = (uint8_t **)malloc(VMP_HTAB_HANDLER_INSTS * sizeof (h->inst_addrs[0]));
+            h->inst_lens = (uint8_t *)malloc(VMP_HTAB_HANDLER_INSTS);
+            if (!h->inst_addrs || !h->inst_lens)
+                return -1;
+        }
+
+        h->inst_addrs[h->insts] = inst;
+        h->inst_lens[h->insts] = (uint8_t)len;
+        h->insts++;
+
+        return 0;
+    }
+
+    // 没有条件跳转的handler，解码出来的就是执行路径，去掉花指令以后看能不能翻译
+    static void vmp_htab_handler_translate(struct vmp_htab_handler *h)
+    {
+        struct vmp_hlib_entry entry;
+        struct vmp_interp_prog *prog;
+        uint8_t *keep, **kept_insts, *kept_lens;
+        int i, n = 0;
+
+        if (h->branches || h->partial || !h->insts || (h->insts > VMP_HLIB_INSTS_MAX))
+            return;
+
+        keep = (uint8_t *)malloc(h->insts);
+        kept_insts = (uint8_t **)malloc(h->insts * sizeof (kept_insts[0]));
+        kept_lens = (uint8_t *)malloc(h->insts);
+        if (!keep || !kept_insts || !kept_lens)
+            goto exit_label;
+
+        // 静态解码量不出VIP/VSP的变化，效果都按0算，只要剩下的指令
+        if (vmp_hlib_analyze(NULL, &entry, h->inst_addrs, h->inst_lens, h->insts, 0, 0, 0, keep) < 0)
+            goto exit_label;
+
+        for (i = 0; i < h->insts; i++)
+        {
+            if (!keep[i])
+                continue;
+            kept_insts[n] = h->inst_addrs[i];
+            kept_lens[n] = h->inst_lens[i];
+            n++;
+        }
+        h->kept = n;
+
+        if (n && keep[h->insts - 1] && (prog = vmp_interp_lift(kept_insts, kept_lens, n)))
+        {
+            h->liftable = 1;
+            vmp_interp_free(prog);
+        }
+
+    exit_label:
+        free(keep);
+        free(kept_insts);
+        free(kept_lens);
+    }
+
+    // 线程池里跑，只写自己的vmp_htab_handler
+    static void vmp_htab_decode_task(void *arg)
+    {
+        struct vmp_htab_handler *h = (struct vmp_htab_handler *)arg;
+        struct vmp_htab *htab = h->htab;
+        xed_decoded_inst_t xedd;
+        xed_category_enum_t cat;
+        struct mhash64 seen;
+        uint8_t *work[VMP_HTAB_WORK_SIZE], *p, *end;
+        int work_i = -1, len, is_new, sec;
+
+        if (mhash64_init(&seen, 256))
+        {
+            h->partial = 1;
+            return;
+        }
+
+        work[++work_i] = vmp_htab_host(htab, h->addr);
+        while ((work_i >= 0) && !h->partial)
+        {
+            p = work[work_i--];
+
+            while (1)
+            {
+                if (!(sec = vmp_htab_in_vmp(htab, p, 1)))
+                    break;
+
+                mhash64_insert(&seen, (uint64_t)(uintptr_t)p, &is_new);
+                if (!is_new)
+                    break;
+
+                if (h->insts >= VMP_HTAB_HANDLER_INSTS)
+                {
+                    h->partial = 1;
+                    break;
+                }
+
+                end = htab->param.sec_start[sec - 1] + htab->param.sec_size[sec - 1];
+                xed_decoded_inst_zero(&xedd);
+                xed_decoded_inst_set_mode(&xedd, XED_MACHINE_MODE_LEGACY_32, XED_ADDRESS_WIDTH_32b);
+                if (xed_decode(&xedd, p, (end - p > 15) ? 15 : (unsigned int)(end - p)) != XED_ERROR_NONE)
+                {
+                    h->partial = 1;
+                    break;
+                }
+
+                len = xed_decoded_inst_get_length(&xedd);
+                if (vmp_htab_handler_add(h, p, len))
+                {
+                    h->partial = 1;
+                    break;
+                }
+
+                cat = xed_decoded_inst_get_category(&xedd);
+                if (cat == XED_CATEGORY_RET)
+                    break;
+
+                if ((cat == XED_CATEGORY_UNCOND_BR) || (cat == XED_CATEGORY_COND_BR) || (cat == XED_CATEGORY_CALL))
+                {
+                    // 间接跳转是handler的结尾
+                    if (!xed_decoded_inst_get_branch_displacement_width(&xedd))
+                    {
+                        if (cat == XED_CATEGORY_CALL)
+                        {
+                            p += len;
+                            continue;
+                        }
+                        break;
+                    }
+
+                    if (cat == XED_CATEGORY_UNCOND_BR)
+                    {
+                        p = p + len + (int32_t)xed_decoded_inst_get_branch_displacement(&xedd);
+                        continue;
+                    }
+
+                    if (cat == XED_CATEGORY_COND_BR)
+                        h->branches++;
+
+                    if (work_i + 1 >= VMP_HTAB_WORK_SIZE)
+                    {
+                        h->partial = 1;
+                        break;
+                    }
+                    work[++work_i] = p + len + (int32_t)xed_decoded_inst_get_branch_displacement(&xedd);
+                }
+
+                p += len;
+            }
+        }
+
+        mhash64_uninit(&seen);
+
+        vmp_htab_handler_translate(h);
+    }
+
+    int vmp_htab_recover(struct vmp_htab *htab, uint32_t *seeds, int counts)
+    {
+        struct vmp_tpool *pool = NULL;
+        struct vmp_htab_handler *h;
+        struct mhash64 index;
+        uint8_t *table;
+        uint64_t *v, *len;
+        uint32_t addr;
+        DWORD tick;
+        int i, j, is_new, ret = -1;
+
+        htab->done = 1;
+
+        memset(&index, 0, sizeof (index));
+        if (vmp_htab_find(htab, seeds, counts, &table, &htab->entries))
+            return -1;
+
+        tick = GetTickCount();
+        htab->table = vmp_htab_ida(htab, table);
+
+        htab->handlers = (struct vmp_htab_handler *)calloc(htab->entries, sizeof (htab->handlers[0]));
+        if (!htab->handlers || mhash64_init(&index, htab->entries * 2))
+        {
+            printf("vmp_htab_recover() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        // 表里有很多重复的项，每个handler只解码一次
+        for (i = 0; i < htab->entries; i++)
+        {
+            addr = vmp_htab_entry_addr(htab, ((uint32_t *)table)[i]);
+            if (!(v = mhash64_insert(&index, addr, &is_new)) || !is_new)
+                continue;
+
+            h = htab->handlers + htab->handler_counts++;
+            h->htab = htab;
+            h->addr = addr;
+            h->index = i;
+        }
+
+        if (!(pool = vmp_tpool_create(htab->param.threads)))
+        {
+            printf("vmp_htab_recover() failed with vmp_tpool_create(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        for (i = 0; i < htab->handler_counts; i++)
+        {
+            if (vmp_tpool_submit(pool, vmp_htab_decode_task, htab->handlers + i))
+            {
+                printf("vmp_htab_recover() failed with vmp_tpool_submit(). %s:%d\n", __FILE__, __LINE__);
+                goto exit_label;
+            }
+        }
+        vmp_tpool_wait(pool);
+
+        // 合并在主线程里做
+        for (i = 0; i < htab->handler_counts; i++)
+        {
+            h = htab->handlers + i;
+            for (j = 0; j < h->insts; j++)
+            {
+                if ((len = mhash64_insert(&htab->insts, vmp_htab_ida(htab, h->inst_addrs[j]), NULL)))
+                    *len = h->inst_lens[j];
+            }
+
+            // 只留统计，地址表不要了
+            free(h->inst_addrs);
+            free(h->inst_lens);
+            h->inst_addrs = NULL;
+            h->inst_lens = NULL;
+        }
+
+        htab->decode_ms = GetTickCount() - tick;
+        ret = 0;
+
+    exit_label:
+        if (pool)
+            vmp_tpool_destroy(pool);
+        mhash64_uninit(&index);
+
+        return ret;
+    }
+
+    int vmp_htab_load(struct vmp_htab *htab, uint32_t table, int entries, struct vmp_htab_handler *handlers, int counts,
+        uint32_t *insts, uint8_t *lens, int inst_counts)
+    {
+        uint64_t *len;
+        int i;
+
+        htab->done = 1;
+
+        htab->handlers = (struct vmp_htab_handler *)calloc(counts + 1, sizeof (htab->handlers[0]));
+        if (!htab->handlers)
+        {
+            printf("vmp_htab_load() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        for (i = 0; i < counts; i++)
+        {
+            htab->handlers[i] = handlers[i];
+            htab->handlers[i].htab = htab;
+            htab->handlers[i].inst_addrs = NULL;
+            htab->handlers[i].inst_lens = NULL;
+        }
+        htab->handler_counts = counts;
+
+        for (i = 0; i < inst_counts; i++)
+        {
+            if (!(len = mhash64_insert(&htab->insts, insts[i], NULL)))
+            {
+                printf("vmp_htab_load() failed with mhash64_insert(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            *len = lens[i];
+        }
+
+        htab->table = table;
+        htab->entries = entries;
+
+        return 0;
+    }
+
+    int vmp_htab_inst_len(struct vmp_htab *htab, uint32_t addr)
+    {
+        uint64_t *len;
+
+        if (!htab->insts.counts)
+            return 0;
+
+        htab->lookups++;
+        if (!(len = mhash64_find(&htab->insts, addr)))
+            return 0;
+
+        htab->lookup_hits++;
+
+        return (int)*len;
+    }
+
+    void vmp_htab_dump(struct vmp_htab *htab)
+    {
+        struct vmp_htab_handler *h;
+        int i, lifts = 0, straight = 0;
+
+        if (!htab->table)
+        {
+            printf("handler table not found\n");
+            return;
+        }
+
+        for (i = 0; i < htab->handler_counts; i++)
+        {
+            h = htab->handlers + i;
+            printf("handler[%3d] %08x insts[%4d] branches[%2d] kept[%3d]%s%s\n",
+                h->index, h->addr, h->insts, h->branches, h->kept,
+                h->liftable ? " interp" : "", h->partial ? " partial" : "");
+
+            straight += !h->branches;
+            lifts += h->liftable;
+        }
+
+        printf("handler table[%08x] entries[%d] seeds hit[%d], handlers[%d] straight[%d] interp[%d], "
+            "insts[%u] decoded in %ums\n",
+            htab->table, htab->entries, htab->hits, htab->handler_counts, straight, lifts,
+            htab->insts.counts, htab->decode_ms);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,106 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_htab_h__
+#define __vmp_htab_h__
+
+#include <windows.h>
+#include <stdint.h>
+#include "mhash.h"
+
+// handler表: vmp2的dispatcher是 movzx eax, byte [esi]; jmp [eax*4 + table] 这种形式，表在.vmp0/.vmp1里，
+// 每一项是重定位过的handler地址。VM入口跑了几次分发以后，拿已经见过的handler到vmp段里找连续的一串
+// 都指向vmp段的dword，包含见过的handler最多的那一串就是表。
+// 找到表以后在线程池里把每个handler静态解码一遍(跟着直接跳转走，条件跳转两边都走，碰到间接跳转/ret停)，
+// 解码结果给主循环当指令长度的缓存用，同时输出完整的handler清单。
+// 加密过的表(表项要先解密才是地址)和没有表的vmp3找不到，这时候还是靠模拟时一个个发现
+#define VMP_HTAB_SEEDS              4
+// 表里至少要有这么多个见过的handler
+#define VMP_HTAB_MIN_HITS           2
+#define VMP_HTAB_MIN_ENTRIES        16
+#define VMP_HTAB_MAX_ENTRIES        1024
+// 一个handler静态解码最多这么多条指令，多了不再往下走
+#define VMP_HTAB_HANDLER_INSTS      2048
+
+#define VMP_HTAB_SECTIONS_MAX       3
+
+typedef struct vmp_htab_param
+{
+    // pe_loader映射的基址，表项是按这个基址重定位过的
+    uint8_t     *image_base;
+    // pe头里的ImageBase，没有重定位过的表项按这个算
+    uint32_t    pe_image_base;
+    int         sec_counts;
+    uint8_t     *sec_start[VMP_HTAB_SECTIONS_MAX];
+    int         sec_size[VMP_HTAB_SECTIONS_MAX];
+    // <=0时用CPU核数
+    int         threads;
+} vmp_htab_param_t;
+
+typedef struct vmp_htab_handler
+{
+    struct vmp_htab *htab;
+    uint32_t    addr;
+    // 表里第一次出现的下标
+    int         index;
+    // 静态解码到的指令
+    int         insts;
+    uint8_t     **inst_addrs;
+    uint8_t     *inst_lens;
+    // 路上的条件跳转个数，为0的时候解码出来的就是handler的执行路径
+    int         branches;
+    // 没有条件跳转时，去掉花指令以后剩下的条数，和能不能翻译成解释器指令
+    int         kept;
+    int         liftable;
+    // 指令太多没有走完，或者解码失败
+    int         partial;
+} vmp_htab_handler_t;
+
+typedef struct vmp_htab
+{
+    struct vmp_htab_param param;
+
+    // 已经找过一次了，不管找没找到都不再找
+    int         done;
+    // 表的IDA地址，0是没找到
+    uint32_t    table;
+    int         entries;
+    int         hits;
+
+    struct vmp_htab_handler *handlers;
+    int         handler_counts;
+
+    // key: 指令的IDA地址, value: 指令长度
+    struct mhash64 insts;
+    uint64_t    lookups;
+    uint64_t    lookup_hits;
+    DWORD       decode_ms;
+} vmp_htab_t;
+
+struct vmp_htab *vmp_htab_create(struct vmp_htab_param *param);
+void vmp_htab_destroy(struct vmp_htab *htab);
+
+/* 用已经见过的handler在vmp段里找表，找到的话在线程池里解码所有的handler，返回前解码全部完成
+@seeds      见过的handler的IDA地址
+@return     0           success
+            -1          没找到表 */
+int vmp_htab_recover(struct vmp_htab *htab, uint32_t *seeds, int counts);
+/* 用缓存里上次找到的表和解码结果，不再找表和解码
+@handlers   只用addr/index和统计，inst_addrs/inst_lens不用
+@insts      静态解码过的指令的IDA地址
+@return     0           success
+            -1          failed */
+int vmp_htab_load(struct vmp_htab *htab, uint32_t table, int entries, struct vmp_htab_handler *handlers, int counts,
+    uint32_t *insts, uint8_t *lens, int inst_counts);
+/* @return     预解码过的指令长度，没有的话返回0 */
+int vmp_htab_inst_len(struct vmp_htab *htab, uint32_t addr);
+void vmp_htab_dump(struct vmp_htab *htab);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
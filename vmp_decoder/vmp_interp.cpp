@@ -0,0 +1,639 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xed/xed-interface.h"
+#include "xed/xed-address-width-enum.h"
+#include "vmp_interp.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define vmp_interp_mask(_size)      (((_size) >= 4) ? 0xffffffff : ((1u << ((_size) * 8)) - 1))
+
+    static int vmp_interp_gpr(xed_reg_enum_t reg)
+    {
+        xed_reg_enum_t r32 = xed_get_largest_enclosing_register32(reg);
+
+        if ((r32 >= XED_REG_EAX) && (r32 <= XED_REG_EDI))
+            return r32 - XED_REG_EAX;
+
+        return -1;
+    }
+
+    static int vmp_interp_lift_opnd(xed_decoded_inst_t *xedd, xed_operand_enum_t name,
+        struct vmp_interp_op *op, struct vmp_interp_opnd *opnd)
+    {
+        xed_reg_enum_t reg;
+        int r;
+
+        memset(opnd, 0, sizeof (opnd[0]));
+
+        if (xed_operand_is_register(name))
+        {
+            reg = xed_decoded_inst_get_reg(xedd, name);
+            if ((r = vmp_interp_gpr(reg)) < 0)
+                return -1;
+
+            opnd->kind = VMP_INTERP_OPND_REG;
+            opnd->reg = (uint8_t)r;
+            opnd->size = (uint8_t)(xed_get_register_width_bits(reg) / 8);
+            opnd->shift = ((reg == XED_REG_AH) || (reg == XED_REG_CH) || (reg == XED_REG_DH) || (reg == XED_REG_BH)) ? 8 : 0;
+            return 0;
+        }
+
+        if ((name == XED_OPERAND_MEM0) || (name == XED_OPERAND_AGEN))
+        {
+            reg = xed_decoded_inst_get_base_reg(xedd, 0);
+            if (reg == XED_REG_INVALID)
+                op->base = VMP_INTERP_REG_NONE;
+            else if ((r = vmp_interp_gpr(reg)) >= 0)
+                op->base = (uint8_t)r;
+            else
+                return -1;
+
+            reg = xed_decoded_inst_get_index_reg(xedd, 0);
+            if (reg == XED_REG_INVALID)
+                op->index = VMP_INTERP_REG_NONE;
+            else if ((r = vmp_interp_gpr(reg)) >= 0)
+                op->index = (uint8_t)r;
+            else
+                return -1;
+
+            op->scale = (uint8_t)xed_decoded_inst_get_scale(xedd, 0);
+            op->disp = (int32_t)xed_decoded_inst_get_memory_displacement(xedd, 0);
+
+            opnd->kind = VMP_INTERP_OPND_MEM;
+            opnd->size = (name == XED_OPERAND_AGEN) ? 4 : (uint8_t)xed_decoded_inst_get_memory_operand_length(xedd, 0);
+            return 0;
+        }
+
+        if (name == XED_OPERAND_IMM0)
+        {
+            op->imm = (uint32_t)xed_decoded_inst_get_signed_immediate(xedd);
+            opnd->kind = VMP_INTERP_OPND_IMM;
+            opnd->size = 4;
+            return 0;
+        }
+
+        return -1;
+    }
+
+    static int vmp_interp_lift_code(xed_iclass_enum_t iclass)
+    {
+        switch (iclass)
+        {
+        case XED_ICLASS_MOV:        return VMP_INTERP_MOV;
+        case XED_ICLASS_MOVZX:      return VMP_INTERP_MOVZX;
+        case XED_ICLASS_MOVSX:      return VMP_INTERP_MOVSX;
+        case XED_ICLASS_ADD:        return VMP_INTERP_ADD;
+        case XED_ICLASS_SUB:        return VMP_INTERP_SUB;
+        case XED_ICLASS_XOR:        return VMP_INTERP_XOR;
+        case XED_ICLASS_AND:        return VMP_INTERP_AND;
+        case XED_ICLASS_OR:         return VMP_INTERP_OR;
+        case XED_ICLASS_NOT:        return VMP_INTERP_NOT;
+        case XED_ICLASS_NEG:        return VMP_INTERP_NEG;
+        case XED_ICLASS_INC:        return VMP_INTERP_INC;
+        case XED_ICLASS_DEC:        return VMP_INTERP_DEC;
+        case XED_ICLASS_ROL:        return VMP_INTERP_ROL;
+        case XED_ICLASS_ROR:        return VMP_INTERP_ROR;
+        case XED_ICLASS_SHL:        return VMP_INTERP_SHL;
+        case XED_ICLASS_SHR:        return VMP_INTERP_SHR;
+        case XED_ICLASS_SAR:        return VMP_INTERP_SAR;
+        case XED_ICLASS_BSWAP:      return VMP_INTERP_BSWAP;
+        case XED_ICLASS_LEA:        return VMP_INTERP_LEA;
+        case XED_ICLASS_PUSH:       return VMP_INTERP_PUSH;
+        case XED_ICLASS_POP:        return VMP_INTERP_POP;
+        case XED_ICLASS_XCHG:       return VMP_INTERP_XCHG;
+        case XED_ICLASS_JMP:        return VMP_INTERP_JMP;
+        case XED_ICLASS_RET_NEAR:   return VMP_INTERP_RET;
+        }
+
+        return 0;
+    }
+
+    static int vmp_interp_lift_inst(xed_decoded_inst_t *xedd, struct vmp_interp_op *op, int last)
+    {
+        const xed_inst_t *xi = xed_decoded_inst_inst(xedd);
+        const xed_operand_t *xop;
+        const xed_simple_flag_t *rfi;
+        struct vmp_interp_opnd opnds[2];
+        unsigned i, n = xed_inst_noperands(xi);
+        int k = 0;
+
+        memset(op, 0, sizeof (op[0]));
+
+        // 读标志位的指令结果和前面的花指令有关，不翻译
+        if ((rfi = xed_decoded_inst_get_rflags_info(xedd)) && xed_simple_flag_reads_flags(rfi))
+            return -1;
+
+        op->code = (uint8_t)vmp_interp_lift_code(xed_decoded_inst_get_iclass(xedd));
+        op->size = (uint8_t)(xed_decoded_inst_get_operand_width(xedd) / 8);
+        if (!op->code || (((op->code == VMP_INTERP_JMP) || (op->code == VMP_INTERP_RET)) != !!last))
+            return -1;
+
+        for (i = 0; i < n; i++)
+        {
+            xop = xed_inst_operand(xi, i);
+            if (xed_operand_operand_visibility(xop) != XED_OPVIS_EXPLICIT)
+                continue;
+            if ((k >= 2) || vmp_interp_lift_opnd(xedd, xed_operand_name(xop), op, opnds + k))
+                return -1;
+            k++;
+        }
+
+        switch (op->code)
+        {
+        case VMP_INTERP_PUSH:
+        case VMP_INTERP_JMP:
+            if (k != 1)
+                return -1;
+            op->src = opnds[0];
+            break;
+
+        case VMP_INTERP_RET:
+            op->imm = k ? (uint32_t)(xed_decoded_inst_get_unsigned_immediate(xedd) & 0xffff) : 0;
+            break;
+
+        case VMP_INTERP_POP:
+        case VMP_INTERP_NOT:
+        case VMP_INTERP_NEG:
+        case VMP_INTERP_INC:
+        case VMP_INTERP_DEC:
+        case VMP_INTERP_BSWAP:
+            if ((k != 1) || (opnds[0].kind == VMP_INTERP_OPND_IMM))
+                return -1;
+            // pop [esp + x]的地址是弹栈以后算的，不管它
+            if ((op->code == VMP_INTERP_POP) && (opnds[0].kind != VMP_INTERP_OPND_REG))
+                return -1;
+            op->dst = opnds[0];
+            break;
+
+        case VMP_INTERP_ROL:
+        case VMP_INTERP_ROR:
+        case VMP_INTERP_SHL:
+        case VMP_INTERP_SHR:
+        case VMP_INTERP_SAR:
+            if ((k < 1) || (opnds[0].kind == VMP_INTERP_OPND_IMM))
+                return -1;
+            op->dst = opnds[0];
+            // D1 /x 的移位次数1是隐含的
+            if (k == 1)
+            {
+                op->src.kind = VMP_INTERP_OPND_IMM;
+                op->src.size = 1;
+                op->imm = 1;
+            }
+            else
+            {
+                op->src = opnds[1];
+            }
+            break;
+
+        default:
+            if ((k != 2) || (opnds[0].kind == VMP_INTERP_OPND_IMM))
+                return -1;
+            op->dst = opnds[0];
+            op->src = opnds[1];
+            break;
+        }
+
+        if (!op->size)
+            op->size = op->dst.size ? op->dst.size : 4;
+
+        return 0;
+    }
+
+    struct vmp_interp_prog *vmp_interp_lift(uint8_t **insts, uint8_t *lens, int counts)
+    {
+        struct vmp_interp_prog *prog;
+        xed_decoded_inst_t xedd;
+        int i;
+
+        if ((counts <= 0) || (counts > VMP_INTERP_OPS_MAX))
+            return NULL;
+
+        prog = (struct vmp_interp_prog *)calloc(1, sizeof (prog[0]) + (counts - 1) * sizeof (prog->ops[0]));
+        if (!prog)
+        {
+            printf("vmp_interp_lift() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+        prog->counts = counts;
+
+        for (i = 0; i < counts; i++)
+        {
+            xed_decoded_inst_zero(&xedd);
+            xed_decoded_inst_set_mode(&xedd, XED_MACHINE_MODE_LEGACY_32, XED_ADDRESS_WIDTH_32b);
+            if ((xed_decode(&xedd, insts[i], lens[i]) != XED_ERROR_NONE)
+                || vmp_interp_lift_inst(&xedd, prog->ops + i, i == counts - 1))
+            {
+                free(prog);
+                return NULL;
+            }
+        }
+
+        return prog;
+    }
+
+    void vmp_interp_free(struct vmp_interp_prog *prog)
+    {
+        free(prog);
+    }
+
+    void vmp_interp_begin(struct vmp_interp_ctx *ctx, struct x86_emu_mod *emu)
+    {
+        struct x86_emu_reg *regs = &emu->eax;
+        int i;
+
+        ctx->emu = emu;
+        ctx->store_counts = 0;
+        for (i = 0; i < 8; i++)
+        {
+            ctx->regs[i] = regs[i].u.r32;
+            ctx->known[i] = regs[i].known;
+        }
+    }
+
+    static uint8_t *vmp_interp_stack_known(struct x86_emu_mod *emu, uint32_t va)
+    {
+        if ((va >= emu->stack.esp_start) && (va <= emu->stack.esp_end))
+            return emu->stack.known + (va - emu->stack.esp_start);
+
+        return NULL;
+    }
+
+    static int vmp_interp_reg_read(struct vmp_interp_ctx *ctx, int reg, int shift, int size, uint32_t *v)
+    {
+        uint32_t m = vmp_interp_mask(size) << shift;
+
+        if ((ctx->known[reg] & m) != m)
+            return -1;
+
+        *v = (ctx->regs[reg] & m) >> shift;
+        return 0;
+    }
+
+    static void vmp_interp_reg_write(struct vmp_interp_ctx *ctx, int reg, int shift, int size, uint32_t v)
+    {
+        uint32_t m = vmp_interp_mask(size) << shift;
+
+        ctx->regs[reg] = (ctx->regs[reg] & ~m) | ((v << shift) & m);
+        ctx->known[reg] |= m;
+    }
+
+    static int vmp_interp_ea(struct vmp_interp_ctx *ctx, struct vmp_interp_op *op, uint32_t *ea)
+    {
+        uint32_t b = 0, x = 0;
+
+        if ((op->base != VMP_INTERP_REG_NONE) && vmp_interp_reg_read(ctx, op->base, 0, 4, &b))
+            return -1;
+        if ((op->index != VMP_INTERP_REG_NONE) && vmp_interp_reg_read(ctx, op->index, 0, 4, &x))
+            return -1;
+
+        *ea = b + x * op->scale + (uint32_t)op->disp;
+        return 0;
+    }
+
+    // known不为空的话按模拟器的规则返回每个字节是不是已知: 模拟器只在push的时候维护栈的known，
+    // 其他方式写的内存known不变，读内存(除了pop)都当成已知
+    static int vmp_interp_load(struct vmp_interp_ctx *ctx, uint32_t va, int size, uint32_t *v, uint32_t *known)
+    {
+        struct vmp_interp_store *st;
+        uint8_t *p, *k, b, kb;
+        uint32_t val = 0, kv = 0, a;
+        int i, j;
+
+        if (!(p = x86_emu_mem_ptr(ctx->emu, va, size)))
+            return -1;
+
+        for (i = size - 1; i >= 0; i--)
+        {
+            a = va + i;
+            b = p[i];
+            kb = (k = vmp_interp_stack_known(ctx->emu, a)) ? k[0] : 0xff;
+
+            // 这个handler自己写过的话用写的值，后写的优先
+            for (j = ctx->store_counts - 1; j >= 0; j--)
+            {
+                st = ctx->stores + j;
+                if ((a >= st->va) && (a < st->va + st->size))
+                {
+                    b = (uint8_t)(st->val >> ((a - st->va) * 8));
+                    if (st->push)
+                        kb = 0xff;
+                    break;
+                }
+            }
+
+            val = (val << 8) | b;
+            kv = (kv << 8) | kb;
+        }
+
+        *v = val;
+        if (known)
+            *known = kv;
+        return 0;
+    }
+
+    static int vmp_interp_store(struct vmp_interp_ctx *ctx, uint32_t va, int size, uint32_t v, int push)
+    {
+        struct vmp_interp_store *st;
+
+        if ((ctx->store_counts >= VMP_INTERP_STORES_MAX) || !x86_emu_mem_ptr(ctx->emu, va, size))
+            return -1;
+
+        st = ctx->stores + ctx->store_counts++;
+        st->va = va;
+        st->size = (uint8_t)size;
+        st->val = v & vmp_interp_mask(size);
+        st->push = (uint8_t)push;
+
+        return 0;
+    }
+
+    static int vmp_interp_read(struct vmp_interp_ctx *ctx, struct vmp_interp_op *op, struct vmp_interp_opnd *opnd, uint32_t *v)
+    {
+        uint32_t ea;
+
+        switch (opnd->kind)
+        {
+        case VMP_INTERP_OPND_REG:
+            return vmp_interp_reg_read(ctx, opnd->reg, opnd->shift, opnd->size, v);
+
+        case VMP_INTERP_OPND_MEM:
+            if (vmp_interp_ea(ctx, op, &ea))
+                return -1;
+            return vmp_interp_load(ctx, ea, opnd->size, v, NULL);
+
+        case VMP_INTERP_OPND_IMM:
+            *v = op->imm;
+            return 0;
+        }
+
+        return -1;
+    }
+
+    static int vmp_interp_write(struct vmp_interp_ctx *ctx, struct vmp_interp_op *op, struct vmp_interp_opnd *opnd, uint32_t v)
+    {
+        uint32_t ea;
+
+        switch (opnd->kind)
+        {
+        case VMP_INTERP_OPND_REG:
+            // 32位寄存器的写会把整个寄存器覆盖掉，16位和8位只改一部分
+            vmp_interp_reg_write(ctx, opnd->reg, opnd->shift, opnd->size, v);
+            return 0;
+
+        case VMP_INTERP_OPND_MEM:
+            if (vmp_interp_ea(ctx, op, &ea))
+                return -1;
+            return vmp_interp_store(ctx, ea, opnd->size, v, 0);
+        }
+
+        return -1;
+    }
+
+    static uint32_t vmp_interp_shift(int code, uint32_t v, uint32_t count, int size)
+    {
+        int bits = size * 8;
+        uint32_t m = vmp_interp_mask(size);
+
+        count &= 0x1f;
+        v &= m;
+
+        switch (code)
+        {
+        case VMP_INTERP_ROL:
+            count %= bits;
+            return count ? (((v << count) | (v >> (bits - count))) & m) : v;
+        case VMP_INTERP_ROR:
+            count %= bits;
+            return count ? (((v >> count) | (v << (bits - count))) & m) : v;
+        case VMP_INTERP_SHL:
+            return (v << count) & m;
+        case VMP_INTERP_SHR:
+            return v >> count;
+        case VMP_INTERP_SAR:
+            // 先符号扩展到32位再移
+            if (bits < 32)
+                v = (uint32_t)(((int32_t)(v << (32 - bits))) >> (32 - bits));
+            return ((uint32_t)((int32_t)v >> count)) & m;
+        }
+
+        return v;
+    }
+
+    static int vmp_interp_exec(struct vmp_interp_ctx *ctx, struct vmp_interp_op *op)
+    {
+        uint32_t a, b, esp;
+
+        switch (op->code)
+        {
+        case VMP_INTERP_MOV:
+        case VMP_INTERP_MOVZX:
+            if (vmp_interp_read(ctx, op, &op->src, &b))
+                return -1;
+            return vmp_interp_write(ctx, op, &op->dst, b);
+
+        case VMP_INTERP_MOVSX:
+            if (vmp_interp_read(ctx, op, &op->src, &b))
+                return -1;
+            b = (op->src.size == 1) ? (uint32_t)(int8_t)b : (uint32_t)(int16_t)b;
+            return vmp_interp_write(ctx, op, &op->dst, b);
+
+        case VMP_INTERP_ADD:
+        case VMP_INTERP_SUB:
+        case VMP_INTERP_XOR:
+        case VMP_INTERP_AND:
+        case VMP_INTERP_OR:
+            if (vmp_interp_read(ctx, op, &op->dst, &a) || vmp_interp_read(ctx, op, &op->src, &b))
+                return -1;
+            switch (op->code)
+            {
+            case VMP_INTERP_ADD:    a += b; break;
+            case VMP_INTERP_SUB:    a -= b; break;
+            case VMP_INTERP_XOR:    a ^= b; break;
+            case VMP_INTERP_AND:    a &= b; break;
+            case VMP_INTERP_OR:     a |= b; break;
+            }
+            return vmp_interp_write(ctx, op, &op->dst, a);
+
+        case VMP_INTERP_NOT:
+        case VMP_INTERP_NEG:
+        case VMP_INTERP_INC:
+        case VMP_INTERP_DEC:
+        case VMP_INTERP_BSWAP:
+            if (vmp_interp_read(ctx, op, &op->dst, &a))
+                return -1;
+            switch (op->code)
+            {
+            case VMP_INTERP_NOT:    a = ~a; break;
+            case VMP_INTERP_NEG:    a = 0 - a; break;
+            case VMP_INTERP_INC:    a++; break;
+            case VMP_INTERP_DEC:    a--; break;
+            case VMP_INTERP_BSWAP:
+                a = (a >> 24) | ((a >> 8) & 0xff00) | ((a << 8) & 0xff0000) | (a << 24);
+                break;
+            }
+            return vmp_interp_write(ctx, op, &op->dst, a);
+
+        case VMP_INTERP_ROL:
+        case VMP_INTERP_ROR:
+        case VMP_INTERP_SHL:
+        case VMP_INTERP_SHR:
+        case VMP_INTERP_SAR:
+            if (vmp_interp_read(ctx, op, &op->dst, &a) || vmp_interp_read(ctx, op, &op->src, &b))
+                return -1;
+            return vmp_interp_write(ctx, op, &op->dst, vmp_interp_shift(op->code, a, b, op->dst.size));
+
+        case VMP_INTERP_LEA:
+            if (vmp_interp_ea(ctx, op, &a))
+                return -1;
+            return vmp_interp_write(ctx, op, &op->dst, a);
+
+        case VMP_INTERP_XCHG:
+            if (vmp_interp_read(ctx, op, &op->dst, &a) || vmp_interp_read(ctx, op, &op->src, &b))
+                return -1;
+            if (vmp_interp_write(ctx, op, &op->dst, b))
+                return -1;
+            return vmp_interp_write(ctx, op, &op->src, a);
+
+        case VMP_INTERP_PUSH:
+            // push esp压的是减之前的值
+            if (vmp_interp_read(ctx, op, &op->src, &b) || vmp_interp_reg_read(ctx, OPERAND_TYPE_REG_ESP, 0, 4, &esp))
+                return -1;
+            esp -= op->size;
+            vmp_interp_reg_write(ctx, OPERAND_TYPE_REG_ESP, 0, 4, esp);
+            return vmp_interp_store(ctx, esp, op->size, b, 1);
+
+        case VMP_INTERP_POP:
+            // pop出来的值是不是已知的取决于栈上的known
+            if (vmp_interp_reg_read(ctx, OPERAND_TYPE_REG_ESP, 0, 4, &esp) || vmp_interp_load(ctx, esp, op->size, &b, &a))
+                return -1;
+            vmp_interp_reg_write(ctx, OPERAND_TYPE_REG_ESP, 0, 4, esp + op->size);
+            vmp_interp_write(ctx, op, &op->dst, b);
+            ctx->known[op->dst.reg] = (ctx->known[op->dst.reg] & ~vmp_interp_mask(op->size)) | (a & vmp_interp_mask(op->size));
+            return 0;
+        }
+
+        return -1;
+    }
+
+    int vmp_interp_body(struct vmp_interp_ctx *ctx, struct vmp_interp_prog *prog)
+    {
+        int i;
+
+        for (i = 0; i < prog->counts - 1; i++)
+        {
+            if (vmp_interp_exec(ctx, prog->ops + i))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    int vmp_interp_target(struct vmp_interp_ctx *ctx, struct vmp_interp_prog *prog, uint32_t *to)
+    {
+        struct vmp_interp_op *op = prog->ops + prog->counts - 1;
+        uint32_t esp;
+
+        if (op->code == VMP_INTERP_JMP)
+            return vmp_interp_read(ctx, op, &op->src, to);
+
+        if (vmp_interp_reg_read(ctx, OPERAND_TYPE_REG_ESP, 0, 4, &esp))
+            return -1;
+
+        return vmp_interp_load(ctx, esp, 4, to, NULL);
+    }
+
+    int vmp_interp_dispatch(struct vmp_interp_ctx *ctx, struct vmp_interp_prog *prog)
+    {
+        struct vmp_interp_op *op = prog->ops + prog->counts - 1;
+        uint32_t esp;
+
+        if (op->code == VMP_INTERP_RET)
+        {
+            if (vmp_interp_reg_read(ctx, OPERAND_TYPE_REG_ESP, 0, 4, &esp))
+                return -1;
+            vmp_interp_reg_write(ctx, OPERAND_TYPE_REG_ESP, 0, 4, esp + 4 + op->imm);
+        }
+
+        return 0;
+    }
+
+    int vmp_interp_commit(struct vmp_interp_ctx *ctx)
+    {
+        struct x86_emu_reg *regs = &ctx->emu->eax;
+        struct vmp_interp_store *st;
+        uint8_t *p, *known;
+        int i, j;
+
+        for (i = 0; i < ctx->store_counts; i++)
+        {
+            st = ctx->stores + i;
+            if (!(p = x86_emu_mem_write_ptr(ctx->emu, st->va, st->size)))
+                continue;
+
+            for (j = 0; j < st->size; j++)
+            {
+                p[j] = (uint8_t)(st->val >> (j * 8));
+                if (st->push && (known = vmp_interp_stack_known(ctx->emu, st->va + j)))
+                    known[0] = 0xff;
+            }
+        }
+
+        for (i = 0; i < 8; i++)
+        {
+            regs[i].u.r32 = ctx->regs[i];
+            regs[i].known = ctx->known[i];
+        }
+        ctx->store_counts = 0;
+
+        return 0;
+    }
+
+    int vmp_interp_check(struct vmp_interp_ctx *ctx, struct x86_emu_mod *emu)
+    {
+        struct x86_emu_reg *regs = &emu->eax;
+        struct vmp_interp_store *st;
+        uint8_t *p;
+        int i, j, k;
+
+        for (i = OPERAND_TYPE_REG_EBX; i <= OPERAND_TYPE_REG_EDI; i++)
+        {
+            if (regs[i].u.r32 != ctx->regs[i])
+                return -1;
+        }
+
+        // 同一个地址写了几次的，只看最后一次
+        for (i = 0; i < ctx->store_counts; i++)
+        {
+            st = ctx->stores + i;
+            if (!(p = x86_emu_mem_ptr(emu, st->va, st->size)))
+                return -1;
+
+            for (j = 0; j < st->size; j++)
+            {
+                for (k = i + 1; k < ctx->store_counts; k++)
+                {
+                    if ((st->va + j >= ctx->stores[k].va) && (st->va + j < ctx->stores[k].va + ctx->stores[k].size))
+                        break;
+                }
+
+                if ((k == ctx->store_counts) && (p[j] != (uint8_t)(st->val >> (j * 8))))
+                    return -1;
+            }
+        }
+
+        return 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
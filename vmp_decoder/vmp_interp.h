@@ -0,0 +1,129 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_interp_h__
+#define __vmp_interp_h__
+
+#include <stdint.h>
+#include "x86_emu.h"
+
+// VM指令级的解释器: handler的摘要(去掉花指令以后的指令)翻译成一串简单的操作，直接在VIP/VM栈/context上执行，
+// 不再经过x86模拟器的解码。只翻译普通的数据传送、算术、移位、push/pop，读标志位的指令(pushfd/adc/cmovcc...)、
+// call、串指令都不认识，这种handler还是交给x86模拟器
+#define VMP_INTERP_OPS_MAX          256
+// 一个handler最多写这么多次内存，写的内容先记在ctx里，执行完了再一起写回模拟器
+#define VMP_INTERP_STORES_MAX       32
+
+#define VMP_INTERP_MOV              1
+#define VMP_INTERP_MOVZX            2
+#define VMP_INTERP_MOVSX            3
+#define VMP_INTERP_ADD              4
+#define VMP_INTERP_SUB              5
+#define VMP_INTERP_XOR              6
+#define VMP_INTERP_AND              7
+#define VMP_INTERP_OR               8
+#define VMP_INTERP_NOT              9
+#define VMP_INTERP_NEG              10
+#define VMP_INTERP_INC              11
+#define VMP_INTERP_DEC              12
+#define VMP_INTERP_ROL              13
+#define VMP_INTERP_ROR              14
+#define VMP_INTERP_SHL              15
+#define VMP_INTERP_SHR              16
+#define VMP_INTERP_SAR              17
+#define VMP_INTERP_BSWAP            18
+#define VMP_INTERP_LEA              19
+#define VMP_INTERP_PUSH             20
+#define VMP_INTERP_POP              21
+#define VMP_INTERP_XCHG             22
+// 只能是最后一条，handler的分发
+#define VMP_INTERP_JMP              23
+#define VMP_INTERP_RET              24
+
+#define VMP_INTERP_OPND_NONE        0
+#define VMP_INTERP_OPND_REG         1
+#define VMP_INTERP_OPND_MEM         2
+#define VMP_INTERP_OPND_IMM         3
+
+#define VMP_INTERP_REG_NONE         0xff
+
+typedef struct vmp_interp_opnd
+{
+    uint8_t     kind;
+    // OPERAND_TYPE_REG_xxx
+    uint8_t     reg;
+    // 高8位寄存器(ah/ch/dh/bh)是8
+    uint8_t     shift;
+    // 字节数
+    uint8_t     size;
+} vmp_interp_opnd_t;
+
+typedef struct vmp_interp_op
+{
+    uint8_t     code;
+    uint8_t     size;
+    struct vmp_interp_opnd dst;
+    struct vmp_interp_opnd src;
+
+    // 一条指令最多一个内存操作数
+    uint8_t     base;
+    uint8_t     index;
+    uint8_t     scale;
+    int32_t     disp;
+    uint32_t    imm;
+} vmp_interp_op_t;
+
+typedef struct vmp_interp_prog
+{
+    int         counts;
+    // 最后一条是分发
+    struct vmp_interp_op ops[1];
+} vmp_interp_prog_t;
+
+typedef struct vmp_interp_store
+{
+    uint32_t    va;
+    uint32_t    val;
+    uint8_t     size;
+    // push写的，和模拟器一样把栈上对应的known置上
+    uint8_t     push;
+} vmp_interp_store_t;
+
+// 一次执行的寄存器和写内存记录，vmp_interp_commit以前模拟器里的状态不会变
+typedef struct vmp_interp_ctx
+{
+    struct x86_emu_mod *emu;
+    uint32_t    regs[8];
+    uint32_t    known[8];
+    int         store_counts;
+    struct vmp_interp_store stores[VMP_INTERP_STORES_MAX];
+} vmp_interp_ctx_t;
+
+/* 把handler的摘要翻译成vmp_interp_prog
+@return     NULL        有不认识的指令 */
+struct vmp_interp_prog *vmp_interp_lift(uint8_t **insts, uint8_t *lens, int counts);
+void vmp_interp_free(struct vmp_interp_prog *prog);
+
+void vmp_interp_begin(struct vmp_interp_ctx *ctx, struct x86_emu_mod *emu);
+/* 执行除了分发以外的指令
+@return     0           success
+            -1          读到了未知的寄存器或者内存，访问了模拟器没有的地址，ctx作废 */
+int vmp_interp_body(struct vmp_interp_ctx *ctx, struct vmp_interp_prog *prog);
+/* 分发的目标，不改变ctx */
+int vmp_interp_target(struct vmp_interp_ctx *ctx, struct vmp_interp_prog *prog, uint32_t *to);
+/* 分发对寄存器的影响，ret的话弹栈 */
+int vmp_interp_dispatch(struct vmp_interp_ctx *ctx, struct vmp_interp_prog *prog);
+/* 寄存器和写过的内存写回模拟器 */
+int vmp_interp_commit(struct vmp_interp_ctx *ctx);
+/* 和模拟器的当前状态比较: EBX/ESP/EBP/ESI/EDI和ctx里写过的内存
+@return     0           一致 */
+int vmp_interp_check(struct vmp_interp_ctx *ctx, struct x86_emu_mod *emu);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,228 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include "xed/xed-interface.h"
+#include "xed/xed-address-width-enum.h"
+#include "vmp_scan.h"
+#include "mbytes.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define FAKE_IMAGE_BASE             0x400000
+
+    struct vmp_scan_ctx
+    {
+        struct vmp_scan_param *param;
+        struct vmp_scan_entry *entries;
+        int         counts;
+        int         size;
+        uint64_t    candidates;
+    };
+
+    const char *vmp_scan_kind_name(int kind)
+    {
+        return (kind == VMP_SCAN_PUSH_CALL) ? "push_call" : ((kind == VMP_SCAN_JMP) ? "jmp" : "unknown");
+    }
+
+    static int vmp_scan_in_vmp(struct vmp_scan_param *param, uint8_t *p, int len)
+    {
+        int i;
+
+        for (i = 0; i < param->sec_counts; i++)
+        {
+            if ((p >= param->sec_start[i]) && (p + len <= param->sec_start[i] + param->sec_size[i]))
+                return i + 1;
+        }
+
+        return 0;
+    }
+
+    // @return     指令长度，解码失败返回0
+    static int vmp_scan_decode(uint8_t *p, uint8_t *end, xed_decoded_inst_t *xedd)
+    {
+        if (p >= end)
+            return 0;
+
+        xed_decoded_inst_zero(xedd);
+        xed_decoded_inst_set_mode(xedd, XED_MACHINE_MODE_LEGACY_32, XED_ADDRESS_WIDTH_32b);
+        if (xed_decode(xedd, p, (end - p > 15) ? 15 : (unsigned int)(end - p)) != XED_ERROR_NONE)
+            return 0;
+
+        return xed_decoded_inst_get_length(xedd);
+    }
+
+    // 目标处开头的几条指令要能正常解码，而且不跑出vmp段，碰到跳转就算确认了
+    static int vmp_scan_verify_target(struct vmp_scan_param *param, uint8_t *target)
+    {
+        xed_decoded_inst_t xedd;
+        xed_category_enum_t cat;
+        int i, sec, len;
+
+        for (i = 0; i < VMP_SCAN_VERIFY_INSTS; i++)
+        {
+            if (!(sec = vmp_scan_in_vmp(param, target, 1)))
+                return 0;
+
+            len = vmp_scan_decode(target, param->sec_start[sec - 1] + param->sec_size[sec - 1], &xedd);
+            if (!len)
+                return 0;
+
+            cat = xed_decoded_inst_get_category(&xedd);
+            if ((cat == XED_CATEGORY_UNCOND_BR) || (cat == XED_CATEGORY_CALL) || (cat == XED_CATEGORY_RET))
+                return 1;
+
+            target += len;
+        }
+
+        return 1;
+    }
+
+    static int vmp_scan_add(struct vmp_scan_ctx *ctx, uint8_t *p, uint8_t *target, uint32_t imm, int kind)
+    {
+        struct vmp_scan_entry *entries, *entry;
+        uint8_t *image_base = ctx->param->pe->image_base;
+
+        if (ctx->counts == ctx->size)
+        {
+            entries = (struct vmp_scan_entry *)realloc(ctx->entries, (ctx->size * 2 + 64) * sizeof (entries[0]));
+            if (!entries)
+            {
+                printf("vmp_scan_add() failed with realloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+            ctx->entries = entries;
+            ctx->size = ctx->size * 2 + 64;
+        }
+
+        entry = ctx->entries + ctx->counts++;
+        entry->addr = FAKE_IMAGE_BASE + (uint32_t)(p - image_base);
+        entry->target = FAKE_IMAGE_BASE + (uint32_t)(target - image_base);
+        entry->imm = imm;
+        entry->kind = kind;
+
+        return 0;
+    }
+
+    // p处是0x68或者0xe9，看看是不是入口桩
+    static int vmp_scan_check(struct vmp_scan_ctx *ctx, uint8_t *p, uint8_t *end)
+    {
+        xed_decoded_inst_t xedd;
+        uint8_t *call = p, *target;
+        int kind = VMP_SCAN_JMP;
+
+        ctx->candidates++;
+
+        if (p[0] == 0x68)
+        {
+            if ((p + 10 > end) || (p[5] != 0xe8))
+                return 0;
+            kind = VMP_SCAN_PUSH_CALL;
+            call = p + 5;
+        }
+        else if (p + 5 > end)
+        {
+            return 0;
+        }
+
+        // 先算目标，绝大部分候选在这里就排除了
+        target = call + 5 + (int32_t)mbytes_read_int_little_endian_4b(call + 1);
+        if (!vmp_scan_in_vmp(ctx->param, target, 1))
+            return 0;
+
+        if ((vmp_scan_decode(p, end, &xedd) != 5)
+            || ((kind == VMP_SCAN_PUSH_CALL) && (vmp_scan_decode(call, end, &xedd) != 5))
+            || !vmp_scan_verify_target(ctx->param, target))
+            return 0;
+
+        return vmp_scan_add(ctx, p, target,
+            (kind == VMP_SCAN_PUSH_CALL) ? mbytes_read_int_little_endian_4b(p + 1) : 0, kind);
+    }
+
+    static int vmp_scan_section(struct vmp_scan_ctx *ctx, uint8_t *start, int size)
+    {
+        uint8_t *p = start, *end = start + size;
+        __m128i jmp = _mm_set1_epi8((char)0xe9), push = _mm_set1_epi8(0x68), call = _mm_set1_epi8((char)0xe8), v, v5;
+        unsigned int mask;
+        int bit;
+
+        // 一次比16个字节: 0xe9，或者0x68并且5个字节以后是0xe8
+        for (; p + 16 + 5 <= end; p += 16)
+        {
+            v = _mm_loadu_si128((const __m128i *)p);
+            v5 = _mm_loadu_si128((const __m128i *)(p + 5));
+            mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, jmp),
+                _mm_and_si128(_mm_cmpeq_epi8(v, push), _mm_cmpeq_epi8(v5, call))));
+
+            for (bit = 0; mask; bit++, mask >>= 1)
+            {
+                if ((mask & 1) && vmp_scan_check(ctx, p + bit, end))
+                    return -1;
+            }
+        }
+
+        for (; p < end; p++)
+        {
+            if (((p[0] == 0xe9) || (p[0] == 0x68)) && vmp_scan_check(ctx, p, end))
+                return -1;
+        }
+
+        return 0;
+    }
+
+    static int vmp_scan_cmp(const void *a, const void *b)
+    {
+        uint32_t x = ((const struct vmp_scan_entry *)a)->addr, y = ((const struct vmp_scan_entry *)b)->addr;
+
+        return (x < y) ? -1 : (x > y);
+    }
+
+    int vmp_scan_entries(struct vmp_scan_param *param, struct vmp_scan_entry **entries, int *counts)
+    {
+        struct vmp_scan_ctx ctx;
+        uint8_t *start;
+        DWORD characteristics;
+        int i, size, sections = 0;
+
+        memset(&ctx, 0, sizeof (ctx));
+        ctx.param = param;
+        *entries = NULL;
+        *counts = 0;
+
+        for (i = 0; pe_loader_section_get(param->pe, i, &start, &size, &characteristics); i++)
+        {
+            // vmp段自己里面全是变形过的代码，不扫
+            if (!(characteristics & (IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_CNT_CODE))
+                || (size <= 0) || vmp_scan_in_vmp(param, start, 1))
+                continue;
+
+            sections++;
+            if (vmp_scan_section(&ctx, start, size))
+            {
+                printf("vmp_scan_entries() failed with vmp_scan_section(). %s:%d\n", __FILE__, __LINE__);
+                free(ctx.entries);
+                return -1;
+            }
+        }
+
+        qsort(ctx.entries, ctx.counts, sizeof (ctx.entries[0]), vmp_scan_cmp);
+
+        printf("vm entry scan: sections[%d] candidates[%llu] entries[%d]\n",
+            sections, (unsigned long long)ctx.candidates, ctx.counts);
+
+        *entries = ctx.entries;
+        *counts = ctx.counts;
+
+        return 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,57 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_scan_h__
+#define __vmp_scan_h__
+
+#include <windows.h>
+#include <stdint.h>
+#include "pe_loader.h"
+
+// VM入口扫描: vmp_decoder_find_vmp_start_addr只从PE入口沿一条路径走到第一个进vmp段的跳转，
+// 被虚拟化的函数很多的话每个都要手工给-vmp_start_addr。这里把所有代码段(vmp段除外)一次扫完，
+// 用SSE2一次比16个字节找vmp的入口桩:
+//  push imm32; call rel32      call的目标在vmp段里
+//  jmp rel32                   被虚拟化的函数原来的位置跳到vmp段里
+// 找到的候选再解码确认一遍: 桩本身的指令长度对，目标在vmp段里开头的几条指令都能正常解码
+#define VMP_SCAN_PUSH_CALL          1
+#define VMP_SCAN_JMP                2
+
+// 目标处解码这么多条指令来确认
+#define VMP_SCAN_VERIFY_INSTS       4
+#define VMP_SCAN_SECTIONS_MAX       3
+
+typedef struct vmp_scan_entry
+{
+    // 入口桩的IDA地址，可以直接当-vmp_start_addr用
+    uint32_t    addr;
+    // 进vmp段的目标(IDA地址)
+    uint32_t    target;
+    // push imm32的立即数，jmp的话是0
+    uint32_t    imm;
+    int         kind;
+} vmp_scan_entry_t;
+
+typedef struct vmp_scan_param
+{
+    struct pe_loader *pe;
+    int         sec_counts;
+    uint8_t     *sec_start[VMP_SCAN_SECTIONS_MAX];
+    int         sec_size[VMP_SCAN_SECTIONS_MAX];
+} vmp_scan_param_t;
+
+/* 扫描所有的代码段，按地址排好序返回
+@entries    返回malloc出来的数组，用完free
+@return     0           success，没找到的时候counts是0
+            -1          failed */
+int vmp_scan_entries(struct vmp_scan_param *param, struct vmp_scan_entry **entries, int *counts);
+const char *vmp_scan_kind_name(int kind);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
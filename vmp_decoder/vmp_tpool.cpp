@@ -0,0 +1,158 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "vmp_tpool.h"
+
+    static unsigned __stdcall vmp_tpool_worker(void *arg)
+    {
+        struct vmp_tpool *pool = (struct vmp_tpool *)arg;
+        struct vmp_tpool_task *task;
+
+        while (1)
+        {
+            AcquireSRWLockExclusive(&pool->lock);
+            while (!pool->head && !pool->quit)
+            {
+                SleepConditionVariableSRW(&pool->has_task, &pool->lock, INFINITE, 0);
+            }
+
+            if (!pool->head)
+            {
+                ReleaseSRWLockExclusive(&pool->lock);
+                break;
+            }
+
+            task = pool->head;
+            pool->head = task->next;
+            if (!pool->head)
+                pool->tail = NULL;
+            ReleaseSRWLockExclusive(&pool->lock);
+
+            task->func(task->arg);
+            free(task);
+
+            AcquireSRWLockExclusive(&pool->lock);
+            if (!--pool->pending)
+            {
+                WakeAllConditionVariable(&pool->all_done);
+            }
+            ReleaseSRWLockExclusive(&pool->lock);
+        }
+
+        return 0;
+    }
+
+    int vmp_tpool_cpu_counts(void)
+    {
+        SYSTEM_INFO si;
+
+        GetSystemInfo(&si);
+
+        return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+    }
+
+    struct vmp_tpool *vmp_tpool_create(int threads)
+    {
+        struct vmp_tpool *pool = (struct vmp_tpool *)calloc(1, sizeof (pool[0]));
+        int i;
+
+        if (!pool)
+        {
+            printf("vmp_tpool_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        if (threads <= 0)
+            threads = vmp_tpool_cpu_counts();
+        if (threads > VMP_TPOOL_MAX_THREADS)
+            threads = VMP_TPOOL_MAX_THREADS;
+
+        InitializeSRWLock(&pool->lock);
+        InitializeConditionVariable(&pool->has_task);
+        InitializeConditionVariable(&pool->all_done);
+
+        for (i = 0; i < threads; i++)
+        {
+            pool->threads[i] = (HANDLE)_beginthreadex(NULL, 0, vmp_tpool_worker, pool, 0, NULL);
+            if (!pool->threads[i])
+            {
+                printf("vmp_tpool_create() failed with _beginthreadex(). %s:%d\n", __FILE__, __LINE__);
+                vmp_tpool_destroy(pool);
+                return NULL;
+            }
+            pool->thread_counts++;
+        }
+
+        return pool;
+    }
+
+    int vmp_tpool_destroy(struct vmp_tpool *pool)
+    {
+        int i;
+
+        if (!pool)
+            return 0;
+
+        AcquireSRWLockExclusive(&pool->lock);
+        pool->quit = 1;
+        WakeAllConditionVariable(&pool->has_task);
+        ReleaseSRWLockExclusive(&pool->lock);
+
+        for (i = 0; i < pool->thread_counts; i++)
+        {
+            WaitForSingleObject(pool->threads[i], INFINITE);
+            CloseHandle(pool->threads[i]);
+        }
+        free(pool);
+
+        return 0;
+    }
+
+    int vmp_tpool_submit(struct vmp_tpool *pool, vmp_tpool_func func, void *arg)
+    {
+        struct vmp_tpool_task *task = (struct vmp_tpool_task *)malloc(sizeof (task[0]));
+
+        if (!task)
+        {
+            printf("vmp_tpool_submit() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+
+        task->next = NULL;
+        task->func = func;
+        task->arg = arg;
+
+        AcquireSRWLockExclusive(&pool->lock);
+        if (pool->tail)
+            pool->tail->next = task;
+        else
+            pool->head = task;
+        pool->tail = task;
+        pool->pending++;
+        WakeConditionVariable(&pool->has_task);
+        ReleaseSRWLockExclusive(&pool->lock);
+
+        return 0;
+    }
+
+    int vmp_tpool_wait(struct vmp_tpool *pool)
+    {
+        AcquireSRWLockExclusive(&pool->lock);
+        while (pool->pending)
+        {
+            SleepConditionVariableSRW(&pool->all_done, &pool->lock, INFINITE, 0);
+        }
+        ReleaseSRWLockExclusive(&pool->lock);
+
+        return 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
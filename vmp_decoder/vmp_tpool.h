@@ -0,0 +1,56 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_tpool_h__
+#define __vmp_tpool_h__
+
+#include <windows.h>
+
+// 固定大小的线程池，任务按提交顺序执行，不保证完成顺序
+#define VMP_TPOOL_MAX_THREADS       64
+
+typedef void (*vmp_tpool_func)(void *arg);
+
+typedef struct vmp_tpool_task
+{
+    struct vmp_tpool_task   *next;
+    vmp_tpool_func          func;
+    void                    *arg;
+} vmp_tpool_task_t;
+
+typedef struct vmp_tpool
+{
+    SRWLOCK             lock;
+    CONDITION_VARIABLE  has_task;
+    CONDITION_VARIABLE  all_done;
+
+    struct vmp_tpool_task *head;
+    struct vmp_tpool_task *tail;
+    // 已提交但还没执行完的任务数
+    int                 pending;
+    int                 quit;
+
+    HANDLE              threads[VMP_TPOOL_MAX_THREADS];
+    int                 thread_counts;
+} vmp_tpool_t;
+
+/*
+@threads    线程数，<=0时用CPU核数 */
+struct vmp_tpool *vmp_tpool_create(int threads);
+/* 等所有任务执行完再退出 */
+int vmp_tpool_destroy(struct vmp_tpool *pool);
+
+int vmp_tpool_submit(struct vmp_tpool *pool, vmp_tpool_func func, void *arg);
+/* 等待目前为止提交的所有任务执行完 */
+int vmp_tpool_wait(struct vmp_tpool *pool);
+
+int vmp_tpool_cpu_counts(void);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
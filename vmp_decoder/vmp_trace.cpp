@@ -0,0 +1,892 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "vmp_trace.h"
+#include "vmp_trace_index.h"
+#include "mbytes.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define VMP_TRACE_BIN_FILENAME      "vmp.trace"
+
+#define VMP_TRACE_EF_CF             (1 << 0)
+#define VMP_TRACE_EF_ZF             (1 << 6)
+#define VMP_TRACE_EF_SF             (1 << 7)
+#define VMP_TRACE_EF_OF             (1 << 11)
+
+#define vmp_trace_field(_regs, _i)  (((uint32_t *)(_regs))[_i])
+
+    static const char *vmp_trace_reg_name[8] = { "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI" };
+    static const char vmp_trace_hex[] = "0123456789abcdef";
+
+    static inline int vmp_trace_write(struct vmp_trace *mod, const void *buf, int len)
+    {
+        mod->offset += len;
+        return (int)fwrite(buf, len, 1, mod->fp);
+    }
+
+    struct vmp_trace *vmp_trace_create(struct vmp_trace_param *param)
+    {
+        struct vmp_trace *mod = (struct vmp_trace *)calloc(1, sizeof (mod[0]));
+        const char *filename;
+        char head[12];
+
+        if (!mod)
+        {
+            printf("vmp_trace_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        mod->mode = param->mode;
+        mod->fmt = param->fmt;
+        mod->keyframe = (param->keyframe > 0) ? param->keyframe : VMP_TRACE_KEYFRAME_DEFAULT;
+        mod->block.regs = param->block_regs;
+
+        filename = param->filename;
+        if (!filename && (mod->fmt == VMP_TRACE_FMT_BIN))
+        {
+            filename = VMP_TRACE_BIN_FILENAME;
+        }
+
+        if (filename)
+        {
+            mod->fp = fopen(filename, (mod->fmt == VMP_TRACE_FMT_BIN) ? "wb" : "w");
+            if (!mod->fp)
+            {
+                printf("vmp_trace_create(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+                goto fail_label;
+            }
+            mod->own_fp = 1;
+        }
+        else
+        {
+            mod->fp = stdout;
+        }
+
+        if (mod->fmt == VMP_TRACE_FMT_BIN)
+        {
+            memcpy(head, VMP_TRACE_MAGIC, 4);
+            mbytes_write_int_little_endian_2b(head + 4, VMP_TRACE_VERSION);
+            mbytes_write_int_little_endian_2b(head + 6, mod->mode);
+            mbytes_write_int_little_endian_4b(head + 8, mod->keyframe);
+            vmp_trace_write(mod, head, sizeof (head));
+
+            if (param->index)
+            {
+                snprintf(mod->index_filename, sizeof (mod->index_filename), "%s%s", filename, VMP_TRACE_INDEX_SUFFIX);
+                mod->index = vmp_trace_index_create(mod->mode, mod->keyframe);
+                if (!mod->index)
+                {
+                    printf("vmp_trace_create() failed with vmp_trace_index_create(). %s:%d\n", __FILE__, __LINE__);
+                    goto fail_label;
+                }
+            }
+        }
+
+        return mod;
+
+    fail_label:
+        vmp_trace_destroy(mod);
+        return NULL;
+    }
+
+    int vmp_trace_destroy(struct vmp_trace *mod)
+    {
+        if (mod)
+        {
+            if (mod->block.open)
+            {
+                vmp_trace_block_leave(mod);
+            }
+
+            if (mod->block.buf)
+            {
+                free(mod->block.buf);
+            }
+            free(mod->block.addrs);
+
+            if (mod->index)
+            {
+                vmp_trace_index_save(mod->index, mod->index_filename);
+                vmp_trace_index_destroy(mod->index);
+            }
+
+            if (mod->fp)
+            {
+                fflush(mod->fp);
+                if (mod->own_fp)
+                    fclose(mod->fp);
+            }
+            free(mod);
+        }
+
+        return 0;
+    }
+
+    static inline char *vmp_trace_put_hex32(char *p, uint32_t v)
+    {
+        int i;
+
+        for (i = 7; i >= 0; i--)
+        {
+            p[i] = vmp_trace_hex[v & 0xf];
+            v >>= 4;
+        }
+
+        return p + 8;
+    }
+
+    static inline char *vmp_trace_put_str(char *p, const char *s)
+    {
+        while (*s)
+            *p++ = *s++;
+        return p;
+    }
+
+    static inline int vmp_trace_put_varint(uint8_t *p, uint32_t v)
+    {
+        int i = 0;
+
+        while (v >= 0x80)
+        {
+            p[i++] = (uint8_t)(v | 0x80);
+            v >>= 7;
+        }
+        p[i++] = (uint8_t)v;
+
+        return i;
+    }
+
+    static inline int vmp_trace_get_varint(FILE *fp, uint32_t *v)
+    {
+        int c, shift = 0;
+        uint32_t r = 0;
+
+        do
+        {
+            if ((c = fgetc(fp)) == EOF)
+                return -1;
+            r |= (uint32_t)(c & 0x7f) << shift;
+            shift += 7;
+        } while ((c & 0x80) && (shift < 35));
+
+        *v = r;
+        return 0;
+    }
+
+#define vmp_trace_zigzag(_d)        ((((uint32_t)(_d)) << 1) ^ (uint32_t)(((int32_t)(_d)) >> 31))
+#define vmp_trace_unzigzag(_z)      (((_z) >> 1) ^ (uint32_t)(-(int32_t)((_z) & 1)))
+
+    static int vmp_trace_text_keyframe(struct vmp_trace *mod, uint64_t count, struct vmp_trace_regs *regs)
+    {
+        fprintf(mod->fp, "EAX[%08x:%08x], ECX[%08x:%08x], EDX[%08x:%08x], EBX[%08x], addr[%x], addr2[%x] [%d][stack = %d]\n"
+            "EBP[%08x:%08x], ESI[%08x:%08x], EDI[%08x:%08x], ESP[%08x], EIP[%08x], EF[%08x], CF[%d], ZF[%d], OF[%d], SF[%d]\n",
+            regs->known[0], regs->val[0], regs->known[1], regs->val[1],
+            regs->known[2], regs->val[2], regs->val[3], regs->access_addr, regs->access_addr2, (int)count, regs->stack_depth,
+            regs->known[5], regs->val[5], regs->known[6], regs->val[6],
+            regs->known[7], regs->val[7], regs->val[4], regs->eip,
+            regs->eflags, !!(regs->eflags & VMP_TRACE_EF_CF), !!(regs->eflags & VMP_TRACE_EF_ZF),
+            !!(regs->eflags & VMP_TRACE_EF_OF), !!(regs->eflags & VMP_TRACE_EF_SF));
+
+        return 0;
+    }
+
+    // 差分行的格式: [count] EIP[xxxxxxxx] ECX[known:val] EF[xxxxxxxx] ZF[1] addr[x]
+    // 只有发生变化的字段才会打印出来，指令地址在前面的反汇编行里已经有了，这里不打印
+    static int vmp_trace_text_delta(struct vmp_trace *mod, const char *head, uint64_t count, uint32_t mask, struct vmp_trace_regs *regs)
+    {
+        char line[512], *p = line;
+        uint32_t ef_diff;
+        int i;
+
+        p = vmp_trace_put_str(p, head);
+        p += sprintf(p, "[%d]", (int)count);
+
+        if (mask & (1 << VMP_TRACE_FIELD_EIP))
+        {
+            p = vmp_trace_put_str(p, " EIP[");
+            p = vmp_trace_put_hex32(p, regs->eip);
+            *p++ = ']';
+        }
+
+        for (i = 0; i < 8; i++)
+        {
+            if (!(mask & ((1 << (VMP_TRACE_FIELD_REG + i)) | (1 << (VMP_TRACE_FIELD_KNOWN + i)))))
+                continue;
+
+            *p++ = ' ';
+            p = vmp_trace_put_str(p, vmp_trace_reg_name[i]);
+            *p++ = '[';
+            p = vmp_trace_put_hex32(p, regs->known[i]);
+            *p++ = ':';
+            p = vmp_trace_put_hex32(p, regs->val[i]);
+            *p++ = ']';
+        }
+
+        if (mask & ((1 << VMP_TRACE_FIELD_EFLAGS) | (1 << VMP_TRACE_FIELD_EF_KNOWN)))
+        {
+            p = vmp_trace_put_str(p, " EF[");
+            p = vmp_trace_put_hex32(p, regs->eflags);
+            *p++ = ']';
+
+            ef_diff = regs->eflags ^ mod->last.eflags;
+            if (ef_diff & VMP_TRACE_EF_CF) p += sprintf(p, " CF[%d]", !!(regs->eflags & VMP_TRACE_EF_CF));
+            if (ef_diff & VMP_TRACE_EF_ZF) p += sprintf(p, " ZF[%d]", !!(regs->eflags & VMP_TRACE_EF_ZF));
+            if (ef_diff & VMP_TRACE_EF_OF) p += sprintf(p, " OF[%d]", !!(regs->eflags & VMP_TRACE_EF_OF));
+            if (ef_diff & VMP_TRACE_EF_SF) p += sprintf(p, " SF[%d]", !!(regs->eflags & VMP_TRACE_EF_SF));
+        }
+
+        if (mask & (1 << VMP_TRACE_FIELD_ADDR))
+            p += sprintf(p, " addr[%x]", regs->access_addr);
+        if (mask & (1 << VMP_TRACE_FIELD_ADDR2))
+            p += sprintf(p, " addr2[%x]", regs->access_addr2);
+        if (mask & (1 << VMP_TRACE_FIELD_STACK))
+            p += sprintf(p, " stack[%d]", regs->stack_depth);
+
+        *p++ = '\n';
+        fwrite(line, p - line, 1, mod->fp);
+
+        return 0;
+    }
+
+    static int vmp_trace_bin_keyframe(struct vmp_trace *mod, uint64_t count, struct vmp_trace_regs *regs)
+    {
+        uint8_t buf[1 + 8 + VMP_TRACE_FIELD_MAX * 4];
+        int i;
+
+        buf[0] = VMP_TRACE_TAG_KEYFRAME;
+        mbytes_write_int_little_endian_8b(buf + 1, count);
+        for (i = 0; i < VMP_TRACE_FIELD_MAX; i++)
+        {
+            mbytes_write_int_little_endian_4b(buf + 9 + i * 4, vmp_trace_field(regs, i));
+        }
+        vmp_trace_write(mod, buf, sizeof (buf));
+
+        return 0;
+    }
+
+    static int vmp_trace_bin_delta(struct vmp_trace *mod, int tag, uint32_t mask, struct vmp_trace_regs *regs)
+    {
+        uint8_t buf[1 + 5 + VMP_TRACE_FIELD_MAX * 5];
+        uint32_t d;
+        int i, len = 1;
+
+        buf[0] = (uint8_t)tag;
+        len += vmp_trace_put_varint(buf + len, mask);
+        for (i = 0; i < VMP_TRACE_FIELD_MAX; i++)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+
+            d = vmp_trace_field(regs, i) - vmp_trace_field(&mod->last, i);
+            len += vmp_trace_put_varint(buf + len, vmp_trace_zigzag(d));
+        }
+        vmp_trace_write(mod, buf, len);
+
+        return 0;
+    }
+
+    static uint32_t vmp_trace_diff(struct vmp_trace *mod, struct vmp_trace_regs *regs)
+    {
+        uint32_t mask = 0;
+        int i;
+
+        for (i = 0; i < VMP_TRACE_FIELD_MAX; i++)
+        {
+            if (vmp_trace_field(regs, i) != vmp_trace_field(&mod->last, i))
+                mask |= 1 << i;
+        }
+
+        return mask;
+    }
+
+    static int vmp_trace_index_add(struct vmp_trace *mod, uint64_t offset, int tag, uint64_t count, int seekable)
+    {
+        struct vmp_trace_record rec;
+
+        rec.tag = tag;
+        rec.count = count;
+        rec.regs = mod->cur;
+        rec.block_id = mod->block.id;
+        rec.block = NULL;
+
+        return vmp_trace_index_record(mod->index, offset, &rec, seekable);
+    }
+
+    int vmp_trace_regs(struct vmp_trace *mod, uint64_t count, struct vmp_trace_regs *regs)
+    {
+        uint64_t offset = mod->offset;
+        uint32_t mask = 0;
+        int keyframe;
+
+        mod->cur = *regs;
+        mod->cur_count = count;
+
+        if ((mod->mode == VMP_TRACE_MODE_BLOCK) || (mod->mode == VMP_TRACE_MODE_VM))
+            return 0;
+
+        // 序号不连续时(比如中间跳过了一些指令)，差分帧无法表达，直接补一个关键帧
+        keyframe = (mod->mode == VMP_TRACE_MODE_FULL) || !mod->has_last
+            || (mod->since_keyframe >= mod->keyframe) || (count != mod->last_count + 1);
+
+        if (!keyframe)
+        {
+            mask = vmp_trace_diff(mod, regs);
+        }
+
+        if (mod->fmt == VMP_TRACE_FMT_BIN)
+        {
+            keyframe ? vmp_trace_bin_keyframe(mod, count, regs) : vmp_trace_bin_delta(mod, VMP_TRACE_TAG_DELTA, mask, regs);
+        }
+        else
+        {
+            keyframe ? vmp_trace_text_keyframe(mod, count, regs) : vmp_trace_text_delta(mod, "", count, mask, regs);
+        }
+
+        mod->since_keyframe = keyframe ? 1 : (mod->since_keyframe + 1);
+        mod->last = *regs;
+        mod->last_count = count;
+        mod->has_last = 1;
+        mod->records++;
+
+        if (mod->index)
+        {
+            vmp_trace_index_add(mod, offset, keyframe ? VMP_TRACE_TAG_KEYFRAME : VMP_TRACE_TAG_DELTA, count, keyframe);
+        }
+
+        return 0;
+    }
+
+    static int vmp_trace_block_buf_reserve(struct vmp_trace *mod, int len)
+    {
+        char *new_buf;
+        int new_size;
+
+        if (mod->block.buf_len + len <= mod->block.buf_size)
+            return 0;
+
+        new_size = mod->block.buf_size ? mod->block.buf_size * 2 : 4096;
+        while (new_size < mod->block.buf_len + len)
+            new_size *= 2;
+
+        new_buf = (char *)realloc(mod->block.buf, new_size);
+        if (!new_buf)
+        {
+            print_err ("[%s] err: vmp_trace_block_buf_reserve() failed with realloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+            return -1;
+        }
+        mod->block.buf = new_buf;
+        mod->block.buf_size = new_size;
+
+        return 0;
+    }
+
+    int vmp_trace_block_enter(struct vmp_trace *mod, int *block_id, uint32_t addr)
+    {
+        if (mod->block.open)
+        {
+            vmp_trace_block_leave(mod);
+        }
+
+        mod->block.open = 1;
+        mod->block.addr = addr;
+        mod->block.insts = 0;
+        mod->block.buf_len = 0;
+        mod->block.recording = 0;
+
+        if (!*block_id)
+        {
+            *block_id = ++mod->block.counts;
+            mod->block.recording = 1;
+        }
+        mod->block.id = *block_id;
+
+        return mod->block.recording;
+    }
+
+    int vmp_trace_block_inst(struct vmp_trace *mod, uint32_t addr, uint8_t *code, int len, const char *disasm)
+    {
+        char *p;
+        int i, dlen = (int)strlen(disasm);
+
+        if (!mod->block.recording)
+            return 0;
+
+        if (dlen > 255)
+            dlen = 255;
+
+        if (vmp_trace_block_buf_reserve(mod, 64 + len * 3 + dlen))
+            return -1;
+
+        if (mod->index)
+        {
+            if (mod->block.insts >= mod->block.addr_size)
+            {
+                uint32_t *new_addrs;
+                int new_size = mod->block.addr_size ? mod->block.addr_size * 2 : 64;
+
+                new_addrs = (uint32_t *)realloc(mod->block.addrs, new_size * sizeof (new_addrs[0]));
+                if (!new_addrs)
+                    return -1;
+                mod->block.addrs = new_addrs;
+                mod->block.addr_size = new_size;
+            }
+            mod->block.addrs[mod->block.insts] = addr;
+        }
+
+        p = mod->block.buf + mod->block.buf_len;
+        if (mod->fmt == VMP_TRACE_FMT_BIN)
+        {
+            mbytes_write_int_little_endian_4b(p, addr);
+            p[4] = (char)len;
+            memcpy(p + 5, code, len);
+            p[5 + len] = (char)dlen;
+            memcpy(p + 6 + len, disasm, dlen);
+            p += 6 + len + dlen;
+        }
+        else
+        {
+            p = vmp_trace_put_str(p, "    [");
+            p = vmp_trace_put_hex32(p, addr);
+            p = vmp_trace_put_str(p, "]    ");
+            for (i = 0; i < 15; i++)
+            {
+                if (i < len)
+                {
+                    *p++ = vmp_trace_hex[code[i] >> 4];
+                    *p++ = vmp_trace_hex[code[i] & 0xf];
+                    *p++ = ' ';
+                }
+                else
+                {
+                    p = vmp_trace_put_str(p, "   ");
+                }
+            }
+            *p++ = '[';
+            memcpy(p, disasm, dlen);
+            p += dlen;
+            *p++ = ']';
+            *p++ = '\n';
+        }
+        mod->block.buf_len = (int)(p - mod->block.buf);
+        mod->block.insts++;
+
+        return 0;
+    }
+
+    static int vmp_trace_block_def(struct vmp_trace *mod)
+    {
+        uint8_t head[1 + 4 + 4 + 2];
+        struct vmp_trace_block block;
+        struct vmp_trace_record rec;
+        uint64_t offset = mod->offset;
+
+        if (mod->fmt == VMP_TRACE_FMT_BIN)
+        {
+            head[0] = VMP_TRACE_TAG_BLOCK_DEF;
+            mbytes_write_int_little_endian_4b(head + 1, mod->block.id);
+            mbytes_write_int_little_endian_4b(head + 5, mod->block.addr);
+            mbytes_write_int_little_endian_2b(head + 9, mod->block.insts);
+            vmp_trace_write(mod, head, sizeof (head));
+            vmp_trace_write(mod, mod->block.buf, mod->block.buf_len);
+
+            if (mod->index)
+            {
+                block.addr = mod->block.addr;
+                block.insts = mod->block.insts;
+                block.inst_addrs = mod->block.addrs;
+                memset(&rec, 0, sizeof (rec));
+                rec.tag = VMP_TRACE_TAG_BLOCK_DEF;
+                rec.block_id = mod->block.id;
+                rec.block = &block;
+                vmp_trace_index_record(mod->index, offset, &rec, 0);
+            }
+        }
+        else
+        {
+            fprintf(mod->fp, "BLOCK[%d] addr[%08x] insts[%d]\n", mod->block.id, mod->block.addr, mod->block.insts);
+            fwrite(mod->block.buf, mod->block.buf_len, 1, mod->fp);
+            fprintf(mod->fp, "END\n");
+        }
+
+        return 0;
+    }
+
+    int vmp_trace_block_leave(struct vmp_trace *mod)
+    {
+        uint64_t offset;
+        uint8_t buf[8];
+        char head[32];
+        uint32_t mask = 0;
+        int keyframe = 0;
+
+        if (!mod->block.open)
+            return 0;
+
+        mod->block.open = 0;
+
+        if (mod->block.recording)
+        {
+            vmp_trace_block_def(mod);
+            mod->block.recording = 0;
+        }
+
+        if (mod->block.regs)
+        {
+            keyframe = !mod->has_last || (mod->since_keyframe >= mod->keyframe);
+            if (!keyframe)
+                mask = vmp_trace_diff(mod, &mod->cur);
+        }
+
+        if (mod->fmt == VMP_TRACE_FMT_BIN)
+        {
+            offset = mod->offset;
+            buf[0] = VMP_TRACE_TAG_BLOCK;
+            vmp_trace_write(mod, buf, 1 + vmp_trace_put_varint(buf + 1, mod->block.id));
+            if (mod->index)
+            {
+                // 后面跟着差分出口的block没法单独解码
+                vmp_trace_index_add(mod, offset, VMP_TRACE_TAG_BLOCK, mod->cur_count, !mod->block.regs || keyframe);
+            }
+
+            if (mod->block.regs)
+            {
+                if (keyframe)
+                {
+                    offset = mod->offset;
+                    vmp_trace_bin_keyframe(mod, mod->cur_count, &mod->cur);
+                    if (mod->index)
+                        vmp_trace_index_add(mod, offset, VMP_TRACE_TAG_KEYFRAME, mod->cur_count, 1);
+                }
+                else
+                {
+                    vmp_trace_bin_delta(mod, VMP_TRACE_TAG_BLOCK_EXIT, mask, &mod->cur);
+                }
+            }
+        }
+        else
+        {
+            if (!mod->block.regs || keyframe)
+            {
+                fprintf(mod->fp, "B[%d]\n", mod->block.id);
+                if (keyframe)
+                    vmp_trace_text_keyframe(mod, mod->cur_count, &mod->cur);
+            }
+            else
+            {
+                sprintf(head, "B[%d] ", mod->block.id);
+                vmp_trace_text_delta(mod, head, mod->cur_count, mask, &mod->cur);
+            }
+        }
+
+        if (mod->block.regs)
+        {
+            mod->since_keyframe = keyframe ? 1 : (mod->since_keyframe + 1);
+            mod->last = mod->cur;
+            mod->last_count = mod->cur_count;
+            mod->has_last = 1;
+        }
+        mod->records++;
+
+        return 0;
+    }
+
+    int vmp_trace_vm(struct vmp_trace *mod, struct vmp_trace_vm_event *ev)
+    {
+        uint8_t buf[1 + VMP_TRACE_VM_EVENT_SIZE];
+        struct vmp_trace_record rec;
+        char plain[20] = "";
+        uint64_t offset = mod->offset;
+
+        mod->last_count += ev->x86_insts;
+
+        if (mod->fmt == VMP_TRACE_FMT_BIN)
+        {
+            buf[0] = VMP_TRACE_TAG_VM;
+            mbytes_write_int_little_endian_4b(buf + 1, ev->seq);
+            mbytes_write_int_little_endian_4b(buf + 5, ev->handler);
+            mbytes_write_int_little_endian_4b(buf + 9, ev->vip);
+            mbytes_write_int_little_endian_4b(buf + 13, ev->operand);
+            mbytes_write_int_little_endian_4b(buf + 17, ev->vsp_top);
+            mbytes_write_int_little_endian_2b(buf + 21, ev->vip_delta);
+            mbytes_write_int_little_endian_2b(buf + 23, ev->vsp_delta);
+            mbytes_write_int_little_endian_2b(buf + 25, ev->x86_insts);
+            buf[27] = ev->operand_size;
+            buf[28] = ev->flags;
+            mbytes_write_int_little_endian_4b(buf + 29, ev->plain);
+            vmp_trace_write(mod, buf, sizeof (buf));
+
+            if (mod->index)
+            {
+                memset(&rec, 0, sizeof (rec));
+                rec.tag = VMP_TRACE_TAG_VM;
+                rec.count = mod->last_count;
+                rec.vm = *ev;
+                vmp_trace_index_record(mod->index, offset, &rec, 1);
+            }
+        }
+        else
+        {
+            if (ev->flags & VMP_TRACE_VM_PLAIN)
+                sprintf(plain, " plain[%x]", ev->plain);
+            fprintf(mod->fp, "VM[%u] handler[%08x] vip[%08x%+d] op[%d:%x]%s vsp[%+d] top[%08x] insts[%d]%s%s%s%s\n",
+                ev->seq, ev->handler, ev->vip, ev->vip_delta, ev->operand_size, ev->operand, plain,
+                ev->vsp_delta, ev->vsp_top, ev->x86_insts,
+                (ev->flags & VMP_TRACE_VM_DISPATCH) ? " dispatch" : "",
+                (ev->flags & VMP_TRACE_VM_RET) ? " ret" : "",
+                (ev->flags & VMP_TRACE_VM_NEW) ? " new" : "",
+                (ev->flags & VMP_TRACE_VM_VIP_UNKNOWN) ? " vip?" : "");
+        }
+        mod->records++;
+
+        return 0;
+    }
+
+    int vmp_trace_reader_open(struct vmp_trace_reader *reader, const char *filename)
+    {
+        uint8_t head[12];
+
+        memset(reader, 0, sizeof (reader[0]));
+
+        reader->fp = fopen(filename, "rb");
+        if (!reader->fp)
+        {
+            printf("vmp_trace_reader_open(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        if ((fread(head, sizeof (head), 1, reader->fp) != 1) || memcmp(head, VMP_TRACE_MAGIC, 4))
+        {
+            printf("vmp_trace_reader_open(%s) failed with invalid trace header. %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        if (mbytes_read_int_little_endian_2b(head + 4) != VMP_TRACE_VERSION)
+        {
+            printf("vmp_trace_reader_open(%s) failed with un-support version[%d]. %s:%d\n",
+                filename, mbytes_read_int_little_endian_2b(head + 4), __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        reader->mode = mbytes_read_int_little_endian_2b(head + 6);
+        reader->keyframe = mbytes_read_int_little_endian_4b(head + 8);
+
+        return 0;
+
+    fail_label:
+        fclose(reader->fp);
+        reader->fp = NULL;
+        return -1;
+    }
+
+    static int vmp_trace_reader_apply_delta(struct vmp_trace_reader *reader)
+    {
+        uint32_t mask, z;
+        int i;
+
+        if (!reader->has_last || vmp_trace_get_varint(reader->fp, &mask))
+            return -1;
+
+        for (i = 0; i < VMP_TRACE_FIELD_MAX; i++)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+
+            if (vmp_trace_get_varint(reader->fp, &z))
+                return -1;
+            vmp_trace_field(&reader->regs, i) += vmp_trace_unzigzag(z);
+        }
+
+        return 0;
+    }
+
+    static int vmp_trace_reader_block_def(struct vmp_trace_reader *reader)
+    {
+        struct vmp_trace_block *block;
+        uint8_t head[10], code[256];
+        int id, i, len, dlen;
+
+        if (fread(head, sizeof (head), 1, reader->fp) != 1)
+            return -1;
+
+        id = mbytes_read_int_little_endian_4b(head);
+        if (id <= 0)
+            return -1;
+
+        if (id >= reader->block_size)
+        {
+            int new_size = reader->block_size ? reader->block_size : 1024;
+            struct vmp_trace_block *new_blocks;
+
+            while (new_size <= id)
+                new_size *= 2;
+            new_blocks = (struct vmp_trace_block *)realloc(reader->blocks, new_size * sizeof (new_blocks[0]));
+            if (!new_blocks)
+                return -1;
+            memset(new_blocks + reader->block_size, 0, (new_size - reader->block_size) * sizeof (new_blocks[0]));
+            reader->blocks = new_blocks;
+            reader->block_size = new_size;
+        }
+
+        block = reader->blocks + id;
+        block->addr = mbytes_read_int_little_endian_4b(head + 4);
+        block->insts = mbytes_read_int_little_endian_2b(head + 8);
+        block->inst_addrs = (uint32_t *)realloc(block->inst_addrs, (block->insts + 1) * sizeof (block->inst_addrs[0]));
+        if (!block->inst_addrs)
+            return -1;
+
+        // 字典里的反汇编读的时候用不上，直接跳过
+        for (i = 0; i < block->insts; i++)
+        {
+            if (fread(code, 5, 1, reader->fp) != 1)
+                return -1;
+            block->inst_addrs[i] = mbytes_read_int_little_endian_4b(code);
+            len = code[4];
+            if (fread(code, len + 1, 1, reader->fp) != 1)
+                return -1;
+            dlen = code[len];
+            if (dlen && (fread(code, dlen, 1, reader->fp) != 1))
+                return -1;
+        }
+
+        if (id > reader->block_counts)
+            reader->block_counts = id;
+
+        return id;
+    }
+
+    int vmp_trace_reader_next(struct vmp_trace_reader *reader, struct vmp_trace_record *rec)
+    {
+        uint8_t buf[8 + VMP_TRACE_FIELD_MAX * 4];
+        struct vmp_trace_vm_event *ev = &rec->vm;
+        uint32_t id;
+        int tag, i;
+
+        if ((tag = fgetc(reader->fp)) == EOF)
+            return 0;
+
+        rec->tag = tag;
+        rec->block_id = 0;
+        rec->block = NULL;
+
+        switch (tag)
+        {
+        case VMP_TRACE_TAG_KEYFRAME:
+            if (fread(buf, sizeof (buf), 1, reader->fp) != 1)
+                goto fail_label;
+
+            reader->count = mbytes_read_int_little_endian_8b(buf);
+            for (i = 0; i < VMP_TRACE_FIELD_MAX; i++)
+            {
+                vmp_trace_field(&reader->regs, i) = mbytes_read_int_little_endian_4b(buf + 8 + i * 4);
+            }
+            reader->has_last = 1;
+            break;
+
+        case VMP_TRACE_TAG_DELTA:
+            if (vmp_trace_reader_apply_delta(reader))
+                goto fail_label;
+            reader->count++;
+            break;
+
+        case VMP_TRACE_TAG_BLOCK_EXIT:
+            if (vmp_trace_reader_apply_delta(reader))
+                goto fail_label;
+            break;
+
+        case VMP_TRACE_TAG_BLOCK_DEF:
+            if ((rec->block_id = vmp_trace_reader_block_def(reader)) < 0)
+                goto fail_label;
+            rec->block = reader->blocks + rec->block_id;
+            break;
+
+        case VMP_TRACE_TAG_BLOCK:
+            if (vmp_trace_get_varint(reader->fp, &id) || !id || ((int)id > reader->block_counts))
+                goto fail_label;
+            rec->block_id = id;
+            rec->block = reader->blocks + id;
+            reader->count += rec->block->insts;
+            break;
+
+        case VMP_TRACE_TAG_VM:
+            if (fread(buf, VMP_TRACE_VM_EVENT_SIZE, 1, reader->fp) != 1)
+                goto fail_label;
+
+            ev->seq = mbytes_read_int_little_endian_4b(buf);
+            ev->handler = mbytes_read_int_little_endian_4b(buf + 4);
+            ev->vip = mbytes_read_int_little_endian_4b(buf + 8);
+            ev->operand = mbytes_read_int_little_endian_4b(buf + 12);
+            ev->vsp_top = mbytes_read_int_little_endian_4b(buf + 16);
+            ev->vip_delta = (int16_t)mbytes_read_int_little_endian_2b(buf + 20);
+            ev->vsp_delta = (int16_t)mbytes_read_int_little_endian_2b(buf + 22);
+            ev->x86_insts = mbytes_read_int_little_endian_2b(buf + 24);
+            ev->operand_size = buf[26];
+            ev->flags = buf[27];
+            ev->plain = mbytes_read_int_little_endian_4b(buf + 28);
+            reader->count += ev->x86_insts;
+            break;
+
+        default:
+            goto fail_label;
+        }
+
+        rec->count = reader->count;
+        rec->regs = reader->regs;
+
+        return 1;
+
+    fail_label:
+        printf("vmp_trace_reader_next() failed with broken record[tag:%d]. %s:%d\n", tag, __FILE__, __LINE__);
+        return -1;
+    }
+
+    int vmp_trace_reader_seek(struct vmp_trace_reader *reader, uint64_t offset, uint64_t count)
+    {
+        if (vmp_fseek(reader->fp, offset, SEEK_SET))
+        {
+            printf("vmp_trace_reader_seek(%llu) failed with fseek(). %s:%d\n", (unsigned long long)offset, __FILE__, __LINE__);
+            return -1;
+        }
+
+        // 差分帧需要前面的关键帧，seek以后要等读到关键帧才能继续
+        reader->count = count;
+        reader->has_last = 0;
+
+        return 0;
+    }
+
+    int vmp_trace_reader_close(struct vmp_trace_reader *reader)
+    {
+        int i;
+
+        if (reader->fp)
+        {
+            fclose(reader->fp);
+            reader->fp = NULL;
+        }
+
+        for (i = 0; i < reader->block_size; i++)
+        {
+            if (reader->blocks[i].inst_addrs)
+                free(reader->blocks[i].inst_addrs);
+        }
+
+        if (reader->blocks)
+        {
+            free(reader->blocks);
+            reader->blocks = NULL;
+        }
+
+        return 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,249 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_trace_h__
+#define __vmp_trace_h__
+
+#include <stdio.h>
+#include <stdint.h>
+
+// trace文件经常超过2G，偏移都用64位
+#if defined(_MSC_VER)
+#define vmp_fseek                   _fseeki64
+#define vmp_ftell                   _ftelli64
+#else
+#define vmp_fseek                   fseeko
+#define vmp_ftell                   ftello
+#endif
+
+// 完整模式，每条指令都输出所有寄存器，和以前的x86_emu_dump一样
+#define VMP_TRACE_MODE_FULL         0
+// 差分模式，只输出和上一条记录相比发生了变化的寄存器，每隔
+// keyframe条指令输出一个完整的关键帧，这样从任意一个关键帧开始
+// 都可以独立的把寄存器状态恢复出来
+#define VMP_TRACE_MODE_DELTA        1
+// block模式，每个基本块第一次执行时把它的地址、指令和反汇编写进block字典，
+// 以后每次执行只输出一个block id，可选在block出口输出寄存器差分
+#define VMP_TRACE_MODE_BLOCK        2
+// VM模式，不再输出x86指令，每执行完一个VM handler输出一条定长的VM事件，
+// 见vmp_vm.h
+#define VMP_TRACE_MODE_VM           3
+
+#define VMP_TRACE_FMT_TEXT          0
+#define VMP_TRACE_FMT_BIN           1
+
+#define VMP_TRACE_KEYFRAME_DEFAULT  1024
+
+// 二进制trace文件格式:
+// 文件头:  "VMPT" + u16 version + u16 mode + u32 keyframe
+// 关键帧:  u8 'K' + u64 count + VMP_TRACE_FIELD_MAX个u32(小端)
+// 差分帧:  u8 'D' + varint mask + 每个置位字段一个 zigzag varint(新值 - 旧值)
+//          差分帧的指令序号固定为上一条记录的序号 + 1
+// block模式下:
+// block字典: u8 'S' + u32 id + u32 addr + u16 insts + insts * (u32 addr + u8 len + code + u8 dlen + 反汇编)
+// block执行: u8 'B' + varint id，指令序号加上这个block的指令条数
+// block出口: u8 'E' + varint mask + zigzag varint，和上一个出口的快照做差分
+//            关键帧还是用'K'，序号是出口时的指令序号
+// VM模式下:
+// VM事件:  u8 'V' + 定长的vmp_trace_vm_event(小端)，指令序号加上这个handler的x86指令条数
+//
+// 版本: 2 加了block模式的'S'/'B'/'E'，3 加了VM事件'V'，4 VM事件后面多了u32 plain
+#define VMP_TRACE_MAGIC             "VMPT"
+#define VMP_TRACE_VERSION           4
+#define VMP_TRACE_TAG_KEYFRAME      'K'
+#define VMP_TRACE_TAG_DELTA         'D'
+#define VMP_TRACE_TAG_BLOCK_DEF     'S'
+#define VMP_TRACE_TAG_BLOCK         'B'
+#define VMP_TRACE_TAG_BLOCK_EXIT    'E'
+#define VMP_TRACE_TAG_VM            'V'
+
+// 快照里字段的编号，差分帧的mask就是按照这个顺序来置位的
+#define VMP_TRACE_FIELD_REG         0   // 0 - 7，寄存器值，顺序和x86_emu_mod一致
+#define VMP_TRACE_FIELD_KNOWN       8   // 8 - 15，寄存器的known
+#define VMP_TRACE_FIELD_EIP         16
+#define VMP_TRACE_FIELD_EFLAGS      17
+#define VMP_TRACE_FIELD_EF_KNOWN    18
+#define VMP_TRACE_FIELD_ADDR        19
+#define VMP_TRACE_FIELD_ADDR2       20
+#define VMP_TRACE_FIELD_STACK       21
+#define VMP_TRACE_FIELD_INST        22  // 当前指令的地址(IDA地址)，eip只有跳转时才会更新
+#define VMP_TRACE_FIELD_MAX         23
+
+typedef struct vmp_trace_regs
+{
+    // 这里的布局不要随便改，差分的时候直接把它当成 u32 数组在比较
+    uint32_t    val[8];
+    uint32_t    known[8];
+    uint32_t    eip;
+    uint32_t    eflags;
+    uint32_t    eflags_known;
+    uint32_t    access_addr;
+    uint32_t    access_addr2;
+    uint32_t    stack_depth;
+    uint32_t    inst_addr;
+} vmp_trace_regs_t;
+
+// 一次VM handler的执行
+#define VMP_TRACE_VM_DISPATCH       0x01    // 从dispatcher跳过来的
+#define VMP_TRACE_VM_RET            0x02    // 通过 push reg; ret 进入的handler
+#define VMP_TRACE_VM_NEW            0x04    // 这个handler第一次执行
+#define VMP_TRACE_VM_VIP_UNKNOWN    0x08    // handler入口的VIP不是已知值
+#define VMP_TRACE_VM_SUMMARY        0x10    // 按摘要执行的，x86_insts只算了保留下来的指令
+#define VMP_TRACE_VM_INTERP         0x20    // 在VM指令级解释执行的，没有经过x86模拟器
+#define VMP_TRACE_VM_PLAIN          0x40    // plain是用校验过的解密链解出来的操作数
+#define VMP_TRACE_VM_EVENT_SIZE     32
+
+typedef struct vmp_trace_vm_event
+{
+    uint32_t    seq;
+    // handler的入口地址(IDA地址)
+    uint32_t    handler;
+    // 进入handler时的VIP，在PE内的话转成IDA地址
+    uint32_t    vip;
+    // handler从VIP字节流里读走的字节，最多4个，小端
+    uint32_t    operand;
+    // handler执行完以后VM栈顶的值
+    uint32_t    vsp_top;
+    int16_t     vip_delta;
+    int16_t     vsp_delta;
+    uint16_t    x86_insts;
+    uint8_t     operand_size;
+    uint8_t     flags;
+    // 解密以后的操作数，flags里有VMP_TRACE_VM_PLAIN时才有效
+    uint32_t    plain;
+} vmp_trace_vm_event_t;
+
+struct vmp_trace_param
+{
+    int         mode;
+    int         fmt;
+    // 多少条指令一个关键帧，0表示用默认值
+    int         keyframe;
+    // 为空时，文本格式输出到stdout(也就是vmp.log)，二进制格式输出到vmp.trace
+    const char  *filename;
+    // block模式下，是否在block出口输出寄存器差分
+    int         block_regs;
+    // 二进制格式下，边写trace边生成索引文件(trace文件名加.idx)，见vmp_trace_index.h
+    int         index;
+};
+
+struct vmp_trace_index;
+
+typedef struct vmp_trace
+{
+    int         mode;
+    int         fmt;
+    int         keyframe;
+    FILE        *fp;
+    int         own_fp;
+    // 已经写进文件的字节数，也就是下一条记录的偏移
+    uint64_t    offset;
+
+    struct vmp_trace_index *index;
+    char        index_filename[260];
+
+    uint64_t    last_count;
+    uint64_t    records;
+    int         since_keyframe;
+    int         has_last;
+    struct vmp_trace_regs last;
+
+    // 最近一次x86_emu_dump传进来的快照，block模式下寄存器不是每条指令
+    // 都输出，先存在这里，等到block出口再决定要不要输出
+    struct vmp_trace_regs cur;
+    uint64_t    cur_count;
+
+    struct {
+        int         regs;
+        int         counts;
+        int         open;
+        int         id;
+        uint32_t    addr;
+        // block第一次执行时，指令先缓存在buf里，出口时一次性写进字典
+        int         recording;
+        int         insts;
+        char        *buf;
+        int         buf_len;
+        int         buf_size;
+        // 生成索引时，记下block里每条指令的地址
+        uint32_t    *addrs;
+        int         addr_size;
+    } block;
+} vmp_trace_t;
+
+struct vmp_trace *vmp_trace_create(struct vmp_trace_param *param);
+int vmp_trace_destroy(struct vmp_trace *mod);
+
+/*
+@count      指令序号，和以前x86_emu_dump打印出来的序号保持一致
+@return     0           success
+            -1          failure */
+int vmp_trace_regs(struct vmp_trace *mod, uint64_t count, struct vmp_trace_regs *regs);
+
+/* block模式的接口，block_id 由调用者保存(一般放在cfg节点里)，0表示还没有分配
+@return     1           这是block的第一次执行，需要调用vmp_trace_block_inst把指令记下来
+            0           block已经在字典里了 */
+int vmp_trace_block_enter(struct vmp_trace *mod, int *block_id, uint32_t addr);
+int vmp_trace_block_inst(struct vmp_trace *mod, uint32_t addr, uint8_t *code, int len, const char *disasm);
+int vmp_trace_block_leave(struct vmp_trace *mod);
+
+/* VM模式的接口，由vmp_vm在每个handler结束时调用 */
+int vmp_trace_vm(struct vmp_trace *mod, struct vmp_trace_vm_event *ev);
+
+#define vmp_trace_is_block_mode(_trace)     ((_trace) && ((_trace)->mode == VMP_TRACE_MODE_BLOCK))
+
+typedef struct vmp_trace_block
+{
+    uint32_t    addr;
+    int         insts;
+    uint32_t    *inst_addrs;
+} vmp_trace_block_t;
+
+typedef struct vmp_trace_record
+{
+    int         tag;
+    // 这条记录结束时的指令序号
+    uint64_t    count;
+    // 'K', 'D', 'E' 时有效，block模式下是block出口的寄存器
+    struct vmp_trace_regs regs;
+    // 'S', 'B' 时有效
+    int         block_id;
+    struct vmp_trace_block *block;
+    // 'V' 时有效
+    struct vmp_trace_vm_event vm;
+} vmp_trace_record_t;
+
+typedef struct vmp_trace_reader
+{
+    FILE        *fp;
+    int         mode;
+    int         keyframe;
+    int         has_last;
+    uint64_t    count;
+    struct vmp_trace_regs regs;
+
+    // block字典，下标就是block id
+    struct vmp_trace_block *blocks;
+    int         block_counts;
+    int         block_size;
+} vmp_trace_reader_t;
+
+int vmp_trace_reader_open(struct vmp_trace_reader *reader, const char *filename);
+/* 读二进制trace，每次调用返回一条记录，差分帧会被还原成完整的快照
+@return     1           got a record
+            0           end of file
+            -1          failure */
+int vmp_trace_reader_next(struct vmp_trace_reader *reader, struct vmp_trace_record *rec);
+/* 跳到offset处继续读，offset必须是索引里记录的可解码位置
+@count      offset处记录之前的指令序号 */
+int vmp_trace_reader_seek(struct vmp_trace_reader *reader, uint64_t offset, uint64_t count);
+int vmp_trace_reader_close(struct vmp_trace_reader *reader);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,1130 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_trace_align.h"
+#include "vmp_trace.h"
+#include "vmp_tpool.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+#define FAKE_IMAGE_BASE             0x400000
+
+#define VMP_ALIGN_EF_CF             (1 << 0)
+#define VMP_ALIGN_EF_PF             (1 << 2)
+#define VMP_ALIGN_EF_AF             (1 << 4)
+#define VMP_ALIGN_EF_ZF             (1 << 6)
+#define VMP_ALIGN_EF_SF             (1 << 7)
+#define VMP_ALIGN_EF_TF             (1 << 8)
+#define VMP_ALIGN_EF_IF             (1 << 9)
+#define VMP_ALIGN_EF_DF             (1 << 10)
+#define VMP_ALIGN_EF_OF             (1 << 11)
+#define VMP_ALIGN_EF_ALL            0xfd5
+// 模拟器只维护了这几个标志位
+#define VMP_ALIGN_EF_CMP            (VMP_ALIGN_EF_CF | VMP_ALIGN_EF_ZF | VMP_ALIGN_EF_SF | VMP_ALIGN_EF_OF)
+
+// IAT调用回来以后，这些寄存器的值两边肯定不一样，直到模拟器重新写了它们再比较
+#define VMP_ALIGN_VOLATILE_REGS     0x07    // eax, ecx, edx
+
+#define VMP_ALIGN_KIND_EMU          0
+#define VMP_ALIGN_KIND_DBG          1
+
+#define VMP_ALIGN_ITEM_ADDR         0x01    // 这一行是一条指令
+#define VMP_ALIGN_ITEM_IDA          0x02    // addr是IDA地址，va是模拟器里的地址
+
+    static const char *vmp_align_reg_name[8] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" };
+
+    // 一行解析出来的内容
+    typedef struct vmp_align_item
+    {
+        uint32_t    flags;
+        uint32_t    addr;
+        uint32_t    va;
+        uint32_t    reg_mask;
+        uint32_t    val[8];
+        uint32_t    known[8];
+        uint32_t    eflags;
+        uint32_t    ef_mask;
+        // 在块里的行号，从1开始
+        uint32_t    line;
+    } vmp_align_item_t;
+
+    typedef struct vmp_align_state
+    {
+        uint32_t    val[8];
+        uint32_t    known[8];
+        uint32_t    eflags;
+        uint32_t    ef_mask;
+    } vmp_align_state_t;
+
+    // 一条指令，模拟器这边index是指令序号，调试器这边是行号
+    typedef struct vmp_align_rec
+    {
+        uint32_t    addr;
+        uint32_t    va;
+        uint64_t    index;
+        // 这条指令之前模拟器跳过了IAT调用
+        int         after_iat;
+        struct vmp_align_state st;
+    } vmp_align_rec_t;
+
+    struct vmp_align_stream;
+
+    typedef struct vmp_align_chunk
+    {
+        struct vmp_align_stream *stream;
+        char        *buf;
+        int         len;
+        struct vmp_align_item *items;
+        int         item_counts;
+        int         item_size;
+        int         lines;
+        int         done;
+        int         err;
+    } vmp_align_chunk_t;
+
+    typedef struct vmp_align_stream
+    {
+        int         kind;
+        const char  *filename;
+        FILE        *fp;
+        int         utf16;
+        int         eof;
+        int         err;
+        struct vmp_tpool *pool;
+
+        SRWLOCK     lock;
+        CONDITION_VARIABLE  done;
+        struct vmp_align_chunk chunks[VMP_TRACE_ALIGN_CHUNKS];
+        int         head;
+        int         counts;
+        int         item_i;
+        uint64_t    line_base;
+
+        // 上一块最后一个换行后面的半行
+        char        *carry;
+        int         carry_len;
+
+        struct vmp_align_state state;
+        uint64_t    records;
+
+        // 二进制trace
+        int         is_bin;
+        struct vmp_trace_reader reader;
+        int         iat;
+        int         has_prev_eip;
+        uint32_t    prev_eip;
+        int         jump_pending;
+        uint32_t    jump_eip;
+        int         va_known;
+        uint32_t    va_off;
+    } vmp_align_stream_t;
+
+    static const char *vmp_align_hex(const char *s, uint32_t *v, int *digits)
+    {
+        uint64_t r = 0;
+        int n = 0, c;
+
+        while (1)
+        {
+            c = *s;
+            if ((c >= '0') && (c <= '9')) c -= '0';
+            else if ((c >= 'a') && (c <= 'f')) c -= 'a' - 10;
+            else if ((c >= 'A') && (c <= 'F')) c -= 'A' - 10;
+            else break;
+
+            r = (r << 4) | c;
+            n++;
+            s++;
+        }
+
+        // 64位的指针只要低32位，模拟器里guest地址就是指针的低32位
+        *v = (uint32_t)r;
+        *digits = n;
+
+        return s;
+    }
+
+    static int vmp_align_reg_index(const char *name, int len)
+    {
+        int i;
+
+        if (len != 3)
+            return -1;
+
+        for (i = 0; i < 8; i++)
+        {
+            if (!_strnicmp(name, vmp_align_reg_name[i], 3))
+                return i;
+        }
+
+        return -1;
+    }
+
+    static int vmp_align_is_word(int c)
+    {
+        return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c == '_');
+    }
+
+    // 模拟器的文本trace:
+    //      [ptr]\t[ida]    xx xx ...   [disasm]        现在的格式
+    //      [ptr]    xx xx ...   [disasm]               以前的格式，没有IDA地址
+    //      EAX[known:val], ..., EBX[val], ..., EF[xxxxxxxx] ...
+    //      [count] EIP[xxxxxxxx] ECX[known:val] EF[xxxxxxxx] ...
+    static int vmp_align_parse_emu(char *line, struct vmp_align_item *item)
+    {
+        const char *p = line, *name;
+        uint32_t v, v2;
+        int digits, digits2, len, i;
+
+        if (*p == '[')
+        {
+            p = vmp_align_hex(p + 1, &v, &digits);
+            if ((*p == ']') && ((digits == 8) || (digits == 16)))
+            {
+                p++;
+                if ((p[0] == '\t') && (p[1] == '['))
+                {
+                    vmp_align_hex(p + 2, &v2, &digits2);
+                    if (digits2 == 8)
+                    {
+                        item->flags = VMP_ALIGN_ITEM_ADDR | VMP_ALIGN_ITEM_IDA;
+                        item->addr = v2;
+                        item->va = v;
+                        return 0;
+                    }
+                }
+
+                while (*p == ' ') p++;
+                // 后面跟着指令字节的才是反汇编行，差分行开头的 [count] 后面是 EIP[ 之类
+                vmp_align_hex(p, &v2, &digits2);
+                if ((digits2 == 2) && (p[2] == ' '))
+                {
+                    item->flags = VMP_ALIGN_ITEM_ADDR;
+                    item->addr = item->va = v;
+                    return 0;
+                }
+            }
+            p = line;
+        }
+
+        while (*p)
+        {
+            if (!vmp_align_is_word(*p) || ((p > line) && vmp_align_is_word(p[-1])))
+            {
+                p++;
+                continue;
+            }
+
+            name = p;
+            while (vmp_align_is_word(*p)) p++;
+            len = (int)(p - name);
+            if (*p != '[')
+                continue;
+
+            p = vmp_align_hex(p + 1, &v, &digits);
+            if (!digits)
+                continue;
+
+            v2 = 0xffffffff;
+            if (*p == ':')
+            {
+                v2 = v;
+                p = vmp_align_hex(p + 1, &v, &digits);
+                if (!digits)
+                    continue;
+            }
+            if (*p != ']')
+                continue;
+
+            if ((len == 2) && !strncmp(name, "EF", 2))
+            {
+                item->eflags = v;
+                item->ef_mask = VMP_ALIGN_EF_CMP;
+            }
+            else if ((i = vmp_align_reg_index(name, len)) >= 0)
+            {
+                item->reg_mask |= 1 << i;
+                item->val[i] = v;
+                item->known[i] = v2;
+            }
+        }
+
+        return 0;
+    }
+
+    static uint32_t vmp_align_flag_letters(const char *p)
+    {
+        uint32_t ef = 0;
+
+        for (; vmp_align_is_word(*p); p++)
+        {
+            switch (*p)
+            {
+            case 'C': case 'c': ef |= VMP_ALIGN_EF_CF; break;
+            case 'P': case 'p': ef |= VMP_ALIGN_EF_PF; break;
+            case 'A': case 'a': ef |= VMP_ALIGN_EF_AF; break;
+            case 'Z': case 'z': ef |= VMP_ALIGN_EF_ZF; break;
+            case 'S': case 's': ef |= VMP_ALIGN_EF_SF; break;
+            case 'T': case 't': ef |= VMP_ALIGN_EF_TF; break;
+            case 'I': case 'i': ef |= VMP_ALIGN_EF_IF; break;
+            case 'D': case 'd': ef |= VMP_ALIGN_EF_DF; break;
+            case 'O': case 'o': ef |= VMP_ALIGN_EF_OF; break;
+            }
+        }
+
+        return ef;
+    }
+
+    // 调试器导出的trace，OllyDbg:  地址  线程  命令  ; 寄存器和注释
+    //                   x64dbg:   序号,地址,字节,反汇编,寄存器,...
+    // 地址是行首(或者第二个逗号分隔的字段)的8位或16位十六进制数，寄存器写成
+    // EAX=xxxxxxxx、eax: xxxxxxxx、eax: old-> new，有';'的话只看';'后面的部分
+    static int vmp_align_parse_dbg(char *line, struct vmp_align_item *item)
+    {
+        static const struct { const char *name; uint32_t flag; } flags[] = {
+            { "CF", VMP_ALIGN_EF_CF }, { "PF", VMP_ALIGN_EF_PF }, { "AF", VMP_ALIGN_EF_AF },
+            { "ZF", VMP_ALIGN_EF_ZF }, { "SF", VMP_ALIGN_EF_SF }, { "TF", VMP_ALIGN_EF_TF },
+            { "IF", VMP_ALIGN_EF_IF }, { "DF", VMP_ALIGN_EF_DF }, { "OF", VMP_ALIGN_EF_OF }
+        };
+        const char *p = line, *name, *end;
+        uint32_t v;
+        int digits, len, i, field;
+
+        for (field = 0; field < 2; field++)
+        {
+            while ((*p == ' ') || (*p == '\t') || (*p == '"')) p++;
+            end = vmp_align_hex(p, &v, &digits);
+            if (((digits == 8) || (digits == 16)) && (!*end || strchr(" \t,|\"", *end)))
+            {
+                item->flags = VMP_ALIGN_ITEM_ADDR;
+                item->addr = v;
+                break;
+            }
+            // x64dbg导出的csv，第一个字段是序号
+            p = strchr(p, ',');
+            if (!p)
+                return 0;
+            p++;
+        }
+        if (!item->flags)
+            return 0;
+
+        p = strchr(end, ';');
+        p = p ? p + 1 : end;
+
+        while (*p)
+        {
+            if (!vmp_align_is_word(*p) || vmp_align_is_word(p[-1]))
+            {
+                p++;
+                continue;
+            }
+
+            name = p;
+            while (vmp_align_is_word(*p)) p++;
+            len = (int)(p - name);
+
+            if (*p == '=')
+                p++;
+            else if (*p == ':')
+                while (*++p == ' ');
+            else
+                continue;
+
+            // FL=CZ，列出来的是置位的标志
+            if ((len == 2) && !_strnicmp(name, "FL", 2))
+            {
+                item->eflags = vmp_align_flag_letters(p);
+                item->ef_mask = VMP_ALIGN_EF_ALL;
+                continue;
+            }
+
+            end = vmp_align_hex(p, &v, &digits);
+            if (!digits)
+                continue;
+            // x64dbg: 旧值-> 新值
+            if ((end[0] == '-') && (end[1] == '>'))
+            {
+                p = end + 2;
+                while (*p == ' ') p++;
+                end = vmp_align_hex(p, &v, &digits);
+                if (!digits)
+                    continue;
+            }
+            p = end;
+
+            if ((i = vmp_align_reg_index(name, len)) >= 0)
+            {
+                item->reg_mask |= 1 << i;
+                item->val[i] = v;
+                item->known[i] = 0xffffffff;
+            }
+            else if (((len == 3) && !_strnicmp(name, "EFL", 3)) || ((len == 6) && !_strnicmp(name, "EFLAGS", 6)))
+            {
+                item->eflags = v;
+                item->ef_mask = VMP_ALIGN_EF_ALL;
+            }
+            else if (len == 2)
+            {
+                for (i = 0; i < (int)(sizeof (flags) / sizeof (flags[0])); i++)
+                {
+                    if (!_strnicmp(name, flags[i].name, 2))
+                    {
+                        item->eflags = (item->eflags & ~flags[i].flag) | (v ? flags[i].flag : 0);
+                        item->ef_mask |= flags[i].flag;
+                        break;
+                    }
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    // 在线程池里跑，解析一整块
+    static void vmp_align_parse_task(void *arg)
+    {
+        struct vmp_align_chunk *chunk = (struct vmp_align_chunk *)arg;
+        struct vmp_align_stream *stream = chunk->stream;
+        struct vmp_align_item *item, *new_items;
+        char *line, *end, *buf = chunk->buf;
+        int i, len = chunk->len, new_size;
+
+        // UTF-16LE只关心ASCII，其他字符都换成'?'
+        if (stream->utf16)
+        {
+            for (i = 0; i < len / 2; i++)
+            {
+                buf[i] = (!buf[i * 2 + 1] && !(buf[i * 2] & 0x80)) ? buf[i * 2] : '?';
+            }
+            len /= 2;
+        }
+        buf[len] = 0;
+
+        chunk->item_counts = 0;
+        chunk->lines = 0;
+        chunk->err = 0;
+
+        for (line = buf; line < buf + len; line = end + 1)
+        {
+            end = (char *)memchr(line, '\n', buf + len - line);
+            if (!end)
+                end = buf + len;
+            *end = 0;
+            if ((end > line) && (end[-1] == '\r'))
+                end[-1] = 0;
+            chunk->lines++;
+
+            if (chunk->item_counts == chunk->item_size)
+            {
+                new_size = chunk->item_size ? chunk->item_size * 2 : 4096;
+                new_items = (struct vmp_align_item *)realloc(chunk->items, new_size * sizeof (new_items[0]));
+                if (!new_items)
+                {
+                    print_err("[%s] err: vmp_align_parse_task() failed with realloc(). %s:%d\r\n", time2s(0), __FILE__, __LINE__);
+                    chunk->err = 1;
+                    break;
+                }
+                chunk->items = new_items;
+                chunk->item_size = new_size;
+            }
+
+            item = chunk->items + chunk->item_counts;
+            memset(item, 0, sizeof (item[0]));
+            if (stream->kind == VMP_ALIGN_KIND_EMU)
+                vmp_align_parse_emu(line, item);
+            else
+                vmp_align_parse_dbg(line, item);
+
+            if (item->flags || item->reg_mask || item->ef_mask)
+            {
+                item->line = chunk->lines;
+                chunk->item_counts++;
+            }
+        }
+
+        AcquireSRWLockExclusive(&stream->lock);
+        chunk->done = 1;
+        WakeAllConditionVariable(&stream->done);
+        ReleaseSRWLockExclusive(&stream->lock);
+    }
+
+    // 把空闲的块都读满，交给线程池解析
+    static int vmp_align_stream_fill(struct vmp_align_stream *stream)
+    {
+        struct vmp_align_chunk *chunk;
+        size_t n;
+        int len, cut;
+
+        while ((stream->counts < VMP_TRACE_ALIGN_CHUNKS) && !stream->eof)
+        {
+            chunk = stream->chunks + (stream->head + stream->counts) % VMP_TRACE_ALIGN_CHUNKS;
+
+            memcpy(chunk->buf, stream->carry, stream->carry_len);
+            len = stream->carry_len;
+            n = fread(chunk->buf + len, 1, VMP_TRACE_ALIGN_CHUNK_SIZE, stream->fp);
+            len += (int)n;
+            if (n < VMP_TRACE_ALIGN_CHUNK_SIZE)
+            {
+                if (ferror(stream->fp))
+                {
+                    printf("vmp_align_stream_fill(%s) failed with fread(). %s:%d\n", stream->filename, __FILE__, __LINE__);
+                    return -1;
+                }
+                stream->eof = 1;
+            }
+
+            cut = len;
+            if (!stream->eof)
+            {
+                if (stream->utf16)
+                {
+                    for (cut = (len & ~1) - 2; cut >= 0; cut -= 2)
+                    {
+                        if ((chunk->buf[cut] == '\n') && !chunk->buf[cut + 1])
+                            break;
+                    }
+                    cut = (cut >= 0) ? cut + 2 : (len & ~1);
+                }
+                else
+                {
+                    for (cut = len - 1; (cut >= 0) && (chunk->buf[cut] != '\n'); cut--);
+                    cut = (cut >= 0) ? cut + 1 : len;
+                }
+            }
+
+            stream->carry_len = len - cut;
+            memcpy(stream->carry, chunk->buf + cut, stream->carry_len);
+            chunk->len = cut;
+            chunk->done = 0;
+            stream->counts++;
+
+            if (vmp_tpool_submit(stream->pool, vmp_align_parse_task, chunk))
+            {
+                printf("vmp_align_stream_fill() failed with vmp_tpool_submit(). %s:%d\n", __FILE__, __LINE__);
+                chunk->done = 1;
+                chunk->err = 1;
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    static int vmp_align_stream_open(struct vmp_align_stream *stream, struct vmp_tpool *pool, int kind, const char *filename)
+    {
+        uint8_t head[4] = {0};
+        size_t n;
+        int i;
+
+        memset(stream, 0, sizeof (stream[0]));
+        stream->kind = kind;
+        stream->filename = filename;
+        stream->pool = pool;
+        InitializeSRWLock(&stream->lock);
+        InitializeConditionVariable(&stream->done);
+
+        stream->fp = fopen(filename, "rb");
+        if (!stream->fp)
+        {
+            printf("vmp_align_stream_open(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        n = fread(head, 1, sizeof (head), stream->fp);
+        if ((kind == VMP_ALIGN_KIND_EMU) && (n == 4) && !memcmp(head, VMP_TRACE_MAGIC, 4))
+        {
+            fclose(stream->fp);
+            stream->fp = NULL;
+            stream->is_bin = 1;
+            if (vmp_trace_reader_open(&stream->reader, filename))
+            {
+                printf("vmp_align_stream_open(%s) failed with vmp_trace_reader_open(). %s:%d\n", filename, __FILE__, __LINE__);
+                return -1;
+            }
+            if ((stream->reader.mode != VMP_TRACE_MODE_FULL) && (stream->reader.mode != VMP_TRACE_MODE_DELTA))
+            {
+                printf("vmp_align_stream_open(%s) failed with un-support trace mode[%d]. %s:%d\n",
+                    filename, stream->reader.mode, __FILE__, __LINE__);
+                return -1;
+            }
+            return 0;
+        }
+
+        // 跳过BOM
+        if ((n >= 2) && (head[0] == 0xff) && (head[1] == 0xfe))
+        {
+            stream->utf16 = 1;
+            vmp_fseek(stream->fp, 2, SEEK_SET);
+        }
+        else if ((n >= 3) && (head[0] == 0xef) && (head[1] == 0xbb) && (head[2] == 0xbf))
+            vmp_fseek(stream->fp, 3, SEEK_SET);
+        else
+            vmp_fseek(stream->fp, 0, SEEK_SET);
+
+        stream->carry = (char *)malloc(VMP_TRACE_ALIGN_CHUNK_SIZE);
+        if (!stream->carry)
+        {
+            printf("vmp_align_stream_open() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        for (i = 0; i < VMP_TRACE_ALIGN_CHUNKS; i++)
+        {
+            stream->chunks[i].stream = stream;
+            // 上一块剩下的半行 + 新读的一块 + 结尾的0
+            stream->chunks[i].buf = (char *)malloc(VMP_TRACE_ALIGN_CHUNK_SIZE * 2 + 2);
+            if (!stream->chunks[i].buf)
+            {
+                printf("vmp_align_stream_open() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+                return -1;
+            }
+        }
+
+        return vmp_align_stream_fill(stream);
+    }
+
+    // 调用前线程池里的任务必须都结束了
+    static void vmp_align_stream_close(struct vmp_align_stream *stream)
+    {
+        int i;
+
+        if (stream->is_bin)
+            vmp_trace_reader_close(&stream->reader);
+        if (stream->fp)
+            fclose(stream->fp);
+
+        for (i = 0; i < VMP_TRACE_ALIGN_CHUNKS; i++)
+        {
+            free(stream->chunks[i].buf);
+            free(stream->chunks[i].items);
+        }
+        free(stream->carry);
+    }
+
+    /* 按顺序取下一行，块还没解析完的话等着 */
+    static struct vmp_align_item *vmp_align_stream_peek(struct vmp_align_stream *stream, uint64_t *line)
+    {
+        struct vmp_align_chunk *chunk;
+
+        while (stream->counts)
+        {
+            chunk = stream->chunks + stream->head;
+
+            AcquireSRWLockExclusive(&stream->lock);
+            while (!chunk->done)
+            {
+                SleepConditionVariableSRW(&stream->done, &stream->lock, INFINITE, 0);
+            }
+            ReleaseSRWLockExclusive(&stream->lock);
+
+            if (chunk->err)
+            {
+                stream->err = 1;
+                return NULL;
+            }
+
+            if (stream->item_i < chunk->item_counts)
+            {
+                if (line)
+                    *line = stream->line_base + chunk->items[stream->item_i].line;
+                return chunk->items + stream->item_i;
+            }
+
+            stream->line_base += chunk->lines;
+            stream->head = (stream->head + 1) % VMP_TRACE_ALIGN_CHUNKS;
+            stream->counts--;
+            stream->item_i = 0;
+
+            if (vmp_align_stream_fill(stream))
+            {
+                stream->err = 1;
+                return NULL;
+            }
+        }
+
+        return NULL;
+    }
+
+    static void vmp_align_state_apply(struct vmp_align_state *st, struct vmp_align_item *item)
+    {
+        int i;
+
+        for (i = 0; i < 8; i++)
+        {
+            if (item->reg_mask & (1 << i))
+            {
+                st->val[i] = item->val[i];
+                st->known[i] = item->known[i];
+            }
+        }
+
+        if (item->ef_mask)
+        {
+            st->eflags = (st->eflags & ~item->ef_mask) | (item->eflags & item->ef_mask);
+            st->ef_mask |= item->ef_mask;
+        }
+    }
+
+    static int vmp_align_next_bin(struct vmp_align_stream *stream, struct vmp_align_rec *rec)
+    {
+        struct vmp_trace_record r;
+        int ret;
+
+        while ((ret = vmp_trace_reader_next(&stream->reader, &r)) == 1)
+        {
+            if ((r.tag != VMP_TRACE_TAG_KEYFRAME) && (r.tag != VMP_TRACE_TAG_DELTA))
+                continue;
+
+            // 模拟器里guest地址和IDA地址的差，从一次跳转的目标(eip)和下一条指令的IDA地址算出来
+            if (stream->jump_pending && r.regs.inst_addr && !stream->va_known)
+            {
+                stream->va_off = stream->jump_eip - r.regs.inst_addr;
+                stream->va_known = 1;
+            }
+            stream->jump_pending = stream->has_prev_eip && (r.regs.eip != stream->prev_eip);
+            stream->jump_eip = r.regs.eip;
+            stream->prev_eip = r.regs.eip;
+            stream->has_prev_eip = 1;
+
+            // IAT调用是用一个假的ret模拟的，不在PE里面，地址是0
+            if (!r.regs.inst_addr)
+            {
+                stream->iat = 1;
+                continue;
+            }
+
+            rec->addr = r.regs.inst_addr;
+            rec->va = stream->va_known ? rec->addr + stream->va_off : 0;
+            rec->index = r.count;
+            rec->after_iat = stream->iat;
+            stream->iat = 0;
+
+            memcpy(rec->st.val, r.regs.val, sizeof (rec->st.val));
+            memcpy(rec->st.known, r.regs.known, sizeof (rec->st.known));
+            rec->st.eflags = r.regs.eflags;
+            rec->st.ef_mask = r.regs.eflags_known & VMP_ALIGN_EF_CMP;
+
+            return 1;
+        }
+
+        return ret;
+    }
+
+    /* 模拟器的下一条指令，文本trace里指令行后面的寄存器行都算这条指令的
+    @return     1           got
+                0           end of file
+                -1          failure */
+    static int vmp_align_next_emu(struct vmp_align_stream *stream, struct vmp_align_rec *rec)
+    {
+        struct vmp_align_item *item;
+
+        if (stream->is_bin)
+            return vmp_align_next_bin(stream, rec);
+
+        while ((item = vmp_align_stream_peek(stream, NULL)) && !(item->flags & VMP_ALIGN_ITEM_ADDR))
+        {
+            vmp_align_state_apply(&stream->state, item);
+            stream->item_i++;
+        }
+        if (!item)
+            return stream->err ? -1 : 0;
+
+        rec->addr = item->addr;
+        rec->va = item->va;
+        rec->index = ++stream->records;
+        rec->after_iat = 0;
+        stream->item_i++;
+
+        while ((item = vmp_align_stream_peek(stream, NULL)) && !(item->flags & VMP_ALIGN_ITEM_ADDR))
+        {
+            vmp_align_state_apply(&stream->state, item);
+            stream->item_i++;
+        }
+        if (stream->err)
+            return -1;
+
+        rec->st = stream->state;
+
+        return 1;
+    }
+
+    static int vmp_align_next_dbg(struct vmp_align_stream *stream, struct vmp_align_rec *rec)
+    {
+        struct vmp_align_item *item;
+        uint64_t line;
+
+        while ((item = vmp_align_stream_peek(stream, &line)))
+        {
+            vmp_align_state_apply(&stream->state, item);
+            stream->item_i++;
+
+            if (item->flags & VMP_ALIGN_ITEM_ADDR)
+            {
+                rec->addr = item->addr;
+                rec->va = item->addr;
+                rec->index = line;
+                rec->after_iat = 0;
+                rec->st = stream->state;
+                return 1;
+            }
+        }
+
+        return stream->err ? -1 : 0;
+    }
+
+    typedef struct vmp_align_ctx
+    {
+        uint32_t    emu_addr;
+        uint32_t    dbg_addr;
+        uint64_t    emu_index;
+        uint64_t    dbg_index;
+    } vmp_align_ctx_t;
+
+    typedef struct vmp_align
+    {
+        struct vmp_trace_align_param param;
+
+        // 调试器地址 - 模拟器trace里的地址
+        int         synced;
+        uint32_t    addr_delta;
+        // 寄存器里的栈地址、PE内的地址，两边的差
+        int         stack_known;
+        uint32_t    stack_delta;
+        int         image_known;
+        uint32_t    image_delta;
+
+        uint32_t    volatile_regs;
+        int         volatile_ef;
+        struct vmp_align_state volatile_st;
+
+        uint64_t    aligned;
+        uint64_t    emu_skipped;
+        uint64_t    dbg_skipped;
+        uint64_t    dbg_head;
+        int         resyncs;
+
+        struct vmp_align_ctx ctx[VMP_TRACE_ALIGN_CONTEXT];
+        int         ctx_i;
+        int         ctx_counts;
+    } vmp_align_t;
+
+    static int vmp_align_reg_equal(struct vmp_align *align, uint32_t e, uint32_t d, uint32_t known)
+    {
+        if (!((e ^ d) & known))
+            return 1;
+
+        if (known != 0xffffffff)
+            return 0;
+
+        if (align->stack_known && ((e - d) == align->stack_delta))
+            return 1;
+
+        if (align->image_known && ((e - d) == align->image_delta))
+            return 1;
+
+        // 模拟器里程序自己的绝对地址没有重定位，还是按IDA地址(0x400000)算的
+        if ((e - d) == (uint32_t)(0 - align->addr_delta))
+            return 1;
+
+        return 0;
+    }
+
+    static void vmp_align_summary(struct vmp_align *align)
+    {
+        printf("align: aligned[%llu] emu skipped[%llu] dbg skipped[%llu] dbg head[%llu] resync[%d]\n",
+            (unsigned long long)align->aligned, (unsigned long long)align->emu_skipped,
+            (unsigned long long)align->dbg_skipped, (unsigned long long)align->dbg_head, align->resyncs);
+    }
+
+    static void vmp_align_print_context(struct vmp_align *align)
+    {
+        struct vmp_align_ctx *ctx;
+        int i, n = align->ctx_counts;
+
+        printf("last %d aligned instructions:\n", n);
+        for (i = n; i > 0; i--)
+        {
+            ctx = align->ctx + (align->ctx_i + VMP_TRACE_ALIGN_CONTEXT - i) % VMP_TRACE_ALIGN_CONTEXT;
+            printf("    emu[%llu] %08x  dbg line[%llu] %08x\n",
+                (unsigned long long)ctx->emu_index, ctx->emu_addr, (unsigned long long)ctx->dbg_index, ctx->dbg_addr);
+        }
+    }
+
+    /* 比较一对对齐了的指令
+    @return     0           一致
+                1           不一致，已经打印出来了 */
+    static int vmp_align_compare(struct vmp_align *align, struct vmp_align_rec *emu, struct vmp_align_state *emu_st, struct vmp_align_rec *dbg)
+    {
+        struct vmp_align_state *dbg_st = &dbg->st;
+        uint32_t known, ef_mask, diff = 0, ef_diff;
+        int i;
+
+        for (i = 0; i < 8; i++)
+        {
+            if (align->volatile_regs & (1 << i))
+            {
+                if ((emu_st->val[i] == align->volatile_st.val[i]) && (emu_st->known[i] == align->volatile_st.known[i]))
+                    continue;
+                align->volatile_regs &= ~(1 << i);
+            }
+
+            known = emu_st->known[i] & dbg_st->known[i];
+            if (known && !vmp_align_reg_equal(align, emu_st->val[i], dbg_st->val[i], known))
+                diff |= 1 << i;
+        }
+
+        if (align->volatile_ef && (emu_st->eflags == align->volatile_st.eflags))
+            ef_diff = 0;
+        else
+        {
+            align->volatile_ef = 0;
+            ef_mask = emu_st->ef_mask & dbg_st->ef_mask & VMP_ALIGN_EF_CMP;
+            ef_diff = (emu_st->eflags ^ dbg_st->eflags) & ef_mask;
+        }
+
+        if (!diff && !ef_diff)
+            return 0;
+
+        printf("divergence at emu inst[%llu] addr[%08x], dbg line[%llu] addr[%08x]\n",
+            (unsigned long long)emu->index, emu->addr, (unsigned long long)dbg->index, dbg->addr);
+        for (i = 0; i < 8; i++)
+        {
+            if (diff & (1 << i))
+                printf("    %s emu[%08x:%08x] dbg[%08x]\n", vmp_align_reg_name[i], emu_st->known[i], emu_st->val[i], dbg_st->val[i]);
+        }
+        if (ef_diff)
+        {
+            printf("    eflags emu[%08x] dbg[%08x] diff[%s%s%s%s]\n", emu_st->eflags, dbg_st->eflags,
+                (ef_diff & VMP_ALIGN_EF_CF) ? " CF" : "", (ef_diff & VMP_ALIGN_EF_ZF) ? " ZF" : "",
+                (ef_diff & VMP_ALIGN_EF_SF) ? " SF" : "", (ef_diff & VMP_ALIGN_EF_OF) ? " OF" : "");
+        }
+        if (align->stack_known || align->image_known)
+            printf("    (stack delta[%08x], image delta[%08x])\n", align->stack_delta, align->image_delta);
+
+        return 1;
+    }
+
+    static int vmp_align_head_match(struct vmp_align_stream *dbg_s, struct vmp_align_rec *dbg, struct vmp_align_rec *emu, struct vmp_align_rec *emu_next)
+    {
+        struct vmp_align_item *item;
+
+        if ((dbg->addr & 0xffff) != (emu->addr & 0xffff))
+            return 0;
+        if (!emu_next)
+            return 1;
+
+        // 调试器trace里留下来的行都带地址，直接看下一行
+        item = vmp_align_stream_peek(dbg_s, NULL);
+
+        return !item || (item->addr - dbg->addr == emu_next->addr - emu->addr);
+    }
+
+    static void vmp_align_set_volatile(struct vmp_align *align, struct vmp_align_state *st)
+    {
+        align->volatile_regs = VMP_ALIGN_VOLATILE_REGS;
+        align->volatile_ef = 1;
+        align->volatile_st = *st;
+    }
+
+    int vmp_trace_align(struct vmp_trace_align_param *param)
+    {
+        struct vmp_align *align = NULL;
+        struct vmp_align_stream *emu_s = NULL, *dbg_s = NULL;
+        struct vmp_align_rec emu, emu_next, dbg;
+        struct vmp_align_state prev_st;
+        struct vmp_tpool *pool = NULL;
+        struct vmp_align_ctx *ctx;
+        int ret = -1, has_next, has_prev = 0, r;
+        uint64_t skipped, from_line;
+
+        align = (struct vmp_align *)calloc(1, sizeof (align[0]));
+        emu_s = (struct vmp_align_stream *)calloc(1, sizeof (emu_s[0]));
+        dbg_s = (struct vmp_align_stream *)calloc(1, sizeof (dbg_s[0]));
+        if (!align || !emu_s || !dbg_s)
+        {
+            printf("vmp_trace_align() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+        align->param = *param;
+        if (align->param.max_skip <= 0)
+            align->param.max_skip = VMP_TRACE_ALIGN_MAX_SKIP;
+
+        pool = vmp_tpool_create(param->threads);
+        if (!pool)
+        {
+            printf("vmp_trace_align() failed with vmp_tpool_create(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (vmp_align_stream_open(emu_s, pool, VMP_ALIGN_KIND_EMU, param->emu_filename)
+            || vmp_align_stream_open(dbg_s, pool, VMP_ALIGN_KIND_DBG, param->dbg_filename))
+        {
+            printf("vmp_trace_align() failed with vmp_align_stream_open(). %s:%d\n", __FILE__, __LINE__);
+            goto exit_label;
+        }
+
+        if (((r = vmp_align_next_emu(emu_s, &emu)) <= 0) || ((r = vmp_align_next_dbg(dbg_s, &dbg)) <= 0))
+        {
+            if (!r)
+                printf("align: empty trace, nothing to compare\n");
+            ret = r;
+            goto exit_label;
+        }
+        if ((has_next = vmp_align_next_emu(emu_s, &emu_next)) < 0)
+            goto exit_label;
+
+        // 给了调试器里的基址，模拟器trace里必须是IDA地址
+        if (param->dbg_base)
+        {
+            align->addr_delta = param->dbg_base - FAKE_IMAGE_BASE;
+            align->synced = 1;
+        }
+
+        while (1)
+        {
+            if (!align->synced)
+            {
+                // 模块是按64K对齐加载的，低16位一样、并且下一条指令也对得上的地方就是模拟器开始的地方
+                for (skipped = 0; !vmp_align_head_match(dbg_s, &dbg, &emu, (has_next > 0) ? &emu_next : NULL); skipped++)
+                {
+                    if ((skipped >= (uint64_t)align->param.max_skip) || ((r = vmp_align_next_dbg(dbg_s, &dbg)) <= 0))
+                    {
+                        printf("align: emu start addr[%08x] not found in the first %llu dbg instructions\n",
+                            emu.addr, (unsigned long long)skipped);
+                        ret = (r < 0) ? -1 : 1;
+                        goto exit_label;
+                    }
+                }
+                align->dbg_head = skipped;
+                align->addr_delta = dbg.addr - emu.addr;
+                align->synced = 1;
+                printf("align: dbg line[%llu] addr[%08x] <-> emu addr[%08x], delta[%08x]\n",
+                    (unsigned long long)dbg.index, dbg.addr, emu.addr, align->addr_delta);
+            }
+
+            if (emu.addr + align->addr_delta != dbg.addr)
+            {
+                // 模拟器多出来的指令(比如文本trace里模拟IAT调用的假ret)
+                if ((has_next > 0) && (emu_next.addr + align->addr_delta == dbg.addr))
+                {
+                    align->emu_skipped++;
+                    emu = emu_next;
+                    emu.after_iat = 1;
+                    if ((has_next = vmp_align_next_emu(emu_s, &emu_next)) < 0)
+                        goto exit_label;
+                    continue;
+                }
+
+                // 调试器跟进去的IAT调用
+                from_line = dbg.index;
+                for (skipped = 0; emu.addr + align->addr_delta != dbg.addr; skipped++)
+                {
+                    if (skipped >= (uint64_t)align->param.max_skip)
+                    {
+                        printf("control flow divergence at emu inst[%llu] addr[%08x]: "
+                            "dbg didn't reach it within %llu lines after line[%llu]\n",
+                            (unsigned long long)emu.index, emu.addr, (unsigned long long)skipped, (unsigned long long)from_line);
+                        vmp_align_print_context(align);
+                        vmp_align_summary(align);
+                        ret = 1;
+                        goto exit_label;
+                    }
+
+                    if ((r = vmp_align_next_dbg(dbg_s, &dbg)) <= 0)
+                    {
+                        if (!r)
+                            printf("align: dbg trace ended while looking for emu addr[%08x] after line[%llu]\n",
+                                emu.addr, (unsigned long long)from_line);
+                        ret = r ? -1 : 0;
+                        vmp_align_summary(align);
+                        goto exit_label;
+                    }
+                }
+                align->dbg_skipped += skipped;
+                align->resyncs++;
+                emu.after_iat = 1;
+            }
+
+            if (emu.after_iat)
+                vmp_align_set_volatile(align, &emu.st);
+
+            align->aligned++;
+            if (!align->stack_known && (emu.st.known[4] == 0xffffffff) && dbg.st.known[4])
+            {
+                align->stack_delta = emu.st.val[4] - dbg.st.val[4];
+                align->stack_known = 1;
+            }
+            if (!align->image_known && emu.va)
+            {
+                align->image_delta = emu.va - dbg.addr;
+                align->image_known = 1;
+            }
+
+            if (!param->dbg_before)
+            {
+                if (vmp_align_compare(align, &emu, &emu.st, &dbg))
+                    goto diverge_label;
+            }
+            else if (has_prev && vmp_align_compare(align, &emu, &prev_st, &dbg))
+                goto diverge_label;
+
+            ctx = align->ctx + align->ctx_i;
+            align->ctx_i = (align->ctx_i + 1) % VMP_TRACE_ALIGN_CONTEXT;
+            if (align->ctx_counts < VMP_TRACE_ALIGN_CONTEXT)
+                align->ctx_counts++;
+            ctx->emu_addr = emu.addr;
+            ctx->dbg_addr = dbg.addr;
+            ctx->emu_index = emu.index;
+            ctx->dbg_index = dbg.index;
+
+            prev_st = emu.st;
+            has_prev = 1;
+
+            if (has_next <= 0)
+                break;
+            emu = emu_next;
+            if ((has_next = vmp_align_next_emu(emu_s, &emu_next)) < 0)
+                goto exit_label;
+
+            if ((r = vmp_align_next_dbg(dbg_s, &dbg)) <= 0)
+            {
+                if (r < 0)
+                    goto exit_label;
+                break;
+            }
+        }
+
+        printf("align: no divergence found\n");
+        vmp_align_summary(align);
+        ret = 0;
+        goto exit_label;
+
+diverge_label:
+        vmp_align_print_context(align);
+        vmp_align_summary(align);
+        ret = 1;
+
+exit_label:
+        // 先等解析任务都结束，再释放块
+        vmp_tpool_destroy(pool);
+        if (emu_s)
+            vmp_align_stream_close(emu_s);
+        if (dbg_s)
+            vmp_align_stream_close(dbg_s);
+        free(emu_s);
+        free(dbg_s);
+        free(align);
+
+        return ret;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,49 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_trace_align_h__
+#define __vmp_trace_align_h__
+
+#include <stdint.h>
+
+// 把模拟器的trace和调试器导出的run trace按指令地址对齐，找出第一处寄存器或标志位不一致的地方
+// 模拟器trace:  二进制trace(x86模式，full或delta)，或者文本trace(vmp.log，也支持以前UTF-16的log)
+// 调试器trace:  每行开头是指令地址，后面的 EAX=xxxxxxxx、ECX: xxxxxxxx、FL=CZ、EFL=xxxxxxxx
+//              都当成执行完这条指令以后的寄存器，没有出现的寄存器沿用上一次的值
+// 两边都是流式读的，文本文件按块读进来，放到线程池里并行解析，内存占用和文件大小无关
+#define VMP_TRACE_ALIGN_CHUNK_SIZE      (1024 * 1024)
+// 每个文件最多同时有多少个块在解析
+#define VMP_TRACE_ALIGN_CHUNKS          4
+#define VMP_TRACE_ALIGN_MAX_SKIP        1000000
+// 出错时打印前面多少条对齐的指令
+#define VMP_TRACE_ALIGN_CONTEXT         8
+
+struct vmp_trace_align_param
+{
+    const char  *emu_filename;
+    const char  *dbg_filename;
+    // 调试器里模块的加载基址，0表示自动:
+    //  在调试器trace里找第一条低16位和模拟器第一条指令相同的地址
+    uint32_t    dbg_base;
+    // 为了重新对齐(比如调试器跟进了IAT调用)，最多跳过调试器trace的多少行，0表示用默认值
+    int         max_skip;
+    // 调试器trace里的寄存器是执行这条指令之前的值
+    int         dbg_before;
+    // 解析线程数，0表示用CPU核数
+    int         threads;
+};
+
+/*
+@return     0           两个trace一致(直到其中一个结束)
+            1           发现了不一致，详细信息已经打印出来了
+            -1          failure */
+int vmp_trace_align(struct vmp_trace_align_param *param);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,751 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_trace_index.h"
+#include "mbytes.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+// 查询结果里的列表最多打印多少项
+#define VMP_TRACE_INDEX_QUERY_MAX   64
+
+    static const char *vmp_trace_index_reg_name[8] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" };
+
+    static int vmp_trace_index_u64s_add(struct vmp_trace_index_u64s *arr, uint64_t v)
+    {
+        uint64_t *new_data;
+        uint32_t new_size;
+
+        if (arr->counts == arr->size)
+        {
+            new_size = arr->size ? arr->size * 2 : 64;
+            new_data = (uint64_t *)realloc(arr->data, new_size * sizeof (new_data[0]));
+            if (!new_data)
+            {
+                print_err ("[%s] err: vmp_trace_index_u64s_add() failed with realloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+                return -1;
+            }
+            arr->data = new_data;
+            arr->size = new_size;
+        }
+        arr->data[arr->counts++] = v;
+
+        return 0;
+    }
+
+    struct vmp_trace_index *vmp_trace_index_create(int mode, int interval)
+    {
+        struct vmp_trace_index *idx = (struct vmp_trace_index *)calloc(1, sizeof (idx[0]));
+
+        if (!idx)
+        {
+            printf("vmp_trace_index_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        idx->mode = mode;
+        idx->interval = (interval > 0) ? interval : VMP_TRACE_KEYFRAME_DEFAULT;
+
+        if (mhash64_init(&idx->addr_map, 4096) || mhash64_init(&idx->unit_map, 256) || mhash64_init(&idx->unit_ids, 256))
+        {
+            printf("vmp_trace_index_create() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            vmp_trace_index_destroy(idx);
+            return NULL;
+        }
+
+        return idx;
+    }
+
+    int vmp_trace_index_destroy(struct vmp_trace_index *idx)
+    {
+        uint32_t i;
+
+        if (!idx)
+            return 0;
+
+        for (i = 0; i < idx->unit_counts; i++)
+        {
+            free(idx->units[i].inst_addrs);
+            free(idx->units[i].execs.data);
+        }
+        for (i = 0; i < 8; i++)
+        {
+            free(idx->regs[i].data);
+        }
+        free(idx->units);
+        free(idx->addrs);
+        free(idx->sparse.data);
+        mhash64_uninit(&idx->addr_map);
+        mhash64_uninit(&idx->unit_map);
+        mhash64_uninit(&idx->unit_ids);
+        free(idx);
+
+        return 0;
+    }
+
+    static int vmp_trace_index_addr_hit(struct vmp_trace_index *idx, uint32_t addr, uint64_t count)
+    {
+        struct vmp_trace_index_addr *a, *new_addrs;
+        uint64_t *slot;
+        int is_new;
+
+        if (!addr)
+            return 0;
+
+        if (!(slot = mhash64_insert(&idx->addr_map, addr, &is_new)))
+            return -1;
+
+        if (is_new)
+        {
+            if (idx->addr_counts == idx->addr_size)
+            {
+                idx->addr_size = idx->addr_size ? idx->addr_size * 2 : 4096;
+                new_addrs = (struct vmp_trace_index_addr *)realloc(idx->addrs, idx->addr_size * sizeof (new_addrs[0]));
+                if (!new_addrs)
+                    return -1;
+                idx->addrs = new_addrs;
+            }
+            *slot = idx->addr_counts++;
+            a = idx->addrs + *slot;
+            a->addr = addr;
+            a->hits = 0;
+            a->first = count;
+        }
+
+        a = idx->addrs + *slot;
+        a->hits++;
+        a->last = count;
+
+        return 0;
+    }
+
+    static struct vmp_trace_index_unit *vmp_trace_index_unit_get(struct vmp_trace_index *idx, uint32_t addr)
+    {
+        struct vmp_trace_index_unit *new_units;
+        uint64_t *slot;
+        int is_new;
+
+        if (!(slot = mhash64_insert(&idx->unit_map, addr, &is_new)))
+            return NULL;
+
+        if (is_new)
+        {
+            if (idx->unit_counts == idx->unit_size)
+            {
+                idx->unit_size = idx->unit_size ? idx->unit_size * 2 : 256;
+                new_units = (struct vmp_trace_index_unit *)realloc(idx->units, idx->unit_size * sizeof (new_units[0]));
+                if (!new_units)
+                    return NULL;
+                idx->units = new_units;
+            }
+            *slot = idx->unit_counts++;
+            memset(idx->units + *slot, 0, sizeof (idx->units[0]));
+            idx->units[*slot].addr = addr;
+            idx->units[*slot].id = (uint32_t)*slot + 1;
+        }
+
+        return idx->units + *slot;
+    }
+
+    static int vmp_trace_index_sparse(struct vmp_trace_index *idx, uint64_t offset, uint64_t count)
+    {
+        struct vmp_trace_index_u64s *sp = &idx->sparse;
+
+        if (sp->counts && (count < sp->data[sp->counts - 2] + idx->interval))
+            return 0;
+
+        if (vmp_trace_index_u64s_add(sp, count) || vmp_trace_index_u64s_add(sp, offset))
+            return -1;
+
+        return 0;
+    }
+
+    static int vmp_trace_index_exec(struct vmp_trace_index *idx, struct vmp_trace_index_unit *unit, uint64_t count)
+    {
+        uint32_t i;
+
+        if (vmp_trace_index_u64s_add(&unit->execs, count))
+            return -1;
+
+        if (!unit->inst_addrs)
+            return vmp_trace_index_addr_hit(idx, unit->addr, count + 1);
+
+        for (i = 0; i < unit->insts; i++)
+        {
+            vmp_trace_index_addr_hit(idx, unit->inst_addrs[i], count + i + 1);
+        }
+
+        return 0;
+    }
+
+    int vmp_trace_index_record(struct vmp_trace_index *idx, uint64_t offset, struct vmp_trace_record *rec, int seekable)
+    {
+        struct vmp_trace_index_unit *unit;
+        uint64_t *slot, before;
+        int i;
+
+        switch (rec->tag)
+        {
+        case VMP_TRACE_TAG_KEYFRAME:
+        case VMP_TRACE_TAG_DELTA:
+            // block模式下的关键帧是block出口的寄存器，本身不包含指令
+            before = (idx->mode == VMP_TRACE_MODE_BLOCK) ? rec->count : (rec->count - 1);
+            if (idx->mode != VMP_TRACE_MODE_BLOCK)
+            {
+                vmp_trace_index_addr_hit(idx, rec->regs.inst_addr, rec->count);
+
+                // esp的访问基本都是push/pop，没有查询的意义。没有第二个访问地址时addr2是0，不能拿去和寄存器比
+                for (i = 0; i < 8; i++)
+                {
+                    if ((i != 4) && rec->regs.access_addr
+                        && ((rec->regs.access_addr == rec->regs.val[i])
+                            || (rec->regs.access_addr2 && (rec->regs.access_addr2 == rec->regs.val[i]))))
+                    {
+                        vmp_trace_index_u64s_add(&idx->regs[i], rec->count);
+                    }
+                }
+            }
+            break;
+
+        case VMP_TRACE_TAG_BLOCK_DEF:
+            if (!(unit = vmp_trace_index_unit_get(idx, rec->block->addr)))
+                return -1;
+            unit->id = rec->block_id;
+            unit->insts = rec->block->insts;
+            unit->def_offset = offset;
+            free(unit->inst_addrs);
+            if ((unit->inst_addrs = (uint32_t *)malloc((unit->insts + 1) * sizeof (unit->inst_addrs[0]))))
+            {
+                memcpy(unit->inst_addrs, rec->block->inst_addrs, unit->insts * sizeof (unit->inst_addrs[0]));
+            }
+            if (!(slot = mhash64_insert(&idx->unit_ids, rec->block_id, NULL)))
+                return -1;
+            *slot = unit - idx->units;
+            return 0;
+
+        case VMP_TRACE_TAG_BLOCK:
+            if (!(slot = mhash64_find(&idx->unit_ids, rec->block_id)))
+                return -1;
+            unit = idx->units + *slot;
+            before = rec->count - unit->insts;
+            vmp_trace_index_exec(idx, unit, before);
+            break;
+
+        case VMP_TRACE_TAG_VM:
+            if (!(unit = vmp_trace_index_unit_get(idx, rec->vm.handler)))
+                return -1;
+            before = rec->count - rec->vm.x86_insts;
+            unit->insts = rec->vm.x86_insts;
+            vmp_trace_index_exec(idx, unit, before);
+            break;
+
+        default:
+            return 0;
+        }
+
+        if (rec->count > idx->total)
+            idx->total = rec->count;
+
+        return seekable ? vmp_trace_index_sparse(idx, offset, before) : 0;
+    }
+
+    static int vmp_trace_index_addr_cmp(const void *a, const void *b)
+    {
+        uint32_t x = ((const struct vmp_trace_index_addr *)a)->addr, y = ((const struct vmp_trace_index_addr *)b)->addr;
+        return (x > y) - (x < y);
+    }
+
+    static int vmp_trace_index_unit_cmp(const void *a, const void *b)
+    {
+        uint32_t x = ((const struct vmp_trace_index_unit *)a)->addr, y = ((const struct vmp_trace_index_unit *)b)->addr;
+        return (x > y) - (x < y);
+    }
+
+    static int vmp_trace_index_write_u64s(FILE *fp, uint64_t *data, uint32_t counts)
+    {
+        uint8_t buf[8 * 256];
+        uint32_t i, n;
+
+        while (counts)
+        {
+            n = (counts > 256) ? 256 : counts;
+            for (i = 0; i < n; i++)
+            {
+                mbytes_write_int_little_endian_8b(buf + i * 8, data[i]);
+            }
+            if (fwrite(buf, n * 8, 1, fp) != 1)
+                return -1;
+            data += n;
+            counts -= n;
+        }
+
+        return 0;
+    }
+
+    int vmp_trace_index_save(struct vmp_trace_index *idx, const char *filename)
+    {
+        uint8_t head[VMP_TRACE_INDEX_HEAD_SIZE], buf[32];
+        uint64_t reg_offset, execs_offset;
+        uint32_t i, sparse_counts = idx->sparse.counts / 2;
+        FILE *fp;
+
+        // 排序以后hash表里的下标就失效了，保存完索引对象就不能再继续使用
+        if (idx->addr_counts)
+            qsort(idx->addrs, idx->addr_counts, sizeof (idx->addrs[0]), vmp_trace_index_addr_cmp);
+        if (idx->unit_counts)
+            qsort(idx->units, idx->unit_counts, sizeof (idx->units[0]), vmp_trace_index_unit_cmp);
+        mhash64_clear(&idx->addr_map);
+        mhash64_clear(&idx->unit_map);
+        mhash64_clear(&idx->unit_ids);
+
+        fp = fopen(filename, "wb");
+        if (!fp)
+        {
+            printf("vmp_trace_index_save(%s) failed with fopen(). %s:%d\n", filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        reg_offset = VMP_TRACE_INDEX_HEAD_SIZE + (uint64_t)sparse_counts * 16
+            + (uint64_t)idx->addr_counts * 24 + (uint64_t)idx->unit_counts * 32;
+
+        memset(head, 0, sizeof (head));
+        memcpy(head, VMP_TRACE_INDEX_MAGIC, 4);
+        mbytes_write_int_little_endian_2b(head + 4, VMP_TRACE_INDEX_VERSION);
+        mbytes_write_int_little_endian_2b(head + 6, idx->mode);
+        mbytes_write_int_little_endian_4b(head + 8, idx->interval);
+        mbytes_write_int_little_endian_4b(head + 12, sparse_counts);
+        mbytes_write_int_little_endian_4b(head + 16, idx->addr_counts);
+        mbytes_write_int_little_endian_4b(head + 20, idx->unit_counts);
+        mbytes_write_int_little_endian_8b(head + 24, idx->total);
+        mbytes_write_int_little_endian_8b(head + 32, reg_offset);
+        fwrite(head, sizeof (head), 1, fp);
+
+        vmp_trace_index_write_u64s(fp, idx->sparse.data, idx->sparse.counts);
+
+        for (i = 0; i < idx->addr_counts; i++)
+        {
+            mbytes_write_int_little_endian_4b(buf, idx->addrs[i].addr);
+            mbytes_write_int_little_endian_4b(buf + 4, idx->addrs[i].hits);
+            mbytes_write_int_little_endian_8b(buf + 8, idx->addrs[i].first);
+            mbytes_write_int_little_endian_8b(buf + 16, idx->addrs[i].last);
+            fwrite(buf, 24, 1, fp);
+        }
+
+        execs_offset = reg_offset + 8 * 8;
+        for (i = 0; i < 8; i++)
+        {
+            execs_offset += (uint64_t)idx->regs[i].counts * 8;
+        }
+
+        for (i = 0; i < idx->unit_counts; i++)
+        {
+            mbytes_write_int_little_endian_4b(buf, idx->units[i].addr);
+            mbytes_write_int_little_endian_4b(buf + 4, idx->units[i].id);
+            mbytes_write_int_little_endian_4b(buf + 8, idx->units[i].insts);
+            mbytes_write_int_little_endian_4b(buf + 12, idx->units[i].execs.counts);
+            mbytes_write_int_little_endian_8b(buf + 16, idx->units[i].def_offset);
+            mbytes_write_int_little_endian_8b(buf + 24, execs_offset);
+            fwrite(buf, 32, 1, fp);
+            execs_offset += (uint64_t)idx->units[i].execs.counts * 8;
+        }
+
+        for (i = 0; i < 8; i++)
+        {
+            mbytes_write_int_little_endian_8b(buf, (uint64_t)idx->regs[i].counts);
+            fwrite(buf, 8, 1, fp);
+        }
+        for (i = 0; i < 8; i++)
+        {
+            vmp_trace_index_write_u64s(fp, idx->regs[i].data, idx->regs[i].counts);
+        }
+        for (i = 0; i < idx->unit_counts; i++)
+        {
+            vmp_trace_index_write_u64s(fp, idx->units[i].execs.data, idx->units[i].execs.counts);
+        }
+
+        if (ferror(fp))
+        {
+            printf("vmp_trace_index_save(%s) failed with fwrite(). %s:%d\n", filename, __FILE__, __LINE__);
+            fclose(fp);
+            return -1;
+        }
+        fclose(fp);
+
+        return 0;
+    }
+
+    int vmp_trace_index_build(const char *trace_filename)
+    {
+        struct vmp_trace_reader reader;
+        struct vmp_trace_record rec;
+        struct vmp_trace_index *idx;
+        char idx_filename[MAX_PATH];
+        uint64_t offset;
+        int ret, seekable, c;
+
+        if (vmp_trace_reader_open(&reader, trace_filename))
+            return -1;
+
+        if (!(idx = vmp_trace_index_create(reader.mode, reader.keyframe)))
+        {
+            vmp_trace_reader_close(&reader);
+            return -1;
+        }
+
+        while (1)
+        {
+            offset = vmp_ftell(reader.fp);
+            if ((ret = vmp_trace_reader_next(&reader, &rec)) <= 0)
+                break;
+
+            switch (rec.tag)
+            {
+            case VMP_TRACE_TAG_KEYFRAME:
+            case VMP_TRACE_TAG_VM:
+                seekable = 1;
+                break;
+
+            case VMP_TRACE_TAG_BLOCK:
+                // 后面跟着差分出口的block没法单独解码
+                c = getc(reader.fp);
+                seekable = (c != VMP_TRACE_TAG_BLOCK_EXIT);
+                if (c != EOF)
+                    ungetc(c, reader.fp);
+                break;
+
+            default:
+                seekable = 0;
+                break;
+            }
+
+            vmp_trace_index_record(idx, offset, &rec, seekable);
+        }
+
+        vmp_trace_reader_close(&reader);
+
+        snprintf(idx_filename, sizeof (idx_filename), "%s%s", trace_filename, VMP_TRACE_INDEX_SUFFIX);
+        if (!ret)
+        {
+            ret = vmp_trace_index_save(idx, idx_filename);
+            printf("index[%s] insts[%llu] sparse[%u] addrs[%u] units[%u]\n", idx_filename,
+                (unsigned long long)idx->total, idx->sparse.counts / 2, idx->addr_counts, idx->unit_counts);
+        }
+        vmp_trace_index_destroy(idx);
+
+        return ret;
+    }
+
+    // 查询时只把文件头和几张定长的表读进来，执行列表和访问列表用的时候再按偏移去读
+    typedef struct vmp_trace_index_file
+    {
+        FILE        *fp;
+        int         mode;
+        uint64_t    total;
+        uint64_t    reg_offset;
+        uint32_t    sparse_counts;
+        uint32_t    addr_counts;
+        uint32_t    unit_counts;
+        uint8_t     *sparse;
+        uint8_t     *addrs;
+        uint8_t     *units;
+    } vmp_trace_index_file_t;
+
+    static int vmp_trace_index_file_close(struct vmp_trace_index_file *f)
+    {
+        if (f->fp)
+            fclose(f->fp);
+        free(f->sparse);
+        free(f->addrs);
+        free(f->units);
+        memset(f, 0, sizeof (f[0]));
+
+        return 0;
+    }
+
+    static uint8_t *vmp_trace_index_file_read(FILE *fp, uint64_t size)
+    {
+        uint8_t *buf = (uint8_t *)malloc((size_t)size + 1);
+
+        if (buf && size && (fread(buf, (size_t)size, 1, fp) != 1))
+        {
+            free(buf);
+            return NULL;
+        }
+
+        return buf;
+    }
+
+    static int vmp_trace_index_file_open(struct vmp_trace_index_file *f, const char *trace_filename)
+    {
+        char filename[MAX_PATH];
+        uint8_t head[VMP_TRACE_INDEX_HEAD_SIZE];
+
+        memset(f, 0, sizeof (f[0]));
+
+        snprintf(filename, sizeof (filename), "%s%s", trace_filename, VMP_TRACE_INDEX_SUFFIX);
+        if (!(f->fp = fopen(filename, "rb")))
+        {
+            printf("vmp_trace_index_file_open(%s) failed with fopen(), build it with -trace_index_build first. %s:%d\n",
+                filename, __FILE__, __LINE__);
+            return -1;
+        }
+
+        if ((fread(head, sizeof (head), 1, f->fp) != 1) || memcmp(head, VMP_TRACE_INDEX_MAGIC, 4)
+            || (mbytes_read_int_little_endian_2b(head + 4) != VMP_TRACE_INDEX_VERSION))
+        {
+            printf("vmp_trace_index_file_open(%s) failed with invalid index header. %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        f->mode = mbytes_read_int_little_endian_2b(head + 6);
+        f->sparse_counts = mbytes_read_int_little_endian_4b(head + 12);
+        f->addr_counts = mbytes_read_int_little_endian_4b(head + 16);
+        f->unit_counts = mbytes_read_int_little_endian_4b(head + 20);
+        f->total = mbytes_read_int_little_endian_8b(head + 24);
+        f->reg_offset = mbytes_read_int_little_endian_8b(head + 32);
+
+        if (!(f->sparse = vmp_trace_index_file_read(f->fp, (uint64_t)f->sparse_counts * 16))
+            || !(f->addrs = vmp_trace_index_file_read(f->fp, (uint64_t)f->addr_counts * 24))
+            || !(f->units = vmp_trace_index_file_read(f->fp, (uint64_t)f->unit_counts * 32)))
+        {
+            printf("vmp_trace_index_file_open(%s) failed with broken index. %s:%d\n", filename, __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        return 0;
+
+    fail_label:
+        vmp_trace_index_file_close(f);
+        return -1;
+    }
+
+    /* 在按u32 key排好序的定长表里二分查找 */
+    static uint8_t *vmp_trace_index_bsearch(uint8_t *table, uint32_t counts, int item_size, uint32_t key)
+    {
+        uint32_t lo = 0, hi = counts, mid, v;
+
+        while (lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            v = mbytes_read_int_little_endian_4b(table + mid * item_size);
+            if (v == key)
+                return table + mid * item_size;
+            if (v < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        return NULL;
+    }
+
+    static int vmp_trace_index_print_list(struct vmp_trace_index_file *f, uint64_t offset, uint64_t counts)
+    {
+        uint8_t buf[8];
+        uint64_t i;
+
+        vmp_fseek(f->fp, offset, SEEK_SET);
+        for (i = 0; (i < counts) && (i < VMP_TRACE_INDEX_QUERY_MAX); i++)
+        {
+            if (fread(buf, 8, 1, f->fp) != 1)
+                return -1;
+            printf("%s%llu", i ? " " : "    ", (unsigned long long)mbytes_read_int_little_endian_8b(buf));
+        }
+        printf("%s\n", (counts > VMP_TRACE_INDEX_QUERY_MAX) ? " ..." : "");
+
+        return 0;
+    }
+
+    static void vmp_trace_index_print_regs(uint64_t count, struct vmp_trace_regs *regs)
+    {
+        int i;
+
+        printf("[%llu] inst[%08x] EIP[%08x]", (unsigned long long)count, regs->inst_addr, regs->eip);
+        for (i = 0; i < 8; i++)
+        {
+            printf(" %s[%08x:%08x]", vmp_trace_index_reg_name[i], regs->known[i], regs->val[i]);
+        }
+        printf(" EF[%08x:%08x] addr[%x] addr2[%x] stack[%d]\n", regs->eflags_known, regs->eflags,
+            regs->access_addr, regs->access_addr2, regs->stack_depth);
+    }
+
+    static int vmp_trace_index_query_inst(struct vmp_trace_index_file *f, const char *trace_filename, uint64_t n)
+    {
+        struct vmp_trace_reader reader;
+        struct vmp_trace_record rec;
+        uint32_t lo = 0, hi = f->sparse_counts, mid, i;
+        uint64_t count = 0, offset = 0, before;
+        int ret;
+
+        if (!f->sparse_counts || (n < 1) || (n > f->total))
+        {
+            printf("inst[%llu] out of range, total[%llu]\n", (unsigned long long)n, (unsigned long long)f->total);
+            return -1;
+        }
+
+        // 找最后一个序号小于n的可解码位置
+        while (lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (mbytes_read_int_little_endian_8b(f->sparse + mid * 16) < n)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo)
+        {
+            count = mbytes_read_int_little_endian_8b(f->sparse + (lo - 1) * 16);
+            offset = mbytes_read_int_little_endian_8b(f->sparse + (lo - 1) * 16 + 8);
+        }
+
+        if (vmp_trace_reader_open(&reader, trace_filename))
+            return -1;
+
+        // block模式下要先把block字典读进来
+        for (i = 0; (f->mode == VMP_TRACE_MODE_BLOCK) && (i < f->unit_counts); i++)
+        {
+            if (vmp_trace_reader_seek(&reader, mbytes_read_int_little_endian_8b(f->units + i * 32 + 16), 0)
+                || (vmp_trace_reader_next(&reader, &rec) != 1))
+            {
+                vmp_trace_reader_close(&reader);
+                return -1;
+            }
+        }
+
+        if (offset && vmp_trace_reader_seek(&reader, offset, count))
+        {
+            vmp_trace_reader_close(&reader);
+            return -1;
+        }
+
+        while ((ret = vmp_trace_reader_next(&reader, &rec)) == 1)
+        {
+            if (rec.count < n)
+                continue;
+
+            switch (rec.tag)
+            {
+            case VMP_TRACE_TAG_KEYFRAME:
+            case VMP_TRACE_TAG_DELTA:
+                vmp_trace_index_print_regs(rec.count, &rec.regs);
+                break;
+
+            case VMP_TRACE_TAG_BLOCK:
+                before = rec.count - rec.block->insts;
+                printf("[%llu] inst[%08x] block[%d] addr[%08x] exec at[%llu]\n", (unsigned long long)n,
+                    rec.block->inst_addrs[n - before - 1], rec.block_id, rec.block->addr, (unsigned long long)before);
+                if (reader.has_last)
+                {
+                    printf("last block exit: ");
+                    vmp_trace_index_print_regs(reader.count, &reader.regs);
+                }
+                break;
+
+            case VMP_TRACE_TAG_VM:
+                printf("[%llu] in VM[%u] handler[%08x] vip[%08x%+d] op[%d:%x] vsp[%+d] top[%08x] insts[%d]\n",
+                    (unsigned long long)n, rec.vm.seq, rec.vm.handler, rec.vm.vip, rec.vm.vip_delta,
+                    rec.vm.operand_size, rec.vm.operand, rec.vm.vsp_delta, rec.vm.vsp_top, rec.vm.x86_insts);
+                break;
+
+            default:
+                continue;
+            }
+            break;
+        }
+
+        vmp_trace_reader_close(&reader);
+
+        return (ret == 1) ? 0 : -1;
+    }
+
+    int vmp_trace_index_query(const char *trace_filename, const char *what, const char *arg)
+    {
+        struct vmp_trace_index_file f;
+        uint8_t *item, buf[8 * 8];
+        uint64_t offset, n;
+        uint32_t key;
+        int i, ret = 0;
+
+        if (vmp_trace_index_file_open(&f, trace_filename))
+            return -1;
+
+        if (!strcmp(what, "inst"))
+        {
+            ret = vmp_trace_index_query_inst(&f, trace_filename, strtoull(arg, NULL, 0));
+        }
+        else if (!strcmp(what, "addr"))
+        {
+            key = strtoul(arg, NULL, 16);
+            if ((item = vmp_trace_index_bsearch(f.addrs, f.addr_counts, 24, key)))
+            {
+                printf("addr[%08x] hits[%u] first[%llu] last[%llu]\n", key, mbytes_read_int_little_endian_4b(item + 4),
+                    (unsigned long long)mbytes_read_int_little_endian_8b(item + 8),
+                    (unsigned long long)mbytes_read_int_little_endian_8b(item + 16));
+            }
+            else
+            {
+                printf("addr[%08x] never executed\n", key);
+            }
+        }
+        else if (!strcmp(what, "block"))
+        {
+            key = strtoul(arg, NULL, 16);
+            if ((item = vmp_trace_index_bsearch(f.units, f.unit_counts, 32, key)))
+            {
+                printf("block[%08x] id[%u] insts[%u] execs[%u]\n", key, mbytes_read_int_little_endian_4b(item + 4),
+                    mbytes_read_int_little_endian_4b(item + 8), mbytes_read_int_little_endian_4b(item + 12));
+                ret = vmp_trace_index_print_list(&f, mbytes_read_int_little_endian_8b(item + 24),
+                    mbytes_read_int_little_endian_4b(item + 12));
+            }
+            else
+            {
+                printf("block[%08x] not found\n", key);
+            }
+        }
+        else if (!strcmp(what, "access"))
+        {
+            for (i = 0; (i < 8) && _stricmp(arg, vmp_trace_index_reg_name[i]); i++);
+            if (i == 8)
+            {
+                printf("unknown register[%s]\n", arg);
+                ret = -1;
+            }
+            else if (vmp_fseek(f.fp, f.reg_offset, SEEK_SET) || (fread(buf, sizeof (buf), 1, f.fp) != 1))
+            {
+                printf("access[%s] failed with broken index\n", arg);
+                ret = -1;
+            }
+            else
+            {
+                // 前面几个寄存器的列表都排在这个寄存器前面
+                offset = f.reg_offset + sizeof (buf);
+                for (key = 0; (int)key < i; key++)
+                {
+                    offset += mbytes_read_int_little_endian_8b(buf + key * 8) * 8;
+                }
+                n = mbytes_read_int_little_endian_8b(buf + i * 8);
+                printf("access[%s] insts[%llu]\n", vmp_trace_index_reg_name[i], (unsigned long long)n);
+                ret = vmp_trace_index_print_list(&f, offset, n);
+            }
+        }
+        else
+        {
+            printf("unknown query[%s], use inst|addr|access|block\n", what);
+            ret = -1;
+        }
+
+        vmp_trace_index_file_close(&f);
+
+        return ret;
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,106 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_trace_index_h__
+#define __vmp_trace_index_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mhash.h"
+#include "vmp_trace.h"
+
+// 二进制trace的索引文件，和trace放在一起，文件名是trace文件名后面加上.idx
+// 文件头(48字节):
+//      "VMPI" + u16 version + u16 trace mode + u32 interval
+//      + u32 sparse_counts + u32 addr_counts + u32 unit_counts
+//      + u64 total_insts + u64 reg_offset + u64 reserved
+// sparse:  sparse_counts * (u64 count + u64 offset)，count是这条记录之前的指令序号，
+//          offset处的记录可以直接开始解码(关键帧、VM事件或者后面不跟'E'的block记录)
+// addrs:   addr_counts * (u32 addr + u32 hits + u64 first + u64 last)，按addr排序
+//          x86模式下是指令地址，block模式下是block内每条指令的地址，VM模式下是handler地址
+// units:   unit_counts * (u32 addr + u32 id + u32 insts + u32 execs + u64 def_offset + u64 execs_offset)
+//          按addr排序，block模式下是block，VM模式下是handler，execs_offset指向
+//          execs个u64，每次执行前的指令序号
+// regs:    reg_offset处 8 * u64 n，后面依次是8个寄存器的访问列表，每项一个u64指令序号，
+//          记录的是访问地址(addr)等于这个寄存器值的指令，比如 [esi]。trace里不区分读写
+#define VMP_TRACE_INDEX_MAGIC       "VMPI"
+#define VMP_TRACE_INDEX_VERSION     1
+#define VMP_TRACE_INDEX_HEAD_SIZE   48
+#define VMP_TRACE_INDEX_SUFFIX      ".idx"
+
+typedef struct vmp_trace_index_addr
+{
+    uint32_t    addr;
+    uint32_t    hits;
+    uint64_t    first;
+    uint64_t    last;
+} vmp_trace_index_addr_t;
+
+typedef struct vmp_trace_index_u64s
+{
+    uint64_t    *data;
+    uint32_t    counts;
+    uint32_t    size;
+} vmp_trace_index_u64s_t;
+
+typedef struct vmp_trace_index_unit
+{
+    uint32_t    addr;
+    uint32_t    id;
+    uint32_t    insts;
+    uint64_t    def_offset;
+    uint32_t    *inst_addrs;
+    struct vmp_trace_index_u64s execs;
+} vmp_trace_index_unit_t;
+
+typedef struct vmp_trace_index
+{
+    int         mode;
+    int         interval;
+    uint64_t    total;
+
+    struct vmp_trace_index_u64s sparse;     // count, offset 两个一组
+
+    struct mhash64 addr_map;                // addr -> addrs下标
+    struct vmp_trace_index_addr *addrs;
+    uint32_t    addr_counts;
+    uint32_t    addr_size;
+
+    struct mhash64 unit_map;                // addr -> units下标
+    struct mhash64 unit_ids;                // block id -> units下标
+    struct vmp_trace_index_unit *units;
+    uint32_t    unit_counts;
+    uint32_t    unit_size;
+
+    struct vmp_trace_index_u64s regs[8];
+} vmp_trace_index_t;
+
+struct vmp_trace_index *vmp_trace_index_create(int mode, int interval);
+int vmp_trace_index_destroy(struct vmp_trace_index *idx);
+
+/* 每写(读)一条trace记录调用一次
+@offset     记录在trace文件里的偏移
+@seekable   是否可以从这条记录开始解码 */
+int vmp_trace_index_record(struct vmp_trace_index *idx, uint64_t offset, struct vmp_trace_record *rec, int seekable);
+int vmp_trace_index_save(struct vmp_trace_index *idx, const char *filename);
+
+/* 从已有的二进制trace生成索引，顺序扫一遍文件 */
+int vmp_trace_index_build(const char *trace_filename);
+
+/* 查询
+@what       inst N      第N条指令的状态
+            addr X      地址X第一次和最后一次执行的位置(IDA地址)
+            access R    访问了[R]的指令，R是寄存器名，比如esi
+            block X     block(或者VM handler)X的执行列表
+@return     0           success
+            -1          failure */
+int vmp_trace_index_query(const char *trace_filename, const char *what, const char *arg);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,124 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_vdec.h"
+
+#define time2s(_a)                  ""
+#define print_err                   printf
+
+    static uint32_t vmp_vdec_mask(int width)
+    {
+        return (width >= 4) ? 0xffffffff : ((1u << (width * 8)) - 1);
+    }
+
+    // 循环移位的位数，和x86一样先模32，8/16位的再按宽度取模
+    static int vmp_vdec_rot(struct vmp_hlib_step *step)
+    {
+        int bits = step->width * 8, n = (int)(step->imm & 0x1f) % bits;
+
+        return (step->op == VMP_HLIB_OP_ROR) ? ((bits - n) % bits) : n;
+    }
+
+    // 只改dst低width字节，和x86部分写寄存器一样
+    static uint32_t vmp_vdec_op(struct vmp_hlib_step *step, uint32_t dst, uint32_t src)
+    {
+        uint32_t m = vmp_vdec_mask(step->width), v = dst & m, s = src & m, r = v;
+        int bits = step->width * 8, n;
+
+        switch (step->op)
+        {
+        case VMP_HLIB_OP_XOR:   r = v ^ s; break;
+        case VMP_HLIB_OP_ADD:   r = v + s; break;
+        case VMP_HLIB_OP_SUB:   r = v - s; break;
+        case VMP_HLIB_OP_INC:   r = v + 1; break;
+        case VMP_HLIB_OP_DEC:   r = v - 1; break;
+        case VMP_HLIB_OP_NOT:   r = ~v; break;
+        case VMP_HLIB_OP_NEG:   r = 0 - v; break;
+        case VMP_HLIB_OP_ROL:
+        case VMP_HLIB_OP_ROR:
+            if ((n = vmp_vdec_rot(step)))
+                r = (v << n) | (v >> (bits - n));
+            break;
+        case VMP_HLIB_OP_BSWAP:
+            r = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+            break;
+        }
+
+        return (dst & ~m) | (r & m);
+    }
+
+    int vmp_vdec_compile(struct vmp_vdec *dec, struct vmp_hlib_entry *entry)
+    {
+        struct vmp_hlib_step *step;
+        int i;
+
+        memset(dec, 0, sizeof (dec[0]));
+
+        if (!entry->step_counts || (entry->step_counts > VMP_HLIB_STEPS_MAX)
+            || ((entry->operand_size != 1) && (entry->operand_size != 2) && (entry->operand_size != 4)))
+            return -1;
+
+        dec->width = entry->operand_size;
+        dec->out_width = dec->width;
+
+        for (i = 0; i < entry->step_counts; i++)
+        {
+            step = entry->steps + i;
+            if (!step->op || (step->op > VMP_HLIB_OP_BSWAP)
+                || ((step->width != 1) && (step->width != 2) && (step->width != 4))
+                || ((step->op == VMP_HLIB_OP_BSWAP) && (step->width != 4)))
+                return -1;
+
+            if (step->src == VMP_HLIB_SRC_KEY)
+                dec->keyed = 1;
+            if (step->dst == VMP_HLIB_DST_KEY)
+                dec->updates_key = 1;
+            else if (step->width > dec->out_width)
+                dec->out_width = step->width;
+        }
+
+        memcpy(dec->steps, entry->steps, entry->step_counts * sizeof (dec->steps[0]));
+        dec->step_counts = entry->step_counts;
+        dec->state = VMP_VDEC_VERIFY;
+
+        return 0;
+    }
+
+    uint32_t vmp_vdec_run(struct vmp_vdec *dec, uint32_t raw, uint32_t *key)
+    {
+        struct vmp_hlib_step *step;
+        uint32_t x = raw & vmp_vdec_mask(dec->width), k = key ? *key : 0, s;
+        int i;
+
+        for (i = 0; i < dec->step_counts; i++)
+        {
+            step = dec->steps + i;
+            switch (step->src)
+            {
+            case VMP_HLIB_SRC_IMM:      s = step->imm; break;
+            case VMP_HLIB_SRC_OPERAND:  s = x; break;
+            case VMP_HLIB_SRC_KEY:      s = k; break;
+            // 源和目的是同一个寄存器
+            default:                    s = (step->dst == VMP_HLIB_DST_OPERAND) ? x : k; break;
+            }
+
+            if (step->dst == VMP_HLIB_DST_OPERAND)
+                x = vmp_vdec_op(step, x, s);
+            else
+                k = vmp_vdec_op(step, k, s);
+        }
+
+        if (key)
+            *key = k;
+
+        return x & vmp_vdec_mask(dec->out_width);
+    }
+
+#ifdef __cplusplus
+}
+#endif
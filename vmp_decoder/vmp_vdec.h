@@ -0,0 +1,46 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_vdec_h__
+#define __vmp_vdec_h__
+
+#include <stdint.h>
+#include "vmp_hlib.h"
+
+// VIP操作数的解密器: 把handler分析出来的解密链(vmp_hlib_step)编译成一个小的解释表，
+// 给出从VIP读出来的原始字节和滚动密钥，不用模拟handler就能算出解密以后的操作数和新的密钥。
+// 不做整段VIP流的批量解密: 流里不同handler的操作数是交错的，下一个是哪个handler要看dispatcher
+// 解出来的opcode字节，这段解密在分发代码里，解密链没有分析它，所以只能跟着模拟的分发一个个解
+#define VMP_VDEC_NONE               0
+#define VMP_VDEC_VERIFY             1   // 编译好了，还没有和模拟的结果对过
+#define VMP_VDEC_READY              2
+
+typedef struct vmp_vdec
+{
+    int         state;
+    int         step_counts;
+    struct vmp_hlib_step steps[VMP_HLIB_STEPS_MAX];
+    // 从VIP读的字节数，和解密以后操作数的字节数(解密链可能在更宽的寄存器上算)
+    int         width;
+    int         out_width;
+    // 解密链里用到或者更新了滚动密钥
+    int         keyed;
+    int         updates_key;
+} vmp_vdec_t;
+
+/* @return     0           success
+            -1          没有解密链，或者有解不了的步骤(比如16位的bswap) */
+int vmp_vdec_compile(struct vmp_vdec *dec, struct vmp_hlib_entry *entry);
+/* 解一个操作数
+@raw        从VIP读出来的width个字节，小端
+@key        进来是handler开始时的密钥，返回解密以后的密钥，没用到密钥的话可以为NULL */
+uint32_t vmp_vdec_run(struct vmp_vdec *dec, uint32_t raw, uint32_t *key);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,765 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_vm.h"
+#include "mbytes.h"
+
+#define VMP_VM_XFER_DIRECT          0
+#define VMP_VM_XFER_JMP             1
+#define VMP_VM_XFER_RET             2
+#define VMP_VM_XFER_CALL            3
+
+#define vmp_vm_reg(_mod, _r)        ((&(_mod)->emu->eax)[_r])
+
+    static void vmp_vm_dump_infos(struct vmp_vm *mod);
+
+    struct vmp_vm *vmp_vm_create(struct vmp_vm_param *param)
+    {
+        struct vmp_vm *mod = (struct vmp_vm *)calloc(1, sizeof (mod[0]));
+
+        if (!mod)
+        {
+            printf("vmp_vm_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        mod->emu = param->emu;
+        mod->trace = param->trace;
+        mod->call_stack_i = -1;
+
+        if (mhash64_init(&mod->edges, 1024)
+            || mhash64_init(&mod->sources, 256)
+            || mhash64_init(&mod->handlers, 256)
+            || mhash64_init(&mod->info_index, 256))
+        {
+            printf("vmp_vm_create() failed with mhash64_init(). %s:%d\n", __FILE__, __LINE__);
+            goto fail_label;
+        }
+
+        return mod;
+
+    fail_label:
+        vmp_vm_destroy(mod);
+        return NULL;
+    }
+
+    int vmp_vm_destroy(struct vmp_vm *mod)
+    {
+        int i;
+
+        if (mod)
+        {
+            vmp_vm_flush(mod);
+
+            if (mod->seq)
+            {
+                printf("vm handlers[%d], dispatcher[%08x] targets[%d], events[%u]\n",
+                    mod->handlers.counts, mod->dispatcher, mod->dispatcher_targets, mod->seq);
+                vmp_vm_dump_infos(mod);
+            }
+
+            if (mod->hlib_hits)
+            {
+                printf("vm handlers taken from library[%u]\n", mod->hlib_hits);
+            }
+
+            if (mod->cache_loads)
+            {
+                printf("vm handlers taken from cache[%u]\n", mod->cache_loads);
+            }
+
+            if (mod->interp_runs)
+            {
+                printf("vm interpreter: handlers[%llu]\n", (unsigned long long)mod->interp_runs);
+            }
+
+            if (mod->vdec_runs || mod->vdec_fails)
+            {
+                printf("vm operand decryptors: runs[%llu], rejected[%llu]\n",
+                    (unsigned long long)mod->vdec_runs, (unsigned long long)mod->vdec_fails);
+            }
+
+            if (mod->summary_runs || mod->summary_fallbacks)
+            {
+                printf("vm summaries: runs[%llu], skipped insts[%llu], fallbacks[%llu]\n",
+                    (unsigned long long)mod->summary_runs, (unsigned long long)mod->summary_skips,
+                    (unsigned long long)mod->summary_fallbacks);
+            }
+
+            mhash64_uninit(&mod->edges);
+            mhash64_uninit(&mod->sources);
+            mhash64_uninit(&mod->handlers);
+            mhash64_uninit(&mod->info_index);
+            for (i = 0; i < mod->info_counts; i++)
+            {
+                free(mod->summaries[i].insts);
+                vmp_interp_free(mod->summaries[i].prog);
+            }
+            free(mod->infos);
+            free(mod->summaries);
+            free(mod->vdecs);
+            free(mod->verify_stack);
+            free(mod);
+        }
+
+        return 0;
+    }
+
+    // VIP有可能是往低地址走的，这时候handler读的是VIP下面的字节
+    static uint32_t vmp_vm_read_operand(struct vmp_vm *mod, uint32_t vip, int delta, uint8_t *size)
+    {
+        uint8_t *p;
+        uint32_t v = 0;
+        int i, n = (delta < 0) ? -delta : delta;
+
+        if (n > 4)
+            n = 4;
+
+        *size = 0;
+        if (!n || !(p = x86_emu_mem_ptr(mod->emu, (delta < 0) ? (vip - n) : vip, n)))
+            return 0;
+
+        for (i = n - 1; i >= 0; i--)
+        {
+            v = (v << 8) | p[i];
+        }
+        *size = (uint8_t)n;
+
+        return v;
+    }
+
+    // 给handler分配infos/summaries/vdecs里的一项，已经有了的话返回-1
+    static int vmp_vm_info_add(struct vmp_vm *mod, uint32_t handler)
+    {
+        struct vmp_hlib_entry *infos;
+        struct vmp_vm_summary *summaries;
+        struct vmp_vdec *vdecs;
+        uint64_t *idx;
+        int is_new;
+
+        idx = mhash64_insert(&mod->info_index, handler, &is_new);
+        if (!idx || !is_new)
+            return -1;
+
+        if (mod->info_counts == mod->info_size)
+        {
+            infos = (struct vmp_hlib_entry *)realloc(mod->infos, (mod->info_size * 2 + 64) * sizeof (infos[0]));
+            if (infos)
+                mod->infos = infos;
+            summaries = (struct vmp_vm_summary *)realloc(mod->summaries, (mod->info_size * 2 + 64) * sizeof (summaries[0]));
+            if (summaries)
+                mod->summaries = summaries;
+            vdecs = (struct vmp_vdec *)realloc(mod->vdecs, (mod->info_size * 2 + 64) * sizeof (vdecs[0]));
+            if (vdecs)
+                mod->vdecs = vdecs;
+            if (!infos || !summaries || !vdecs)
+            {
+                printf("vmp_vm_info_add() failed with realloc(). %s:%d\n", __FILE__, __LINE__);
+                mhash64_remove(&mod->info_index, handler);
+                return -1;
+            }
+            mod->info_size = mod->info_size * 2 + 64;
+        }
+
+        memset(mod->summaries + mod->info_counts, 0, sizeof (mod->summaries[0]));
+        *idx = ++mod->info_counts;
+
+        return mod->info_counts - 1;
+    }
+
+    // handler第一次执行完，分析记下来的指令
+    static int vmp_vm_handler_analyze(struct vmp_vm *mod, struct vmp_trace_vm_event *ev)
+    {
+        struct vmp_hlib_entry *entry;
+        struct vmp_vm_summary *summary;
+        uint8_t keep[VMP_HLIB_INSTS_MAX];
+        int i, n, ret;
+
+        mod->recording = 0;
+        if ((n = vmp_vm_info_add(mod, ev->handler)) < 0)
+            return 0;
+
+        summary = mod->summaries + n;
+        entry = mod->infos + n;
+        // 库里有的话解密链直接用库里的，不再分析
+        ret = vmp_hlib_analyze(mod->hlib, entry, mod->rec_insts, mod->rec_lens, mod->rec_counts,
+            ev->vip_delta, ev->vsp_delta, ev->operand_size, keep);
+        if (ret > 0)
+            mod->hlib_hits++;
+
+        // 编译失败的话state是VMP_VDEC_NONE
+        if (ret < 0)
+            memset(mod->vdecs + n, 0, sizeof (mod->vdecs[0]));
+        else
+            vmp_vdec_compile(mod->vdecs + n, entry);
+
+        // 中间跑出过vmp段(比如调了IAT)的话，记下来的指令不全
+        if (!mod->summary || (ret < 0) || (ev->x86_insts != mod->rec_counts)
+            || (entry->flags & (VMP_HLIB_F_BRANCH | VMP_HLIB_F_MEM_WRITE)) || !keep[mod->rec_counts - 1])
+            return 0;
+
+        summary->insts = (uint8_t **)malloc(entry->kept * (sizeof (summary->insts[0]) + 1));
+        if (!summary->insts)
+        {
+            printf("vmp_vm_handler_analyze() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        summary->lens = (uint8_t *)(summary->insts + entry->kept);
+
+        for (i = 0; i < mod->rec_counts; i++)
+        {
+            if (keep[i])
+            {
+                summary->insts[summary->counts] = mod->rec_insts[i];
+                summary->lens[summary->counts] = mod->rec_lens[i];
+                summary->counts++;
+            }
+        }
+        summary->state = VMP_VM_SUMMARY_VERIFY;
+
+        return 0;
+    }
+
+    // 把摘要校验的结果定下来，to是完整模拟时handler分发出去的目标
+    static int vmp_vm_summary_check(struct vmp_vm *mod, uint32_t to)
+    {
+        struct vmp_vm_summary *summary = mod->verifying;
+        struct x86_emu_reg *regs = &mod->emu->eax;
+        int i, top = (int)(regs[OPERAND_TYPE_REG_ESP].u.r32 - mod->emu->stack.esp_start);
+
+        mod->verifying = NULL;
+        summary->state = VMP_VM_SUMMARY_READY;
+
+        if (to != mod->verify_to)
+            summary->state = VMP_VM_SUMMARY_NONE;
+
+        for (i = OPERAND_TYPE_REG_EBX; i <= OPERAND_TYPE_REG_EDI; i++)
+        {
+            if ((regs[i].u.r32 != mod->verify_regs[i].u.r32) || (regs[i].known != mod->verify_regs[i].known))
+                summary->state = VMP_VM_SUMMARY_NONE;
+        }
+
+        // 只比较ESP以上还在用的栈
+        if ((top < 0) || (top > mod->emu->stack.size)
+            || memcmp(mod->emu->stack.data + top, mod->verify_stack + top, mod->emu->stack.size - top))
+            summary->state = VMP_VM_SUMMARY_NONE;
+
+        if (summary->state == VMP_VM_SUMMARY_NONE)
+        {
+            printf("handler[%08x] summary differs from full emulation, not used\n", mod->cur.handler);
+        }
+
+        // 解释器的结果也要和完整模拟的一样
+        if (summary->prog && ((summary->state == VMP_VM_SUMMARY_NONE) || !mod->verify_interp
+            || (to != mod->verify_interp_to) || vmp_interp_check(&mod->ictx, mod->emu)))
+        {
+            if (summary->state != VMP_VM_SUMMARY_NONE)
+                printf("handler[%08x] interpreter differs from full emulation, not used\n", mod->cur.handler);
+            vmp_interp_free(summary->prog);
+            summary->prog = NULL;
+        }
+
+        return 0;
+    }
+
+    static int vmp_vm_summary_exec(struct vmp_vm *mod, struct vmp_vm_summary *summary, int counts)
+    {
+        x86_emu_flow_analysis_t *flow = NULL;
+        int i;
+
+        for (i = 0; i < counts; i++)
+        {
+            if (x86_emu_run(mod->emu, summary->insts[i], summary->lens[i], &flow) < 0)
+                return -1;
+        }
+
+        // 摘要里的直接跳转已经去掉了，只有最后一条分发跳转的目标有意义
+        mod->verify_to = (flow && flow->jmp_type) ? x86_emu_ida_addr(mod->emu, flow->true_addr) : 0;
+
+        return 0;
+    }
+
+    // 先在快照上把摘要跑一遍，记下结果以后恢复快照，这次还是完整模拟，handler结束时再对比
+    static int vmp_vm_summary_verify(struct vmp_vm *mod, struct vmp_vm_summary *summary)
+    {
+        struct x86_emu_mod *emu = mod->emu, saved = *mod->emu;
+        uint8_t *data, *known;
+        uint32_t to;
+        int size = emu->stack.size, ret;
+
+        if (!mod->verify_stack && !(mod->verify_stack = (uint8_t *)malloc(size * 3)))
+        {
+            printf("vmp_vm_summary_verify() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        data = mod->verify_stack + size;
+        known = data + size;
+
+        memcpy(data, emu->stack.data, size);
+        memcpy(known, emu->stack.known, size);
+
+        // 解释器只是记在ictx里，不会改模拟器的状态
+        mod->verify_interp = 0;
+        if (mod->interp && (summary->prog = vmp_interp_lift(summary->insts, summary->lens, summary->counts)))
+        {
+            vmp_interp_begin(&mod->ictx, emu);
+            mod->verify_interp = !vmp_interp_body(&mod->ictx, summary->prog)
+                && !vmp_interp_target(&mod->ictx, summary->prog, &to)
+                && !vmp_interp_dispatch(&mod->ictx, summary->prog);
+            mod->verify_interp_to = mod->verify_interp ? x86_emu_ida_addr(emu, (uint8_t *)(emu->addr64_prefix | to)) : 0;
+        }
+
+        ret = vmp_vm_summary_exec(mod, summary, summary->counts);
+        memcpy(mod->verify_regs, &emu->eax, sizeof (mod->verify_regs));
+        memcpy(mod->verify_stack, emu->stack.data, size);
+
+        *emu = saved;
+        memcpy(emu->stack.data, data, size);
+        memcpy(emu->stack.known, known, size);
+
+        if (ret)
+        {
+            summary->state = VMP_VM_SUMMARY_NONE;
+            vmp_interp_free(summary->prog);
+            summary->prog = NULL;
+            return -1;
+        }
+        mod->verifying = summary;
+
+        return 0;
+    }
+
+    // 用handler的解密器解这次读到的操作数。解密器先要和模拟的结果对上: 更新了密钥的话和handler结束时的EBX比，
+    // push_imm类的handler解出来的操作数和VM栈顶比，对不上的话这个handler以后都不再用解密器
+    static int vmp_vm_handler_decrypt(struct vmp_vm *mod, struct vmp_trace_vm_event *ev)
+    {
+        struct vmp_vdec *dec;
+        uint64_t *idx;
+        uint32_t key = mod->key, plain, mask;
+        int checked = 0, ok = 1;
+
+        if (!mod->key_known || !(idx = mhash64_find(&mod->info_index, ev->handler)))
+            return 0;
+
+        dec = mod->vdecs + *idx - 1;
+        if ((dec->state == VMP_VDEC_NONE) || (ev->operand_size != dec->width))
+            return 0;
+
+        plain = vmp_vdec_run(dec, ev->operand, &key);
+        mask = (dec->out_width >= 4) ? 0xffffffff : ((1u << (dec->out_width * 8)) - 1);
+
+        if (dec->updates_key && (vmp_vm_reg(mod, VMP_VM_REG_KEY).known == 0xffffffff))
+        {
+            checked = 1;
+            ok = ok && (key == vmp_vm_reg(mod, VMP_VM_REG_KEY).u.r32);
+        }
+
+        if (mod->infos[*idx - 1].cls == VMP_HLIB_CLASS_PUSH_IMM)
+        {
+            checked = 1;
+            ok = ok && !((plain ^ ev->vsp_top) & mask);
+        }
+
+        if (checked && !ok)
+        {
+            dec->state = VMP_VDEC_NONE;
+            mod->vdec_fails++;
+            return 0;
+        }
+
+        if (checked)
+            dec->state = VMP_VDEC_READY;
+
+        if (dec->state == VMP_VDEC_READY)
+        {
+            ev->plain = plain;
+            ev->flags |= VMP_TRACE_VM_PLAIN;
+            mod->vdec_runs++;
+        }
+
+        return 0;
+    }
+
+    static int vmp_vm_handler_end(struct vmp_vm *mod)
+    {
+        struct vmp_trace_vm_event *ev = &mod->cur;
+        uint32_t vip = vmp_vm_reg(mod, VMP_VM_REG_VIP).u.r32;
+        uint32_t vsp = vmp_vm_reg(mod, VMP_VM_REG_VSP).u.r32;
+        int insts = mod->emu->inst.count - mod->start_count;
+        uint8_t *p;
+
+        if (!mod->in_handler)
+            return 0;
+
+        mod->in_handler = 0;
+
+        ev->seq = ++mod->seq;
+        ev->vip_delta = (int16_t)(vip - mod->vip);
+        ev->vsp_delta = (int16_t)(vsp - mod->vsp);
+        ev->operand = vmp_vm_read_operand(mod, mod->vip, ev->vip_delta, &ev->operand_size);
+        ev->vsp_top = (p = x86_emu_mem_ptr(mod->emu, vsp, 4)) ? mbytes_read_int_little_endian_4b(p) : 0;
+        ev->x86_insts = (uint16_t)((insts > 0xffff) ? 0xffff : insts);
+
+        if (mod->recording)
+            vmp_vm_handler_analyze(mod, ev);
+
+        vmp_vm_handler_decrypt(mod, ev);
+
+        return mod->trace ? vmp_trace_vm(mod->trace, ev) : 0;
+    }
+
+    static int vmp_vm_handler_begin(struct vmp_vm *mod, uint32_t from, uint32_t to, int flags)
+    {
+        struct x86_emu_reg *vip = &vmp_vm_reg(mod, VMP_VM_REG_VIP);
+        uint64_t *targets, *hits;
+        uint8_t *p;
+        int is_new;
+
+        mhash64_insert(&mod->edges, ((uint64_t)from << 32) | to, &is_new);
+        if (is_new && (targets = mhash64_insert(&mod->sources, from, NULL)))
+        {
+            if (++*targets > mod->dispatcher_targets)
+            {
+                mod->dispatcher = from;
+                mod->dispatcher_targets = (uint32_t)*targets;
+            }
+        }
+
+        if ((from == mod->dispatcher) && (mod->dispatcher_targets >= VMP_VM_DISPATCH_MIN_TARGETS))
+            flags |= VMP_TRACE_VM_DISPATCH;
+
+        if ((hits = mhash64_insert(&mod->handlers, to, &is_new)))
+            (*hits)++;
+        if (is_new)
+            flags |= VMP_TRACE_VM_NEW;
+        // 缓存里有分析结果的handler不用再记录
+        mod->recording = is_new && !mhash64_find(&mod->info_index, to);
+        mod->rec_counts = 0;
+
+        if (vip->known != 0xffffffff)
+            flags |= VMP_TRACE_VM_VIP_UNKNOWN;
+
+        memset(&mod->cur, 0, sizeof (mod->cur));
+        mod->cur.handler = to;
+        mod->cur.flags = (uint8_t)flags;
+        mod->vip = vip->u.r32;
+        mod->vsp = vmp_vm_reg(mod, VMP_VM_REG_VSP).u.r32;
+        mod->key = vmp_vm_reg(mod, VMP_VM_REG_KEY).u.r32;
+        mod->key_known = (vmp_vm_reg(mod, VMP_VM_REG_KEY).known == 0xffffffff);
+        mod->cur.vip = (p = x86_emu_mem_ptr(mod->emu, mod->vip, 1)) ? x86_emu_ida_addr(mod->emu, p) : mod->vip;
+        if (!mod->cur.vip)
+            mod->cur.vip = mod->vip;
+        mod->start_count = mod->emu->inst.count;
+        mod->in_handler = 1;
+
+        return 0;
+    }
+
+    static int vmp_vm_xfer_kind(uint8_t *inst, int len)
+    {
+        uint8_t *code = inst;
+
+        // bnd/rep/段前缀不影响跳转类型
+        while ((code < inst + len - 1)
+            && ((code[0] == 0xf2) || (code[0] == 0xf3) || (code[0] == 0x2e) || (code[0] == 0x3e)))
+        {
+            code++;
+        }
+
+        switch (code[0])
+        {
+        case 0xe8:
+            return VMP_VM_XFER_CALL;
+
+        case 0xc2:
+        case 0xc3:
+            return VMP_VM_XFER_RET;
+
+        case 0xff:
+            switch (MODRM_GET_REG(code[1]))
+            {
+            case 2:
+            case 3:
+                return VMP_VM_XFER_CALL;
+            case 4:
+            case 5:
+                return VMP_VM_XFER_JMP;
+            }
+            break;
+        }
+
+        return VMP_VM_XFER_DIRECT;
+    }
+
+    // ret的目标是影子栈里的返回地址的话，返回它在影子栈里的位置
+    static int vmp_vm_ret_pair(struct vmp_vm *mod, uint32_t to_va)
+    {
+        int i;
+
+        for (i = mod->call_stack_i; i >= 0; i--)
+        {
+            if (mod->call_stack[i] == to_va)
+                return i;
+        }
+
+        return -1;
+    }
+
+    int vmp_vm_transfer(struct vmp_vm *mod, uint8_t *inst, int len, uint8_t *to)
+    {
+        uint32_t from_va, to_va, ret_va;
+        int i, kind = vmp_vm_xfer_kind(inst, len);
+
+        if (kind == VMP_VM_XFER_DIRECT)
+            return 0;
+
+        from_va = x86_emu_ida_addr(mod->emu, inst);
+        to_va = x86_emu_ida_addr(mod->emu, to);
+
+        if (kind == VMP_VM_XFER_CALL)
+        {
+            ret_va = x86_emu_ida_addr(mod->emu, inst + len);
+            if (mod->call_stack_i + 1 < VMP_VM_CALL_STACK_SIZE)
+            {
+                mod->call_stack[++mod->call_stack_i] = ret_va;
+            }
+            return 0;
+        }
+
+        // 正常的函数返回，栈里中间有没配对的call时一起弹掉
+        if ((kind == VMP_VM_XFER_RET) && ((i = vmp_vm_ret_pair(mod, to_va)) >= 0))
+        {
+            mod->call_stack_i = i - 1;
+            return 0;
+        }
+
+        // 跳出了PE镜像，不当成handler
+        if (!to_va)
+            return 0;
+
+        if (mod->verifying)
+            vmp_vm_summary_check(mod, to_va);
+
+        vmp_vm_handler_end(mod);
+        vmp_vm_handler_begin(mod, from_va, to_va, (kind == VMP_VM_XFER_RET) ? VMP_TRACE_VM_RET : 0);
+
+        return 1;
+    }
+
+    int vmp_vm_flush(struct vmp_vm *mod)
+    {
+        // 模拟结束时handler还没走完，校验不出结果
+        mod->verifying = NULL;
+        return vmp_vm_handler_end(mod);
+    }
+
+    int vmp_vm_inst(struct vmp_vm *mod, uint8_t *inst, int len)
+    {
+        if (!mod->in_handler || !mod->recording)
+            return 0;
+
+        // 超过上限以后rec_counts停在VMP_HLIB_INSTS_MAX + 1，分析时会当成指令太多
+        if (mod->rec_counts < VMP_HLIB_INSTS_MAX)
+        {
+            mod->rec_insts[mod->rec_counts] = inst;
+            mod->rec_lens[mod->rec_counts] = (uint8_t)len;
+            mod->rec_counts++;
+        }
+        else
+        {
+            mod->rec_counts = VMP_HLIB_INSTS_MAX + 1;
+        }
+
+        return 0;
+    }
+
+    int vmp_vm_set_hlib(struct vmp_vm *mod, struct vmp_hlib *lib)
+    {
+        mod->hlib = lib;
+        return 0;
+    }
+
+    int vmp_vm_load_handler(struct vmp_vm *mod, uint32_t handler, struct vmp_hlib_entry *entry, uint8_t **insts, uint8_t *lens, int counts)
+    {
+        struct vmp_vm_summary *summary;
+        int n;
+
+        if ((n = vmp_vm_info_add(mod, handler)) < 0)
+            return -1;
+
+        mod->infos[n] = *entry;
+        mod->cache_loads++;
+        if (entry->flags & VMP_HLIB_F_PARTIAL)
+            memset(mod->vdecs + n, 0, sizeof (mod->vdecs[0]));
+        else
+            vmp_vdec_compile(mod->vdecs + n, entry);
+
+        if (!mod->summary || !counts)
+            return 0;
+
+        summary = mod->summaries + n;
+        summary->insts = (uint8_t **)malloc(counts * (sizeof (summary->insts[0]) + 1));
+        if (!summary->insts)
+        {
+            printf("vmp_vm_load_handler() failed with malloc(). %s:%d\n", __FILE__, __LINE__);
+            return -1;
+        }
+        summary->lens = (uint8_t *)(summary->insts + counts);
+        memcpy(summary->insts, insts, counts * sizeof (summary->insts[0]));
+        memcpy(summary->lens, lens, counts);
+        summary->counts = counts;
+        // 和刚分析出来的一样，先和完整模拟对一遍
+        summary->state = VMP_VM_SUMMARY_VERIFY;
+
+        return 0;
+    }
+
+    struct vmp_hlib_entry *vmp_vm_handler_info(struct vmp_vm *mod, uint32_t handler)
+    {
+        uint64_t *idx = mhash64_find(&mod->info_index, handler);
+
+        return idx ? (mod->infos + *idx - 1) : NULL;
+    }
+
+    int vmp_vm_set_summary(struct vmp_vm *mod, int enable)
+    {
+        mod->summary = enable;
+        return 0;
+    }
+
+    int vmp_vm_set_interp(struct vmp_vm *mod, int enable)
+    {
+        mod->interp = enable;
+        if (enable)
+            mod->summary = 1;
+        return 0;
+    }
+
+    // 当前handler和后面连续的能解释的handler都在VM指令级执行，返回最后一个handler的分发跳转
+    static uint8_t *vmp_vm_interp_run(struct vmp_vm *mod, struct vmp_vm_summary *summary, int *len)
+    {
+        struct vmp_interp_ctx *ctx = &mod->ictx, disp;
+        struct vmp_vm_summary *next;
+        uint8_t *tail, *to;
+        uint64_t *idx;
+        uint32_t to_va, target;
+        int tail_len;
+
+        vmp_interp_begin(ctx, mod->emu);
+        if (vmp_interp_body(ctx, summary->prog))
+            return NULL;
+        vmp_interp_commit(ctx);
+        mod->cur.flags |= VMP_TRACE_VM_INTERP;
+        mod->interp_runs++;
+
+        while (1)
+        {
+            tail = summary->insts[summary->counts - 1];
+            tail_len = summary->lens[summary->counts - 1];
+
+            // 分发的目标也要是能解释的handler，否则回到x86模拟器，从分发跳转接着走
+            vmp_interp_begin(ctx, mod->emu);
+            if (vmp_interp_target(ctx, summary->prog, &target))
+                break;
+            to = (uint8_t *)(mod->emu->addr64_prefix | target);
+            if (!(to_va = x86_emu_ida_addr(mod->emu, to))
+                || ((vmp_vm_xfer_kind(tail, tail_len) == VMP_VM_XFER_RET) && (vmp_vm_ret_pair(mod, to_va) >= 0))
+                || !(idx = mhash64_find(&mod->info_index, to_va)))
+                break;
+
+            next = mod->summaries + *idx - 1;
+            if ((next->state != VMP_VM_SUMMARY_READY) || !next->prog
+                || vmp_interp_dispatch(ctx, summary->prog) || vmp_interp_body(ctx, next->prog))
+                break;
+
+            // 先只做分发，vm的事件和完整模拟时一样从分发以后的寄存器取值
+            vmp_interp_begin(&disp, mod->emu);
+            vmp_interp_dispatch(&disp, summary->prog);
+            vmp_interp_commit(&disp);
+            vmp_vm_transfer(mod, tail, tail_len, to);
+
+            vmp_interp_commit(ctx);
+            mod->cur.flags |= VMP_TRACE_VM_INTERP;
+            mod->interp_runs++;
+            summary = next;
+        }
+
+        *len = tail_len;
+        return tail;
+    }
+
+    uint8_t *vmp_vm_summary_run(struct vmp_vm *mod, int *len)
+    {
+        struct vmp_vm_summary *summary;
+        uint64_t *idx;
+        uint8_t *p;
+
+        if (!mod->summary || !mod->in_handler || !(idx = mhash64_find(&mod->info_index, mod->cur.handler)))
+            return NULL;
+
+        summary = mod->summaries + *idx - 1;
+        if (summary->state == VMP_VM_SUMMARY_NONE)
+            return NULL;
+
+        // VIP不是已知值的时候，摘要里的解密和分发算不出来，退回去一条条模拟
+        if (mod->cur.flags & VMP_TRACE_VM_VIP_UNKNOWN)
+        {
+            mod->summary_fallbacks++;
+            return NULL;
+        }
+
+        if (summary->state == VMP_VM_SUMMARY_VERIFY)
+        {
+            vmp_vm_summary_verify(mod, summary);
+            return NULL;
+        }
+
+        if (mod->interp && summary->prog && (p = vmp_vm_interp_run(mod, summary, len)))
+            return p;
+
+        if (vmp_vm_summary_exec(mod, summary, summary->counts - 1))
+        {
+            printf("vmp_vm_summary_run() failed with x86_emu_run(). %s:%d\n", __FILE__, __LINE__);
+            summary->state = VMP_VM_SUMMARY_NONE;
+            return NULL;
+        }
+
+        mod->cur.flags |= VMP_TRACE_VM_SUMMARY;
+        mod->summary_runs++;
+        mod->summary_skips += mod->infos[*idx - 1].insts - summary->counts;
+
+        *len = summary->lens[summary->counts - 1];
+        return summary->insts[summary->counts - 1];
+    }
+
+    // 按分类统计一下，找到的handler逐个打出来
+    static void vmp_vm_dump_infos(struct vmp_vm *mod)
+    {
+        struct vmp_hlib_entry *e;
+        int i, counts[VMP_HLIB_CLASS_MAX] = { 0 };
+        uint32_t j;
+
+        mhash64_foreach(&mod->info_index, j)
+        {
+            e = mod->infos + mod->info_index.vals[j] - 1;
+            counts[e->cls]++;
+            printf("handler[%08x] %-12s fp[%016llx] insts[%d/%d] vip[%d] vsp[%d] steps[%d] samples[%u]\n",
+                (uint32_t)mod->info_index.keys[j], e->name, (unsigned long long)e->fingerprint,
+                e->kept, e->insts, e->vip_delta, e->vsp_delta, e->step_counts, e->samples);
+        }
+
+        for (i = 0; i < VMP_HLIB_CLASS_MAX; i++)
+        {
+            if (counts[i])
+                printf("handler class[%s]: %d\n", vmp_hlib_class_name(i), counts[i]);
+        }
+    }
+
+#ifdef __cplusplus
+}
+#endif
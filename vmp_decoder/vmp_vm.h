@@ -0,0 +1,163 @@
+﻿
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_vm_h__
+#define __vmp_vm_h__
+
+#include <stdint.h>
+#include "mhash.h"
+#include "x86_emu.h"
+#include "vmp_trace.h"
+#include "vmp_hlib.h"
+#include "vmp_interp.h"
+#include "vmp_vdec.h"
+
+// vmp的寄存器约定: ESI是VIP(虚拟指令指针)，EBP是VM栈指针，EDI指向VM的寄存器上下文
+#define VMP_VM_REG_VIP              OPERAND_TYPE_REG_ESI
+#define VMP_VM_REG_VSP              OPERAND_TYPE_REG_EBP
+// EBX是操作数解密用的滚动密钥
+#define VMP_VM_REG_KEY              OPERAND_TYPE_REG_EBX
+
+// 同一个地址上的间接跳转，跳到了这么多个不同的目标，就认为它是dispatcher
+#define VMP_VM_DISPATCH_MIN_TARGETS 3
+
+// 用来过滤正常的 call/ret 配对，vmp的handler是用 push reg; ret 分发的，
+// 这种ret的目标不会等于影子栈顶的返回地址
+#define VMP_VM_CALL_STACK_SIZE      64
+
+// handler的效果摘要: 第一次执行时记下的指令去掉花指令以后剩下的部分。handler的执行路径上没有条件跳转、
+// 没有写VM栈和context以外的内存、没有跑出vmp段的话，下次分发到它时就只模拟这些指令
+#define VMP_VM_SUMMARY_NONE         0   // 不能用摘要
+#define VMP_VM_SUMMARY_VERIFY       1   // 下一次执行时先和完整模拟的结果对一遍
+#define VMP_VM_SUMMARY_READY        2
+
+typedef struct vmp_vm_summary
+{
+    int                 state;
+    int                 counts;
+    // 最后一条是handler结尾的分发跳转，不在摘要里模拟，交回给调用者
+    uint8_t             **insts;
+    uint8_t             *lens;
+    // 摘要翻译成的解释器指令，不认识或者和模拟的结果对不上的话为NULL
+    struct vmp_interp_prog *prog;
+} vmp_vm_summary_t;
+
+struct vmp_vm_param
+{
+    struct x86_emu_mod  *emu;
+    struct vmp_trace    *trace;
+};
+
+typedef struct vmp_vm
+{
+    struct x86_emu_mod  *emu;
+    struct vmp_trace    *trace;
+
+    // key: (src << 32) | dst, 间接跳转的(源, 目标)对
+    struct mhash64      edges;
+    // key: src, value: 不同目标的个数
+    struct mhash64      sources;
+    // key: handler地址, value: 执行次数
+    struct mhash64      handlers;
+
+    uint32_t            dispatcher;
+    uint32_t            dispatcher_targets;
+
+    uint32_t            call_stack[VMP_VM_CALL_STACK_SIZE];
+    int                 call_stack_i;
+
+    // 当前正在执行的handler
+    int                 in_handler;
+    struct vmp_trace_vm_event cur;
+    uint32_t            vip;
+    uint32_t            vsp;
+    // handler开始时的滚动密钥，不是已知值的时候不解密
+    uint32_t            key;
+    int                 key_known;
+    int                 start_count;
+
+    uint32_t            seq;
+
+    // 新handler第一次执行时记下执行过的指令，handler结束时分析，超过VMP_HLIB_INSTS_MAX条就不记了
+    int                 recording;
+    int                 rec_counts;
+    uint8_t             *rec_insts[VMP_HLIB_INSTS_MAX];
+    uint8_t             rec_lens[VMP_HLIB_INSTS_MAX];
+
+    // 可以为NULL，不为空的话按指纹到库里匹配，命中的handler不再分析解密链
+    struct vmp_hlib     *hlib;
+    uint32_t            hlib_hits;
+    // 从缓存里恢复的handler分析结果，这些handler不再记录和分析
+    uint32_t            cache_loads;
+    // key: handler地址, value: infos的下标 + 1
+    struct mhash64      info_index;
+    struct vmp_hlib_entry *infos;
+    int                 info_counts;
+    int                 info_size;
+
+    // 和infos一一对应，summary为0时不生成
+    int                 summary;
+    struct vmp_vm_summary *summaries;
+    // 正在校验的摘要，摘要跑完以后的寄存器和栈，handler结束时和完整模拟的结果比较
+    struct vmp_vm_summary *verifying;
+    struct x86_emu_reg  verify_regs[8];
+    uint32_t            verify_to;
+    uint8_t             *verify_stack;
+    uint64_t            summary_runs;
+    uint64_t            summary_skips;
+    uint64_t            summary_fallbacks;
+
+    // 在VM指令级解释执行，连续的能解释的handler不再回到x86模拟器
+    int                 interp;
+    int                 verify_interp;
+    uint32_t            verify_interp_to;
+    // 解释器的执行现场，校验摘要和解释执行时共用
+    struct vmp_interp_ctx ictx;
+    uint64_t            interp_runs;
+
+    // 和infos一一对应，handler的解密链编译成的解密器，校验过以后每次执行直接算出解密以后的操作数
+    struct vmp_vdec     *vdecs;
+    uint64_t            vdec_runs;
+    uint64_t            vdec_fails;
+} vmp_vm_t;
+
+struct vmp_vm *vmp_vm_create(struct vmp_vm_param *param);
+int vmp_vm_destroy(struct vmp_vm *mod);
+
+/* 在vmp段内的每次跳转后调用，跳转指令已经模拟过了，寄存器是跳转以后的状态
+@inst       跳转指令的地址
+@len        跳转指令的长度
+@to         跳转的目标
+@return     1           这是一次handler分发
+            0           普通跳转 */
+int vmp_vm_transfer(struct vmp_vm *mod, uint8_t *inst, int len, uint8_t *to);
+/* 把还没结束的handler输出掉，在模拟结束时调用 */
+int vmp_vm_flush(struct vmp_vm *mod);
+/* 每条vmp段内的指令在模拟之前调用，用来记录新handler的指令 */
+int vmp_vm_inst(struct vmp_vm *mod, uint8_t *inst, int len);
+int vmp_vm_set_hlib(struct vmp_vm *mod, struct vmp_hlib *lib);
+/* 用缓存里上次的分析结果，handler第一次执行时不再记录和分析
+@insts/lens 摘要的指令，counts为0或者没打开摘要时不生成摘要，有的话下次执行时先和完整模拟校验
+@return     0           success
+            -1          已经有了或者内存不足 */
+int vmp_vm_load_handler(struct vmp_vm *mod, uint32_t handler, struct vmp_hlib_entry *entry, uint8_t **insts, uint8_t *lens, int counts);
+/* @return     handler的分析结果，还没有执行完一次的话返回NULL */
+struct vmp_hlib_entry *vmp_vm_handler_info(struct vmp_vm *mod, uint32_t handler);
+int vmp_vm_set_summary(struct vmp_vm *mod, int enable);
+/* vmp_vm_transfer返回1以后调用，分发到的handler有校验过的摘要的话，只模拟摘要里的指令；
+打开了解释器的话，从这个handler开始能解释的handler都直接解释执行，直到碰到不能解释的handler
+@len        返回分发跳转的长度
+@return     最后一个执行了的handler结尾分发跳转的地址，调用者从这条指令接着模拟
+            NULL        没有可用的摘要，还是一条条模拟 */
+uint8_t *vmp_vm_summary_run(struct vmp_vm *mod, int *len);
+/* 打开解释器的同时会打开摘要 */
+int vmp_vm_set_interp(struct vmp_vm *mod, int enable);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
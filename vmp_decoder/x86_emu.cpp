@@ -9,11 +9,15 @@ extern "C" {
 #include <assert.h>
 #include "x86_emu.h"
 #include "mbytes.h"
+#include "mhash.h"
 
 #define time2s(_t)                  ""
 #define print_err                   printf
 
 #define X86_EMU_EXTERNAL_CALL       0xb1b1b1b1
+#define FAKE_IMAGE_BASE             0x400000
+#define X86_EMU_COW_PAGE            4096
+#define X86_EMU_STACK_SIZE          (128 * 1024)
 
 #define XE_EFLAGS_BIT_GET(mod1, flag1)    (!!(mod1->eflags.eflags & flag1))
 #define x86_emu_mem_fix(_va)    (uint8_t *)((uint64_t)(_va) | mod->addr64_prefix)
@@ -81,7 +85,10 @@ static uint32_t x86_emu_reg_val_get2(struct x86_emu_mod *mod, int reg_type);
  * 做的转换有以下几种：
  * 1. 32位地址到64位地址的转换
  * 2. PE文件内部 相对文件地址 到 rva 的转换 */
-static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t addr);
+static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t addr, int len);
+static uint8_t *x86_emu_access_mem_w(struct x86_emu_mod *mod, uint32_t addr, int len);
+static uint8_t *x86_emu_cow(struct x86_emu_mod *mod, uint8_t *addr, int len, int write);
+static uint8_t *x86_emu_va2ptr(struct x86_emu_mod *mod, uint32_t va);
 
 #define X86_EMU_REG_IS_KNOWN(_op_siz, _reg)                 (((_op_siz == 32) && ((_reg)->known == 0xffffffff)) || ((_op_siz == 16) && (((_reg)->known & 0xffff) == 0xffff)))
 #define X86_EMU_REG8_IS_KNOWN(_reg_type, _reg)              ((_reg_type < 4) ? ((_reg)->known & 0xff):((_reg)->known & 0xff00))
@@ -248,21 +255,16 @@ static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t addr);
 
 #define counts_of_array(_a)         (sizeof (_a) / sizeof (_a[0]))
 
-struct x86_emu_mod *x86_emu_create(struct x86_emu_create_param *param)
+// 已经有的堆栈、污点表和cow的缓冲直接用，没有的才分配，分配失败由调用者destroy
+static int x86_emu_init(struct x86_emu_mod *mod, struct x86_emu_create_param *param)
 {
-    struct x86_emu_mod *mod;
     struct x86_emu_reg *regs;
     int i;
 
-    mod = (struct x86_emu_mod *)calloc(1, sizeof (mod[0]));
-    if (!mod)
-    {
-        printf("x86_emu_create() failed when calloc(). %s:%d", __FILE__, __LINE__);
-        return NULL;
-    }
-
     mod->pe_mod = param->pe_mod;
     mod->vmp_in_callback = param->vmp_in_callback;
+    mod->trace = param->trace;
+    mod->quiet = param->quiet;
 
     mod->eax.type = OPERAND_TYPE_REG_EAX;
     mod->ebx.type = OPERAND_TYPE_REG_EBX;
@@ -287,10 +289,17 @@ struct x86_emu_mod *x86_emu_create(struct x86_emu_create_param *param)
     // 信息，因为我们是静态分析，用来去除死代码和常量计算的，必须得
     // 在程序的某个点上确认当前这个变量是否可计算，需要清楚这个变量
     // 是否是Known的。
-    mod->stack.top = 128 * 1024;
-    mod->stack.size = 128 * 1024;
-    mod->stack.known = (uint8_t *)calloc(1, mod->stack.size);
-    mod->stack.data = (uint8_t *)calloc(1, mod->stack.size);
+    mod->stack.top = X86_EMU_STACK_SIZE;
+    mod->stack.size = X86_EMU_STACK_SIZE;
+    if (!mod->stack.known)
+        mod->stack.known = (uint8_t *)calloc(1, mod->stack.size);
+    if (!mod->stack.data)
+        mod->stack.data = (uint8_t *)calloc(1, mod->stack.size);
+    if (!mod->stack.data || !mod->stack.known)
+    {
+        print_err ("[%s] err:  failed with calloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+        return -1;
+    }
 
     // esp寄存器比较特别，理论上所有的寄存器开始时都是unknown状态的
     // 但是因为我们实际在操作堆栈时，依赖于esp，所以假设一开始esp
@@ -314,19 +323,110 @@ struct x86_emu_mod *x86_emu_create(struct x86_emu_create_param *param)
     mod->eflags.eflags |= XE_EFLAGS_B1;
     mod->eflags.eflags |= XE_EFLAGS_IEF;
 
-    if (!mod->stack.data || !mod->stack.known)
+    if (param->taint && !mod->taint.stack && !(mod->taint.stack = (uint8_t *)calloc(1, mod->stack.size)))
     {
         print_err ("[%s] err:  failed with calloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+        return -1;
+    }
+
+    // 只预留地址空间，写到哪一页才提交哪一页
+    if (param->cow)
+    {
+        mod->cow.pages = (mod->pe_mod->size_of_image + X86_EMU_COW_PAGE - 1) / X86_EMU_COW_PAGE;
+        if (!mod->cow.dirty)
+            mod->cow.dirty = (uint8_t *)calloc(1, mod->cow.pages);
+        if (!mod->cow.base)
+            mod->cow.base = (uint8_t *)VirtualAlloc(NULL, mod->cow.pages * X86_EMU_COW_PAGE, MEM_RESERVE, PAGE_NOACCESS);
+        if (!mod->cow.dirty || !mod->cow.base)
+        {
+            print_err ("[%s] err:  failed with VirtualAlloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct x86_emu_mod *x86_emu_create(struct x86_emu_create_param *param)
+{
+    struct x86_emu_mod *mod;
+
+    mod = (struct x86_emu_mod *)calloc(1, sizeof (mod[0]));
+    if (!mod)
+    {
+        printf("x86_emu_create() failed when calloc(). %s:%d", __FILE__, __LINE__);
+        return NULL;
+    }
+
+    if (x86_emu_init(mod, param))
+    {
+        x86_emu_destroy(mod);
         return NULL;
     }
 
     return mod;
 }
 
+int x86_emu_reset(struct x86_emu_mod *mod, struct x86_emu_create_param *param)
+{
+    uint8_t *known = mod->stack.known, *data = mod->stack.data, *taint = mod->taint.stack;
+    uint8_t *cow_base = mod->cow.base, *cow_dirty = mod->cow.dirty;
+    int cow_pages = mod->cow.pages;
+
+    // 镜像大小不一样的话cow的地址空间要重新预留，一样的话把提交过的页还回去
+    if (cow_base && (!param->cow || (cow_pages != (param->pe_mod->size_of_image + X86_EMU_COW_PAGE - 1) / X86_EMU_COW_PAGE)))
+    {
+        VirtualFree(cow_base, 0, MEM_RELEASE);
+        free(cow_dirty);
+        cow_base = cow_dirty = NULL;
+    }
+    else if (cow_base)
+    {
+        VirtualFree(cow_base, cow_pages * X86_EMU_COW_PAGE, MEM_DECOMMIT);
+        memset(cow_dirty, 0, cow_pages);
+    }
+
+    if (taint && !param->taint)
+    {
+        free(taint);
+        taint = NULL;
+    }
+
+    memset(mod, 0, sizeof (mod[0]));
+    if (known)
+        memset(known, 0, X86_EMU_STACK_SIZE);
+    if (data)
+        memset(data, 0, X86_EMU_STACK_SIZE);
+    if (taint)
+        memset(taint, 0, X86_EMU_STACK_SIZE);
+
+    mod->stack.known = known;
+    mod->stack.data = data;
+    mod->taint.stack = taint;
+    mod->cow.base = cow_base;
+    mod->cow.dirty = cow_dirty;
+
+    if (x86_emu_init(mod, param))
+    {
+        printf("x86_emu_reset() failed with x86_emu_init(). %s:%d\n", __FILE__, __LINE__);
+        return -1;
+    }
+
+    return 0;
+}
+
 int x86_emu_destroy(struct x86_emu_mod *mod)
 {
     if (mod)
     {
+        if (mod->cow.base)
+        {
+            VirtualFree(mod->cow.base, 0, MEM_RELEASE);
+        }
+        free(mod->cow.dirty);
+        free(mod->taint.stack);
+        free(mod->stack.known);
+        free(mod->stack.data);
         free(mod);
     }
 
@@ -386,7 +486,7 @@ int x86_emu_push(struct x86_emu_mod *mod, uint8_t *code, int len)
         x86_emu_modrm_analysis2(mod, code + 1, 0, NULL, NULL, &E);
         if (E.kind == a_mem)
         {
-            uint8_t *new_addr = x86_emu_access_mem(mod, E.u.mem.addr32);
+            uint8_t *new_addr = x86_emu_access_mem(mod, E.u.mem.addr32, mod->inst.oper_size / 8);
             x86_emu__push(mod, NULL, new_addr, mod->inst.oper_size / 8);
         }
         else
@@ -1178,7 +1278,7 @@ int x86_emu_mov(struct x86_emu_mod *mod, uint8_t *code, int len)
         {
             uint8_t *new_addr;
 
-            new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32);
+            new_addr = x86_emu_access_mem_w(mod, src_imm.u.mem.addr32, mod->inst.oper_size / 8);
             printf("code + ret = %d\n", 2 + ret);
             memcpy(new_addr, code + 2 + ret, mod->inst.oper_size / 8);
         }
@@ -1195,7 +1295,7 @@ int x86_emu_mov(struct x86_emu_mod *mod, uint8_t *code, int len)
         if (src_imm.kind == a_mem)
         {
             if ((src_imm.u.mem.known & UINT_MAX)
-                && (new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32)))
+                && (new_addr = x86_emu_access_mem_w(mod, src_imm.u.mem.addr32, 1)))
             {
                 new_addr[0] = x86_emu_reg8_get(src_reg, reg_type);
             }
@@ -1212,7 +1312,7 @@ int x86_emu_mov(struct x86_emu_mod *mod, uint8_t *code, int len)
         if (src_imm.kind == a_mem)
         {
             if ((src_imm.u.mem.known & UINT_MAX)
-                && (new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32)))
+                && (new_addr = x86_emu_access_mem_w(mod, src_imm.u.mem.addr32, mod->inst.oper_size / 8)))
             {
                 x86_emu_dynam_mem_set(new_addr, src_reg);
             }
@@ -1233,7 +1333,7 @@ int x86_emu_mov(struct x86_emu_mod *mod, uint8_t *code, int len)
         if (src_imm.kind == a_mem)
         {
             if ((src_imm.u.mem.known & UINT_MAX)
-                && (new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32)))
+                && (new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32, 1)))
             {
                 x86_emu_reg8_oper(dst_reg, reg_type, = new_addr[0]);
                 dst_reg->known |= (reg_type < 4) ? 0x00ff:0xff00;
@@ -1254,7 +1354,7 @@ int x86_emu_mov(struct x86_emu_mod *mod, uint8_t *code, int len)
 
         if (src_imm.kind == a_mem)
         {
-            uint8_t *new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32);
+            uint8_t *new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32, mod->inst.oper_size / 8);
             x86_emu_dynam_imm_set(dst_reg, new_addr);
         }
         else
@@ -1328,7 +1428,8 @@ int x86_emu_add(struct x86_emu_mod *mod, uint8_t *code, int len)
         x86_emu_modrm_analysis2(mod, code + 1, 0, NULL, NULL, &E);
         if (E.kind == a_mem)
         {
-            uint8_t *new_addr = x86_emu_access_mem(mod, E.u.mem.addr32);
+            // 写内存，镜像里的页要先复制一份
+            uint8_t *new_addr = x86_emu_access_mem_w(mod, E.u.mem.addr32, 1);
 
             new_addr[0] += X86_EMU_REG_AL(mod);
         }
@@ -1742,12 +1843,9 @@ static int x86_emu_add_modify_status(struct x86_emu_mod *mod, uint32_t dst, uint
     }
 #endif
 
-    if ((sign_src == sign_dst) && (sign_s != sign_src))
-    {
-        x86_emu_of_set(mod, 1);
-    }
+    x86_emu_of_set(mod, (sign_src == sign_dst) && (sign_s != sign_src));
 
-    x86_emu_zf_set(mod, src == dst);
+    x86_emu_zf_set(mod, s == 0);
 
     x86_emu_sf_set(mod, !!sign_s);
 
@@ -2123,7 +2221,7 @@ int x86_emu_movzx(struct x86_emu_mod *mod, uint8_t *code, int len)
         {
             if (src_imm.u.mem.known == UINT_MAX)
             {
-                x86_emu_dynam_set(dst_reg, (x86_emu_access_mem(mod, src_imm.u.mem.addr32))[0]);
+                x86_emu_dynam_set(dst_reg, (x86_emu_access_mem(mod, src_imm.u.mem.addr32, 1))[0]);
             }
         }
         else
@@ -2148,7 +2246,7 @@ int x86_emu_movzx(struct x86_emu_mod *mod, uint8_t *code, int len)
         {
             if (src_imm.u.mem.known == UINT_MAX)
             {
-                uint8_t *new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32);
+                uint8_t *new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32, 2);
                 dst_reg->u.r32 = mbytes_read_int_little_endian_2b(new_addr);
             }
         }
@@ -2670,34 +2768,54 @@ static int x86_emu_btr(struct x86_emu_mod *mod, uint8_t *code, int len)
     return 0;
 }
 
-static int x86_emu_jnbe(struct x86_emu_mod *mod, uint8_t *code, int len)
+// cc是jcc opcode的低4位，偶数是条件本身，奇数是取反
+static int x86_emu_cond(struct x86_emu_mod *mod, int cc)
 {
-    switch (code[0])
+    int cf = x86_emu_cf_get(mod), zf = x86_emu_zf_get(mod), sf = x86_emu_sf_get(mod), of = x86_emu_of_get(mod), r;
+
+    switch (cc >> 1)
     {
-    case 0x77:
-        if ((x86_emu_cf_get(mod) == 0) && (x86_emu_zf_get(mod) == 0))
-        {
-            mod->eip.u.r32 = (((uint64_t)mod->inst.start) & UINT_MAX)
-                + mod->inst.len + code[1];
-            mod->eip.known = UINT_MAX;
-        }
-        break;
+    case 0: r = of; break;                      // jo
+    case 1: r = cf; break;                      // jb
+    case 2: r = zf; break;                      // jz
+    case 3: r = cf || zf; break;                // jbe
+    case 4: r = sf; break;                      // js
+    case 5: r = x86_emu_pf_get(mod); break;     // jp
+    case 6: r = (sf != of); break;              // jl
+    default: r = zf || (sf != of); break;       // jle
+    }
 
-    case 0x87:
-        if ((x86_emu_cf_get(mod) == 0) && (x86_emu_zf_get(mod) == 0))
-        {
-            mod->eip.u.r32 = (((uint64_t) mod->inst.start) & UINT_MAX)
-                + mod->inst.len + x86_emu_dynam_le_read(mod->inst.oper_size, code + 1);
-            mod->eip.known = UINT_MAX;
-        }
-        break;
+    return (cc & 1) ? !r : r;
+}
 
-    default:
+// 70~7f rel8，0f 80~8f rel16/32
+// true_addr是实际走的那一边，false_addr是没走的另一边
+static int x86_emu_jcc(struct x86_emu_mod *mod, uint8_t *code, int len)
+{
+    uint32_t next = (uint32_t)(((uint64_t)mod->inst.start) & UINT_MAX) + mod->inst.len, target;
+
+    if ((code[0] & 0xf0) == 0x70)
+    {
+        target = next + (int8_t)code[1];
+    }
+    else if ((code[0] & 0xf0) == 0x80)
+    {
+        target = next + ((mod->inst.oper_size == 16) ? (int16_t)mbytes_read_int_little_endian_2b(code + 1)
+            : mbytes_read_int_little_endian_4b(code + 1));
+    }
+    else
+    {
         return -1;
     }
 
-    mod->analys.jmp_type = X86_JMP;
+    mod->analys.jmp_type = X86_COND_JMP;
+    mod->analys.cond = x86_emu_cond(mod, code[0] & 0xf);
+
+    mod->eip.u.r32 = mod->analys.cond ? target : next;
+    mod->eip.known = UINT_MAX;
+
     mod->analys.true_addr = x86_emu_mem_fix(mod->eip.u.r32);
+    mod->analys.false_addr = x86_emu_mem_fix(mod->analys.cond ? next : target);
 
     return 0;
 }
@@ -2737,8 +2855,8 @@ static int x86_emu_movsb(struct x86_emu_mod *mod, uint8_t *code, int len)
         cts = 1;
     }
 
-    dst = x86_emu_mem_fix(mod->edi.u.r32);
-    src = x86_emu_mem_fix(mod->esi.u.r32);
+    dst = x86_emu_cow(mod, x86_emu_va2ptr(mod, mod->edi.u.r32), cts, 1);
+    src = x86_emu_cow(mod, x86_emu_va2ptr(mod, mod->esi.u.r32), cts, 0);
 
     for (i = 0; cts; cts--, i++)
     {
@@ -2787,7 +2905,7 @@ static int x86_emu_pop(struct x86_emu_mod *mod, uint8_t *code, int len)
         {
             assert(src_imm.u.mem.addr32);
             assert(src_imm.u.mem.known);
-            uint8_t *new_addr = x86_emu_access_mem(mod, src_imm.u.mem.addr32);
+            uint8_t *new_addr = x86_emu_access_mem_w(mod, src_imm.u.mem.addr32, mod->inst.oper_size / 8);
 
             memcpy(new_addr, mod->stack.data + x86_emu_stack_top(mod),  mod->inst.oper_size / 8);
             x86_emu__pop(mod, mod->inst.oper_size / 8);
@@ -2884,6 +3002,22 @@ struct x86_emu_on_inst_item x86_emu_inst_tab[] =
     { {0x5f, 0, 0}, -1, x86_emu_pop },
     { {0x68, 0, 0}, -1, x86_emu_push },
     { {0x6a, 0, 0}, -1, x86_emu_push },
+    { {0x70, 0, 0}, -1, x86_emu_jcc },
+    { {0x71, 0, 0}, -1, x86_emu_jcc },
+    { {0x72, 0, 0}, -1, x86_emu_jcc },
+    { {0x73, 0, 0}, -1, x86_emu_jcc },
+    { {0x74, 0, 0}, -1, x86_emu_jcc },
+    { {0x75, 0, 0}, -1, x86_emu_jcc },
+    { {0x76, 0, 0}, -1, x86_emu_jcc },
+    { {0x77, 0, 0}, -1, x86_emu_jcc },
+    { {0x78, 0, 0}, -1, x86_emu_jcc },
+    { {0x79, 0, 0}, -1, x86_emu_jcc },
+    { {0x7a, 0, 0}, -1, x86_emu_jcc },
+    { {0x7b, 0, 0}, -1, x86_emu_jcc },
+    { {0x7c, 0, 0}, -1, x86_emu_jcc },
+    { {0x7d, 0, 0}, -1, x86_emu_jcc },
+    { {0x7e, 0, 0}, -1, x86_emu_jcc },
+    { {0x7f, 0, 0}, -1, x86_emu_jcc },
     { {0x80, 0, 0}, 0, x86_emu_add },
     { {0x80, 0, 0}, 1, x86_emu_or },
     { {0x80, 0, 0}, 2, x86_emu_adc },
@@ -3025,7 +3159,22 @@ struct x86_emu_on_inst_item x86_emu_inst_tab[] =
     { {0x0f, 0x48, 0}, -1, x86_emu_cmovs },
     { {0x0f, 0x4a, 0}, -1, x86_emu_cmovp },
     { {0x0f, 0x4c, 0}, -1, x86_emu_cmovl },
-    { {0x0f, 0x87, 0}, -1, x86_emu_jnbe },
+    { {0x0f, 0x80, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x81, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x82, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x83, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x84, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x85, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x86, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x87, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x88, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x89, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x8a, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x8b, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x8c, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x8d, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x8e, 0}, -1, x86_emu_jcc },
+    { {0x0f, 0x8f, 0}, -1, x86_emu_jcc },
     { {0x0f, 0x94, 0}, -1, x86_emu_setz },
     { {0x0f, 0x95, 0}, -1, x86_emu_setnz },
     { {0x0f, 0x9a, 0}, -1, x86_emu_setp },
@@ -3075,6 +3224,32 @@ int x86_emu_dump (struct x86_emu_mod *mod)
     }
 #endif
 
+    if (mod->trace)
+    {
+        struct vmp_trace_regs regs;
+        struct x86_emu_reg *gprs = &mod->eax;
+        int i;
+
+        for (i = 0; i < 8; i++)
+        {
+            regs.val[i] = gprs[i].u.r32;
+            regs.known[i] = gprs[i].known;
+        }
+        regs.eip = mod->eip.u.r32;
+        regs.eflags = mod->eflags.eflags;
+        regs.eflags_known = mod->eflags.known;
+        regs.access_addr = mod->inst.access_addr;
+        regs.access_addr2 = mod->inst.access_addr2;
+        regs.stack_depth = mod->stack.size - x86_emu_stack_top(mod);
+        regs.inst_addr = ((mod->inst.start >= mod->pe_mod->image_base) && (mod->inst.start < mod->pe_mod->image_base + mod->pe_mod->size_of_image))
+            ? (FAKE_IMAGE_BASE + (uint32_t)(mod->inst.start - mod->pe_mod->image_base)) : 0;
+
+        return vmp_trace_regs(mod->trace, mod->inst.count + 1, &regs);
+    }
+
+    if (mod->quiet)
+        return 0;
+
     printf("EAX[%08x:%08x], ECX[%08x:%08x], EDX[%08x:%08x], EBX[%08x], addr[%x], addr2[%x] [%d][stack = %d]\n"
         "EBP[%08x:%08x], ESI[%08x:%08x], EDI[%08x:%08x], ESP[%08x], EIP[%08x], EF[%08x], CF[%d], ZF[%d], OF[%d], SF[%d]\n",
         mod->eax.known, mod->eax.u.r32, mod->ecx.known, mod->ecx.u.r32,
@@ -3089,7 +3264,7 @@ int x86_emu_dump (struct x86_emu_mod *mod)
         if (mod->inst.count == 3335)
         {
             if (!watch_addr)
-                watch_addr = x86_emu_access_mem(mod, mod->esi.u.r32);
+                watch_addr = x86_emu_access_mem(mod, mod->esi.u.r32, 4);
         }
 
         if (watch_addr)
@@ -3455,7 +3630,7 @@ static int x86_emu_df_set(struct x86_emu_mod *mod, int v)
 
 static int x86_emu_of_get(struct x86_emu_mod *mod)
 {
-    return XE_EFLAGS_BIT_GET(mod, XE_EFLAGS_DF);
+    return XE_EFLAGS_BIT_GET(mod, XE_EFLAGS_OF);
 }
 
 static int x86_emu_of_set(struct x86_emu_mod *mod, int v)
@@ -3534,9 +3709,8 @@ static int x86_emu__push_imm32(struct x86_emu_mod *mod, uint32_t imm32)
     return x86_emu__push (mod, (uint8_t *)&known, (uint8_t *)&imm32, sizeof (imm32));
 }
 
-#define FAKE_IMAGE_BASE          0x400000
-
-static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t va)
+// 只用来读，写内存要用x86_emu_access_mem_w，不然开了写时复制时会写到共用的镜像里
+static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t va, int len)
 {
     uint8_t *new_addr = NULL;
     uint8_t *t_addr = NULL;
@@ -3560,7 +3734,7 @@ static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t va)
 #endif
     if ((va >= mod->stack.esp_start) && (va <= mod->stack.esp_end))
     {
-        new_addr = (uint8_t *)((uint64_t)va | mod->addr64_prefix);
+        new_addr = x86_emu_va2ptr(mod, va);
     }
     else
     { 
@@ -3572,11 +3746,71 @@ static uint8_t *x86_emu_access_mem(struct x86_emu_mod *mod, uint32_t va)
     // 地址假如在PE文件内，那么我们就把这个虚拟地址转成当前文件地址
     // 假如不在，那么就是堆栈地址
 
-    return t_addr?t_addr:new_addr;
+    return x86_emu_cow(mod, t_addr?t_addr:new_addr, len, 0);
+}
+
+static uint8_t *x86_emu_access_mem_w(struct x86_emu_mod *mod, uint32_t va, int len)
+{
+    return x86_emu_cow(mod, x86_emu_va2ptr(mod, va), len, 1);
+}
+
+// 堆栈上的地址按esp_start换算成stack.data里的偏移。没恢复过快照的模拟器esp_start就是
+// stack.data的低32位，和直接拼高32位一样；恢复了别的模拟器的快照以后，堆栈的虚拟地址
+// 不变，换的只是底下的内存
+static uint8_t *x86_emu_va2ptr(struct x86_emu_mod *mod, uint32_t va)
+{
+    if ((va >= mod->stack.esp_start) && (va <= mod->stack.esp_end))
+        return mod->stack.data + (va - mod->stack.esp_start);
+
+    return x86_emu_mem_fix(va);
+}
+
+// addr开始的len个字节在PE镜像内的话换成私有副本里的地址。写的时候把涉及到的页都复制过来，
+// 读的时候只要有一页复制过，其他页也一起复制，保证返回的地址连续。没开写时复制的原样返回
+static uint8_t *x86_emu_cow(struct x86_emu_mod *mod, uint8_t *addr, int len, int write)
+{
+    uint8_t *image_base = mod->pe_mod->image_base;
+    int i, first, last, dirty = 0, size;
+
+    if (!mod->cow.base || (addr < image_base) || (addr >= image_base + mod->pe_mod->size_of_image))
+        return addr;
+
+    first = (int)((addr - image_base) / X86_EMU_COW_PAGE);
+    last = (int)((addr - image_base + ((len > 0) ? len - 1 : 0)) / X86_EMU_COW_PAGE);
+    if (last >= mod->cow.pages)
+        last = mod->cow.pages - 1;
+
+    for (i = first; i <= last; i++)
+    {
+        dirty |= mod->cow.dirty[i];
+    }
+
+    if (!write && !dirty)
+        return addr;
+
+    for (i = first; i <= last; i++)
+    {
+        if (mod->cow.dirty[i])
+            continue;
+
+        if (!VirtualAlloc(mod->cow.base + i * X86_EMU_COW_PAGE, X86_EMU_COW_PAGE, MEM_COMMIT, PAGE_READWRITE))
+        {
+            print_err ("[%s] err:  x86_emu_cow() failed with VirtualAlloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+            return addr;
+        }
+
+        size = mod->pe_mod->size_of_image - i * X86_EMU_COW_PAGE;
+        memcpy(mod->cow.base + i * X86_EMU_COW_PAGE, image_base + i * X86_EMU_COW_PAGE,
+            (size > X86_EMU_COW_PAGE) ? X86_EMU_COW_PAGE : size);
+        mod->cow.dirty[i] = 1;
+        mod->cow.copied++;
+    }
+
+    return mod->cow.base + (addr - image_base);
 }
 uint8_t *x86_emu_access_esp(struct x86_emu_mod *mod)
 {
-    return ((uint8_t *)((mod)->addr64_prefix | (uint64_t) mod->esp.u.r32));
+    return mod->stack.data + ((int64_t)mod->esp.u.r32 - (int64_t)mod->stack.esp_start);
 }
 
 int x86_emu_stack_top(struct x86_emu_mod *mod)
@@ -3637,6 +3871,259 @@ int x86_emu_set(struct x86_emu_mod *mod, int reg, uint32_t val)
     return 0;
 }
 
+static uint8_t *x86_emu_mem_ptr2(struct x86_emu_mod *mod, uint32_t va, int len, int write)
+{
+    uint8_t *addr;
+
+    // esp_end是堆栈的最后一个字节，包含在堆栈里
+    if ((va >= mod->stack.esp_start) && (va + len - 1 <= mod->stack.esp_end))
+    {
+        return x86_emu_va2ptr(mod, va);
+    }
+
+    addr = x86_emu_mem_fix(va);
+    if ((addr >= mod->pe_mod->image_base) && (addr + len <= mod->pe_mod->image_base + mod->pe_mod->size_of_image))
+    {
+        return x86_emu_cow(mod, addr, len, write);
+    }
+
+    return NULL;
+}
+
+uint8_t *x86_emu_mem_ptr(struct x86_emu_mod *mod, uint32_t va, int len)
+{
+    return x86_emu_mem_ptr2(mod, va, len, 0);
+}
+
+uint8_t *x86_emu_mem_write_ptr(struct x86_emu_mod *mod, uint32_t va, int len)
+{
+    return x86_emu_mem_ptr2(mod, va, len, 1);
+}
+
+uint32_t x86_emu_ida_addr(struct x86_emu_mod *mod, uint8_t *addr)
+{
+    if ((addr >= mod->pe_mod->image_base) && (addr < mod->pe_mod->image_base + mod->pe_mod->size_of_image))
+    {
+        return FAKE_IMAGE_BASE + (uint32_t)(addr - mod->pe_mod->image_base);
+    }
+
+    return 0;
+}
+
+struct x86_emu_snap
+{
+    struct x86_emu_reg  regs[8];
+    struct x86_emu_reg  eip;
+    x86_emu_eflags_t    eflags;
+    uint32_t            esp_start;
+    uint32_t            esp_end;
+    uint32_t            taint_eflags;
+    uint32_t            taint_regs;
+
+    // 堆栈的[top, size)，数据、known、污点依次放在buf里
+    int                 top;
+    uint8_t             *buf;
+
+    // 写时复制改过的页
+    int                 pages;
+    int                 *page_idx;
+    uint8_t             *page_data;
+};
+
+static int x86_emu_snap_top(struct x86_emu_mod *mod)
+{
+    int top = x86_emu_stack_top(mod);
+
+    return (top < 0) ? 0 : ((top > mod->stack.size) ? mod->stack.size : top);
+}
+
+struct x86_emu_snap *x86_emu_snap(struct x86_emu_mod *mod)
+{
+    struct x86_emu_snap *snap;
+    int i, n, used;
+
+    snap = (struct x86_emu_snap *)calloc(1, sizeof (snap[0]));
+    if (!snap)
+    {
+        print_err ("[%s] err:  x86_emu_snap() failed with calloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+        return NULL;
+    }
+
+    memcpy(snap->regs, &mod->eax, sizeof (snap->regs));
+    snap->eip = mod->eip;
+    snap->eflags = mod->eflags;
+    snap->esp_start = mod->stack.esp_start;
+    snap->esp_end = mod->stack.esp_end;
+    snap->taint_eflags = mod->taint.eflags;
+    snap->taint_regs = mod->taint.regs;
+
+    snap->top = x86_emu_snap_top(mod);
+    used = mod->stack.size - snap->top;
+    snap->buf = (uint8_t *)calloc(1, used * 3 + 1);
+    if (!snap->buf)
+        goto fail_label;
+
+    memcpy(snap->buf, mod->stack.data + snap->top, used);
+    memcpy(snap->buf + used, mod->stack.known + snap->top, used);
+    if (mod->taint.stack)
+    {
+        memcpy(snap->buf + used * 2, mod->taint.stack + snap->top, used);
+    }
+
+    for (i = 0; i < mod->cow.pages; i++)
+    {
+        snap->pages += !!mod->cow.dirty[i];
+    }
+
+    if (snap->pages)
+    {
+        snap->page_idx = (int *)malloc(snap->pages * sizeof (snap->page_idx[0]));
+        snap->page_data = (uint8_t *)malloc((size_t)snap->pages * X86_EMU_COW_PAGE);
+        if (!snap->page_idx || !snap->page_data)
+            goto fail_label;
+
+        for (i = n = 0; i < mod->cow.pages; i++)
+        {
+            if (!mod->cow.dirty[i])
+                continue;
+
+            snap->page_idx[n] = i;
+            memcpy(snap->page_data + (size_t)n * X86_EMU_COW_PAGE, mod->cow.base + i * X86_EMU_COW_PAGE, X86_EMU_COW_PAGE);
+            n++;
+        }
+    }
+
+    return snap;
+
+fail_label:
+    print_err ("[%s] err:  x86_emu_snap() failed with malloc(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+    x86_emu_snap_free(snap);
+    return NULL;
+}
+
+int x86_emu_restore(struct x86_emu_mod *mod, struct x86_emu_snap *snap)
+{
+    uint8_t *image_base = mod->pe_mod->image_base, *page;
+    int i, size, used = mod->stack.size - snap->top;
+
+    if (snap->pages && !mod->cow.base)
+    {
+        print_err ("[%s] err:  x86_emu_restore() failed with cow disabled. %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+        return -1;
+    }
+
+    memcpy(&mod->eax, snap->regs, sizeof (snap->regs));
+    mod->eip = snap->eip;
+    mod->eflags = snap->eflags;
+    mod->stack.esp_start = snap->esp_start;
+    mod->stack.esp_end = snap->esp_end;
+    mod->taint.eflags = snap->taint_eflags;
+    mod->taint.regs = snap->taint_regs;
+
+    memcpy(mod->stack.data + snap->top, snap->buf, used);
+    memcpy(mod->stack.known + snap->top, snap->buf + used, used);
+    if (mod->taint.stack)
+    {
+        memcpy(mod->taint.stack + snap->top, snap->buf + used * 2, used);
+    }
+
+    // 自己改过的页先还原成镜像里的内容，页留着不释放，下次写的时候不用再提交
+    for (i = 0; i < mod->cow.pages; i++)
+    {
+        if (!mod->cow.dirty[i])
+            continue;
+
+        size = mod->pe_mod->size_of_image - i * X86_EMU_COW_PAGE;
+        memcpy(mod->cow.base + i * X86_EMU_COW_PAGE, image_base + i * X86_EMU_COW_PAGE,
+            (size > X86_EMU_COW_PAGE) ? X86_EMU_COW_PAGE : size);
+    }
+
+    for (i = 0; i < snap->pages; i++)
+    {
+        page = x86_emu_cow(mod, image_base + snap->page_idx[i] * X86_EMU_COW_PAGE, 1, 1);
+        if (page != mod->cow.base + snap->page_idx[i] * X86_EMU_COW_PAGE)
+        {
+            print_err ("[%s] err:  x86_emu_restore() failed with x86_emu_cow(). %s:%d\r\n", time2s (0), __FILE__, __LINE__);
+            return -1;
+        }
+        memcpy(page, snap->page_data + (size_t)i * X86_EMU_COW_PAGE, X86_EMU_COW_PAGE);
+    }
+
+    return 0;
+}
+
+void x86_emu_snap_free(struct x86_emu_snap *snap)
+{
+    if (snap)
+    {
+        free(snap->buf);
+        free(snap->page_idx);
+        free(snap->page_data);
+        free(snap);
+    }
+}
+
+static uint64_t x86_emu_hash_buf(uint64_t h, const uint8_t *buf, int size)
+{
+    uint64_t w;
+    int i;
+
+    for (i = 0; i + 8 <= size; i += 8)
+    {
+        memcpy(&w, buf + i, 8);
+        h = (h ^ mhash64_mix(w)) * 0x100000001b3ULL;
+    }
+    if (i < size)
+    {
+        w = 0;
+        memcpy(&w, buf + i, size - i);
+        h = (h ^ mhash64_mix(w)) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+#define x86_emu_hash_u64(_h, _v)        (((_h) ^ mhash64_mix(_v)) * 0x100000001b3ULL)
+
+uint64_t x86_emu_state_hash(struct x86_emu_mod *mod)
+{
+    struct x86_emu_reg *regs = &mod->eax;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    int i, size, top = x86_emu_snap_top(mod);
+
+    for (i = 0; i < 8; i++)
+    {
+        h = x86_emu_hash_u64(h, ((uint64_t)regs[i].known << 32) | regs[i].u.r32);
+    }
+    h = x86_emu_hash_u64(h, ((uint64_t)mod->eflags.known << 32) | mod->eflags.eflags);
+    h = x86_emu_hash_u64(h, ((uint64_t)mod->taint.eflags << 32) | mod->taint.regs);
+    h = x86_emu_hash_u64(h, ((uint64_t)mod->stack.esp_start << 32) | (uint32_t)top);
+
+    h = x86_emu_hash_buf(h, mod->stack.data + top, mod->stack.size - top);
+    h = x86_emu_hash_buf(h, mod->stack.known + top, mod->stack.size - top);
+    if (mod->taint.stack)
+    {
+        h = x86_emu_hash_buf(h, mod->taint.stack + top, mod->stack.size - top);
+    }
+
+    // 恢复快照时还原过的页还标着dirty，内容和镜像一样的不算
+    for (i = 0; i < mod->cow.pages; i++)
+    {
+        size = mod->pe_mod->size_of_image - i * X86_EMU_COW_PAGE;
+        if (size > X86_EMU_COW_PAGE)
+            size = X86_EMU_COW_PAGE;
+
+        if (!mod->cow.dirty[i]
+            || !memcmp(mod->cow.base + i * X86_EMU_COW_PAGE, mod->pe_mod->image_base + i * X86_EMU_COW_PAGE, size))
+            continue;
+
+        h = x86_emu_hash_u64(h, (uint64_t)i);
+        h = x86_emu_hash_buf(h, mod->cow.base + i * X86_EMU_COW_PAGE, X86_EMU_COW_PAGE);
+    }
+
+    return mhash64_mix(h);
+}
+
 
 #ifdef __cplusplus
 }
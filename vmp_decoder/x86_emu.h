@@ -10,6 +10,7 @@ extern "C" {
 #include <stdint.h>
 #include "pe_loader.h"
 #include "vmp_hlp.h"
+#include "vmp_trace.h"
 
 #define OPERAND_TYPE_REG_EAX    0
 #define OPERAND_TYPE_REG_ECX    1
@@ -224,12 +225,35 @@ typedef struct x86_emu_mod
         uint8_t         external_call[4];
     } mem;
 
+    // 不为空的话，写PE镜像时先把那一页复制到私有的副本里再写，读的时候复制过的页从副本里读，
+    // 这样多个模拟器可以共用一个只读的镜像。base是预留的和镜像一样大的地址空间，按页提交
+    struct {
+        uint8_t     *base;
+        uint8_t     *dirty;
+        int         pages;
+        int         copied;
+    } cow;
+
     struct pe_loader *pe_mod;
     struct vmp_hlp *hlp;
 
     uint64_t        addr64_prefix;
     x86_emu_flow_analysis_t analys;
     x86_emu_vmp_in_callback vmp_in_callback;
+
+    // 不为空时，寄存器状态通过trace模块输出，否则还是直接printf
+    struct vmp_trace    *trace;
+    // 不为0时每条指令的寄存器状态都不输出
+    int                 quiet;
+
+    // 污点，标记哪些值是从外部调用的返回值、没写过的堆栈(函数参数)传过来的。模拟器自己
+    // 不用也不维护，由vmp_explore按指令的操作数传播，跟着快照一起保存和恢复。
+    // regs按通用寄存器的顺序一位一个，eflags和XE_EFLAGS_xx一样，stack每个字节一个
+    struct {
+        uint8_t     *stack;
+        uint32_t    eflags;
+        uint32_t    regs;
+    } taint;
 } x86_emu_mod_t;
 
 typedef int(*x86_emu_on_inst) (struct x86_emu_mod *mod, uint8_t *addr, int len);
@@ -262,9 +286,18 @@ struct x86_emu_create_param
     struct pe_loader *pe_mod;
     struct vmp_hlp *hlp;
     x86_emu_vmp_in_callback vmp_in_callback;
+    struct vmp_trace *trace;
+    // 写PE镜像时按页写时复制，不改共用的镜像
+    int cow;
+    // 不输出寄存器状态，多个模拟器同时跑的时候不抢stdout
+    int quiet;
+    // 分配堆栈的污点表
+    int taint;
 };
 
 struct x86_emu_mod *x86_emu_create(struct x86_emu_create_param *param);
+/* 回到x86_emu_create以后的状态，堆栈和污点表的缓冲留着重用，cow在镜像大小不变时只把提交的页还回去 */
+int x86_emu_reset(struct x86_emu_mod *mod, struct x86_emu_create_param *param);
 int x86_emu_destroy(struct x86_emu_mod *mod);
 /*
 @return     -1           failure
@@ -279,6 +312,24 @@ uint8_t *x86_emu_eip(struct x86_emu_mod *mod);
 int x86_emu_on_ret(struct x86_emu_mod *mod);
 int x86_emu_set(struct x86_emu_mod *mod, int reg, uint32_t val);
 
+/* 把模拟器里的32位地址转成可以直接读的指针，只允许访问模拟的堆栈和PE镜像
+@return     NULL        地址不在堆栈和镜像内 */
+uint8_t *x86_emu_mem_ptr(struct x86_emu_mod *mod, uint32_t va, int len);
+/* 和x86_emu_mem_ptr一样，但是返回的地址是用来写的，写时复制的模拟器会先把镜像里的页复制出来 */
+uint8_t *x86_emu_mem_write_ptr(struct x86_emu_mod *mod, uint32_t va, int len);
+/* PE镜像内的指针转成IDA里的地址，不在镜像内返回0 */
+uint32_t x86_emu_ida_addr(struct x86_emu_mod *mod, uint8_t *addr);
+
+/* 模拟器状态的快照: 寄存器、标志位、堆栈上用到的部分(数据、known、污点)和写时复制改过的页，
+可以恢复到同一个镜像的另一个模拟器里。堆栈的虚拟地址跟着快照走，恢复以后指向堆栈的指针
+照样能用，两个模拟器都要开cow
+@return     NULL        failed */
+struct x86_emu_snap *x86_emu_snap(struct x86_emu_mod *mod);
+int x86_emu_restore(struct x86_emu_mod *mod, struct x86_emu_snap *snap);
+void x86_emu_snap_free(struct x86_emu_snap *snap);
+/* 不算eip和指令计数，寄存器、标志位、堆栈上用到的部分、改过的页和污点都一样的状态hash一样 */
+uint64_t x86_emu_state_hash(struct x86_emu_mod *mod);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,59 @@
+﻿
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef __vmp_decoder_test_h__
+#define __vmp_decoder_test_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "pe_loader.h"
+
+// 测试写出来的文件都放在这个目录下，每次运行覆盖
+#define TEST_TMP_DIR                "vmp_decoder_test.tmp"
+
+// 造出来的PE: .text和.vmp0两个段，各TEST_PE_SEC_SIZE字节
+#define TEST_PE_IMAGE_BASE          0x400000
+#define TEST_PE_TEXT_RVA            0x1000
+#define TEST_PE_VMP_RVA             0x3000
+#define TEST_PE_SEC_SIZE            0x1000
+#define TEST_PE_IMAGE_SIZE          0x4000
+
+extern int test_checks;
+extern int test_fails;
+
+// 检查失败时打印位置，接着跑后面的检查
+#define TEST_CHECK(_cond) \
+    do { \
+        test_checks++; \
+        if (!(_cond)) \
+        { \
+            test_fails++; \
+            printf("check(%s) failed. %s:%d\n", #_cond, __FILE__, __LINE__); \
+        } \
+    } while (0)
+
+/* 固定种子的LCG，每次运行的输入都一样 */
+uint32_t test_rand(uint32_t *seed);
+/* TEST_TMP_DIR下的文件名，buf至少260 */
+const char *test_path(char *buf, const char *name);
+/* 在内存里造一个32位PE，两个段都是可执行的代码段，内容是nop
+@text       返回镜像里.text的开头
+@vmp        返回镜像里.vmp0的开头 */
+struct pe_loader *test_pe_create(uint8_t **text, uint8_t **vmp);
+
+void test_trace(void);
+void test_trace_index(void);
+void test_cfg(void);
+void test_cfg_csr(void);
+void test_cfg_dom(void);
+void test_scan(void);
+void test_emu(void);
+void test_vdec(void);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
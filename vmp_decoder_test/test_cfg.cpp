@@ -0,0 +1,316 @@
+﻿#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "x86_emu.h"
+#include "vmp_cfg.h"
+#include "vmp_cfg_csr.h"
+#include "vmp_cfg_dom.h"
+#include "test.h"
+
+    // 节点的id是这里面的地址，cfg本身不读里面的内容
+    static uint8_t test_code[0x200];
+
+    static struct vmp_cfg_node *test_cfg_block(struct vmp_cfg *cfg, int offset, int len)
+    {
+        struct vmp_cfg_node *node = vmp_cfg_node_create(cfg, test_code + offset, 0);
+
+        TEST_CHECK(node != NULL);
+        if (node)
+            TEST_CHECK(!vmp_cfg_add_inst(cfg, node, node->id, len));
+
+        return node;
+    }
+
+    // CSR节点的下标，按节点地址的低32位找
+    static uint32_t test_csr_find(struct vmp_cfg_csr *csr, struct vmp_cfg_node *node)
+    {
+        uint32_t i;
+
+        for (i = 0; i < csr->head->node_counts; i++)
+        {
+            if (csr->nodes[i].addr == (uint32_t)(uintptr_t)node->id)
+                return i;
+        }
+
+        return VMP_CFG_DOM_NONE;
+    }
+
+    static uint64_t test_csr_weight(struct vmp_cfg_csr *csr, uint32_t from, uint32_t to)
+    {
+        uint32_t i;
+
+        for (i = csr->rows[from]; i < csr->rows[from + 1]; i++)
+        {
+            if (csr->edges[i].to == to)
+                return csr->weights[i];
+        }
+
+        return 0;
+    }
+
+    // block变长、边去重、切block以后出边挪到后半部分
+    void test_cfg(void)
+    {
+        struct vmp_cfg *cfg;
+        struct vmp_cfg_node *a, *b, *c, *head = NULL, *tail = NULL;
+
+        cfg = vmp_cfg_create();
+        TEST_CHECK(cfg != NULL);
+        if (!cfg)
+            return;
+
+        a = test_cfg_block(cfg, 0, 2);
+        b = test_cfg_block(cfg, 0x40, 4);
+        c = test_cfg_block(cfg, 0x80, 4);
+        if (!a || !b || !c)
+            goto exit_label;
+
+        TEST_CHECK(!vmp_cfg_add_inst(cfg, a, test_code + 2, 3));
+        TEST_CHECK(vmp_cfg_add_inst(cfg, a, test_code + 10, 1) == -1);
+        TEST_CHECK(!vmp_cfg_add_inst(cfg, a, test_code + 5, 2));
+        TEST_CHECK(a->len == 7);
+
+        TEST_CHECK(vmp_cfg_find(cfg, test_code) == a);
+        TEST_CHECK(vmp_cfg_find(cfg, test_code + 1) == NULL);
+        TEST_CHECK(vmp_cfg_find_contain(cfg, test_code + 6) == a);
+        TEST_CHECK(vmp_cfg_find_contain(cfg, test_code + 7) == NULL);
+        TEST_CHECK(vmp_cfg_find_contain(cfg, test_code + 0x43) == b);
+
+        // 同一条边只留一个，次数累加
+        TEST_CHECK(!vmp_cfg_add_edges(cfg, a, b, X86_JMP));
+        TEST_CHECK(!vmp_cfg_add_edges(cfg, a, b, X86_JMP));
+        TEST_CHECK(!vmp_cfg_add_edges(cfg, a, c, X86_COND_JMP));
+        TEST_CHECK(!vmp_cfg_add_edges(cfg, a, c, X86_COND_JMP));
+        TEST_CHECK(!vmp_cfg_add_edges(cfg, a, c, X86_COND_JMP));
+        TEST_CHECK(cfg->edge_counts == 2);
+        TEST_CHECK((a->jmps.count == 1) && (a->jmps.list->node == b) && (a->jmps.list->counts == 2));
+        TEST_CHECK((a->trues.count == 1) && (a->trues.list->node == c) && (a->trues.list->counts == 3));
+
+        TEST_CHECK(vmp_cfg_seperate(cfg, a, test_code, &head, &tail) == -1);
+        TEST_CHECK(vmp_cfg_seperate(cfg, a, test_code + 7, &head, &tail) == -1);
+
+        TEST_CHECK(!vmp_cfg_seperate(cfg, a, test_code + 2, &head, &tail));
+        TEST_CHECK(head == a);
+        TEST_CHECK(tail && (tail->id == test_code + 2));
+        if (!tail)
+            goto exit_label;
+
+        TEST_CHECK((a->len == 2) && (tail->len == 5));
+        TEST_CHECK(!a->jmps.count && !a->trues.count);
+        TEST_CHECK((a->falls.count == 1) && (a->falls.list->node == tail) && (a->falls.list->counts == 5));
+        TEST_CHECK((tail->jmps.count == 1) && (tail->jmps.list->node == b) && (tail->jmps.list->counts == 2));
+        TEST_CHECK((tail->trues.count == 1) && (tail->trues.list->node == c) && (tail->trues.list->counts == 3));
+        TEST_CHECK(cfg->edge_counts == 3);
+        TEST_CHECK(vmp_cfg_find(cfg, test_code + 2) == tail);
+        TEST_CHECK(vmp_cfg_find_contain(cfg, test_code + 1) == a);
+        TEST_CHECK(vmp_cfg_find_contain(cfg, test_code + 6) == tail);
+
+        // 挪过去的边换了key，再加还是同一条
+        TEST_CHECK(!vmp_cfg_add_edges(cfg, tail, b, X86_JMP));
+        TEST_CHECK(!vmp_cfg_add_fall_edge(cfg, a, tail));
+        TEST_CHECK(cfg->edge_counts == 3);
+        TEST_CHECK((tail->jmps.count == 1) && (tail->jmps.list->counts == 3));
+        TEST_CHECK((a->falls.count == 1) && (a->falls.list->counts == 6));
+
+        vmp_cfg_reset(cfg);
+        TEST_CHECK(!cfg->counts && !cfg->edge_counts);
+        TEST_CHECK(vmp_cfg_find(cfg, test_code) == NULL);
+        TEST_CHECK(vmp_cfg_find_contain(cfg, test_code + 0x41) == NULL);
+
+    exit_label:
+        vmp_cfg_destroy(cfg);
+    }
+
+    // VM的形状: entry -> D，D -> h1..h5，每个handler跳回D，还有一个走不到的节点
+    void test_cfg_csr(void)
+    {
+        struct vmp_cfg *cfg;
+        struct vmp_cfg_node *entry, *d, *h[5], *u;
+        struct vmp_cfg_csr *csr = NULL, *mapped = NULL;
+        char filename[260];
+        uint32_t di, hi, i;
+
+        cfg = vmp_cfg_create();
+        TEST_CHECK(cfg != NULL);
+        if (!cfg)
+            return;
+
+        entry = test_cfg_block(cfg, 0, 4);
+        d = test_cfg_block(cfg, 0x10, 8);
+        for (i = 0; i < 5; i++)
+        {
+            h[i] = test_cfg_block(cfg, 0x20 + i * 0x10, 6);
+        }
+        u = test_cfg_block(cfg, 0xf0, 2);
+
+        vmp_cfg_add_edges(cfg, entry, d, X86_JMP);
+        for (i = 0; i < 5; i++)
+        {
+            for (hi = 0; hi <= i; hi++)
+            {
+                vmp_cfg_add_edges(cfg, d, h[i], X86_JMP);
+                vmp_cfg_add_edges(cfg, h[i], d, X86_JMP);
+            }
+        }
+        vmp_cfg_add_edges(cfg, u, d, X86_JMP);
+
+        csr = vmp_cfg_csr_build(cfg, entry, NULL, NULL);
+        TEST_CHECK(csr != NULL);
+        if (!csr)
+            goto exit_label;
+
+        TEST_CHECK(!memcmp(csr->head->magic, VMP_CFG_CSR_MAGIC, 4));
+        TEST_CHECK(csr->head->node_counts == 8);
+        TEST_CHECK(csr->head->edge_counts == 12);
+        TEST_CHECK(csr->head->reach_counts == 7);
+        TEST_CHECK(test_csr_find(csr, entry) == 0);
+        TEST_CHECK(test_csr_find(csr, u) == 7);
+        TEST_CHECK(!strcmp(vmp_cfg_csr_name(csr, 0), "label1"));
+
+        di = test_csr_find(csr, d);
+        TEST_CHECK(di == 1);
+        if (di != 1)
+            goto exit_label;
+
+        TEST_CHECK((vmp_cfg_csr_out_counts(csr, 0) == 1) && (csr->edges[csr->rows[0]].to == di));
+        TEST_CHECK(csr->edges[csr->rows[0]].kind == VMP_CFG_EDGE_JMP);
+        TEST_CHECK(vmp_cfg_csr_out_counts(csr, di) == 5);
+        TEST_CHECK(csr->nodes[di].len == 8);
+        TEST_CHECK(csr->idom[0] == 0);
+        TEST_CHECK(csr->idom[di] == 0);
+        TEST_CHECK(csr->loop[0] == VMP_CFG_DOM_NONE);
+        TEST_CHECK(csr->loop[di] == VMP_CFG_DOM_NONE);
+        TEST_CHECK(csr->nodes[di].flags & VMP_CFG_CSR_NODE_HEADER);
+        TEST_CHECK(csr->nodes[di].flags & VMP_CFG_CSR_NODE_DISPATCHER);
+        TEST_CHECK(csr->head->dispatcher == di);
+        TEST_CHECK(csr->head->header_counts == 1);
+
+        for (i = 0; i < 5; i++)
+        {
+            hi = test_csr_find(csr, h[i]);
+            TEST_CHECK((hi >= 2) && (hi < 7));
+            if ((hi < 2) || (hi >= 7))
+                continue;
+
+            TEST_CHECK(csr->idom[hi] == di);
+            TEST_CHECK(csr->loop[hi] == di);
+            TEST_CHECK(!(csr->nodes[hi].flags & (VMP_CFG_CSR_NODE_HEADER | VMP_CFG_CSR_NODE_UNREACH)));
+            TEST_CHECK(test_csr_weight(csr, di, hi) == i + 1);
+            TEST_CHECK(test_csr_weight(csr, hi, di) == i + 1);
+        }
+
+        TEST_CHECK(csr->nodes[7].flags & VMP_CFG_CSR_NODE_UNREACH);
+        TEST_CHECK(csr->idom[7] == VMP_CFG_DOM_NONE);
+        TEST_CHECK(csr->loop[7] == VMP_CFG_DOM_NONE);
+
+        // 写出去再映射回来，内容一个字节都不变
+        TEST_CHECK(!vmp_cfg_csr_save(csr, test_path(filename, "cfg.csr")));
+        mapped = vmp_cfg_csr_open(filename);
+        TEST_CHECK(mapped != NULL);
+        if (mapped)
+        {
+            TEST_CHECK(mapped->head->file_size == csr->head->file_size);
+            TEST_CHECK(!memcmp(mapped->base, csr->base, (size_t)csr->head->file_size));
+            TEST_CHECK(mapped->rows[8] == 12);
+            TEST_CHECK(!strcmp(vmp_cfg_csr_name(mapped, di), vmp_cfg_csr_name(csr, di)));
+        }
+
+    exit_label:
+        vmp_cfg_csr_close(mapped);
+        vmp_cfg_csr_close(csr);
+        vmp_cfg_destroy(cfg);
+    }
+
+    // 两层循环: e -> h1 -> h2 -> b，b -> h2是内层回边，b -> l -> h1是外层回边，h1 -> x出循环
+    void test_cfg_dom(void)
+    {
+        struct vmp_cfg *cfg;
+        struct vmp_cfg_node *n[6];
+        struct vmp_cfg_csr *csr = NULL;
+        struct vmp_cfg_dom *dom = NULL;
+        uint32_t e, h1, h2, b, l, x, i;
+
+        cfg = vmp_cfg_create();
+        TEST_CHECK(cfg != NULL);
+        if (!cfg)
+            return;
+
+        for (i = 0; i < 6; i++)
+        {
+            n[i] = test_cfg_block(cfg, i * 0x10, 4);
+        }
+
+        vmp_cfg_add_edges(cfg, n[0], n[1], X86_JMP);
+        vmp_cfg_add_edges(cfg, n[1], n[2], X86_COND_JMP);
+        vmp_cfg_add_edges(cfg, n[1], n[5], X86_JMP);
+        vmp_cfg_add_edges(cfg, n[2], n[3], X86_JMP);
+        vmp_cfg_add_edges(cfg, n[3], n[2], X86_COND_JMP);
+        vmp_cfg_add_edges(cfg, n[3], n[4], X86_JMP);
+        vmp_cfg_add_edges(cfg, n[4], n[1], X86_JMP);
+
+        csr = vmp_cfg_csr_build(cfg, n[0], NULL, NULL);
+        TEST_CHECK(csr != NULL);
+        if (!csr)
+            goto exit_label;
+
+        dom = vmp_cfg_dom_create(csr);
+        TEST_CHECK(dom != NULL);
+        if (!dom)
+            goto exit_label;
+
+        e = test_csr_find(csr, n[0]);
+        h1 = test_csr_find(csr, n[1]);
+        h2 = test_csr_find(csr, n[2]);
+        b = test_csr_find(csr, n[3]);
+        l = test_csr_find(csr, n[4]);
+        x = test_csr_find(csr, n[5]);
+        TEST_CHECK(dom->reach_counts == 6);
+        TEST_CHECK(e == 0);
+
+        TEST_CHECK(dom->idom[e] == e);
+        TEST_CHECK(dom->idom[h1] == e);
+        TEST_CHECK(dom->idom[h2] == h1);
+        TEST_CHECK(dom->idom[b] == h2);
+        TEST_CHECK(dom->idom[l] == b);
+        TEST_CHECK(dom->idom[x] == h1);
+
+        TEST_CHECK(vmp_cfg_dom_dominates(dom, h1, b));
+        TEST_CHECK(vmp_cfg_dom_dominates(dom, e, x));
+        TEST_CHECK(vmp_cfg_dom_dominates(dom, b, b));
+        TEST_CHECK(!vmp_cfg_dom_dominates(dom, b, h1));
+        TEST_CHECK(!vmp_cfg_dom_dominates(dom, h2, x));
+
+        TEST_CHECK(vmp_cfg_dom_is_header(dom, h1) && vmp_cfg_dom_is_header(dom, h2));
+        TEST_CHECK(!vmp_cfg_dom_is_header(dom, b) && !vmp_cfg_dom_is_header(dom, e));
+        TEST_CHECK((dom->latches[h1] == 1) && (dom->latches[h2] == 1));
+        TEST_CHECK(dom->header_counts == 2);
+        // 回边太少，不当成dispatcher
+        TEST_CHECK(dom->dispatcher == VMP_CFG_DOM_NONE);
+
+        TEST_CHECK(dom->loop[e] == VMP_CFG_DOM_NONE);
+        TEST_CHECK(dom->loop[x] == VMP_CFG_DOM_NONE);
+        TEST_CHECK(dom->loop[h1] == VMP_CFG_DOM_NONE);
+        TEST_CHECK(dom->loop[h2] == h1);
+        TEST_CHECK(dom->loop[b] == h2);
+        TEST_CHECK(dom->loop[l] == h1);
+        TEST_CHECK((dom->loop_depth[e] == 0) && (dom->loop_depth[x] == 0));
+        TEST_CHECK((dom->loop_depth[h1] == 1) && (dom->loop_depth[l] == 1));
+        TEST_CHECK((dom->loop_depth[h2] == 2) && (dom->loop_depth[b] == 2));
+
+        TEST_CHECK(!memcmp(csr->loop, dom->loop, 6 * sizeof (uint32_t)));
+        TEST_CHECK(csr->head->header_counts == 2);
+        TEST_CHECK(csr->head->dispatcher == VMP_CFG_DOM_NONE);
+
+    exit_label:
+        vmp_cfg_dom_destroy(dom);
+        vmp_cfg_csr_close(csr);
+        vmp_cfg_destroy(cfg);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,307 @@
+﻿#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "x86_emu.h"
+#include "vmp_vdec.h"
+#include "mbytes.h"
+#include "test.h"
+
+    static struct x86_emu_mod *test_emu_create(struct pe_loader *pe)
+    {
+        struct x86_emu_create_param param;
+        struct x86_emu_mod *mod;
+
+        memset(&param, 0, sizeof (param));
+        param.word_size = 32;
+        param.pe_mod = pe;
+        param.cow = 1;
+        param.quiet = 1;
+
+        mod = x86_emu_create(&param);
+        TEST_CHECK(mod != NULL);
+
+        return mod;
+    }
+
+    static int test_emu_exec(struct x86_emu_mod *mod, const uint8_t *code, int len)
+    {
+        x86_emu_flow_analysis_t *analy;
+
+        return x86_emu_run(mod, (uint8_t *)code, len, &analy);
+    }
+
+    static uint32_t test_emu_read(struct x86_emu_mod *mod, uint32_t va)
+    {
+        uint8_t *p = x86_emu_mem_ptr(mod, va, 4);
+
+        return p ? mbytes_read_int_little_endian_4b(p) : 0;
+    }
+
+    static int test_emu_regs_equal(struct x86_emu_mod *a, struct x86_emu_mod *b)
+    {
+        struct x86_emu_reg *x = &a->eax, *y = &b->eax;
+        int i;
+
+        for (i = 0; i < 8; i++)
+        {
+            if ((x[i].u.r32 != y[i].u.r32) || (x[i].known != y[i].known))
+                return 0;
+        }
+
+        return (a->eflags.eflags == b->eflags.eflags) && (a->eflags.known == b->eflags.known);
+    }
+
+    // 写时复制、快照、状态hash: 两个模拟器共用一个PE镜像
+    void test_emu(void)
+    {
+        static const uint8_t push_eax[] = { 0x50 };
+        static const uint8_t push_imm[] = { 0x68, 0x78, 0x56, 0x34, 0x12 };
+        static const uint8_t push_ebx[] = { 0x53 };
+        static const uint8_t mov_ecx_eax[] = { 0x89, 0x01 };
+        struct pe_loader *pe;
+        struct x86_emu_mod *emu1 = NULL, *emu2 = NULL;
+        struct x86_emu_snap *snap = NULL;
+        uint8_t *text, *vmp, *p;
+        uint32_t va, vmp_va, esp;
+        uint64_t hash, hash2;
+
+        pe = test_pe_create(&text, &vmp);
+        TEST_CHECK(pe != NULL);
+        if (!pe)
+            return;
+
+        emu1 = test_emu_create(pe);
+        emu2 = test_emu_create(pe);
+        if (!emu1 || !emu2)
+            goto exit_label;
+
+        // 模拟器里的地址是指针的低32位
+        va = (uint32_t)(uintptr_t)(text + 0x10);
+        vmp_va = (uint32_t)(uintptr_t)vmp;
+
+        // 没写过的页直接读共用的镜像
+        TEST_CHECK(x86_emu_mem_ptr(emu1, va, 4) == text + 0x10);
+        p = x86_emu_mem_write_ptr(emu1, va, 4);
+        TEST_CHECK(p && (p != text + 0x10));
+        if (!p)
+            goto exit_label;
+        mbytes_write_int_little_endian_4b(p, 0xdeadbeef);
+        TEST_CHECK(test_emu_read(emu1, va) == 0xdeadbeef);
+        TEST_CHECK(mbytes_read_int_little_endian_4b(text + 0x10) == 0x90909090);
+        TEST_CHECK(x86_emu_mem_ptr(emu2, va, 4) == text + 0x10);
+
+        // 模拟的指令写镜像也一样
+        x86_emu_set(emu2, OPERAND_TYPE_REG_EAX, 0x11223344);
+        x86_emu_set(emu2, OPERAND_TYPE_REG_ECX, va + 4);
+        TEST_CHECK(test_emu_exec(emu2, mov_ecx_eax, sizeof (mov_ecx_eax)) >= 0);
+        TEST_CHECK(test_emu_read(emu2, va + 4) == 0x11223344);
+        TEST_CHECK(test_emu_read(emu1, va + 4) == 0x90909090);
+        TEST_CHECK(mbytes_read_int_little_endian_4b(text + 0x14) == 0x90909090);
+
+        // 快照: 寄存器、堆栈、改过的页
+        x86_emu_set(emu1, OPERAND_TYPE_REG_EAX, 0xcafe0001);
+        TEST_CHECK(test_emu_exec(emu1, push_eax, sizeof (push_eax)) >= 0);
+        TEST_CHECK(test_emu_exec(emu1, push_imm, sizeof (push_imm)) >= 0);
+        esp = emu1->esp.u.r32;
+        TEST_CHECK(test_emu_read(emu1, esp) == 0x12345678);
+        TEST_CHECK(test_emu_read(emu1, esp + 4) == 0xcafe0001);
+
+        hash = x86_emu_state_hash(emu1);
+        TEST_CHECK(hash == x86_emu_state_hash(emu1));
+        snap = x86_emu_snap(emu1);
+        TEST_CHECK(snap != NULL);
+        if (!snap)
+            goto exit_label;
+
+        // 改寄存器、压栈、再写一页，hash都要变
+        x86_emu_set(emu1, OPERAND_TYPE_REG_ECX, 0x55);
+        hash2 = x86_emu_state_hash(emu1);
+        TEST_CHECK(hash2 != hash);
+        TEST_CHECK(test_emu_exec(emu1, push_ebx, sizeof (push_ebx)) >= 0);
+        TEST_CHECK(x86_emu_state_hash(emu1) != hash2);
+        hash2 = x86_emu_state_hash(emu1);
+        p = x86_emu_mem_write_ptr(emu1, vmp_va, 4);
+        TEST_CHECK(p != NULL);
+        if (p)
+            mbytes_write_int_little_endian_4b(p, 0x01020304);
+        TEST_CHECK(x86_emu_state_hash(emu1) != hash2);
+
+        // 还原到自己身上
+        TEST_CHECK(!x86_emu_restore(emu1, snap));
+        TEST_CHECK(x86_emu_state_hash(emu1) == hash);
+        TEST_CHECK(emu1->eax.u.r32 == 0xcafe0001);
+        TEST_CHECK(emu1->esp.u.r32 == esp);
+        TEST_CHECK(test_emu_read(emu1, va) == 0xdeadbeef);
+        TEST_CHECK(test_emu_read(emu1, vmp_va) == 0x90909090);
+        TEST_CHECK(mbytes_read_int_little_endian_4b(vmp) == 0x90909090);
+
+        // 还原到另一个模拟器上，它自己写过的页要回到镜像里的内容
+        TEST_CHECK(!x86_emu_restore(emu2, snap));
+        TEST_CHECK(x86_emu_state_hash(emu2) == hash);
+        TEST_CHECK(test_emu_regs_equal(emu1, emu2));
+        TEST_CHECK(emu2->esp.u.r32 == esp);
+        TEST_CHECK(test_emu_read(emu2, esp) == 0x12345678);
+        TEST_CHECK(test_emu_read(emu2, esp + 4) == 0xcafe0001);
+        TEST_CHECK(test_emu_read(emu2, va) == 0xdeadbeef);
+        TEST_CHECK(test_emu_read(emu2, va + 4) == 0x90909090);
+
+        // 两边接着跑同样的指令，状态还是一样
+        TEST_CHECK(test_emu_exec(emu1, push_ebx, sizeof (push_ebx)) >= 0);
+        TEST_CHECK(test_emu_exec(emu2, push_ebx, sizeof (push_ebx)) >= 0);
+        TEST_CHECK(x86_emu_state_hash(emu1) == x86_emu_state_hash(emu2));
+        TEST_CHECK(x86_emu_state_hash(emu1) != hash);
+
+    exit_label:
+        x86_emu_snap_free(snap);
+        if (emu1)
+            x86_emu_destroy(emu1);
+        if (emu2)
+            x86_emu_destroy(emu2);
+        pe_loader_destroy(pe);
+    }
+
+    // 一条解密链，和模拟器里跑的等价的指令，操作数在eax(al)里，密钥在ebx(bl)里
+    struct test_vdec_chain
+    {
+        int operand_size;
+        int step_counts;
+        struct vmp_hlib_step steps[6];
+        int lens[6];
+        uint8_t code[32];
+    };
+
+#define TEST_STEP(_op, _dst, _src, _width, _imm)    { _op, VMP_HLIB_DST_##_dst, VMP_HLIB_SRC_##_src, _width, 0, 0, _imm }
+
+    static struct test_vdec_chain test_vdec_chains[] = {
+        {
+            4, 5,
+            {
+                TEST_STEP(VMP_HLIB_OP_XOR, OPERAND, KEY, 4, 0),         // xor eax, ebx
+                TEST_STEP(VMP_HLIB_OP_ADD, OPERAND, IMM, 4, 0x12345678),// add eax, 12345678h
+                TEST_STEP(VMP_HLIB_OP_ROL, OPERAND, IMM, 4, 3),         // rol eax, 3
+                TEST_STEP(VMP_HLIB_OP_BSWAP, OPERAND, NONE, 4, 0),      // bswap eax
+                TEST_STEP(VMP_HLIB_OP_XOR, KEY, OPERAND, 4, 0),         // xor ebx, eax
+            },
+            { 2, 5, 3, 2, 2 },
+            { 0x33, 0xc3, 0x05, 0x78, 0x56, 0x34, 0x12, 0xc1, 0xc0, 0x03, 0x0f, 0xc8, 0x33, 0xd8 },
+        },
+        {
+            4, 6,
+            {
+                TEST_STEP(VMP_HLIB_OP_SUB, OPERAND, IMM, 4, 0x7f00ff01),// sub eax, 7f00ff01h
+                TEST_STEP(VMP_HLIB_OP_ROR, OPERAND, IMM, 4, 11),        // ror eax, 11
+                TEST_STEP(VMP_HLIB_OP_NEG, OPERAND, NONE, 4, 0),        // neg eax
+                TEST_STEP(VMP_HLIB_OP_DEC, OPERAND, NONE, 4, 0),        // dec eax
+                TEST_STEP(VMP_HLIB_OP_NOT, OPERAND, NONE, 4, 0),        // not eax
+                TEST_STEP(VMP_HLIB_OP_ADD, KEY, OPERAND, 4, 0),         // add ebx, eax
+            },
+            { 5, 3, 2, 1, 2, 2 },
+            { 0x2d, 0x01, 0xff, 0x00, 0x7f, 0xc1, 0xc8, 0x0b, 0xf7, 0xd8, 0x48, 0xf7, 0xd0, 0x03, 0xd8 },
+        },
+        {
+            1, 6,
+            {
+                TEST_STEP(VMP_HLIB_OP_XOR, OPERAND, KEY, 1, 0),         // xor al, bl
+                TEST_STEP(VMP_HLIB_OP_ADD, OPERAND, IMM, 1, 0x9d),      // add al, 9dh
+                TEST_STEP(VMP_HLIB_OP_ROL, OPERAND, IMM, 1, 5),         // rol al, 5
+                TEST_STEP(VMP_HLIB_OP_INC, OPERAND, NONE, 1, 0),        // inc al
+                TEST_STEP(VMP_HLIB_OP_NOT, OPERAND, NONE, 1, 0),        // not al
+                TEST_STEP(VMP_HLIB_OP_XOR, KEY, OPERAND, 1, 0),         // xor bl, al
+            },
+            { 2, 2, 3, 2, 2, 2 },
+            { 0x32, 0xc3, 0x04, 0x9d, 0xc0, 0xc0, 0x05, 0xfe, 0xc0, 0xf6, 0xd0, 0x32, 0xd8 },
+        },
+    };
+
+    // 解密链直接算出来的操作数和密钥，要和模拟器跑一遍的结果一样
+    void test_vdec(void)
+    {
+        struct test_vdec_chain *chain;
+        struct vmp_hlib_entry entry;
+        struct vmp_vdec dec;
+        struct pe_loader *pe;
+        struct x86_emu_mod *emu = NULL;
+        uint8_t *text, *vmp, *code;
+        uint32_t seed = 11, raw, key, out, mask;
+        int i, j, k, mismatch;
+
+        pe = test_pe_create(&text, &vmp);
+        TEST_CHECK(pe != NULL);
+        if (!pe)
+            return;
+
+        emu = test_emu_create(pe);
+        if (!emu)
+            goto exit_label;
+
+        for (i = 0; i < (int)(sizeof (test_vdec_chains) / sizeof (test_vdec_chains[0])); i++)
+        {
+            chain = test_vdec_chains + i;
+
+            memset(&entry, 0, sizeof (entry));
+            entry.operand_size = chain->operand_size;
+            entry.step_counts = chain->step_counts;
+            memcpy(entry.steps, chain->steps, chain->step_counts * sizeof (entry.steps[0]));
+            TEST_CHECK(!vmp_vdec_compile(&dec, &entry));
+            TEST_CHECK(dec.state == VMP_VDEC_VERIFY);
+            TEST_CHECK(dec.updates_key);
+            TEST_CHECK(dec.width == chain->operand_size);
+
+            mask = (chain->operand_size == 4) ? 0xffffffff : 0xff;
+            for (j = mismatch = 0; (j < 1000) && !mismatch; j++)
+            {
+                raw = test_rand(&seed) ^ (test_rand(&seed) << 16);
+                key = test_rand(&seed) ^ (test_rand(&seed) << 16);
+
+                x86_emu_set(emu, OPERAND_TYPE_REG_EAX, raw);
+                x86_emu_set(emu, OPERAND_TYPE_REG_EBX, key);
+                for (k = 0, code = chain->code; k < chain->step_counts; code += chain->lens[k], k++)
+                {
+                    if (test_emu_exec(emu, code, chain->lens[k]) < 0)
+                    {
+                        mismatch = 1;
+                        break;
+                    }
+                }
+
+                out = vmp_vdec_run(&dec, raw, &key);
+                if (((emu->eax.u.r32 & mask) != out) || (emu->ebx.u.r32 != key))
+                {
+                    printf("chain[%d] raw[%08x] emu[%08x, %08x] vdec[%08x, %08x]\n",
+                        i, raw, emu->eax.u.r32 & mask, emu->ebx.u.r32, out, key);
+                    mismatch = 1;
+                }
+            }
+            TEST_CHECK(!mismatch);
+        }
+
+        // 16位的bswap结果是未定义的，不编译
+        memset(&entry, 0, sizeof (entry));
+        entry.operand_size = 2;
+        entry.step_counts = 1;
+        entry.steps[0].op = VMP_HLIB_OP_BSWAP;
+        entry.steps[0].width = 2;
+        TEST_CHECK(vmp_vdec_compile(&dec, &entry) == -1);
+
+        // 没用到密钥的链，key可以传NULL
+        entry.operand_size = 2;
+        entry.steps[0].op = VMP_HLIB_OP_XOR;
+        entry.steps[0].src = VMP_HLIB_SRC_IMM;
+        entry.steps[0].imm = 0x1234;
+        TEST_CHECK(!vmp_vdec_compile(&dec, &entry));
+        TEST_CHECK(!dec.keyed && !dec.updates_key);
+        TEST_CHECK(vmp_vdec_run(&dec, 0xffff5678, NULL) == (0x5678 ^ 0x1234));
+
+    exit_label:
+        if (emu)
+            x86_emu_destroy(emu);
+        pe_loader_destroy(pe);
+    }
+
+#ifdef __cplusplus
+}
+#endif
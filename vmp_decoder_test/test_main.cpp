@@ -0,0 +1,137 @@
+﻿#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xed/xed-interface.h"
+#include "test.h"
+
+    int test_checks = 0;
+    int test_fails = 0;
+
+    uint32_t test_rand(uint32_t *seed)
+    {
+        *seed = *seed * 1103515245 + 12345;
+
+        return *seed >> 8;
+    }
+
+    const char *test_path(char *buf, const char *name)
+    {
+        sprintf(buf, "%s\\%s", TEST_TMP_DIR, name);
+
+        return buf;
+    }
+
+    struct pe_loader *test_pe_create(uint8_t **text, uint8_t **vmp)
+    {
+        static const char *names[2] = { ".text", ".vmp0" };
+        static const DWORD rvas[2] = { TEST_PE_TEXT_RVA, TEST_PE_VMP_RVA };
+        PIMAGE_DOS_HEADER pdos_header;
+        PIMAGE_NT_HEADERS32 pnt_headder;
+        PIMAGE_SECTION_HEADER psec_header;
+        struct pe_loader *pe;
+        uint8_t *data;
+        int i, size = 0x400 + 2 * TEST_PE_SEC_SIZE;
+
+        data = (uint8_t *)calloc(1, size);
+        if (!data)
+        {
+            printf("test_pe_create() failed with calloc(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        pdos_header = (PIMAGE_DOS_HEADER)data;
+        pdos_header->e_magic = IMAGE_DOS_SIGNATURE;
+        pdos_header->e_lfanew = 0x80;
+
+        pnt_headder = (PIMAGE_NT_HEADERS32)(data + pdos_header->e_lfanew);
+        pnt_headder->Signature = IMAGE_NT_SIGNATURE;
+        pnt_headder->FileHeader.Machine = IMAGE_FILE_MACHINE_I386;
+        pnt_headder->FileHeader.NumberOfSections = 2;
+        pnt_headder->FileHeader.SizeOfOptionalHeader = sizeof (IMAGE_OPTIONAL_HEADER32);
+        pnt_headder->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
+        pnt_headder->OptionalHeader.ImageBase = TEST_PE_IMAGE_BASE;
+        pnt_headder->OptionalHeader.SectionAlignment = 0x1000;
+        pnt_headder->OptionalHeader.FileAlignment = 0x200;
+        pnt_headder->OptionalHeader.SizeOfImage = TEST_PE_IMAGE_SIZE;
+        pnt_headder->OptionalHeader.SizeOfHeaders = 0x400;
+
+        psec_header = (PIMAGE_SECTION_HEADER)(pnt_headder + 1);
+        for (i = 0; i < 2; i++)
+        {
+            memcpy(psec_header[i].Name, names[i], strlen(names[i]));
+            psec_header[i].VirtualAddress = rvas[i];
+            psec_header[i].Misc.VirtualSize = TEST_PE_SEC_SIZE;
+            psec_header[i].PointerToRawData = 0x400 + i * TEST_PE_SEC_SIZE;
+            psec_header[i].SizeOfRawData = TEST_PE_SEC_SIZE;
+            psec_header[i].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+            memset(data + psec_header[i].PointerToRawData, 0x90, TEST_PE_SEC_SIZE);
+        }
+
+        pe = pe_loader_create_mem(data, size);
+        free(data);
+        if (!pe)
+        {
+            printf("test_pe_create() failed with pe_loader_create_mem(). %s:%d\n", __FILE__, __LINE__);
+            return NULL;
+        }
+
+        *text = pe->image_base + TEST_PE_TEXT_RVA;
+        *vmp = pe->image_base + TEST_PE_VMP_RVA;
+
+        return pe;
+    }
+
+    static struct test_case
+    {
+        const char *name;
+        void (*run)(void);
+    } test_cases[] = {
+        { "trace", test_trace },
+        { "trace_index", test_trace_index },
+        { "cfg", test_cfg },
+        { "cfg_csr", test_cfg_csr },
+        { "cfg_dom", test_cfg_dom },
+        { "scan", test_scan },
+        { "emu", test_emu },
+        { "vdec", test_vdec },
+        { NULL, NULL }
+    };
+
+    // 不带参数跑全部，否则只跑名字对得上的
+    int main(int argc, char **argv)
+    {
+        struct test_case *test;
+        int i, fails, runs = 0;
+
+        xed_tables_init();
+        CreateDirectory(TEST_TMP_DIR, NULL);
+
+        for (test = test_cases; test->name; test++)
+        {
+            for (i = 1; i < argc; i++)
+            {
+                if (!strcmp(argv[i], test->name))
+                    break;
+            }
+            if ((argc > 1) && (i == argc))
+                continue;
+
+            fails = test_fails;
+            test->run();
+            runs++;
+            printf("[%s] %s\n", (test_fails == fails) ? " ok " : "FAIL", test->name);
+        }
+
+        printf("tests[%d] checks[%d] fails[%d]\n", runs, test_checks, test_fails);
+
+        return test_fails ? 1 : 0;
+    }
+
+#ifdef __cplusplus
+}
+#endif
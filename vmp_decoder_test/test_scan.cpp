@@ -0,0 +1,134 @@
+﻿#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_scan.h"
+#include "mbytes.h"
+#include "test.h"
+
+    // 一个字节一个字节的参考实现，vmp段里全是nop，目标后面放得下VMP_SCAN_VERIFY_INSTS条nop才算
+    static int test_scan_ref(uint8_t *image_base, uint8_t *text, uint8_t *vmp, struct vmp_scan_entry *entries, int size)
+    {
+        uint8_t *p, *call, *target, *end = text + TEST_PE_SEC_SIZE;
+        int counts = 0, kind;
+
+        for (p = text; p < end; p++)
+        {
+            if ((p[0] == 0xe9) && (p + 5 <= end))
+            {
+                kind = VMP_SCAN_JMP;
+                call = p;
+            }
+            else if ((p[0] == 0x68) && (p + 10 <= end) && (p[5] == 0xe8))
+            {
+                kind = VMP_SCAN_PUSH_CALL;
+                call = p + 5;
+            }
+            else
+            {
+                continue;
+            }
+
+            target = call + 5 + (int32_t)mbytes_read_int_little_endian_4b(call + 1);
+            if ((target < vmp) || (target + VMP_SCAN_VERIFY_INSTS > vmp + TEST_PE_SEC_SIZE) || (counts >= size))
+                continue;
+
+            entries[counts].addr = TEST_PE_IMAGE_BASE + (uint32_t)(p - image_base);
+            entries[counts].target = TEST_PE_IMAGE_BASE + (uint32_t)(target - image_base);
+            entries[counts].imm = (kind == VMP_SCAN_PUSH_CALL) ? mbytes_read_int_little_endian_4b(p + 1) : 0;
+            entries[counts].kind = kind;
+            counts++;
+        }
+
+        return counts;
+    }
+
+    // 在p处放一个入口桩，跳到target
+    static void test_scan_plant(uint8_t *p, uint8_t *target, int kind, uint32_t imm)
+    {
+        if (kind == VMP_SCAN_PUSH_CALL)
+        {
+            p[0] = 0x68;
+            mbytes_write_int_little_endian_4b(p + 1, imm);
+            p += 5;
+        }
+
+        p[0] = (kind == VMP_SCAN_PUSH_CALL) ? 0xe8 : 0xe9;
+        mbytes_write_int_little_endian_4b(p + 1, (uint32_t)(target - (p + 5)));
+    }
+
+    // 随机放的桩跨过16字节的边界，也落在最后不满16字节的尾巴里，目标有的在vmp段里，
+    // 有的在vmp段末尾放不下几条指令，有的不在vmp段里，SSE2的扫描要和逐字节的结果一样
+    void test_scan(void)
+    {
+        struct pe_loader *pe;
+        struct vmp_scan_param param;
+        struct vmp_scan_entry *entries = NULL, ref[512];
+        uint8_t *text, *vmp, *target;
+        uint32_t seed = 3, r = 0;
+        int i, counts = 0, ref_counts, off, kind;
+
+        pe = test_pe_create(&text, &vmp);
+        TEST_CHECK(pe != NULL);
+        if (!pe)
+            return;
+
+        for (off = 0; off + 64 < TEST_PE_SEC_SIZE; off += 12 + r % 20)
+        {
+            r = test_rand(&seed);
+            kind = (r & 1) ? VMP_SCAN_PUSH_CALL : VMP_SCAN_JMP;
+            switch ((r >> 1) % 4)
+            {
+            case 0:     target = vmp + TEST_PE_SEC_SIZE - 2; break;
+            case 1:     target = text + (r >> 4) % TEST_PE_SEC_SIZE; break;
+            default:    target = vmp + (r >> 4) % (TEST_PE_SEC_SIZE - 16); break;
+            }
+            test_scan_plant(text + off, target, kind, test_rand(&seed));
+        }
+
+        // 段尾: 跨进最后16字节的push call，正好放得下的jmp，后面放不下call的push
+        test_scan_plant(text + TEST_PE_SEC_SIZE - 26, vmp, VMP_SCAN_PUSH_CALL, 0x1234);
+        test_scan_plant(text + TEST_PE_SEC_SIZE - 5, vmp + 0x100, VMP_SCAN_JMP, 0);
+        text[TEST_PE_SEC_SIZE - 9] = 0x68;
+
+        // vmp段自己不扫，放在随机目标够不着的地方，不影响目标的确认
+        test_scan_plant(vmp + TEST_PE_SEC_SIZE - 10, vmp, VMP_SCAN_JMP, 0);
+
+        memset(&param, 0, sizeof (param));
+        param.pe = pe;
+        param.sec_counts = 1;
+        param.sec_start[0] = vmp;
+        param.sec_size[0] = TEST_PE_SEC_SIZE;
+
+        TEST_CHECK(!vmp_scan_entries(&param, &entries, &counts));
+        ref_counts = test_scan_ref(pe->image_base, text, vmp, ref, 512);
+        TEST_CHECK(ref_counts > 20);
+        TEST_CHECK(counts == ref_counts);
+
+        for (i = 0; (i < counts) && (i < ref_counts); i++)
+        {
+            if ((entries[i].addr != ref[i].addr) || (entries[i].target != ref[i].target)
+                || (entries[i].imm != ref[i].imm) || (entries[i].kind != ref[i].kind))
+            {
+                printf("entry[%d] %x -> %x, expect %x -> %x\n", i, entries[i].addr, entries[i].target, ref[i].addr, ref[i].target);
+                TEST_CHECK(0);
+                break;
+            }
+            TEST_CHECK(!i || (entries[i - 1].addr < entries[i].addr));
+        }
+
+        TEST_CHECK((counts > 0) && (entries[counts - 1].addr == TEST_PE_IMAGE_BASE + TEST_PE_TEXT_RVA + TEST_PE_SEC_SIZE - 5));
+        TEST_CHECK((counts > 0) && (entries[counts - 1].target == TEST_PE_IMAGE_BASE + TEST_PE_VMP_RVA + 0x100));
+        TEST_CHECK((counts > 1) && (entries[counts - 2].addr == TEST_PE_IMAGE_BASE + TEST_PE_TEXT_RVA + TEST_PE_SEC_SIZE - 26));
+        TEST_CHECK((counts > 1) && (entries[counts - 2].imm == 0x1234));
+
+        free(entries);
+        pe_loader_destroy(pe);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,358 @@
+﻿#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmp_trace.h"
+#include "vmp_trace_index.h"
+#include "mbytes.h"
+#include "test.h"
+
+#define TEST_TRACE_RECORDS          1000
+#define TEST_TRACE_KEYFRAME         16
+
+#define TEST_INDEX_RECORDS          5000
+#define TEST_INDEX_KEYFRAME         100
+#define TEST_INDEX_ADDRS            50
+
+    static uint8_t *test_read_file(const char *filename, long *size)
+    {
+        FILE *fp = fopen(filename, "rb");
+        uint8_t *buf = NULL;
+
+        *size = 0;
+        if (!fp)
+            return NULL;
+
+        fseek(fp, 0, SEEK_END);
+        *size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        buf = (uint8_t *)malloc(*size + 1);
+        if (buf && (fread(buf, 1, *size, fp) != (size_t)*size))
+        {
+            free(buf);
+            buf = NULL;
+        }
+        fclose(fp);
+
+        return buf;
+    }
+
+    // 差分模式: 每条记录随机改几个字段，读回来的快照要和写进去的一样，关键帧的位置要对
+    static void test_trace_delta(void)
+    {
+        struct vmp_trace_param param = { 0 };
+        struct vmp_trace *trace;
+        struct vmp_trace_reader reader;
+        struct vmp_trace_record rec;
+        struct vmp_trace_regs regs, *all;
+        char filename[260];
+        uint32_t seed = 1, r;
+        int i, n, ret, keyframes = 0;
+
+        all = (struct vmp_trace_regs *)calloc(TEST_TRACE_RECORDS, sizeof (all[0]));
+        TEST_CHECK(all != NULL);
+        if (!all)
+            return;
+
+        param.mode = VMP_TRACE_MODE_DELTA;
+        param.fmt = VMP_TRACE_FMT_BIN;
+        param.keyframe = TEST_TRACE_KEYFRAME;
+        param.filename = test_path(filename, "delta.trace");
+        trace = vmp_trace_create(&param);
+        TEST_CHECK(trace != NULL);
+        if (!trace)
+            goto exit_label;
+
+        memset(&regs, 0, sizeof (regs));
+        for (i = 0; i < TEST_TRACE_RECORDS; i++)
+        {
+            r = test_rand(&seed);
+            regs.eip += 1 + r % 5;
+            regs.inst_addr = regs.eip;
+            regs.val[r % 8] = test_rand(&seed);
+            regs.known[(r >> 3) % 8] ^= 0xff << ((r >> 6) % 4 * 8);
+            if (r & 0x1000)
+                regs.eflags ^= 1 << ((r >> 13) % 12);
+            regs.access_addr = (r & 0x20000) ? test_rand(&seed) : 0;
+            regs.stack_depth = (r >> 18) % 64;
+            all[i] = regs;
+            TEST_CHECK(!vmp_trace_regs(trace, i + 1, &regs));
+        }
+        vmp_trace_destroy(trace);
+
+        TEST_CHECK(!vmp_trace_reader_open(&reader, filename));
+        for (n = 0; (ret = vmp_trace_reader_next(&reader, &rec)) == 1; n++)
+        {
+            if ((n >= TEST_TRACE_RECORDS) || (rec.count != (uint64_t)n + 1)
+                || memcmp(&rec.regs, all + n, sizeof (rec.regs)))
+                break;
+
+            if (rec.tag == VMP_TRACE_TAG_KEYFRAME)
+            {
+                TEST_CHECK(n % TEST_TRACE_KEYFRAME == 0);
+                keyframes++;
+            }
+            else
+            {
+                TEST_CHECK(rec.tag == VMP_TRACE_TAG_DELTA);
+            }
+        }
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(n == TEST_TRACE_RECORDS);
+        TEST_CHECK(keyframes == (TEST_TRACE_RECORDS + TEST_TRACE_KEYFRAME - 1) / TEST_TRACE_KEYFRAME);
+        vmp_trace_reader_close(&reader);
+
+    exit_label:
+        free(all);
+    }
+
+    // block模式: 三个block轮流执行，每个block只在第一次执行时进字典，出口的寄存器和指令序号要对得上
+    static void test_trace_block(void)
+    {
+        struct vmp_trace_param param = { 0 };
+        struct vmp_trace *trace;
+        struct vmp_trace_reader reader;
+        struct vmp_trace_record rec;
+        struct vmp_trace_regs regs;
+        char filename[260];
+        uint8_t code[2] = { 0x8b, 0xc8 };
+        uint64_t count = 0, block_end = 0;
+        int ids[3] = { 0 }, i, j, b, first, ret, defs = 0, execs = 0, exits = 0;
+
+        param.mode = VMP_TRACE_MODE_BLOCK;
+        param.fmt = VMP_TRACE_FMT_BIN;
+        param.keyframe = 3;
+        param.filename = test_path(filename, "block.trace");
+        param.block_regs = 1;
+        trace = vmp_trace_create(&param);
+        TEST_CHECK(trace != NULL);
+        if (!trace)
+            return;
+
+        memset(&regs, 0, sizeof (regs));
+        for (i = 0; i < 10; i++)
+        {
+            b = i % 3;
+            first = vmp_trace_block_enter(trace, &ids[b], 0x401000 + b * 0x10);
+            TEST_CHECK(first == (i < 3));
+            for (j = 0; j <= b; j++)
+            {
+                if (first)
+                    vmp_trace_block_inst(trace, 0x401000 + b * 0x10 + j * 2, code, 2, "mov ecx, eax");
+                count++;
+                regs.val[1] = (uint32_t)count * 7;
+                regs.inst_addr = 0x401000 + b * 0x10 + j * 2;
+                vmp_trace_regs(trace, count, &regs);
+            }
+            vmp_trace_block_leave(trace);
+        }
+        vmp_trace_destroy(trace);
+        TEST_CHECK((ids[0] == 1) && (ids[1] == 2) && (ids[2] == 3));
+
+        TEST_CHECK(!vmp_trace_reader_open(&reader, filename));
+        while ((ret = vmp_trace_reader_next(&reader, &rec)) == 1)
+        {
+            switch (rec.tag)
+            {
+            case VMP_TRACE_TAG_BLOCK_DEF:
+                defs++;
+                TEST_CHECK(rec.block && (rec.block->addr == 0x401000 + (uint32_t)(rec.block_id - 1) * 0x10));
+                TEST_CHECK(rec.block && (rec.block->insts == rec.block_id));
+                break;
+
+            case VMP_TRACE_TAG_BLOCK:
+                execs++;
+                block_end = rec.count;
+                break;
+
+            default:
+                // 出口的寄存器跟在block后面，序号就是block最后一条指令
+                exits++;
+                TEST_CHECK((rec.tag == VMP_TRACE_TAG_KEYFRAME) || (rec.tag == VMP_TRACE_TAG_BLOCK_EXIT));
+                TEST_CHECK(rec.count == block_end);
+                TEST_CHECK(rec.regs.val[1] == (uint32_t)rec.count * 7);
+                break;
+            }
+        }
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(defs == 3);
+        TEST_CHECK(execs == 10);
+        TEST_CHECK(exits == 10);
+        TEST_CHECK(block_end == count);
+        vmp_trace_reader_close(&reader);
+    }
+
+    // VM模式: 定长的事件原样读回来，指令序号按x86_insts累加
+    static void test_trace_vm(void)
+    {
+        struct vmp_trace_param param = { 0 };
+        struct vmp_trace *trace;
+        struct vmp_trace_reader reader;
+        struct vmp_trace_record rec;
+        struct vmp_trace_vm_event ev[100];
+        char filename[260];
+        uint32_t seed = 7;
+        uint64_t count = 0;
+        int i, n, ret;
+
+        param.mode = VMP_TRACE_MODE_VM;
+        param.fmt = VMP_TRACE_FMT_BIN;
+        param.filename = test_path(filename, "vm.trace");
+        trace = vmp_trace_create(&param);
+        TEST_CHECK(trace != NULL);
+        if (!trace)
+            return;
+
+        memset(ev, 0, sizeof (ev));
+        for (i = 0; i < 100; i++)
+        {
+            ev[i].seq = i + 1;
+            ev[i].handler = 0x403000 + (test_rand(&seed) % 9) * 0x20;
+            ev[i].vip = 0x405000 + i * 3;
+            ev[i].operand = test_rand(&seed);
+            ev[i].vsp_top = test_rand(&seed);
+            ev[i].vip_delta = (int16_t)(test_rand(&seed) % 9) - 4;
+            ev[i].vsp_delta = (int16_t)(test_rand(&seed) % 9) - 4;
+            ev[i].x86_insts = 5 + test_rand(&seed) % 30;
+            ev[i].operand_size = 1 << (test_rand(&seed) % 3);
+            ev[i].flags = test_rand(&seed) & 0x7f;
+            ev[i].plain = (ev[i].flags & VMP_TRACE_VM_PLAIN) ? test_rand(&seed) : 0;
+            TEST_CHECK(!vmp_trace_vm(trace, ev + i));
+        }
+        vmp_trace_destroy(trace);
+
+        TEST_CHECK(!vmp_trace_reader_open(&reader, filename));
+        for (n = 0; (ret = vmp_trace_reader_next(&reader, &rec)) == 1; n++)
+        {
+            if ((n >= 100) || (rec.tag != VMP_TRACE_TAG_VM) || memcmp(&rec.vm, ev + n, sizeof (rec.vm)))
+                break;
+
+            count += ev[n].x86_insts;
+            TEST_CHECK(rec.count == count);
+        }
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(n == 100);
+        vmp_trace_reader_close(&reader);
+    }
+
+    void test_trace(void)
+    {
+        test_trace_delta();
+        test_trace_block();
+        test_trace_vm();
+    }
+
+    // 边写trace边生成的索引要和事后扫一遍生成的一样，里面的稀疏表、地址表和寄存器访问表按构造的输入检查
+    void test_trace_index(void)
+    {
+        struct vmp_trace_param param = { 0 };
+        struct vmp_trace *trace;
+        struct vmp_trace_reader reader;
+        struct vmp_trace_record rec;
+        struct vmp_trace_regs regs;
+        char filename[260], idx_filename[270];
+        uint8_t *live = NULL, *built = NULL, *p;
+        uint32_t sparse_counts, addr_counts, interval, i;
+        uint64_t count, offset, reg_offset, n;
+        long live_size, built_size;
+
+        param.mode = VMP_TRACE_MODE_DELTA;
+        param.fmt = VMP_TRACE_FMT_BIN;
+        param.keyframe = TEST_INDEX_KEYFRAME;
+        param.filename = test_path(filename, "index.trace");
+        param.index = 1;
+        trace = vmp_trace_create(&param);
+        TEST_CHECK(trace != NULL);
+        if (!trace)
+            return;
+
+        // esi每条指令加一，每5条指令访问一次[esi]
+        memset(&regs, 0, sizeof (regs));
+        for (i = 0; i < TEST_INDEX_RECORDS; i++)
+        {
+            regs.inst_addr = 0x401000 + (i % TEST_INDEX_ADDRS) * 4;
+            regs.eip = regs.inst_addr;
+            regs.val[6] = 0x1000 + i;
+            regs.access_addr = (i % 5 == 0) ? regs.val[6] : 0x77;
+            vmp_trace_regs(trace, i + 1, &regs);
+        }
+        vmp_trace_destroy(trace);
+
+        sprintf(idx_filename, "%s%s", filename, VMP_TRACE_INDEX_SUFFIX);
+        live = test_read_file(idx_filename, &live_size);
+        TEST_CHECK(live && (live_size >= VMP_TRACE_INDEX_HEAD_SIZE));
+        TEST_CHECK(!vmp_trace_index_build(filename));
+        built = test_read_file(idx_filename, &built_size);
+        TEST_CHECK(built && (built_size == live_size) && !memcmp(built, live, live_size));
+        if (!live || (live_size < VMP_TRACE_INDEX_HEAD_SIZE))
+            goto exit_label;
+
+        TEST_CHECK(!memcmp(live, VMP_TRACE_INDEX_MAGIC, 4));
+        interval = mbytes_read_int_little_endian_4b(live + 8);
+        sparse_counts = mbytes_read_int_little_endian_4b(live + 12);
+        addr_counts = mbytes_read_int_little_endian_4b(live + 16);
+        reg_offset = mbytes_read_int_little_endian_8b(live + 32);
+        TEST_CHECK(interval == TEST_INDEX_KEYFRAME);
+        TEST_CHECK(sparse_counts == TEST_INDEX_RECORDS / TEST_INDEX_KEYFRAME);
+        TEST_CHECK(addr_counts == TEST_INDEX_ADDRS);
+        TEST_CHECK(mbytes_read_int_little_endian_8b(live + 24) == TEST_INDEX_RECORDS);
+        TEST_CHECK(reg_offset + 8 * 8 <= (uint64_t)live_size);
+        if ((reg_offset + 8 * 8 > (uint64_t)live_size)
+            || (VMP_TRACE_INDEX_HEAD_SIZE + (uint64_t)sparse_counts * 16 + (uint64_t)addr_counts * 24 > reg_offset))
+            goto exit_label;
+
+        // 稀疏表里的每个位置都能直接跳过去解码
+        TEST_CHECK(!vmp_trace_reader_open(&reader, filename));
+        for (i = 0, p = live + VMP_TRACE_INDEX_HEAD_SIZE; i < sparse_counts; i++, p += 16)
+        {
+            count = mbytes_read_int_little_endian_8b(p);
+            offset = mbytes_read_int_little_endian_8b(p + 8);
+            TEST_CHECK(count == (uint64_t)i * TEST_INDEX_KEYFRAME);
+            TEST_CHECK(!vmp_trace_reader_seek(&reader, offset, count));
+            TEST_CHECK(vmp_trace_reader_next(&reader, &rec) == 1);
+            TEST_CHECK(rec.tag == VMP_TRACE_TAG_KEYFRAME);
+            TEST_CHECK(rec.count == count + 1);
+            TEST_CHECK(rec.regs.val[6] == 0x1000 + (uint32_t)count);
+        }
+        vmp_trace_reader_close(&reader);
+
+        // 地址表按地址排序，每个地址执行了TEST_INDEX_RECORDS / TEST_INDEX_ADDRS次
+        for (i = 0; i < addr_counts; i++, p += 24)
+        {
+            TEST_CHECK(mbytes_read_int_little_endian_4b(p) == 0x401000 + i * 4);
+            TEST_CHECK(mbytes_read_int_little_endian_4b(p + 4) == TEST_INDEX_RECORDS / TEST_INDEX_ADDRS);
+            TEST_CHECK(mbytes_read_int_little_endian_8b(p + 8) == i + 1);
+            TEST_CHECK(mbytes_read_int_little_endian_8b(p + 16) == TEST_INDEX_RECORDS - TEST_INDEX_ADDRS + i + 1);
+        }
+
+        // 只有esi的值等于访问地址
+        p = live + reg_offset;
+        for (i = 0; i < 8; i++)
+        {
+            n = mbytes_read_int_little_endian_8b(p + i * 8);
+            TEST_CHECK(n == ((i == 6) ? TEST_INDEX_RECORDS / 5 : 0));
+        }
+        p += 8 * 8;
+        TEST_CHECK(reg_offset + 8 * 8 + TEST_INDEX_RECORDS / 5 * 8 <= (uint64_t)live_size);
+        for (i = 0; (i < TEST_INDEX_RECORDS / 5) && (p + 8 <= live + live_size); i++, p += 8)
+        {
+            TEST_CHECK(mbytes_read_int_little_endian_8b(p) == (uint64_t)i * 5 + 1);
+        }
+
+        TEST_CHECK(vmp_trace_index_query(filename, "inst", "500") == 0);
+        TEST_CHECK(vmp_trace_index_query(filename, "addr", "401008") == 0);
+        TEST_CHECK(vmp_trace_index_query(filename, "access", "esi") == 0);
+        TEST_CHECK(vmp_trace_index_query(filename, "unknown", "0") == -1);
+
+    exit_label:
+        free(live);
+        free(built);
+    }
+
+#ifdef __cplusplus
+}
+#endif